@@ -35,16 +35,121 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "kms-quads.h"
 
+/*
+ * Adds a rectangle to a damage region. If we've run out of space, we merge it
+ * with the last one instead, which may leave parts redrawn unnecessarily, but
+ * never misses anything.
+ */
+void damage_add_rect(struct damage *damage, int32_t x1, int32_t y1,
+		     int32_t x2, int32_t y2)
+{
+	struct drm_mode_rect *last;
+
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	if (damage->num_rects < MAX_DAMAGE_RECTS) {
+		damage->rects[damage->num_rects++] = (struct drm_mode_rect) {
+			.x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2,
+		};
+		return;
+	}
+
+	last = &damage->rects[MAX_DAMAGE_RECTS - 1];
+	last->x1 = (x1 < last->x1) ? x1 : last->x1;
+	last->y1 = (y1 < last->y1) ? y1 : last->y1;
+	last->x2 = (x2 > last->x2) ? x2 : last->x2;
+	last->y2 = (y2 > last->y2) ? y2 : last->y2;
+}
+
+void damage_add(struct damage *damage, const struct damage *other)
+{
+	for (int i = 0; i < other->num_rects; i++) {
+		const struct drm_mode_rect *r = &other->rects[i];
+		damage_add_rect(damage, r->x1, r->y1, r->x2, r->y2);
+	}
+}
+
+/*
+ * Works out which parts of the buffer change when moving the animation from
+ * one frame to another.
+ *
+ * Both the checkerboard below and the GL quads split the buffer into four at
+ * the same point, which moves from the top-left to the bottom-right corner;
+ * so moving between two frames only changes a full-height band between the
+ * two horizontal split positions, and a full-width band between the two
+ * vertical ones. We pad these by a pixel either side, so we don't have to
+ * care about how exactly the GPU rasterises the edges of the quads.
+ *
+ * The Vulkan colour wheel rotates over the whole buffer, so changes entirely
+ * every frame.
+ *
+ * anim_damage does the same for an image of the given size which we don't
+ * have a buffer for yet, such as the back buffer of an EGL surface.
+ */
+void anim_damage(struct device *device, uint32_t width, uint32_t height,
+		 unsigned int from, unsigned int to, struct damage *damage)
+{
+	int32_t w = width;
+	int32_t h = height;
+	int32_t x1 = (w * from) / NUM_ANIM_FRAMES;
+	int32_t x2 = (w * to) / NUM_ANIM_FRAMES;
+	int32_t y1 = (h * from) / NUM_ANIM_FRAMES;
+	int32_t y2 = (h * to) / NUM_ANIM_FRAMES;
+	int32_t tmp;
+
+	damage->num_rects = 0;
+
+	if (device->vk_device) {
+		damage_add_rect(damage, 0, 0, w, h);
+		return;
+	}
+
+	if (from == to)
+		return;
+
+	if (x1 > x2) {
+		tmp = x1;
+		x1 = x2;
+		x2 = tmp;
+	}
+	if (y1 > y2) {
+		tmp = y1;
+		y1 = y2;
+		y2 = tmp;
+	}
+
+	damage_add_rect(damage, (x1 > 0) ? x1 - 1 : 0, 0,
+			(x2 < w) ? x2 + 1 : w, h);
+	damage_add_rect(damage, 0, (y1 > 0) ? y1 - 1 : 0,
+			w, (y2 < h) ? y2 + 1 : h);
+}
+
+void buffer_anim_damage(struct buffer *buffer, unsigned int from,
+			unsigned int to, struct damage *damage)
+{
+	anim_damage(buffer->output->device, buffer->width, buffer->height,
+		    from, to, damage);
+}
+
 /*
  * Using the CPU mapping, fill the buffer with a simple pixel-by-pixel
- * checkerboard; the boundaries advance from top-left to bottom-right.
+ * checkerboard; the boundaries advance from top-left to bottom-right. The
+ * software renderer in software.c does the actual work.
+ *
+ * Only the damaged parts of the buffer are filled in; the rest of it
+ * already holds the right content from the last time we rendered into it.
  */
 void buffer_fill(struct buffer *buffer, int frame_num)
 {
-	struct output *output = buffer->output;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buffer->render_start_nsec = timespec_to_nsec(&now);
 
 	if (buffer->gbm.bo) {
 		if (buffer->output->device->vk_device) {
@@ -53,35 +158,11 @@ void buffer_fill(struct buffer *buffer, int frame_num)
 		} else {
 			buffer_egl_fill(buffer, frame_num);
 		}
-
-		return;
+	} else {
+		buffer_sw_fill(buffer, frame_num);
 	}
 
-	for (unsigned int y = 0; y < buffer->height; y++) {
-		/*
-		 * We play silly games with pointer types so we advance
-		 * by (y*pitch) in bytes rather than in pixels, then cast back.
-		 */
-		uint8_t b;
-		uint32_t *pix =
-			(uint32_t *) ((uint8_t *) buffer->dumb.mem + (y * buffer->pitches[0]));
-		if (y >= (buffer->height * output->frame_num) / NUM_ANIM_FRAMES)
-			b = 0xff;
-		else
-			b = 0;
-
-		for (unsigned int x = 0; x < buffer->width; x++) {
-			uint32_t r;
-
-			if (x >= (buffer->width * output->frame_num) / NUM_ANIM_FRAMES)
-				r = 0xff;
-			else
-				r = 0;
-
-			*pix++ = (0xff << 24 /* A */) | (r << 16) | \
-				 (0x00 <<  8 /* G */) | b;
-		}
-	}
+	buffer->damage.num_rects = 0;
 }
 
 /*
@@ -94,7 +175,8 @@ void buffer_fill(struct buffer *buffer, int frame_num)
  * comprehensive example of multiple buffer types:
  *   https://gitlab.freedesktop.org/wayland/weston/tree/master/libweston/compositor-drm.c
  */
-static struct buffer *buffer_dumb_create(struct device *device, struct output *output)
+static struct buffer *buffer_dumb_create(struct device *device, struct output *output,
+					uint32_t width, uint32_t height)
 {
 	struct buffer *ret = calloc(1, sizeof(*ret));
 	struct drm_mode_create_dumb create;
@@ -132,8 +214,8 @@ static struct buffer *buffer_dumb_create(struct device *device, struct output *o
 	 *   https://afrantzis.com/pixel-format-guide/
 	 */
 	create = (struct drm_mode_create_dumb) {
-		.width = output->mode.hdisplay,
-		.height = output->mode.vdisplay,
+		.width = width,
+		.height = height,
 		.bpp = 32,
 	};
 	err = drmIoctl(device->kms_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create);
@@ -174,8 +256,10 @@ static struct buffer *buffer_dumb_create(struct device *device, struct output *o
 		goto err_dumb;
 	}
 
-	ret->dumb.mem = mmap(NULL, create.size, PROT_WRITE, MAP_SHARED,
-			     device->kms_fd, map.offset);
+	ret->dumb.mem = mmap(NULL, create.size,
+			     device->capture.enabled ? PROT_READ | PROT_WRITE :
+						       PROT_WRITE,
+			     MAP_SHARED, device->kms_fd, map.offset);
 	if (ret->dumb.mem == MAP_FAILED) {
 		fprintf(stderr, "failed to mmap %u x %u dumb buffer: %s\n",
 			ret->width, ret->height, strerror(errno));
@@ -183,8 +267,28 @@ static struct buffer *buffer_dumb_create(struct device *device, struct output *o
 	}
 	ret->dumb.size = create.size;
 
+	/*
+	 * The mapping we get is usually write-combined, or even uncached, so
+	 * reading from it is terribly slow. If we're asked to, allocate a
+	 * shadow copy in normal memory to render into, which the software
+	 * renderer then copies across to the real buffer.
+	 */
+	if (device->dumb_shadow) {
+		void *shadow;
+
+		if (posix_memalign(&shadow, 64, create.size) != 0) {
+			fprintf(stderr, "failed to allocate %u x %u shadow buffer\n",
+				ret->width, ret->height);
+			goto err_map;
+		}
+		ret->dumb.shadow = shadow;
+	}
+
 	return ret;
 
+err_map:
+	munmap(ret->dumb.mem, ret->dumb.size);
+
 err_dumb:
 	destroy = (struct drm_mode_destroy_dumb) { .handle = create.handle };
 	drmIoctl(device->kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
@@ -193,31 +297,97 @@ err:
 	return NULL;
 }
 
-struct buffer *buffer_create(struct device *device, struct output *output)
+static const char *buffer_kind(struct buffer *buffer)
 {
-	struct buffer *ret;
-	uint64_t modifiers[4] = { 0, };
-	int err;
+	if (buffer->dumb.mem)
+		return "dumb";
+	if (buffer->dmabuf.imported)
+		return "imported";
+	return "GBM";
+}
 
-	if (device->gbm_device) {
-		if (device->vk_device) {
-			ret = buffer_vk_create(device, output);
-		} else {
-			ret = buffer_egl_create(device, output);
+/*
+ * Close the GEM handles drmPrimeFDToHandle gave us for a buffer's planes,
+ * and clear them. Each plane's dmabuf may well be the same one, in which
+ * case KMS gives us the same handle back without counting references, so
+ * we only close each handle once. A 0 handle ends the list early, if we
+ * failed part-way through importing.
+ */
+static void gem_handles_close(struct device *device, uint32_t *handles,
+			      int num_planes)
+{
+	for (int i = 0; i < num_planes && handles[i]; i++) {
+		struct drm_gem_close gem_close = {
+			.handle = handles[i],
+		};
+		bool seen = false;
+
+		for (int j = 0; j < i; j++)
+			seen |= (handles[j] == handles[i]);
+		if (!seen)
+			drmIoctl(device->kms_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
+
+	memset(handles, 0, num_planes * sizeof(*handles));
+}
+
+/* Close the handles buffer_prime_import got from KMS, if any. */
+void buffer_prime_release(struct device *device, struct buffer *buffer)
+{
+	if (!buffer->gbm.prime_handles)
+		return;
+
+	gem_handles_close(device, buffer->gem_handles,
+			  ARRAY_LENGTH(buffer->gem_handles));
+	buffer->gbm.prime_handles = false;
+}
+
+/*
+ * Import a buffer we've allocated on the render GPU into our KMS device, so
+ * we can get a framebuffer for it. If the KMS device can't import it at all,
+ * we leave the buffer without any GEM handles, and buffer_create falls back
+ * to copying where the renderer can.
+ *
+ * Each plane's dmabuf may well be the same one, in which case KMS gives us
+ * the same handle back; we only need to close it once.
+ */
+void buffer_prime_import(struct device *device, struct buffer *buffer,
+			 const int *dma_buf_fds, int num_planes)
+{
+	memset(buffer->gem_handles, 0, sizeof(buffer->gem_handles));
+
+	for (int i = 0; i < num_planes; i++) {
+		if (drmPrimeFDToHandle(device->kms_fd, dma_buf_fds[i],
+				       &buffer->gem_handles[i]) != 0) {
+			error("couldn't import render GPU buffer into KMS: %s\n",
+			      strerror(errno));
+			buffer->gbm.prime_handles = true;
+			buffer_prime_release(device, buffer);
+			return;
 		}
-	} else {
-		ret = buffer_dumb_create(device, output);
 	}
 
-	if (!ret)
-		return NULL;
+	buffer->gbm.prime_handles = true;
+}
+
+/*
+ * Wraps the buffer's GEM handles in a KMS framebuffer, which we can then
+ * attach to a plane.
+ */
+int buffer_add_fb(struct device *device, struct buffer *buffer)
+{
+	uint64_t modifiers[4] = { 0, };
+	int err;
 
-	for (int i = 0; ret->gem_handles[i]; i++) {
-		modifiers[i] = ret->modifier;
+	/* We couldn't import a buffer from the render GPU into KMS. */
+	if (buffer->gem_handles[0] == 0)
+		return -1;
+
+	for (int i = 0; buffer->gem_handles[i]; i++) {
+		modifiers[i] = buffer->modifier;
 		debug("[GEM:%" PRIu32 "]: %u x %u %s buffer (plane %d), pitch %u\n",
-		      ret->gem_handles[i], ret->width, ret->height,
-		      (ret->dumb.mem) ? "dumb" : "GBM",
-		      i, ret->pitches[i]);
+		      buffer->gem_handles[i], buffer->width, buffer->height,
+		      buffer_kind(buffer), i, buffer->pitches[i]);
 	}
 
 	/*
@@ -240,31 +410,223 @@ struct buffer *buffer_create(struct device *device, struct output *output)
 	 * the kernel enforces that they must be the same for each plane
 	 * which is there, and 0 for everything else.
 	 */
-	if (device->fb_modifiers) {
+	if (device->fb_modifiers && !buffer->gbm.copy.handle &&
+	    buffer->modifier != DRM_FORMAT_MOD_INVALID) {
 		err = drmModeAddFB2WithModifiers(device->kms_fd,
-						 ret->width, ret->height,
-						 ret->format,
-						 ret->gem_handles,
-						 ret->pitches,
-						 ret->offsets,
-						 modifiers, &ret->fb_id,
+						 buffer->width, buffer->height,
+						 buffer->format,
+						 buffer->gem_handles,
+						 buffer->pitches,
+						 buffer->offsets,
+						 modifiers, &buffer->fb_id,
 						 DRM_MODE_FB_MODIFIERS);
 	} else {
-		err = drmModeAddFB2(device->kms_fd, ret->width, ret->height,
-			    	    ret->format, ret->gem_handles, ret->pitches,
-				    ret->offsets, &ret->fb_id, 0);
+		err = drmModeAddFB2(device->kms_fd, buffer->width, buffer->height,
+			    	    buffer->format, buffer->gem_handles, buffer->pitches,
+				    buffer->offsets, &buffer->fb_id, 0);
 	}
 
-	if (err != 0 || ret->fb_id == 0) {
+	if (err != 0 || buffer->fb_id == 0) {
 		fprintf(stderr, "failed AddFB2 on %u x %u %s (modifier 0x%" PRIx64 ") buffer: %s\n",
-			ret->width, ret->height,
-			(ret->dumb.mem) ? "dumb" : "GBM",
-			ret->modifier, strerror(errno));
-		goto err;
+			buffer->width, buffer->height, buffer_kind(buffer),
+			buffer->modifier, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Takes a buffer the given output could use out of the device's buffer
+ * cache, if there is one: it has to be the right size and format, and have
+ * one of the modifiers the output would allocate with.
+ */
+static struct buffer *buffer_cache_take(struct device *device,
+					struct output *output,
+					uint32_t width, uint32_t height)
+{
+	const uint64_t *modifiers = NULL;
+	unsigned int num_modifiers = 0;
+	struct buffer **link, *ret = NULL;
+
+	if (device->gbm_device && device->fb_modifiers)
+		num_modifiers = output_modifiers_get(output, &modifiers);
+
+	pthread_mutex_lock(&device->buffer_cache.lock);
+	for (link = &device->buffer_cache.head; *link; link = &(*link)->cache.next) {
+		struct buffer *buffer = *link;
+		bool match = buffer->width == width && buffer->height == height &&
+			     buffer->format == output->format;
+
+		if (match && modifiers) {
+			match = false;
+			for (unsigned int m = 0; m < num_modifiers; m++)
+				match |= (modifiers[m] == buffer->modifier);
+		}
+		if (!match)
+			continue;
+
+		*link = buffer->cache.next;
+		device->buffer_cache.num_buffers--;
+		ret = buffer;
+		break;
 	}
+	if (ret)
+		device->buffer_cache.num_hits++;
+	else
+		device->buffer_cache.num_misses++;
+	pthread_mutex_unlock(&device->buffer_cache.lock);
+
+	if (!ret)
+		return NULL;
+
+	debug("[%s] reusing cached %u x %u buffer with FB ID %" PRIu32 "\n",
+	      output->name, ret->width, ret->height, ret->fb_id);
+	ret->output = output;
+	ret->cache.next = NULL;
+	if (ret->gbm.bo && !device->vk_device &&
+	    !buffer_egl_bind(device, ret)) {
+		buffer_destroy(ret);
+		return NULL;
+	}
+
+	/* Whatever it was showing before is no use to its new output. */
+	damage_add_rect(&ret->damage, 0, 0, ret->width, ret->height);
 	return ret;
+}
+
+/*
+ * Creating a buffer from scratch takes a BO allocation, importing it into
+ * the renderer (an EGLImage or a Vulkan image with its own memory,
+ * framebuffer and command buffer), and an AddFB2 for KMS; destroying it
+ * takes as many calls again, plus RmFB, which can stall until the display
+ * engine has let go. Outputs shedding and regaining buffers, outputs coming
+ * and going with hotplug, and picking modifiers at startup would all churn
+ * through these repeatedly.
+ *
+ * So rather than destroying buffers while the device lives, outputs give
+ * them back here, complete with their framebuffer. The next output to
+ * want a buffer of the same size and layout gets the most recently
+ * released one; only the EGL texture and FBO need recreating, as those
+ * belong to the output's context. Once more than BUFFER_CACHE_SIZE buffers
+ * are waiting, the least recently released ones are destroyed.
+ *
+ * Buffers we copy frames into when rendering on another GPU, and imported
+ * ones (which have their own cache per output), are just destroyed.
+ */
+void buffer_release(struct buffer *buffer)
+{
+	struct output *output = buffer->output;
+	struct device *device = output->device;
+
+	if (buffer->dmabuf.imported || buffer->gbm.copy.handle) {
+		buffer_destroy(buffer);
+		return;
+	}
+
+	if (buffer->gbm.bo && !device->vk_device)
+		buffer_egl_unbind(device, buffer);
+
+	buffer->output = NULL;
+	buffer->in_use = false;
+	buffer->ready = false;
+	buffer->fence_deferred = false;
+	buffer->cache.device = device;
+
+	pthread_mutex_lock(&device->buffer_cache.lock);
+	buffer->cache.next = device->buffer_cache.head;
+	device->buffer_cache.head = buffer;
+	device->buffer_cache.num_buffers++;
+	pthread_mutex_unlock(&device->buffer_cache.lock);
+
+	buffer_cache_evict(device, BUFFER_CACHE_SIZE);
+}
+
+/*
+ * Destroy all but the max_buffers most recently released buffers in the
+ * cache; with 0, empties it, which we must do before tearing down the
+ * renderer.
+ */
+void buffer_cache_evict(struct device *device, int max_buffers)
+{
+	struct buffer **link, *victims = NULL;
+	int n = 0;
+
+	pthread_mutex_lock(&device->buffer_cache.lock);
+	for (link = &device->buffer_cache.head; *link; link = &(*link)->cache.next) {
+		if (n++ == max_buffers) {
+			victims = *link;
+			*link = NULL;
+			break;
+		}
+	}
+	for (struct buffer *buffer = victims; buffer; buffer = buffer->cache.next) {
+		device->buffer_cache.num_buffers--;
+		device->buffer_cache.num_evicted++;
+	}
+	pthread_mutex_unlock(&device->buffer_cache.lock);
+
+	while (victims) {
+		struct buffer *buffer = victims;
+
+		victims = buffer->cache.next;
+		buffer_destroy(buffer);
+	}
+}
+
+struct buffer *buffer_create(struct device *device, struct output *output,
+			     uint32_t width, uint32_t height)
+{
+	struct buffer *ret;
+
+	ret = buffer_cache_take(device, output, width, height);
+	if (ret)
+		return ret;
+
+	if (device->gbm_device) {
+		if (device->vk_device) {
+			ret = buffer_vk_create(device, output, width, height);
+		} else {
+			ret = buffer_egl_create(device, output, width, height);
+		}
+	} else {
+		ret = buffer_dumb_create(device, output, width, height);
+	}
+
+	if (!ret)
+		return NULL;
+
+	/* Nothing has been rendered into our new buffer yet. */
+	damage_add_rect(&ret->damage, 0, 0, ret->width, ret->height);
+
+	if (!output->render_copy && buffer_add_fb(device, ret) == 0)
+		return ret;
+
+	/*
+	 * When rendering on another GPU, KMS might not be able to scan out
+	 * of its buffers at all, or at least not with any layout the render
+	 * GPU can produce. We can still copy each frame into a buffer KMS
+	 * allocated itself, which costs some bandwidth every frame, but
+	 * always works. Once one buffer has needed that, the output's other
+	 * buffers won't do any better, so we don't try them directly.
+	 *
+	 * Only the GL renderer can copy; Vulkan records each image's commands
+	 * once, when it is created, so needs KMS to take its images as they
+	 * are.
+	 */
+	if (device->render_fd >= 0 && ret->gbm.bo && !device->vk_device &&
+	    buffer_egl_add_copy(device, ret) && buffer_add_fb(device, ret) == 0) {
+		if (!output->render_copy) {
+			printf("[%s] can't scan out from render GPU, copying frames\n",
+			       output->name);
+			output->render_copy = true;
+		} else {
+			debug("[%s] new buffer copies frames from render GPU\n",
+			      output->name);
+		}
+		return ret;
+	}
 
-err:
 	buffer_destroy(ret);
 	return NULL;
 }
@@ -272,16 +634,22 @@ err:
 void buffer_destroy(struct buffer *buffer)
 {
 	struct output *output = buffer->output;
-	struct device *device = output->device;
+	struct device *device = output ? output->device : buffer->cache.device;
 
 	drmModeRmFB(device->kms_fd, buffer->fb_id);
 
+	if (buffer->render_fence_fd >= 0)
+		close(buffer->render_fence_fd);
+	if (buffer->kms_fence_fd >= 0)
+		close(buffer->kms_fence_fd);
+
 	if (buffer->dumb.mem) {
 		struct drm_mode_destroy_dumb destroy = {
 			.handle = buffer->gem_handles[0],
 		};
 
 		munmap(buffer->dumb.mem, buffer->dumb.size);
+		free(buffer->dumb.shadow);
 		drmIoctl(device->kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
 	} else if (buffer->gbm.bo) {
 		if (device->vk_device) {
@@ -292,3 +660,320 @@ void buffer_destroy(struct buffer *buffer)
 	}
 	free(buffer);
 }
+
+/*
+ * Looks for a buffer we've already imported for this dmabuf, with the same
+ * layout, so showing it again doesn't need a new framebuffer.
+ */
+static struct buffer **dmabuf_cache_find(struct output *output,
+					 const struct dmabuf_attributes *attrs,
+					 const struct stat *st)
+{
+	struct buffer **link;
+
+	for (link = &output->external.dmabufs; *link; link = &(*link)->dmabuf.next) {
+		struct buffer *buffer = *link;
+		bool match = buffer->dmabuf.dev == st->st_dev &&
+			     buffer->dmabuf.ino == st->st_ino &&
+			     buffer->format == attrs->format &&
+			     buffer->modifier == attrs->modifier &&
+			     buffer->width == attrs->width &&
+			     buffer->height == attrs->height;
+
+		for (int i = 0; match && i < attrs->num_planes; i++) {
+			match = buffer->pitches[i] == attrs->pitches[i] &&
+				buffer->offsets[i] == attrs->offsets[i];
+		}
+		if (match)
+			return link;
+	}
+
+	return NULL;
+}
+
+/*
+ * Once the cache is full, throw away the least recently used buffer which
+ * isn't on screen or about to be.
+ */
+static void dmabuf_cache_trim(struct output *output)
+{
+	struct buffer **link, **victim = NULL;
+
+	if (output->external.num_dmabufs <= DMABUF_CACHE_SIZE)
+		return;
+
+	for (link = &output->external.dmabufs; *link; link = &(*link)->dmabuf.next) {
+		struct buffer *buffer = *link;
+
+		if (!buffer->in_use && buffer != output->external.next)
+			victim = link;
+	}
+	if (!victim)
+		return;
+
+	struct buffer *buffer = *victim;
+	*victim = buffer->dmabuf.next;
+	output->external.num_dmabufs--;
+	buffer_destroy(buffer);
+}
+
+/*
+ * Wraps a dmabuf someone else has allocated and filled, e.g. a decoded
+ * video frame, in a buffer we can display, without copying it.
+ *
+ * drmPrimeFDToHandle gives us a GEM handle on our KMS device for each of
+ * its planes, which we then make a framebuffer out of exactly as we do for
+ * our own buffers. Producers usually cycle through the same few dmabufs,
+ * so we keep the framebuffers for the ones we've seen (up to
+ * DMABUF_CACHE_SIZE per output), and only pay for the ioctls the first
+ * time each one comes around.
+ *
+ * The buffer stays owned by the output: it is freed when it drops out of
+ * the cache, or with the output.
+ */
+struct buffer *buffer_dmabuf_import(struct output *output,
+				    const struct dmabuf_attributes *attrs)
+{
+	struct device *device = output->device;
+	struct buffer **link;
+	struct buffer *ret;
+	struct stat st;
+	int err;
+
+	assert(attrs->num_planes > 0 && attrs->num_planes <= 4);
+
+	if (fstat(attrs->fds[0], &st) != 0) {
+		fprintf(stderr, "[%s] couldn't stat dmabuf: %s\n",
+			output->name, strerror(errno));
+		goto err;
+	}
+
+	link = dmabuf_cache_find(output, attrs, &st);
+	if (link) {
+		ret = *link;
+		*link = ret->dmabuf.next;
+		goto out;
+	}
+
+	ret = calloc(1, sizeof(*ret));
+	assert(ret);
+	ret->output = output;
+	ret->format = attrs->format;
+	ret->modifier = attrs->modifier;
+	ret->width = attrs->width;
+	ret->height = attrs->height;
+	ret->render_fence_fd = -1;
+	ret->kms_fence_fd = -1;
+	ret->dmabuf.imported = true;
+	ret->dmabuf.dev = st.st_dev;
+	ret->dmabuf.ino = st.st_ino;
+
+	for (int i = 0; i < attrs->num_planes; i++) {
+		ret->pitches[i] = attrs->pitches[i];
+		ret->offsets[i] = attrs->offsets[i];
+		if (drmPrimeFDToHandle(device->kms_fd, attrs->fds[i],
+				       &ret->gem_handles[i]) != 0) {
+			fprintf(stderr, "[%s] couldn't import dmabuf into KMS: %s\n",
+				output->name, strerror(errno));
+			gem_handles_close(device, ret->gem_handles,
+					  attrs->num_planes);
+			buffer_destroy(ret);
+			goto err;
+		}
+	}
+
+	/*
+	 * Importing the same dmabuf again gives us back the same handle,
+	 * which KMS doesn't refcount: if we kept it for as long as the
+	 * buffer, destroying one of two buffers for the same dmabuf (e.g.
+	 * the same frame shown on two outputs) would close the handle under
+	 * the other. The framebuffer holds its own reference to the
+	 * underlying object, so we don't need the handles once we have
+	 * created it.
+	 */
+	err = buffer_add_fb(device, ret);
+	gem_handles_close(device, ret->gem_handles, attrs->num_planes);
+	if (err != 0) {
+		buffer_destroy(ret);
+		goto err;
+	}
+	output->external.num_dmabufs++;
+
+out:
+	ret->dmabuf.next = output->external.dmabufs;
+	output->external.dmabufs = ret;
+	dmabuf_cache_trim(output);
+
+	/* Replaces the fence for whatever was in this buffer before. */
+	fd_replace(&ret->render_fence_fd, attrs->acquire_fence_fd);
+	return ret;
+
+err:
+	if (attrs->acquire_fence_fd >= 0)
+		close(attrs->acquire_fence_fd);
+	return NULL;
+}
+
+void output_dmabufs_destroy(struct output *output)
+{
+	while (output->external.dmabufs) {
+		struct buffer *buffer = output->external.dmabufs;
+
+		output->external.dmabufs = buffer->dmabuf.next;
+		buffer_destroy(buffer);
+	}
+	output->external.num_dmabufs = 0;
+}
+
+/*
+ * Keep no fewer than this many bytes of system memory free whilst baking;
+ * below that, we'd rather render live than push the system into swap.
+ */
+#define BAKED_MIN_FREE_BYTES (256ULL << 20)
+
+/*
+ * How many bytes of memory the kernel reckons could be given to us without
+ * swapping, or 0 if it won't say. This is MemAvailable rather than the
+ * free memory sysconf reports: page cache counts as free here, as it can
+ * be dropped, whereas after a while up, hardly any memory is simply unused.
+ */
+uint64_t mem_available(void)
+{
+	unsigned long long kib = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kib) == 1)
+			break;
+	}
+	fclose(f);
+
+	return (uint64_t) kib << 10;
+}
+
+static uint64_t buffer_size(struct buffer *buffer)
+{
+	uint64_t size = 0;
+
+	for (int i = 0; i < 4 && buffer->pitches[i]; i++)
+		size += (uint64_t) buffer->pitches[i] * buffer->height;
+
+	return size;
+}
+
+/*
+ * Returns a buffer holding the given frame of the animation, ready to be
+ * committed, or NULL if the caller should render the frame live.
+ *
+ * The animation wraps around every NUM_ANIM_FRAMES frames, so once we've
+ * rendered a frame there's no need to ever render it again: we keep the
+ * buffer and its framebuffer, and just flip to it the next time the frame
+ * comes around. After the first time through the animation, repainting
+ * costs us nothing more than an atomic commit.
+ *
+ * Each frame we haven't baked yet gets a buffer of its own, allocated with
+ * the same modifier as the pool (which is compressed, if KMS and the
+ * renderer agreed on one), and rendered from scratch. We stop baking when
+ * the device's budget runs out, when we fail to allocate, or when the
+ * system is short of memory; whichever frames we have are still used.
+ *
+ * A frame can't be committed while it's still the one on screen, since
+ * it's already in use: this only happens when the animation hasn't moved
+ * on since the last flip, and then the caller renders it live.
+ *
+ * With Vulkan, each buffer also holds a slot of the renderer's uniform
+ * arena and a command buffer, which would add up to a lot of both over a
+ * whole animation. Baked frames give theirs back as soon as they've been
+ * rendered (see buffer_vk_retire), which we check for before baking
+ * another.
+ */
+struct buffer *output_baked_frame(struct output *output,
+				  unsigned int frame_num)
+{
+	struct device *device = output->device;
+	struct buffer *buffer = output->baked.frames[frame_num];
+	uint64_t size = 0;
+	uint64_t avail;
+
+	if (buffer) {
+		if (buffer == output->buffer_last ||
+		    buffer == output->buffer_pending)
+			return NULL;
+
+		/*
+		 * The commit which displayed the frame last time has long
+		 * since completed, so its rendering must be done; drop the
+		 * fence rather than have KMS wait on it again.
+		 */
+		buffer->baked.shown = true;
+		fd_replace(&buffer->render_fence_fd, -1);
+		if (device->vk_device)
+			buffer_vk_retire(buffer);
+		return buffer;
+	}
+
+	if (output->baked.full)
+		return NULL;
+
+	if (device->vk_device) {
+		for (int i = 0; i < NUM_ANIM_FRAMES; i++) {
+			if (output->baked.frames[i])
+				buffer_vk_retire(output->baked.frames[i]);
+		}
+	}
+
+	avail = mem_available();
+	if (device->baked.used >= device->baked.budget ||
+	    (avail > 0 && avail < BAKED_MIN_FREE_BYTES)) {
+		printf("[%s] out of memory for baking, rendering %d of %d frames live\n",
+		       output->name, NUM_ANIM_FRAMES - output->baked.num_frames,
+		       NUM_ANIM_FRAMES);
+		output->baked.full = true;
+		return NULL;
+	}
+
+	buffer = buffer_create(device, output, output->pool.width,
+			       output->pool.height);
+	if (!buffer) {
+		error("[%s] couldn't allocate buffer to bake frame %u, rendering %d of %d frames live\n",
+		      output->name, frame_num,
+		      NUM_ANIM_FRAMES - output->baked.num_frames,
+		      NUM_ANIM_FRAMES);
+		output->baked.full = true;
+		return NULL;
+	}
+
+	size = buffer_size(buffer);
+	buffer->baked.frame = true;
+	buffer->frame_num = frame_num;
+	buffer_fill(buffer, frame_num);
+
+	device->baked.used += size;
+	output->baked.frames[frame_num] = buffer;
+	if (++output->baked.num_frames == NUM_ANIM_FRAMES) {
+		printf("[%s] baked all %d frames\n", output->name,
+		       NUM_ANIM_FRAMES);
+	}
+
+	return buffer;
+}
+
+void output_baked_destroy(struct output *output)
+{
+	for (int i = 0; i < NUM_ANIM_FRAMES; i++) {
+		struct buffer *buffer = output->baked.frames[i];
+
+		if (!buffer)
+			continue;
+
+		output->device->baked.used -= buffer_size(buffer);
+		buffer_destroy(buffer);
+		output->baked.frames[i] = NULL;
+	}
+	output->baked.num_frames = 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * Capturing the frames we show, for verifying what actually went out, or
+ * streaming it somewhere else ($KMS_CAPTURE).
+ *
+ * Once a buffer has hit the screen, we know exactly what the output is
+ * scanning out, and nobody will render into that buffer again until KMS has
+ * moved on to the next one. So that's when we take our copy: the GL and
+ * Vulkan renderers queue up a copy into host-visible memory on the GPU,
+ * scaled down first if we've been asked to, and for dumb buffers we copy
+ * with the CPU. None of this waits for anything: each output has a small
+ * ring of slots to copy into, and capture_poll picks up whichever copies the
+ * GPU has finished each time around the main loop.
+ *
+ * Finished frames are then written out from a thread of our own, so a slow
+ * file system or a reader on the other end of the socket which can't keep up
+ * never holds up our repaints; it only means we run out of free slots, and
+ * drop frames from the capture until it catches up.
+ *
+ * Each frame is written as a struct capture_header, followed by height rows
+ * of stride bytes each. Frames from all outputs go to the same file or
+ * socket, in the order they were shown, as far as the GPU finishing the
+ * copies goes.
+ */
+
+/*
+ * Copyright © 2018-2019 Collabora, Ltd.
+ * Copyright © 2018-2019 DAQRI, LLC and its affiliates
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "kms-quads.h"
+
+/*
+ * What comes before each frame. Everything is in host byte order; format is
+ * the DRM fourcc of the pixel data, and flip_nsec the CLOCK_MONOTONIC time
+ * the frame hit the screen.
+ */
+#define CAPTURE_MAGIC 0x434d4b /* "KMC\0" */
+
+struct capture_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t frame_num;
+	uint64_t flip_nsec;
+	char output[32];
+};
+
+/*
+ * The sink is a Unix socket if the path starts with this, and a file to
+ * create (or truncate) otherwise.
+ */
+#define CAPTURE_SOCKET_PREFIX "unix:"
+
+static bool write_all(struct device *device, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+
+	while (size > 0) {
+		ssize_t ret;
+
+		/*
+		 * Don't let the reader going away kill us with SIGPIPE: we'd
+		 * rather just stop capturing.
+		 */
+		if (device->capture.socket)
+			ret = send(device->capture.fd, p, size, MSG_NOSIGNAL);
+		else
+			ret = write(device->capture.fd, p, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		size -= ret;
+	}
+
+	return true;
+}
+
+static void *capture_thread(void *data)
+{
+	struct device *device = data;
+	bool failed = false;
+
+	pthread_mutex_lock(&device->capture.lock);
+	while (!device->capture.thread_exit) {
+		struct capture_slot *slot = device->capture.queue;
+		struct capture_header header;
+
+		if (!slot) {
+			pthread_cond_wait(&device->capture.cond,
+					  &device->capture.lock);
+			continue;
+		}
+
+		device->capture.queue = slot->next;
+		slot->next = NULL;
+		slot->state = CAPTURE_WRITING;
+		pthread_mutex_unlock(&device->capture.lock);
+
+		/*
+		 * Nobody else touches a slot whilst we're writing it, so we
+		 * can let go of the lock for the slow part.
+		 */
+		if (!failed) {
+			memset(&header, 0, sizeof(header));
+			header.magic = CAPTURE_MAGIC;
+			header.format = slot->format;
+			header.width = slot->width;
+			header.height = slot->height;
+			header.stride = slot->stride;
+			header.frame_num = slot->frame_num;
+			header.flip_nsec = slot->flip_nsec;
+			snprintf(header.output, sizeof(header.output), "%s",
+				 slot->output->name);
+
+			if (!write_all(device, &header, sizeof(header)) ||
+			    !write_all(device, slot->data,
+				       (size_t) slot->stride * slot->height)) {
+				error("couldn't write captured frame, no longer capturing: %s\n",
+				      strerror(errno));
+				failed = true;
+			}
+		}
+
+		pthread_mutex_lock(&device->capture.lock);
+		slot->state = CAPTURE_FREE;
+		pthread_cond_broadcast(&device->capture.cond);
+	}
+	pthread_mutex_unlock(&device->capture.lock);
+
+	return NULL;
+}
+
+static int capture_socket_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error("capture socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Opens the sink, and starts the thread which writes to it. This must be
+ * called before any outputs are set up, since renderers need to know to
+ * make their buffers readable.
+ */
+bool capture_init(struct device *device, const char *path)
+{
+	size_t prefix_len = strlen(CAPTURE_SOCKET_PREFIX);
+
+	if (strncmp(path, CAPTURE_SOCKET_PREFIX, prefix_len) == 0) {
+		device->capture.socket = true;
+		device->capture.fd = capture_socket_open(path + prefix_len);
+	} else {
+		device->capture.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC |
+						O_CLOEXEC, 0644);
+	}
+	if (device->capture.fd < 0) {
+		error("couldn't open capture sink %s: %s\n", path,
+		      strerror(errno));
+		return false;
+	}
+
+	pthread_mutex_init(&device->capture.lock, NULL);
+	pthread_cond_init(&device->capture.cond, NULL);
+	if (pthread_create(&device->capture.thread, NULL, capture_thread,
+			   device) != 0) {
+		error("couldn't start capture thread\n");
+		pthread_cond_destroy(&device->capture.cond);
+		pthread_mutex_destroy(&device->capture.lock);
+		close(device->capture.fd);
+		return false;
+	}
+	device->capture.enabled = true;
+
+	return true;
+}
+
+/* Stops the writer thread; called once all outputs are gone. */
+void capture_fini(struct device *device)
+{
+	if (!device->capture.enabled)
+		return;
+
+	pthread_mutex_lock(&device->capture.lock);
+	device->capture.thread_exit = true;
+	pthread_cond_broadcast(&device->capture.cond);
+	pthread_mutex_unlock(&device->capture.lock);
+	pthread_join(device->capture.thread, NULL);
+
+	pthread_cond_destroy(&device->capture.cond);
+	pthread_mutex_destroy(&device->capture.lock);
+	close(device->capture.fd);
+	device->capture.enabled = false;
+}
+
+/*
+ * Scales down by picking every scale'th pixel of every scale'th row. The
+ * GPU renderers filter properly when they scale down; this is for
+ * everything the CPU copies, where reading every source pixel would be far
+ * too slow, since dumb buffers are usually write-combined.
+ */
+void capture_downscale(uint8_t *dst, uint32_t dst_stride,
+		       const uint8_t *src, uint32_t src_stride,
+		       uint32_t width, uint32_t height, int scale)
+{
+	for (uint32_t y = 0; y < height; y++) {
+		const uint32_t *s = (const uint32_t *)
+			(src + (size_t) y * scale * src_stride);
+		uint32_t *d = (uint32_t *) (dst + (size_t) y * dst_stride);
+
+		if (scale == 1) {
+			memcpy(d, s, width * sizeof(*d));
+			continue;
+		}
+		for (uint32_t x = 0; x < width; x++)
+			d[x] = s[x * scale];
+	}
+}
+
+static bool buffer_dumb_capture(struct buffer *buffer,
+				struct capture_slot *slot)
+{
+	const uint8_t *src = (const uint8_t *)
+		(buffer->dumb.shadow ? buffer->dumb.shadow : buffer->dumb.mem);
+
+	if (!slot->data) {
+		slot->data = malloc((size_t) slot->stride * slot->height);
+		if (!slot->data)
+			return false;
+	}
+
+	capture_downscale(slot->data, slot->stride, src, buffer->pitches[0],
+			  slot->width, slot->height,
+			  buffer->output->device->capture.scale);
+	return true;
+}
+
+static void capture_slot_queue(struct device *device,
+			       struct capture_slot *slot)
+{
+	struct capture_slot **tail = &device->capture.queue;
+
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = slot;
+	slot->state = CAPTURE_READY;
+	pthread_cond_broadcast(&device->capture.cond);
+}
+
+/*
+ * Takes a copy of a buffer which has just started being displayed, if it's
+ * one of the frames we're capturing. Called from the atomic event handler;
+ * the copy only has to have finished by the time the buffer is rendered
+ * into again, which the renderers make sure of.
+ */
+void output_capture_frame(struct output *output, struct buffer *buffer,
+			  int64_t flip_nsec)
+{
+	struct device *device = output->device;
+	struct capture_slot *slot = NULL;
+	bool ok;
+
+	/*
+	 * Imported buffers may not even be RGB, so we only capture our own
+	 * rendering.
+	 */
+	if (buffer->dmabuf.imported)
+		return;
+	if (output->stats.num_frames % device->capture.every != 0)
+		return;
+
+	if (output->capture.width == 0) {
+		output->capture.width = buffer->width / device->capture.scale;
+		output->capture.height = buffer->height / device->capture.scale;
+		if (output->capture.width == 0)
+			output->capture.width = 1;
+		if (output->capture.height == 0)
+			output->capture.height = 1;
+	}
+
+	pthread_mutex_lock(&device->capture.lock);
+	for (int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		if (output->capture.slots[i].state == CAPTURE_FREE) {
+			slot = &output->capture.slots[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&device->capture.lock);
+
+	if (!slot) {
+		output->capture.num_dropped++;
+		return;
+	}
+
+	slot->output = output;
+	slot->frame_num = buffer->frame_num;
+	slot->flip_nsec = flip_nsec;
+	slot->format = DRM_FORMAT_XRGB8888;
+	slot->width = output->capture.width;
+	slot->height = output->capture.height;
+	slot->stride = slot->width * 4;
+
+	if (device->vk_device)
+		ok = buffer_vk_capture(buffer, slot);
+	else if (device->gbm_device)
+		ok = buffer_egl_capture(buffer, slot);
+	else
+		ok = buffer_dumb_capture(buffer, slot);
+	if (!ok) {
+		output->capture.num_dropped++;
+		return;
+	}
+
+	output->capture.num_captured++;
+	pthread_mutex_lock(&device->capture.lock);
+	if (device->vk_device || device->gbm_device)
+		slot->state = CAPTURE_PENDING;
+	else
+		capture_slot_queue(device, slot);
+	pthread_mutex_unlock(&device->capture.lock);
+}
+
+/*
+ * Hands every copy the GPU has finished to the writer thread. Only the main
+ * thread moves slots out of pending, so we don't need the lock to look.
+ */
+bool capture_poll(struct device *device)
+{
+	bool pending = false;
+
+	if (!device->capture.enabled)
+		return false;
+
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+
+		for (int j = 0; j < CAPTURE_RING_SIZE; j++) {
+			struct capture_slot *slot = &output->capture.slots[j];
+			bool done;
+
+			if (slot->state != CAPTURE_PENDING)
+				continue;
+
+			if (device->vk_device)
+				done = capture_slot_vk_done(slot);
+			else
+				done = capture_slot_egl_done(slot);
+			if (!done) {
+				pending = true;
+				continue;
+			}
+
+			pthread_mutex_lock(&device->capture.lock);
+			capture_slot_queue(device, slot);
+			pthread_mutex_unlock(&device->capture.lock);
+		}
+	}
+
+	return pending;
+}
+
+/*
+ * Drops whatever the writer thread hasn't got to yet, and waits for it to
+ * finish with the slot it's writing, before freeing the output's slots.
+ */
+void output_capture_destroy(struct output *output)
+{
+	struct device *device = output->device;
+	bool busy;
+
+	if (!device->capture.enabled)
+		return;
+
+	pthread_mutex_lock(&device->capture.lock);
+	for (struct capture_slot **link = &device->capture.queue; *link;) {
+		struct capture_slot *slot = *link;
+
+		if (slot->output == output) {
+			*link = slot->next;
+			slot->next = NULL;
+			slot->state = CAPTURE_FREE;
+		} else {
+			link = &slot->next;
+		}
+	}
+	do {
+		busy = false;
+		for (int i = 0; i < CAPTURE_RING_SIZE; i++)
+			busy |= output->capture.slots[i].state == CAPTURE_WRITING;
+		if (busy)
+			pthread_cond_wait(&device->capture.cond,
+					  &device->capture.lock);
+	} while (busy);
+	pthread_mutex_unlock(&device->capture.lock);
+
+	if (device->vk_device)
+		output_vk_capture_destroy(output);
+	else if (device->gbm_device)
+		output_egl_capture_destroy(output);
+
+	for (int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		if (!device->vk_device)
+			free(output->capture.slots[i].data);
+		output->capture.slots[i].data = NULL;
+		output->capture.slots[i].state = CAPTURE_FREE;
+	}
+}
@@ -48,21 +48,29 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <linux/kd.h>
 #include <linux/major.h>
 #include <linux/vt.h>
 
 #include "kms-quads.h"
 
+/* Only defined by fairly recent kernel and libdrm headers. */
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
 /*
  * Set up the VT/TTY so it runs in graphics mode and lets us handle our own
  * input. This uses the VT specified in $TTYNO if specified, or the current VT
@@ -168,10 +176,110 @@ static int vt_setup(struct device *device)
 
 static void vt_reset(struct device *device)
 {
+	if (device->vt_fd < 0)
+		return;
+
 	ioctl(device->vt_fd, KDSKBMODE, device->saved_kb_mode);
 	ioctl(device->vt_fd, KDSETMODE, KD_TEXT);
 }
 
+/*
+ * $KMS_COLOR moves our colour management into the display hardware: each
+ * CRTC with a gamma LUT decodes our content, optionally transforms it by
+ * the row-major 3x3 matrix in $KMS_CTM, then encodes it for a display with
+ * the gamma given in $KMS_COLOR (2.2 if none). Our renderers then write
+ * their colours out as they are, rather than encoding them for sRGB
+ * themselves; see output_color_init.
+ *
+ * This has to be decided before we create our renderers, since the
+ * Vulkan renderer picks its render target format from it.
+ */
+static void color_setup(struct device *device)
+{
+	const char *env = getenv("KMS_COLOR");
+	const char *ctm = getenv("KMS_CTM");
+
+	device->color.deep = !!getenv("KMS_DEEP_COLOR");
+	if (!env && !ctm)
+		return;
+
+	device->color.enabled = true;
+	device->color.gamma = COLOR_CONTENT_GAMMA;
+	if (env && *env) {
+		char *endptr = NULL;
+		double gamma = strtod(env, &endptr);
+
+		if (gamma <= 0.0 || *endptr != '\0')
+			fprintf(stderr, "invalid $KMS_COLOR gamma '%s', using %.1f\n",
+				env, COLOR_CONTENT_GAMMA);
+		else
+			device->color.gamma = gamma;
+	}
+
+	if (ctm) {
+		double *m = device->color.ctm;
+
+		if (sscanf(ctm, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+			   &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+			   &m[6], &m[7], &m[8]) == 9)
+			device->color.has_ctm = true;
+		else
+			fprintf(stderr, "couldn't parse $KMS_CTM '%s', expected 9 comma-separated values\n",
+				ctm);
+	}
+
+	printf("colour management in KMS for display gamma %.2f%s\n",
+	       device->color.gamma,
+	       device->color.has_ctm ? ", with a colour transform" : "");
+}
+
+/*
+ * If $KMS_RENDER_NODE names a render node (e.g. /dev/dri/renderD129), open
+ * it so we can render there rather than on the KMS device: on hybrid laptops
+ * and headless render boxes, the fast GPU often has no connectors at all.
+ *
+ * Every frame we render is then shared with the KMS device as a dmabuf, see
+ * buffer_egl_create and buffer_vk_create, with explicit fencing between the
+ * two drivers where they support it. The Vulkan renderer picks the physical
+ * device behind the render node rather than the KMS device.
+ *
+ * The render node is shared by every KMS device we drive; with
+ * $KMS_ALL_DEVICES, each of them opens it for itself.
+ */
+static bool render_node_open(struct device *device, const char *kms_node)
+{
+	const char *node = getenv("KMS_RENDER_NODE");
+	drmDevicePtr kms_dev = NULL, render_dev = NULL;
+	bool same;
+
+	if (!node)
+		return true;
+
+	device->render_fd = open(node, O_RDWR | O_CLOEXEC, 0);
+	if (device->render_fd < 0) {
+		fprintf(stderr, "couldn't open render node %s: %s\n", node,
+			strerror(errno));
+		return false;
+	}
+
+	/* If it's the same GPU after all, there's nothing to share. */
+	same = drmGetDevice2(device->kms_fd, 0, &kms_dev) == 0 &&
+	       drmGetDevice2(device->render_fd, 0, &render_dev) == 0 &&
+	       drmDevicesEqual(kms_dev, render_dev);
+	drmFreeDevice(&kms_dev);
+	drmFreeDevice(&render_dev);
+	if (same) {
+		printf("render node %s belongs to %s, not using a second GPU\n",
+		       node, kms_node);
+		close(device->render_fd);
+		device->render_fd = -1;
+		return true;
+	}
+
+	printf("rendering on %s for display on %s\n", node, kms_node);
+	return true;
+}
+
 /*
  * Open a single KMS device, enumerate its resources, and attempt to find
  * usable outputs.
@@ -186,6 +294,10 @@ static struct device *device_open(const char *filename)
 	int err;
 
 	assert(ret);
+	ret->vt_fd = -1;
+	ret->render_fd = -1;
+	ret->uevent_fd = -1;
+	pthread_mutex_init(&ret->buffer_cache.lock, NULL);
 
 	/*
 	 * Open the device and ensure we have support for universal planes and
@@ -223,6 +335,16 @@ static struct device *device_open(const char *filename)
 	debug("device %s framebuffer modifiers\n",
 	      (ret->fb_modifiers) ? "supports" : "does not support");
 
+	/*
+	 * Async flips have been possible through the legacy page-flip ioctl
+	 * for a long time, but only more recent kernels allow them in atomic
+	 * commits, with a separate capability.
+	 */
+	err = drmGetCap(ret->kms_fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+	ret->async_caps.atomic = (err == 0 && cap != 0);
+	err = drmGetCap(ret->kms_fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap);
+	ret->async_caps.legacy = (err == 0 && cap != 0);
+
 	/*
 	 * The two 'resource' properties describe the KMS capabilities for
 	 * this device.
@@ -234,6 +356,9 @@ static struct device *device_open(const char *filename)
 		goto err_fd;
 	}
 
+	/* Pick up whatever we learnt about this device on a previous run. */
+	probe_cache_create(ret);
+
 	plane_res = drmModeGetPlaneResources(ret->kms_fd);
 	if (!plane_res) {
 		fprintf(stderr, "device %s has no planes\n", filename);
@@ -254,6 +379,36 @@ static struct device *device_open(const char *filename)
 		assert(ret->planes[i]);
 	}
 
+	/*
+	 * If using GPU rendering, create a GBM device to allocate buffers
+	 * for us, then an EGLDisplay we can use to connect EGL to KMS.
+	 *
+	 * We don't create surfaces or contexts here; we'll do that later
+	 * in per-output setup.
+	 *
+	 * We do this before enumerating our outputs, as the Vulkan renderer
+	 * compiles its pipeline on a separate thread, which can then run
+	 * whilst we go through all the KMS resources.
+	 */
+	color_setup(ret);
+	if (!getenv("KMS_NO_GBM") && !render_node_open(ret, filename))
+		goto err_planes;
+	if (!getenv("KMS_NO_GBM"))
+		ret->gbm_device = gbm_create_device(ret->render_fd >= 0 ?
+						    ret->render_fd :
+						    ret->kms_fd);
+
+	const char* renderer = "software";
+	if (ret->gbm_device) {
+		renderer = "vulkan";
+		if (getenv("KMS_NO_VULKAN") || !vk_device_create(ret)) {
+			printf("Not using vulkan for rendering, trying gl\n");
+			renderer = "gl";
+			if (ret->gbm_device && !device_egl_setup(ret))
+				goto err_gbm;
+		}
+	}
+
 	ret->outputs = calloc(ret->res->count_connectors,
 			      sizeof(*ret->outputs));
 	assert(ret->outputs);
@@ -263,53 +418,74 @@ static struct device *device_open(const char *filename)
 	 * output chain. The comments in output_create() describe how we
 	 * determine how to set up the output, and why we work backwards
 	 * from a connector.
+	 *
+	 * drmModeGetConnector makes the kernel probe the connector again,
+	 * which can mean waiting for the monitor to send its EDID over a
+	 * slow bus. If we have already seen this connector since boot, we
+	 * trust the kernel's current state instead: it will have sent us a
+	 * hotplug event if anything changed since then.
 	 */
 	for (int i = 0; i < ret->res->count_connectors; i++) {
-		drmModeConnectorPtr connector =
-			drmModeGetConnector(ret->kms_fd,
-					    ret->res->connectors[i]);
-		struct output *output = output_create(ret, connector);
+		uint32_t id = ret->res->connectors[i];
+		drmModeConnectorPtr connector;
+		struct output *output;
+
+		if (probe_get_connector(ret, id))
+			connector = drmModeGetConnectorCurrent(ret->kms_fd, id);
+		else
+			connector = drmModeGetConnector(ret->kms_fd, id);
+		if (!connector)
+			continue;
 
+		connector_probe(ret, connector);
+		output = output_create(ret, connector);
+		drmModeFreeConnector(connector);
 		if (!output)
 			continue;
 
 		ret->outputs[ret->num_outputs++] = output;
 	}
 
+	/*
+	 * The Vulkan pipeline has been compiling whilst we probed; only now
+	 * do we find out whether it worked. None of our outputs have set up
+	 * their renderer yet, so we can still fall back to GL.
+	 */
+	if (ret->vk_device && !vk_device_wait_pipeline(ret->vk_device)) {
+		printf("Vulkan pipeline creation failed, trying gl\n");
+		vk_device_destroy(ret->vk_device);
+		ret->vk_device = NULL;
+		renderer = "gl";
+		if (!device_egl_setup(ret))
+			goto err_outputs;
+	}
+
 	if (ret->num_outputs == 0) {
 		fprintf(stderr, "device %s has no active outputs\n", filename);
 		goto err_outputs;
 	}
 
-	/*
-	 * If using GPU rendering, create a GBM device to allocate buffers
-	 * for us, then an EGLDisplay we can use to connect EGL to KMS.
-	 *
-	 * We don't create surfaces or contexts here; we'll do that later
-	 * in per-output setup.
-	 */
-	if (!getenv("KMS_NO_GBM"))
-		ret->gbm_device = gbm_create_device(ret->kms_fd);
-
-	const char* renderer = "software";
-	if (ret->gbm_device) {
-		renderer = "vulkan";
-		if (getenv("KMS_NO_VULKAN") || !vk_device_create(ret)) {
-			printf("Not using vulkan for rendering, trying gl\n");
-			renderer = "gl";
-			if (ret->gbm_device && !device_egl_setup(ret))
-				goto err_gbm;
-		}
-	}
+	ret->uevent_fd = probe_uevent_open();
+	probe_cache_save(ret);
 
 	printf("using device %s with %d outputs and %s rendering\n",
 	       filename, ret->num_outputs, renderer);
 	return ret;
 
-err_gbm:
-	gbm_device_destroy(ret->gbm_device);
 err_outputs:
+	for (int i = 0; i < ret->num_outputs; i++)
+		output_destroy(ret->outputs[i]);
 	free(ret->outputs);
+	if (ret->vk_device)
+		vk_device_destroy(ret->vk_device);
+	if (ret->egl_dpy)
+		eglTerminate(ret->egl_dpy);
+err_gbm:
+	if (ret->gbm_device)
+		gbm_device_destroy(ret->gbm_device);
+	if (ret->render_fd >= 0)
+		close(ret->render_fd);
+err_planes:
 	for (int i = 0; i < ret->num_planes; i++)
 		drmModeFreePlane(ret->planes[i]);
 	free(ret->planes);
@@ -317,6 +493,7 @@ err_plane_res:
 	drmModeFreePlaneResources(plane_res);
 err_res:
 	drmModeFreeResources(ret->res);
+	probe_cache_destroy(ret);
 err_fd:
 	close(ret->kms_fd);
 err:
@@ -324,13 +501,189 @@ err:
 	return NULL;
 }
 
+/*
+ * A quick look at a primary node, to see whether it has any displays at
+ * all: with $KMS_ALL_DEVICES we need to know that before opening it for
+ * real, see device_create_all.
+ */
+static bool device_is_kms(const char *filename)
+{
+	drmModeResPtr res = NULL;
+	bool ret;
+	int fd;
+
+	fd = open(filename, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0 &&
+	    drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+		res = drmModeGetResources(fd);
+	ret = res && res->count_crtcs > 0 && res->count_connectors > 0;
+	drmModeFreeResources(res);
+	close(fd);
+
+	if (!ret)
+		printf("device %s is not a KMS device\n", filename);
+	return ret;
+}
+
+static pid_t *device_children;
+static volatile sig_atomic_t device_num_children = 0;
+
+static void device_forward_signal(int signo)
+{
+	for (int i = 0; i < device_num_children; i++)
+		kill(device_children[i], signo);
+}
+
+/*
+ * $KMS_ALL_DEVICES drives the outputs of every KMS device, rather than just
+ * the first one we can use. Each device gets a process of its own, which
+ * then runs exactly as it would have done alone: our main loop, the
+ * commits it groups together and the CPU time the benchmark measures are
+ * all per device anyway, and a device which fails or hangs leaves the
+ * others running.
+ *
+ * We have to fork before opening any of them for real, as neither GBM nor
+ * Vulkan survive being forked, so device_is_kms only weeds out the nodes
+ * with no displays at all. The parent sets up the VT on behalf of all its
+ * children, passes SIGINT on to them, and puts the VT back once the last
+ * of them has exited; it never returns from here. SIGUSR1 and SIGUSR2 are
+ * not passed on, as pkill already sends them to every child, and getting
+ * SIGUSR2 twice would unpause them straight away. Each child returns its
+ * own device, or NULL if it couldn't use it after all.
+ */
+static struct device *device_create_all(drmDevicePtr *devices, int num_devices)
+{
+	struct sigaction sa, old_sa[3];
+	const int signals[] = { SIGINT, SIGUSR1, SIGUSR2 };
+	struct device *vt;
+	const char **nodes;
+	int num_nodes = 0, num_running;
+	pid_t parent = getpid();
+	sigset_t mask, old_mask;
+	bool failed = false;
+
+	nodes = calloc(num_devices, sizeof(*nodes));
+	assert(nodes);
+	for (int i = 0; i < num_devices; i++) {
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+		if (device_is_kms(devices[i]->nodes[DRM_NODE_PRIMARY]))
+			nodes[num_nodes++] = devices[i]->nodes[DRM_NODE_PRIMARY];
+	}
+	if (num_nodes == 0) {
+		free(nodes);
+		return NULL;
+	}
+
+	/* Only our VT state is ever used from this one. */
+	vt = calloc(1, sizeof(*vt));
+	assert(vt);
+	vt->vt_fd = -1;
+	if (vt_setup(vt) != 0) {
+		fprintf(stderr, "couldn't set up VT for graphics mode\n");
+		exit(EXIT_FAILURE);
+	}
+
+	device_children = calloc(num_nodes, sizeof(*device_children));
+	assert(device_children);
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	for (unsigned int i = 0; i < ARRAY_LENGTH(signals); i++) {
+		sa.sa_handler = (signals[i] == SIGINT) ? device_forward_signal :
+							 SIG_IGN;
+		sigaction(signals[i], &sa, &old_sa[i]);
+	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+
+	printf("driving %d KMS devices, one process each\n", num_nodes);
+	for (int i = 0; i < num_nodes; i++) {
+		pid_t pid;
+
+		/* Otherwise whatever we haven't written out yet would be
+		 * written out again by every child. */
+		fflush(stdout);
+		fflush(stderr);
+
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "couldn't fork for %s: %s\n", nodes[i],
+				strerror(errno));
+			failed = true;
+			device_forward_signal(SIGINT);
+			break;
+		}
+
+		if (pid == 0) {
+			const char *node = nodes[i];
+
+			for (unsigned int j = 0; j < ARRAY_LENGTH(signals); j++)
+				sigaction(signals[j], &old_sa[j], NULL);
+			device_num_children = 0;
+			free(device_children);
+			device_children = NULL;
+			close(vt->vt_fd);
+			free(vt);
+			free(nodes);
+
+			/* Don't outlive the parent, which has the VT. */
+			prctl(PR_SET_PDEATHSIG, SIGINT);
+			if (getppid() != parent)
+				exit(EXIT_FAILURE);
+
+			return device_open(node);
+		}
+
+		device_children[device_num_children++] = pid;
+	}
+
+	num_running = device_num_children;
+	while (num_running > 0) {
+		int status;
+		pid_t pid = wait(&status);
+
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+
+		/* Its PID can be reused as soon as we have reaped it. */
+		sigprocmask(SIG_BLOCK, &mask, &old_mask);
+		for (int i = 0; i < device_num_children; i++) {
+			if (device_children[i] != pid)
+				continue;
+			device_children[i] =
+				device_children[device_num_children - 1];
+			device_num_children--;
+			num_running--;
+			break;
+		}
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	}
+
+	vt_reset(vt);
+	close(vt->vt_fd);
+	free(vt);
+	free(device_children);
+	free(nodes);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
 /*
  * Enumerate all KMS devices and find one we can use; also set up our TTY for
- * graphics mode if we find one.
+ * graphics mode if we find one. With $KMS_ALL_DEVICES, we use all of them
+ * instead, see device_create_all.
  */
 struct device *device_create(void)
 {
-	struct device *ret;
+	struct device *ret = NULL;
 	drmDevicePtr *devices;
 	int num_devices;
 
@@ -345,6 +698,14 @@ struct device *device_create(void)
 	num_devices = drmGetDevices2(0, devices, num_devices);
 	printf("%d DRM devices available\n", num_devices);
 
+	if (getenv("KMS_ALL_DEVICES")) {
+		ret = device_create_all(devices, num_devices);
+		drmFreeDevices(devices, num_devices);
+		if (!ret)
+			fprintf(stderr, "couldn't find any suitable KMS device\n");
+		return ret;
+	}
+
 	for (int i = 0; i < num_devices; i++) {
 		drmDevicePtr candidate = devices[i];
 
@@ -386,14 +747,25 @@ void device_destroy(struct device *device)
 	for (int i = 0; i < device->num_outputs; i++)
 		output_destroy(device->outputs[i]);
 	free(device->outputs);
+	capture_fini(device);
+	buffer_cache_evict(device, 0);
+	pthread_mutex_destroy(&device->buffer_cache.lock);
+
+	probe_cache_save(device);
+	probe_cache_destroy(device);
+	if (device->uevent_fd >= 0)
+		close(device->uevent_fd);
 
 	if (device->vk_device)
 		vk_device_destroy(device->vk_device);
 	if (device->gbm_device)
 		gbm_device_destroy(device->gbm_device);
+	if (device->render_fd >= 0)
+		close(device->render_fd);
+	if (device->sw_renderer)
+		sw_renderer_destroy(device->sw_renderer);
 
 	close(device->kms_fd);
-	free(device);
-
 	vt_reset(device);
+	free(device);
 }
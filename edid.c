@@ -73,6 +73,7 @@
 #define EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING	0xfe
 #define EDID_DESCRIPTOR_DISPLAY_PRODUCT_NAME		0xfc
 #define EDID_DESCRIPTOR_DISPLAY_PRODUCT_SERIAL_NUMBER	0xff
+#define EDID_DESCRIPTOR_DISPLAY_RANGE_LIMITS		0xfd
 #define EDID_OFFSET_DATA_BLOCKS				0x36
 #define EDID_OFFSET_LAST_BLOCK				0x6c
 #define EDID_OFFSET_PNPID				0x08
@@ -167,6 +168,15 @@ edid_parse(const uint8_t *data, size_t length)
 		} else if (data[i+3] == EDID_DESCRIPTOR_ALPHANUMERIC_DATA_STRING) {
 			edid_parse_string(&data[i+5],
 					  edid->eisa_id);
+		} else if (data[i+3] == EDID_DESCRIPTOR_DISPLAY_RANGE_LIMITS) {
+			/* EDID 1.4 allows rates above 255Hz by flagging
+			 * an offset of 255 in the low bits of byte 4 */
+			edid->min_vrefresh = data[i+5];
+			edid->max_vrefresh = data[i+6];
+			if ((data[i+4] & 0x3) == 0x3)
+				edid->min_vrefresh += 255;
+			if (data[i+4] & 0x2)
+				edid->max_vrefresh += 255;
 		}
 	}
 
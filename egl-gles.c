@@ -24,6 +24,7 @@
  * Author: Daniel Stone <daniels@collabora.com>
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -178,11 +179,19 @@ egl_find_config(struct output *output)
 	assert(err);
 
 	for (EGLint c = 0; c < num_cfg; c++) {
-		EGLint visual;
+		EGLint visual, surface_type;
 		err = eglGetConfigAttrib(device->egl_dpy, configs[c],
 					 EGL_NATIVE_VISUAL_ID, &visual);
 		assert(err);
-		if (visual == DRM_FORMAT_XRGB8888) {
+
+		/* Window surfaces need a config which can make them. */
+		err = eglGetConfigAttrib(device->egl_dpy, configs[c],
+					 EGL_SURFACE_TYPE, &surface_type);
+		assert(err);
+		if (device->egl_surface && !(surface_type & EGL_WINDOW_BIT))
+			continue;
+
+		if ((uint32_t) visual == output->format) {
 			ret = configs[c];
 			break;
 		}
@@ -192,7 +201,7 @@ egl_find_config(struct output *output)
 
 	if (!ret) {
 		error("no EGL config for format 0x%" PRIx32 "\n",
-		      DRM_FORMAT_XRGB8888);
+		      output->format);
 	}
 
 	return ret;
@@ -271,36 +280,49 @@ egl_create_context(struct output *output)
 	return EGL_NO_CONTEXT;
 }
 
-/* The following is boring boilerplate GL to draw four quads. */
+/*
+ * The following is boring boilerplate GL to draw coloured triangles, which
+ * we only use with $KMS_GL_DRAW; see buffer_egl_fill.
+ */
 static const char *vert_shader_text_gles =
 	"precision highp float;\n"
 	"attribute vec2 in_pos;\n"
+	"attribute vec4 in_col;\n"
+	"varying vec4 v_col;\n"
 	"void main() {\n"
 	"  gl_Position = vec4(in_pos, 0.0, 1.0);\n"
+	"  v_col = in_col;\n"
 	"}\n";
 
 static const char *frag_shader_text_gles =
 	"precision highp float;\n"
-	"uniform vec4 u_col;\n"
+	"varying vec4 v_col;\n"
 	"void main() {\n"
-	"  gl_FragColor = u_col;\n"
+	"  gl_FragColor = v_col;\n"
 	"}\n";
 
 static const char *vert_shader_text_glcore =
 	"#version 330 core\n"
 	"in vec2 in_pos;\n"
+	"in vec4 in_col;\n"
+	"out vec4 v_col;\n"
 	"void main() {\n"
 	"  gl_Position = vec4(in_pos, 0.0, 1.0);\n"
+	"  v_col = in_col;\n"
 	"}\n";
 
 static const char *frag_shader_text_glcore =
 	"#version 330 core\n"
-	"uniform vec4 u_col;\n"
+	"in vec4 v_col;\n"
 	"out vec4 out_color;\n"
 	"void main() {\n"
-	"  out_color = u_col;\n"
+	"  out_color = v_col;\n"
 	"}\n";
 
+/* Each render op is two triangles, each vertex a position and colour. */
+#define VERTS_PER_OP 6
+#define FLOATS_PER_VERT 6
+
 static GLuint
 create_shader(GLuint program, const char *source, GLenum shader_type)
 {
@@ -330,6 +352,52 @@ create_shader(GLuint program, const char *source, GLenum shader_type)
         return EGL_TRUE;
 }
 
+/*
+ * When rendering on another GPU, the modifiers KMS accepts for the output's
+ * plane aren't necessarily ones the render GPU can produce: tiling layouts
+ * are specific to each GPU vendor, and often generation. Cut our list down
+ * to those which both support, so that GBM picks one KMS can scan out of
+ * without a copy. Usually this only leaves LINEAR, if anything.
+ */
+static void output_egl_filter_modifiers(struct output *output)
+{
+	struct device *device = output->device;
+	PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_modifiers =
+		(PFNEGLQUERYDMABUFMODIFIERSEXTPROC)
+		eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+	EGLuint64KHR *render_mods;
+	EGLBoolean *external_only;
+	EGLint num_render_mods = 0;
+	unsigned int num = 0;
+
+	if (!query_modifiers ||
+	    !query_modifiers(device->egl_dpy, output->format, 0, NULL,
+			     NULL, &num_render_mods))
+		return;
+
+	render_mods = calloc(num_render_mods, sizeof(*render_mods));
+	external_only = calloc(num_render_mods, sizeof(*external_only));
+	assert(render_mods && external_only);
+	query_modifiers(device->egl_dpy, output->format, num_render_mods,
+			render_mods, external_only, &num_render_mods);
+
+	for (unsigned int i = 0; i < output->num_modifiers; i++) {
+		for (EGLint j = 0; j < num_render_mods; j++) {
+			if (external_only[j] ||
+			    render_mods[j] != output->modifiers[i])
+				continue;
+			output->modifiers[num++] = output->modifiers[i];
+			break;
+		}
+	}
+
+	debug("[%s] %u of %u modifiers usable across both GPUs\n",
+	      output->name, num, output->num_modifiers);
+	output->num_modifiers = num;
+	free(render_mods);
+	free(external_only);
+}
+
 bool
 output_egl_setup(struct output *output)
 {
@@ -351,6 +419,9 @@ output_egl_setup(struct output *output)
 	debug("%susing explicit fencing\n",
 	      (output->explicit_fencing) ? "" : "not ");
 
+	if (device->render_fd >= 0 && device->fb_modifiers)
+		output_egl_filter_modifiers(output);
+
 	output->egl.cfg = egl_find_config(output);
 	if (!output->egl.cfg)
 		return false;
@@ -428,7 +499,9 @@ output_egl_setup(struct output *output)
 	assert(ret);
 
 	output->egl.pos_attr = 0;
+	output->egl.col_attr = 1;
 	glBindAttribLocation(output->egl.gl_prog, output->egl.pos_attr, "in_pos");
+	glBindAttribLocation(output->egl.gl_prog, output->egl.col_attr, "in_col");
 
 	glLinkProgram(output->egl.gl_prog);
 	glGetProgramiv(output->egl.gl_prog, GL_LINK_STATUS, &status);
@@ -441,13 +514,18 @@ output_egl_setup(struct output *output)
 	}
 	assert(status);
 
-	output->egl.col_uniform = glGetUniformLocation(output->egl.gl_prog, "u_col");
-
 	glUseProgram(output->egl.gl_prog);
 
+	/*
+	 * The vertex buffer is re-specified with each frame's vertices, so
+	 * the driver can hand us fresh storage rather than waiting for the
+	 * GPU to finish with the last frame's.
+	 */
 	glGenBuffers(1, &output->egl.vbo);
 	glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 8, NULL, GL_DYNAMIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER,
+		     sizeof(GLfloat) * MAX_RENDER_OPS * VERTS_PER_OP * FLOATS_PER_VERT,
+		     NULL, GL_STREAM_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	glGenVertexArrays(1, &output->egl.vao);
@@ -455,8 +533,13 @@ output_egl_setup(struct output *output)
 
 	glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
 
-	glVertexAttribPointer(output->egl.pos_attr, 2, GL_FLOAT, GL_FALSE, 0, (char*)(NULL));
-	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(output->egl.pos_attr, 2, GL_FLOAT, GL_FALSE,
+			      sizeof(GLfloat) * FLOATS_PER_VERT, (char*)(NULL));
+	glVertexAttribPointer(output->egl.col_attr, 4, GL_FLOAT, GL_FALSE,
+			      sizeof(GLfloat) * FLOATS_PER_VERT,
+			      (char*)(NULL) + sizeof(GLfloat) * 2);
+	glEnableVertexAttribArray(output->egl.pos_attr);
+	glEnableVertexAttribArray(output->egl.col_attr);
 
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
@@ -481,23 +564,157 @@ output_egl_destroy(struct device* device, struct output *output)
 	glDeleteVertexArrays(1, &output->egl.vao);
 	glDeleteBuffers(1, &output->egl.vbo);
 	glDeleteProgram(output->egl.gl_prog);
+
+	/*
+	 * Destroying the GBM surface also destroys its BOs, and with them
+	 * the buffers we wrapped them in.
+	 */
+	if (output->egl.surface != EGL_NO_SURFACE)
+		eglDestroySurface(device->egl_dpy, output->egl.surface);
+	if (output->egl.gbm_surface)
+		gbm_surface_destroy(output->egl.gbm_surface);
+
 	eglDestroyContext(output->device->egl_dpy, output->egl.ctx);
 }
 
+/*
+ * Give a buffer on the render GPU a dumb buffer on our KMS device to copy
+ * its frames into, for when KMS can't scan out from the render GPU's buffer
+ * directly.
+ *
+ * Dumb buffers are linear, which every GPU which can import dmabufs at all
+ * can render to, so we import it into EGL as a second render target, and
+ * blit each frame over once it is done; see buffer_egl_fill. KMS then gets
+ * the dumb buffer instead of the render GPU's buffer.
+ */
+bool buffer_egl_add_copy(struct device *device, struct buffer *buffer)
+{
+	PFNEGLCREATEIMAGEKHRPROC create_img = (PFNEGLCREATEIMAGEKHRPROC)
+		eglGetProcAddress("eglCreateImageKHR");
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC target_tex_2d =
+		(PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+		eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	struct drm_mode_create_dumb create = {
+		.width = buffer->width,
+		.height = buffer->height,
+		.bpp = 32,
+	};
+	struct drm_mode_destroy_dumb destroy = { 0 };
+	EGLint attribs[32];
+	EGLint nattribs = 0;
+	int fd;
+
+	assert(create_img && target_tex_2d);
+
+	if (drmIoctl(device->kms_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0) {
+		error("failed to create %u x %u dumb buffer to copy into: %s\n",
+		      buffer->width, buffer->height, strerror(errno));
+		return false;
+	}
+
+	fd = handle_to_fd(device->kms_fd, create.handle);
+	if (fd < 0)
+		goto err_dumb;
+
+	attribs[nattribs++] = EGL_WIDTH;
+	attribs[nattribs++] = buffer->width;
+	attribs[nattribs++] = EGL_HEIGHT;
+	attribs[nattribs++] = buffer->height;
+	attribs[nattribs++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[nattribs++] = buffer->format;
+	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_FD_EXT;
+	attribs[nattribs++] = fd;
+	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+	attribs[nattribs++] = 0;
+	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_PITCH_EXT;
+	attribs[nattribs++] = create.pitch;
+	if (device->fb_modifiers) {
+		attribs[nattribs++] = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+		attribs[nattribs++] = DRM_FORMAT_MOD_LINEAR >> 32;
+		attribs[nattribs++] = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+		attribs[nattribs++] = DRM_FORMAT_MOD_LINEAR & 0xffffffff;
+	}
+	attribs[nattribs++] = EGL_NONE;
+
+	if (!output_egl_make_current(buffer->output)) {
+		error("[%s] couldn't make EGL context current\n",
+		      buffer->output->name);
+		close(fd);
+		goto err_dumb;
+	}
+
+	buffer->gbm.copy.img = create_img(device->egl_dpy, EGL_NO_CONTEXT,
+					  EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	close(fd);
+	if (!buffer->gbm.copy.img) {
+		error("render GPU can't import %u x %u dumb buffer to copy into\n",
+		      buffer->width, buffer->height);
+		goto err_dumb;
+	}
+
+	glGenTextures(1, &buffer->gbm.copy.tex_id);
+	glBindTexture(GL_TEXTURE_2D, buffer->gbm.copy.tex_id);
+	target_tex_2d(GL_TEXTURE_2D, buffer->gbm.copy.img);
+	glGenFramebuffers(1, &buffer->gbm.copy.fbo_id);
+	glBindFramebuffer(GL_FRAMEBUFFER, buffer->gbm.copy.fbo_id);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, buffer->gbm.copy.tex_id, 0);
+	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+	/* From now on, KMS only ever sees the dumb buffer. */
+	buffer_prime_release(device, buffer);
+	buffer->gbm.copy.handle = create.handle;
+	buffer->gem_handles[0] = create.handle;
+	buffer->pitches[0] = create.pitch;
+	buffer->offsets[0] = 0;
+	buffer->modifier = DRM_FORMAT_MOD_LINEAR;
+	return true;
+
+err_dumb:
+	destroy.handle = create.handle;
+	drmIoctl(device->kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	return false;
+}
+
+/*
+ * Make the output's context current on the calling thread, unless it already
+ * is. Switching contexts forces the driver to flush and swap out a lot of
+ * state, so we don't want to pay for it on every frame when we are only
+ * rendering one output on this thread.
+ *
+ * The client API bound with eglBindAPI is per-thread state, so we also need
+ * to bind it again when making the context current for the first time on a
+ * new thread.
+ */
+bool
+output_egl_make_current(struct output *output)
+{
+	struct device *device = output->device;
+
+	if (eglGetCurrentContext() == output->egl.ctx)
+		return true;
+
+	if (!eglBindAPI(output->egl.gl_core ? EGL_OPENGL_API :
+					      EGL_OPENGL_ES_API))
+		return false;
+
+	return eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			      output->egl.ctx);
+}
+
 /*
  * Allocates a buffer and makes it usable for rendering with EGL/GL. We achieve
  * this by allocating each individual buffer with GBM, importing it into EGL
  * as an EGLImage, binding the EGLImage to a texture unit, then finally creating
  * a FBO from that texture unit so we can render into it.
  */
-struct buffer *buffer_egl_create(struct device *device, struct output *output)
+struct buffer *buffer_egl_create(struct device *device, struct output *output,
+				 uint32_t width, uint32_t height)
 {
 	struct buffer *ret = calloc(1, sizeof(*ret));
 	static PFNEGLCREATEIMAGEKHRPROC create_img = NULL;
-	static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC target_tex_2d = NULL;
 	EGLint attribs[64] = { 0, }; /* see note below about type */
 	EGLint nattribs = 0;
-	EGLBoolean err;
 	int num_planes;
 	int dma_buf_fds[4] = { -1, -1, -1, -1 };
 
@@ -508,36 +725,49 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 	ret->kms_fence_fd = -1;
 
 	/*
-	 * We have the list of the acceptable modifiers for KMS, which we just
-	 * pass straight to GBM. GBM takes this list of modifiers, and picks
-	 * the 'best' modifier according to whatever internal preference the
-	 * driver wants to use. We can then query the GBM BO to find out which
-	 * modifier it selected.
+	 * We have the list of the acceptable modifiers for KMS, which we
+	 * could pass straight to GBM: GBM takes this list of modifiers, and
+	 * picks the 'best' modifier according to whatever internal preference
+	 * the driver wants to use. We can then query the GBM BO to find out
+	 * which modifier it selected.
+	 *
+	 * The driver's preference doesn't know anything about what KMS can
+	 * actually scan out at this mode though, so once main.c has picked a
+	 * modifier by testing them in turn, we pass only that one.
 	 */
 	if (device->fb_modifiers) {
+		const uint64_t *modifiers;
+		unsigned int num_modifiers =
+			output_modifiers_get(output, &modifiers);
+
 		ret->gbm.bo = gbm_bo_create_with_modifiers(device->gbm_device,
-							   output->mode.hdisplay,
-							   output->mode.vdisplay,
-							   DRM_FORMAT_XRGB8888,
-							   output->modifiers,
-							   output->num_modifiers);
+							   width,
+							   height,
+							   output->format,
+							   modifiers,
+							   num_modifiers);
 	}
-	if (!ret->gbm.bo) {
+	if (!ret->gbm.bo && !output->mod_pick.selecting) {
 		/*
 		 * Fall back to the non-modifier path if we can't create a
-		 * buffer with modifiers.
+		 * buffer with modifiers. Whilst we're still trying candidate
+		 * modifiers one by one, we just fail instead, so the next one
+		 * can be tried.
 		 */
 		device->fb_modifiers = false;
 		ret->gbm.bo = gbm_bo_create(device->gbm_device,
-					    output->mode.hdisplay,
-					    output->mode.vdisplay,
-					    DRM_FORMAT_XRGB8888,
-					    GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+					    width,
+					    height,
+					    output->format,
+					    GBM_BO_USE_RENDERING |
+					    ((device->render_fd >= 0) ?
+					     GBM_BO_USE_LINEAR :
+					     GBM_BO_USE_SCANOUT));
 	}
 
 	if (!ret->gbm.bo) {
 		error("failed to create %u x %u BO\n",
-		      output->mode.hdisplay, output->mode.vdisplay);
+		      width, height);
 		goto err;
 	}
 
@@ -545,9 +775,9 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 	 * We can query all the image properties from the GBM BO once we've
 	 * created it.
 	 */
-	ret->format = DRM_FORMAT_XRGB8888;
-	ret->width = output->mode.hdisplay;
-	ret->height = output->mode.vdisplay;
+	ret->format = output->format;
+	ret->width = width;
+	ret->height = height;
 	ret->modifier = gbm_bo_get_modifier(ret->gbm.bo);
 	num_planes = gbm_bo_get_plane_count(ret->gbm.bo);
 	for (int i = 0; i < num_planes; i++) {
@@ -562,7 +792,10 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 		}
 		ret->gem_handles[i] = h.u32;
 
-		dma_buf_fds[i] = handle_to_fd(device, ret->gem_handles[i]);
+		dma_buf_fds[i] = handle_to_fd(device->render_fd >= 0 ?
+					      device->render_fd :
+					      device->kms_fd,
+					      ret->gem_handles[i]);
 		if (dma_buf_fds[i] == -1) {
 			error("failed to get file descriptor for BO plane %d (modifier 0x%" PRIx64 ")\n",
 			      i, ret->modifier);
@@ -600,7 +833,7 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 	attribs[nattribs++] = EGL_HEIGHT;
 	attribs[nattribs++] = ret->height;
 	attribs[nattribs++] = EGL_LINUX_DRM_FOURCC_EXT;
-	attribs[nattribs++] = DRM_FORMAT_XRGB8888;
+	attribs[nattribs++] = ret->format;
 	debug("importing %u x %u EGLImage with %d planes\n", ret->width, ret->height, num_planes);
 
 	attribs[nattribs++] = EGL_DMA_BUF_PLANE0_FD_EXT;
@@ -668,10 +901,6 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 
 	attribs[nattribs++] = EGL_NONE;
 
-	err = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     output->egl.ctx);
-	assert(err);
-
 	/*
 	 * Create an EGLImage from our GBM BO, which will give EGL and GLES
 	 * the ability to use it as a render target.
@@ -684,6 +913,13 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 		goto err_bo;
 	}
 
+	/*
+	 * The BO's GEM handles are only valid on the render GPU; if that's
+	 * not our KMS device, we also need to import the dmabufs there.
+	 */
+	if (device->render_fd >= 0)
+		buffer_prime_import(device, ret, dma_buf_fds, num_planes);
+
 	/*
 	 * EGL does not take ownership of the dma-buf file descriptors and will
 	 * clone them internally. We don't need the file descriptors after
@@ -693,13 +929,45 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 		close(dma_buf_fds[i]);
 	}
 
-	/*
-	 * Bind the EGLImage to a GLES texture unit, then bind that texture
-	 * to a GL framebuffer object, so we can use it to render into.
-	 */
-	glGenTextures(1, &ret->gbm.tex_id);
+	if (!buffer_egl_bind(device, ret)) {
+		buffer_egl_destroy(device, ret);
+		free(ret);
+		return NULL;
+	}
+	return ret;
+
+err_bo:
+	gbm_bo_destroy(ret->gbm.bo);
+	for (size_t i = 0; i < ARRAY_LENGTH(dma_buf_fds); i++) {
+		if (dma_buf_fds[i] != -1)
+			close(dma_buf_fds[i]);
+	}
+err:
+	free(ret);
+	return NULL;
+}
+
+/*
+ * Bind the buffer's EGLImage to a GLES texture unit, then bind that texture
+ * to a GL framebuffer object, so we can use it to render into.
+ *
+ * The EGLImage belongs to the display, but textures and FBOs belong to the
+ * output's context; so when a buffer is handed from one output to another
+ * through the buffer cache (see buffer_release), only these are recreated.
+ */
+bool buffer_egl_bind(struct device *device, struct buffer *buffer)
+{
+	static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC target_tex_2d = NULL;
+
+	if (!output_egl_make_current(buffer->output)) {
+		error("[%s] couldn't make EGL context current\n",
+		      buffer->output->name);
+		return false;
+	}
+
+	glGenTextures(1, &buffer->gbm.tex_id);
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, ret->gbm.tex_id);
+	glBindTexture(GL_TEXTURE_2D, buffer->gbm.tex_id);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -710,35 +978,45 @@ struct buffer *buffer_egl_create(struct device *device, struct output *output)
 			eglGetProcAddress("glEGLImageTargetTexture2DOES");
 	}
 	assert(target_tex_2d);
-	target_tex_2d(GL_TEXTURE_2D, ret->gbm.img);
+	target_tex_2d(GL_TEXTURE_2D, buffer->gbm.img);
 
-	glGenFramebuffers(1, &ret->gbm.fbo_id);
-	glBindFramebuffer(GL_FRAMEBUFFER, ret->gbm.fbo_id);
+	glGenFramebuffers(1, &buffer->gbm.fbo_id);
+	glBindFramebuffer(GL_FRAMEBUFFER, buffer->gbm.fbo_id);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-			       ret->gbm.tex_id, 0);
+			       buffer->gbm.tex_id, 0);
 	assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+	return true;
+}
 
-	return ret;
-
-err_bo:
-	gbm_bo_destroy(ret->gbm.bo);
-	for (size_t i = 0; i < ARRAY_LENGTH(dma_buf_fds); i++) {
-		if (dma_buf_fds[i] != -1)
-			close(dma_buf_fds[i]);
+/*
+ * Drops the output's texture and FBO for the buffer, see buffer_egl_bind,
+ * along with those for the buffer we copy frames into, if any; see
+ * buffer_egl_add_copy. If we can't make the context current, we can only
+ * forget about them; they go when the context does.
+ */
+void buffer_egl_unbind(struct device *device, struct buffer *buffer)
+{
+	if (!buffer->gbm.fbo_id && !buffer->gbm.copy.fbo_id)
+		return;
+
+	if (output_egl_make_current(buffer->output)) {
+		glDeleteFramebuffers(1, &buffer->gbm.fbo_id);
+		glDeleteTextures(1, &buffer->gbm.tex_id);
+		glDeleteFramebuffers(1, &buffer->gbm.copy.fbo_id);
+		glDeleteTextures(1, &buffer->gbm.copy.tex_id);
+	} else {
+		error("[%s] couldn't make EGL context current\n",
+		      buffer->output->name);
 	}
-err:
-	free(ret);
-	return NULL;
+	buffer->gbm.fbo_id = 0;
+	buffer->gbm.tex_id = 0;
+	buffer->gbm.copy.fbo_id = 0;
+	buffer->gbm.copy.tex_id = 0;
 }
 
 void buffer_egl_destroy(struct device *device, struct buffer *buffer)
 {
 	static PFNEGLDESTROYIMAGEKHRPROC destroy_img = NULL;
-	EGLBoolean ret;
-
-	ret = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     buffer->output->egl.ctx);
-	assert(ret);
 
 	if (!destroy_img) {
 		destroy_img = (PFNEGLDESTROYIMAGEKHRPROC)
@@ -746,70 +1024,150 @@ void buffer_egl_destroy(struct device *device, struct buffer *buffer)
 	}
 	assert(destroy_img);
 
+	/*
+	 * Buffers sitting in the buffer cache have no output, and so no
+	 * textures or FBOs to delete; buffers with a copy are never cached.
+	 */
+	if (buffer->output)
+		buffer_egl_unbind(device, buffer);
 	destroy_img(device->egl_dpy, buffer->gbm.img);
-	glDeleteFramebuffers(1, &buffer->gbm.fbo_id);
-	glDeleteTextures(1, &buffer->gbm.tex_id);
 	gbm_bo_destroy(buffer->gbm.bo);
+
+	if (buffer->gbm.copy.handle) {
+		struct drm_mode_destroy_dumb destroy = {
+			.handle = buffer->gbm.copy.handle,
+		};
+
+		destroy_img(device->egl_dpy, buffer->gbm.copy.img);
+		drmIoctl(device->kms_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	buffer_prime_release(device, buffer);
 }
 
-static void fill_verts(GLfloat *verts, GLfloat *col, int frame_num, int loc)
+/* Writes two triangles covering the rectangle, in the given colour. */
+static GLfloat *fill_verts(GLfloat *verts, const struct drm_mode_rect *rect,
+			   const float *col, unsigned int width,
+			   unsigned int height)
 {
-	float factor = ((frame_num * 2.0) / (float) NUM_ANIM_FRAMES) - 1.0f;
-	GLfloat top, bottom, left, right;
-
-	assert(loc >= 0 && loc < 4);
-
-	switch (loc) {
-	case 0:
-		col[0] = 0.0f;
-		col[1] = 0.0f;
-		col[2] = 0.0f;
-		col[3] = 1.0f;
-		top = -1.0f;
-		left = -1.0f;
-		bottom = factor;
-		right = factor;
-		break;
-	case 1:
-		col[0] = 1.0f;
-		col[1] = 0.0f;
-		col[2] = 0.0f;
-		col[3] = 1.0f;
-		top = -1.0f;
-		left = factor;
-		right = 1.0f;
-		bottom = factor;
-		break;
-	case 2:
-		col[0] = 0.0f;
-		col[1] = 0.0f;
-		col[2] = 1.0f;
-		col[3] = 1.0f;
-		top = factor;
-		left = -1.0f;
-		bottom = 1.0f;
-		right = factor;
-		break;
-	case 3:
-		col[0] = 1.0f;
-		col[1] = 0.0f;
-		col[2] = 1.0f;
-		col[3] = 1.0f;
-		top = factor;
-		left = factor;
-		bottom = 1.0f;
-		right = 1.0f;
-		break;
-	}
-
-	verts[0] = left;
-	verts[1] = bottom;
-	verts[2] = left;
-	verts[3] = top;
-	verts[4] = right;
-	verts[5] = top;
-	verts[6] = right;
-	verts[7] = bottom;
+	static const int corners[VERTS_PER_OP][2] = {
+		{ 0, 0 }, { 1, 0 }, { 1, 1 },
+		{ 0, 0 }, { 1, 1 }, { 0, 1 },
+	};
+	GLfloat left = (2.0f * rect->x1) / width - 1.0f;
+	GLfloat right = (2.0f * rect->x2) / width - 1.0f;
+	GLfloat top = (2.0f * rect->y1) / height - 1.0f;
+	GLfloat bottom = (2.0f * rect->y2) / height - 1.0f;
+
+	for (int v = 0; v < VERTS_PER_OP; v++) {
+		*verts++ = corners[v][0] ? right : left;
+		*verts++ = corners[v][1] ? bottom : top;
+		for (int c = 0; c < 4; c++)
+			*verts++ = col[c];
+	}
+
+	return verts;
+}
+
+/*
+ * Only redraw the parts of the target which are out of date: the render
+ * list has the solid rectangles making up the frame, already clipped to
+ * the damage. We fill each with a scissored clear, which needs no shading,
+ * vertices or draw calls at all.
+ *
+ * With $KMS_GL_DRAW, we draw the same rectangles as triangles instead,
+ * uploading all their vertices at once and drawing them with a single
+ * call.
+ *
+ * When we render into an FBO, GL's window co-ordinates start at the first
+ * row in memory, the same as KMS's and the list's. A window surface has
+ * its origin at the bottom left like any other, so there we have to flip
+ * the list upside down.
+ */
+static void egl_draw(struct output *output, const struct damage *damage,
+		     uint32_t width, uint32_t height, int frame_num,
+		     bool flip_y)
+{
+	struct render_list list;
+
+	render_list_build(&list, damage, width, height, frame_num);
+	for (int i = 0; i < list.num_ops && flip_y; i++) {
+		struct drm_mode_rect *rect = &list.ops[i].rect;
+		int32_t y1 = rect->y1;
+
+		rect->y1 = height - rect->y2;
+		rect->y2 = height - y1;
+	}
+
+	if (!output->device->gl_draw) {
+		glEnable(GL_SCISSOR_TEST);
+		for (int i = 0; i < list.num_ops; i++) {
+			const struct render_op *op = &list.ops[i];
+
+			glScissor(op->rect.x1, op->rect.y1,
+				  op->rect.x2 - op->rect.x1,
+				  op->rect.y2 - op->rect.y1);
+			glClearColor(op->col[0], op->col[1], op->col[2],
+				     op->col[3]);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+		glDisable(GL_SCISSOR_TEST);
+	} else if (list.num_ops > 0) {
+		GLfloat verts[MAX_RENDER_OPS * VERTS_PER_OP * FLOATS_PER_VERT];
+		GLfloat *end = verts;
+
+		for (int i = 0; i < list.num_ops; i++)
+			end = fill_verts(end, &list.ops[i].rect,
+					 list.ops[i].col, width, height);
+
+		glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
+		glBufferData(GL_ARRAY_BUFFER, (end - verts) * sizeof(GLfloat),
+			     verts, GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindVertexArray(output->egl.vao);
+		glDrawArrays(GL_TRIANGLES, 0, list.num_ops * VERTS_PER_OP);
+		glBindVertexArray(0);
+	}
+
+#ifdef DEBUG
+	{
+		GLenum err = glGetError();
+		if (err != GL_NO_ERROR)
+			debug("GL error state 0x%x\n", err);
+	}
+#endif
+}
+
+/* Entrypoints for EGL fence syncs, only looked up once we need them. */
+static PFNEGLCREATESYNCKHRPROC create_sync = NULL;
+static PFNEGLWAITSYNCKHRPROC wait_sync = NULL;
+static PFNEGLDESTROYSYNCKHRPROC destroy_sync = NULL;
+static PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_fence_fd = NULL;
+
+static void egl_sync_procs_init(void)
+{
+	if (!create_sync) {
+		create_sync = (PFNEGLCREATESYNCKHRPROC)
+			eglGetProcAddress("eglCreateSyncKHR");
+	}
+	assert(create_sync);
+
+	if (!wait_sync) {
+		wait_sync = (PFNEGLWAITSYNCKHRPROC)
+			eglGetProcAddress("eglWaitSyncKHR");
+	}
+	assert(wait_sync);
+
+	if (!destroy_sync) {
+		destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+			eglGetProcAddress("eglDestroySyncKHR");
+	}
+	assert(destroy_sync);
+
+	if (!dup_fence_fd) {
+		dup_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
+			eglGetProcAddress("eglDupNativeFenceFDANDROID");
+	}
+	assert(dup_fence_fd);
 }
 
 void
@@ -817,41 +1175,14 @@ buffer_egl_fill(struct buffer *buffer, int frame_num)
 {
 	struct output *output = buffer->output;
 	struct device *device = output->device;
-	static PFNEGLCREATESYNCKHRPROC create_sync = NULL;
-	static PFNEGLWAITSYNCKHRPROC wait_sync = NULL;
-	static PFNEGLDESTROYSYNCKHRPROC destroy_sync = NULL;
-	static PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_fence_fd = NULL;
 	EGLSyncKHR sync;
 	EGLBoolean ret;
 
-	ret = eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
-			     output->egl.ctx);
+	ret = output_egl_make_current(output);
 	assert(ret);
 
 	if (output->explicit_fencing) {
-		if (!create_sync) {
-			create_sync = (PFNEGLCREATESYNCKHRPROC)
-				eglGetProcAddress("eglCreateSyncKHR");
-		}
-		assert(create_sync);
-
-		if (!wait_sync) {
-			wait_sync = (PFNEGLWAITSYNCKHRPROC)
-				eglGetProcAddress("eglWaitSyncKHR");
-		}
-		assert(wait_sync);
-
-		if (!destroy_sync) {
-			destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
-				eglGetProcAddress("eglDestroySyncKHR");
-		}
-		assert(destroy_sync);
-
-		if (!dup_fence_fd) {
-			dup_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
-				eglGetProcAddress("eglDupNativeFenceFDANDROID");
-		}
-		assert(dup_fence_fd);
+		egl_sync_procs_init();
 
 		/*
 		 * If this buffer was previously used by KMS, insert a sync
@@ -884,24 +1215,23 @@ buffer_egl_fill(struct buffer *buffer, int frame_num)
 
 	glBindFramebuffer(GL_FRAMEBUFFER, buffer->gbm.fbo_id);
 	glViewport(0, 0, buffer->width, buffer->height);
+	egl_draw(output, &buffer->damage, buffer->width, buffer->height,
+		 frame_num, false);
 
-	for (unsigned int i = 0; i < 4; i++) {
-		GLfloat col[4];
-		GLfloat verts[8];
-		GLuint err = glGetError();
-		fill_verts(verts, col, frame_num, i);
-		glBindBuffer(GL_ARRAY_BUFFER, output->egl.vbo);
-		/* glBufferSubData is most supported across GLES2 / Core profile,
-		 * Core profile / GLES3 might have better ways */
-		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 8, verts);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindVertexArray(output->egl.vao);
-		glUniform4f(output->egl.col_uniform, col[0], col[1], col[2], col[3]);
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-		glBindVertexArray(0);
-		err = glGetError();
-		if (err != GL_NO_ERROR)
-			debug("GL error state 0x%x\n", err);
+	/*
+	 * If KMS can't scan out of this buffer, because it's on another GPU,
+	 * copy the parts we've just repainted over to the buffer it can.
+	 */
+	if (buffer->gbm.copy.fbo_id) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, buffer->gbm.fbo_id);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, buffer->gbm.copy.fbo_id);
+		for (int d = 0; d < buffer->damage.num_rects; d++) {
+			const struct drm_mode_rect *rect = &buffer->damage.rects[d];
+
+			glBlitFramebuffer(rect->x1, rect->y1, rect->x2, rect->y2,
+					  rect->x1, rect->y1, rect->x2, rect->y2,
+					  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		}
 	}
 
 	/*
@@ -929,6 +1259,14 @@ buffer_egl_fill(struct buffer *buffer, int frame_num)
 
 	glFlush();
 
+	/*
+	 * Implicit fencing doesn't necessarily work between two different
+	 * drivers, so without a fence to pass to KMS, we have to wait for
+	 * the render GPU to finish before we let KMS have the buffer.
+	 */
+	if (device->render_fd >= 0 && !output->explicit_fencing)
+		glFinish();
+
 	/*
 	 * Now we've flushed, we can get the fence FD associated with our
 	 * rendering, which we can pass to KMS to wait for.
@@ -941,3 +1279,373 @@ buffer_egl_fill(struct buffer *buffer, int frame_num)
 		destroy_sync(device->egl_dpy, sync);
 	}
 }
+
+/*
+ * The alternative to allocating BOs ourselves and rendering into them
+ * through FBOs ($KMS_EGL_SURFACE): the usual native window path, where EGL
+ * renders into a window surface on a gbm_surface, and we take each frame
+ * off it once it's been swapped. The driver then picks the layout of the
+ * buffers itself and renders straight into them, which for some (older Mali
+ * and Vivante, for instance) is much faster than going through an FBO, or
+ * is the only way to get framebuffer compression.
+ *
+ * We give GBM the modifiers KMS can take, narrowed down to the one we
+ * picked by testing if we got that far, just as buffer_egl_create does.
+ */
+bool output_egl_surface_setup(struct output *output, uint32_t width,
+			      uint32_t height)
+{
+	struct device *device = output->device;
+	const char *exts = eglQueryString(device->egl_dpy, EGL_EXTENSIONS);
+
+	if (device->fb_modifiers) {
+		const uint64_t *modifiers;
+		unsigned int num_modifiers =
+			output_modifiers_get(output, &modifiers);
+
+		if (num_modifiers > 0) {
+			output->egl.gbm_surface =
+				gbm_surface_create_with_modifiers(device->gbm_device,
+								  width, height,
+								  output->format,
+								  modifiers,
+								  num_modifiers);
+		}
+	}
+	if (!output->egl.gbm_surface) {
+		output->egl.gbm_surface =
+			gbm_surface_create(device->gbm_device, width, height,
+					   output->format,
+					   GBM_BO_USE_SCANOUT |
+					   GBM_BO_USE_RENDERING);
+	}
+	if (!output->egl.gbm_surface) {
+		error("[%s] failed to create %u x %u GBM surface\n",
+		      output->name, width, height);
+		return false;
+	}
+
+	output->egl.surface =
+		eglCreateWindowSurface(device->egl_dpy, output->egl.cfg,
+				       (EGLNativeWindowType) output->egl.gbm_surface,
+				       NULL);
+	if (output->egl.surface == EGL_NO_SURFACE) {
+		error("[%s] failed to create EGL window surface: 0x%x\n",
+		      output->name, eglGetError());
+		gbm_surface_destroy(output->egl.gbm_surface);
+		output->egl.gbm_surface = NULL;
+		return false;
+	}
+
+	output->egl.buffer_age =
+		gl_extension_supported(exts, "EGL_EXT_buffer_age");
+	output->egl.num_frames = 0;
+
+	printf("[%s] rendering into a GBM surface%s\n", output->name,
+	       output->egl.buffer_age ? ", repainting by buffer age" : "");
+	return true;
+}
+
+/* Called by GBM when it destroys a BO we've wrapped in a buffer. */
+static void surface_buffer_destroy(struct gbm_bo *bo, void *data)
+{
+	struct buffer *buffer = data;
+
+	drmModeRmFB(buffer->output->device->kms_fd, buffer->fb_id);
+	if (buffer->render_fence_fd >= 0)
+		close(buffer->render_fence_fd);
+	if (buffer->kms_fence_fd >= 0)
+		close(buffer->kms_fence_fd);
+	free(buffer);
+}
+
+/*
+ * GBM surfaces only have a handful of BOs, which they hand out again and
+ * again. The first time we see each one, we wrap it in a buffer with a
+ * framebuffer, and attach that to the BO so we find it again next time.
+ */
+static struct buffer *surface_buffer_get(struct output *output,
+					 struct gbm_bo *bo)
+{
+	struct buffer *ret = gbm_bo_get_user_data(bo);
+	int num_planes;
+
+	if (ret)
+		return ret;
+
+	ret = calloc(1, sizeof(*ret));
+	assert(ret);
+	ret->output = output;
+	ret->render_fence_fd = -1;
+	ret->kms_fence_fd = -1;
+	ret->gbm.bo = bo;
+	ret->gbm.surface = output->egl.gbm_surface;
+	ret->format = gbm_bo_get_format(bo);
+	ret->width = gbm_bo_get_width(bo);
+	ret->height = gbm_bo_get_height(bo);
+	ret->modifier = gbm_bo_get_modifier(bo);
+
+	num_planes = gbm_bo_get_plane_count(bo);
+	for (int i = 0; i < num_planes; i++) {
+		ret->gem_handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+		ret->pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+		ret->offsets[i] = gbm_bo_get_offset(bo, i);
+	}
+
+	if (buffer_add_fb(output->device, ret) != 0) {
+		free(ret);
+		return NULL;
+	}
+
+	gbm_bo_set_user_data(bo, ret, surface_buffer_destroy);
+	return ret;
+}
+
+/*
+ * Render a frame into the output's window surface, swap it, and return the
+ * buffer for the BO it ended up in, ready to commit; or NULL if we couldn't.
+ *
+ * The surface decides which BO we render into, so unlike with our own
+ * buffers we can't track damage per buffer. EGL_EXT_buffer_age tells us
+ * how many frames ago the back buffer was last shown, though, which with
+ * our list of the frames we've rendered tells us what it holds; without
+ * it, or if it's older than we remember, we repaint everything.
+ *
+ * KMS keeps the BO until we release it with buffer_egl_surface_release,
+ * once it's no longer on screen; until then, the surface won't hand it out
+ * again, so there's no KMS fence to wait for. The render fence works the
+ * same as for our own buffers.
+ */
+struct buffer *output_egl_surface_render(struct output *output,
+					 unsigned int frame_num)
+{
+	struct device *device = output->device;
+	uint32_t width = output->pool.width;
+	uint32_t height = output->pool.height;
+	EGLSyncKHR sync = EGL_NO_SYNC_KHR;
+	struct damage damage = { 0, };
+	struct buffer *buffer;
+	struct timespec start;
+	struct gbm_bo *bo;
+	EGLint age = 0;
+	EGLBoolean ret;
+
+	if (!gbm_surface_has_free_buffers(output->egl.gbm_surface)) {
+		error("[%s] GBM surface has no free buffers\n", output->name);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (!eglBindAPI(output->egl.gl_core ? EGL_OPENGL_API :
+					      EGL_OPENGL_ES_API))
+		return NULL;
+	ret = eglMakeCurrent(device->egl_dpy, output->egl.surface,
+			     output->egl.surface, output->egl.ctx);
+	assert(ret);
+
+	if (output->egl.buffer_age &&
+	    !eglQuerySurface(device->egl_dpy, output->egl.surface,
+			     EGL_BUFFER_AGE_EXT, &age))
+		age = 0;
+	if (age > 0 && (unsigned int) age <= output->egl.num_frames)
+		anim_damage(device, width, height,
+			    output->egl.frames[age - 1], frame_num, &damage);
+	else
+		damage_add_rect(&damage, 0, 0, width, height);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, width, height);
+	egl_draw(output, &damage, width, height, frame_num, true);
+
+	if (output->explicit_fencing) {
+		EGLint attribs[] = {
+			EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+			EGL_NONE,
+		};
+
+		egl_sync_procs_init();
+		sync = create_sync(device->egl_dpy,
+				   EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+		assert(sync);
+	}
+
+	/* Swapping flushes our rendering, so the fence then exists. */
+	if (!eglSwapBuffers(device->egl_dpy, output->egl.surface)) {
+		error("[%s] eglSwapBuffers failed: 0x%x\n", output->name,
+		      eglGetError());
+		goto err_sync;
+	}
+
+	bo = gbm_surface_lock_front_buffer(output->egl.gbm_surface);
+	if (!bo) {
+		error("[%s] couldn't lock GBM surface front buffer\n",
+		      output->name);
+		goto err_sync;
+	}
+
+	buffer = surface_buffer_get(output, bo);
+	if (!buffer) {
+		gbm_surface_release_buffer(output->egl.gbm_surface, bo);
+		goto err_sync;
+	}
+
+	buffer->frame_num = frame_num;
+	buffer->render_start_nsec = timespec_to_nsec(&start);
+	if (sync != EGL_NO_SYNC_KHR) {
+		int fd = dup_fence_fd(device->egl_dpy, sync);
+		assert(fd >= 0);
+		assert(linux_sync_file_is_valid(fd));
+		fd_replace(&buffer->render_fence_fd, fd);
+		destroy_sync(device->egl_dpy, sync);
+	}
+
+	memmove(&output->egl.frames[1], &output->egl.frames[0],
+		(EGL_SURFACE_MAX_AGE - 1) * sizeof(output->egl.frames[0]));
+	output->egl.frames[0] = frame_num;
+	if (output->egl.num_frames < EGL_SURFACE_MAX_AGE)
+		output->egl.num_frames++;
+
+	return buffer;
+
+err_sync:
+	if (sync != EGL_NO_SYNC_KHR)
+		destroy_sync(device->egl_dpy, sync);
+	return NULL;
+}
+
+/* Hands a buffer KMS has finished with back to its GBM surface. */
+void buffer_egl_surface_release(struct buffer *buffer)
+{
+	gbm_surface_release_buffer(buffer->gbm.surface, buffer->gbm.bo);
+}
+
+/*
+ * Frame capture (see capture.c): we read the buffer back into the slot's
+ * pixel buffer object, which lets glReadPixels return straight away rather
+ * than waiting for the GPU to finish, and fence it so that capture_poll can
+ * tell when the copy has landed. When scaling down, we blit into a smaller
+ * renderbuffer first, filtering as we go, and read that back instead.
+ *
+ * GL only guarantees we can read back as RGBA bytes, so that's what we
+ * capture; in DRM terms, that's XBGR8888.
+ */
+bool buffer_egl_capture(struct buffer *buffer, struct capture_slot *slot)
+{
+	struct output *output = buffer->output;
+	GLuint read_fbo = buffer->gbm.fbo_id;
+	GLsizeiptr size = (GLsizeiptr) slot->stride * slot->height;
+	EGLBoolean ret;
+
+	if (!read_fbo)
+		return false;
+
+	ret = output_egl_make_current(output);
+	assert(ret);
+
+	if (!slot->pbo) {
+		slot->data = malloc(size);
+		if (!slot->data)
+			return false;
+		glGenBuffers(1, &slot->pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	if (slot->width != buffer->width || slot->height != buffer->height) {
+		if (!output->capture.fbo_id) {
+			glGenRenderbuffers(1, &output->capture.rbo_id);
+			glBindRenderbuffer(GL_RENDERBUFFER, output->capture.rbo_id);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8,
+					      slot->width, slot->height);
+			glGenFramebuffers(1, &output->capture.fbo_id);
+			glBindFramebuffer(GL_FRAMEBUFFER, output->capture.fbo_id);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+						  GL_COLOR_ATTACHMENT0,
+						  GL_RENDERBUFFER,
+						  output->capture.rbo_id);
+			assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+			       GL_FRAMEBUFFER_COMPLETE);
+		}
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output->capture.fbo_id);
+		glBlitFramebuffer(0, 0, buffer->width, buffer->height,
+				  0, 0, slot->width, slot->height,
+				  GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		read_fbo = output->capture.fbo_id;
+	}
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, slot->width, slot->height, GL_RGBA,
+		     GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	slot->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+	slot->format = DRM_FORMAT_XBGR8888;
+
+	return true;
+}
+
+/*
+ * Copies a finished read back out of its pixel buffer object, returning
+ * false if the GPU hasn't got to it yet.
+ */
+bool capture_slot_egl_done(struct capture_slot *slot)
+{
+	GLsizeiptr size = (GLsizeiptr) slot->stride * slot->height;
+	EGLBoolean ret;
+	GLenum status;
+	void *map;
+
+	ret = output_egl_make_current(slot->output);
+	assert(ret);
+
+	status = glClientWaitSync(slot->sync, 0, 0);
+	if (status == GL_TIMEOUT_EXPIRED)
+		return false;
+	glDeleteSync(slot->sync);
+	slot->sync = NULL;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+	map = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if (map) {
+		memcpy(slot->data, map, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	} else {
+		error("[%s] couldn't map capture buffer\n", slot->output->name);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return true;
+}
+
+void output_egl_capture_destroy(struct output *output)
+{
+	EGLBoolean ret;
+
+	ret = output_egl_make_current(output);
+	assert(ret);
+
+	for (int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		struct capture_slot *slot = &output->capture.slots[i];
+
+		if (slot->sync)
+			glDeleteSync(slot->sync);
+		if (slot->pbo)
+			glDeleteBuffers(1, &slot->pbo);
+		slot->sync = NULL;
+		slot->pbo = 0;
+	}
+
+	if (output->capture.fbo_id) {
+		glDeleteFramebuffers(1, &output->capture.fbo_id);
+		glDeleteRenderbuffers(1, &output->capture.rbo_id);
+		output->capture.fbo_id = 0;
+		output->capture.rbo_id = 0;
+	}
+}
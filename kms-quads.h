@@ -25,12 +25,15 @@
  */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/types.h>
 
 /* The dma-fence explicit fencing API was previously called sync-file. */
 #include <linux/sync_file.h>
@@ -81,10 +84,16 @@
 struct buffer;
 struct device;
 struct output;
+struct probe_cache;
+struct sw_renderer;
 
 
-#define BUFFER_QUEUE_DEPTH 3 /* how many buffers to allocate per output */
+#ifndef BUFFER_QUEUE_DEPTH
+#define BUFFER_QUEUE_DEPTH 3 /* the most buffers we allocate per output */
+#endif
 #define NUM_ANIM_FRAMES 240 /* how many frames before we wrap around */
+#define MAX_DAMAGE_RECTS 8 /* collapse damage to its bounding box beyond this */
+#define STATS_RING_SIZE 1024 /* how many frames of timing to keep per output */
 
 
 /**
@@ -136,6 +145,7 @@ enum wdrm_plane_property {
 	WDRM_PLANE_CRTC_ID,
 	WDRM_PLANE_IN_FORMATS,
 	WDRM_PLANE_IN_FENCE_FD,
+	WDRM_PLANE_FB_DAMAGE_CLIPS,
 	WDRM_PLANE__COUNT
 };
 
@@ -157,6 +167,7 @@ enum wdrm_connector_property {
 	WDRM_CONNECTOR_DPMS,
 	WDRM_CONNECTOR_CRTC_ID,
 	WDRM_CONNECTOR_NON_DESKTOP,
+	WDRM_CONNECTOR_VRR_CAPABLE,
 	WDRM_CONNECTOR__COUNT
 };
 
@@ -175,9 +186,76 @@ enum wdrm_crtc_property {
 	WDRM_CRTC_MODE_ID = 0,
 	WDRM_CRTC_ACTIVE,
 	WDRM_CRTC_OUT_FENCE_PTR,
+	WDRM_CRTC_VRR_ENABLED,
+	WDRM_CRTC_DEGAMMA_LUT,
+	WDRM_CRTC_DEGAMMA_LUT_SIZE,
+	WDRM_CRTC_CTM,
+	WDRM_CRTC_GAMMA_LUT,
+	WDRM_CRTC_GAMMA_LUT_SIZE,
 	WDRM_CRTC__COUNT
 };
 
+/*
+ * How expensive we expect a modifier's memory layout to be to scan out,
+ * from worst to best; see modifier_classify.
+ */
+enum modifier_class {
+	MODIFIER_CLASS_LINEAR = 0,
+	MODIFIER_CLASS_TILED,
+	MODIFIER_CLASS_COMPRESSED,
+};
+
+/*
+ * Timing information for one frame, recorded when its commit completes.
+ * All times are CLOCK_MONOTONIC in nanoseconds.
+ *
+ * predicted_nsec is when we expected the frame to hit the screen, flip_nsec
+ * is when it actually did, and render_done_nsec is when the GPU finished
+ * rendering it according to the render fence, or 0 without explicit
+ * fencing; render_nsec is then the time from starting to render the frame
+ * until the fence signalled. commit_nsec is how long drmModeAtomicCommit
+ * took, and num_dropped is how many animation frames advance_frame skipped
+ * because we were running late.
+ */
+struct frame_record {
+	int64_t predicted_nsec;
+	int64_t flip_nsec;
+	int64_t render_done_nsec;
+	int64_t render_nsec;
+	int64_t commit_nsec;
+	unsigned int num_dropped;
+};
+
+/*
+ * A region of a buffer, as a list of possibly-overlapping rectangles in
+ * buffer co-ordinates. We use the same rect structure as KMS's
+ * FB_DAMAGE_CLIPS property, so we can pass the list straight through; x2
+ * and y2 are exclusive.
+ *
+ * This is deliberately simple rather than a real region implementation:
+ * once we run out of rects, we just grow the last one to cover everything.
+ */
+struct damage {
+	int num_rects;
+	struct drm_mode_rect rects[MAX_DAMAGE_RECTS];
+};
+
+/*
+ * A frame as a list of solid rectangles to fill, already clipped to the
+ * buffer's damage; see render.c. Each of the four quads can appear once per
+ * damaged rectangle.
+ */
+#define MAX_RENDER_OPS (4 * MAX_DAMAGE_RECTS)
+
+struct render_op {
+	struct drm_mode_rect rect;
+	float col[4];
+};
+
+struct render_list {
+	int num_ops;
+	struct render_op ops[MAX_RENDER_OPS];
+};
 
 /*
  * A buffer to display on screen. We currently use KMS dumb buffers for this.
@@ -197,10 +275,40 @@ struct buffer {
 	struct output *output;
 
 	/*
-	 * true if this buffer is currently owned by KMS.
+	 * true if this buffer is currently owned by KMS, or has been
+	 * rendered ahead and is queued waiting to be committed.
 	 */
 	bool in_use;
 
+	/*
+	 * true if this buffer has been picked to render a frame ahead of
+	 * time: it is either being rendered by the output's render thread,
+	 * or sitting in output->buffers_ready, waiting to be committed.
+	 */
+	bool ready;
+
+	/*
+	 * The animation frame last rendered into this buffer, and when we
+	 * started rendering it (CLOCK_MONOTONIC).
+	 */
+	unsigned int frame_num;
+	int64_t render_start_nsec;
+
+	/*
+	 * When we last picked this buffer to render into (CLOCK_MONOTONIC),
+	 * so we can tell which of an output's buffers has been sitting idle
+	 * and can be freed; see output_buffers_trim.
+	 */
+	int64_t last_used_nsec;
+
+	/*
+	 * The parts of this buffer which are out of date, i.e. which have
+	 * changed in frames rendered into our other buffers since this one
+	 * was last rendered. This is all we need to repaint the next time
+	 * we render into it; new buffers start out entirely damaged.
+	 */
+	struct damage damage;
+
 	/*
 	 * The GEM handle for this buffer, returned from the dumb-buffer
 	 * creation ioctl. GEM names are also returned from
@@ -212,7 +320,9 @@ struct buffer {
 	 * display the buffer we've created, we need to create a framebuffer,
 	 * which annotates our GEM buffer with additional metadata.
 	 *
-	 * 0 is always an invalid GEM handle.
+	 * 0 is always an invalid GEM handle. Imported dmabufs only have
+	 * handles until their framebuffer is created; see
+	 * buffer_dmabuf_import.
 	 */
 	uint32_t gem_handles[4];
 
@@ -230,6 +340,13 @@ struct buffer {
 	 */
 	int render_fence_fd;
 
+	/*
+	 * Set when the renderer has queued up the work for this buffer but
+	 * not submitted it yet, so render_fence_fd only becomes valid later;
+	 * see vk_batch_begin.
+	 */
+	bool fence_deferred;
+
 	/*
 	 * dma_fence FD for completion of the last KMS commit this buffer
 	 * was used in.
@@ -262,23 +379,172 @@ struct buffer {
 	uint32_t format;
 	uint64_t modifier;
 
-	/* Parameters for our memory-mapped image. */
+	/*
+	 * Parameters for our memory-mapped image. shadow is a copy of the
+	 * image in normal cached memory with the same layout, which we render
+	 * into instead with $KMS_SHADOW, or NULL.
+	 */
 	struct {
 		uint32_t *mem;
+		uint32_t *shadow;
 		unsigned int size;
 	} dumb;
 
+	/*
+	 * When rendering on a different GPU from the one driving KMS, the
+	 * BO lives on the render GPU, and gem_handles are our KMS device's
+	 * handles for the same dmabuf, which we own (prime_handles).
+	 *
+	 * If KMS can't scan out of the render GPU's buffer, we instead give
+	 * it a dumb buffer, which we also import into EGL, and copy each
+	 * frame into that after rendering: copy.handle is then the dumb
+	 * buffer's handle on the KMS device.
+	 */
 	struct {
 		struct gbm_bo *bo;
 		EGLImage img;
 		GLuint tex_id;
 		GLuint fbo_id;
+		bool prime_handles;
+		struct {
+			uint32_t handle;
+			EGLImage img;
+			GLuint tex_id;
+			GLuint fbo_id;
+		} copy;
+
+		/*
+		 * For buffers which wrap a BO locked from an output's GBM
+		 * surface, the surface to give it back to once KMS is done
+		 * with it; the surface owns the BO.
+		 */
+		struct gbm_surface *surface;
 	} gbm;
 
 	unsigned int width;
 	unsigned int height;
 	unsigned int pitches[4]; /* in bytes */
 	unsigned int offsets[4]; /* in bytes */
+
+	/*
+	 * Buffers imported from someone else's dmabuf, e.g. a video decoder,
+	 * through buffer_dmabuf_import: we never render into these, only
+	 * display them. We close the GEM handles as soon as we have made
+	 * the framebuffer, which holds its own reference to the object.
+	 *
+	 * A dmabuf is identified by the inode of its fd, which stays the
+	 * same however many times it is passed to us, and can't be reused
+	 * for another dmabuf whilst our framebuffer's reference keeps the
+	 * object, and so the inode, alive. next links the output's imported
+	 * buffers, most recently used first.
+	 */
+	struct {
+		bool imported;
+		dev_t dev;
+		ino_t ino;
+		struct buffer *next;
+	} dmabuf;
+
+	/*
+	 * Whilst the buffer sits in the device's buffer cache (see
+	 * buffer_release), output is NULL, and this is the device it
+	 * belongs to; next links the cache, most recently released first.
+	 */
+	struct {
+		struct device *device;
+		struct buffer *next;
+	} cache;
+
+	/*
+	 * Set for buffers holding one frame of the baked animation; see
+	 * output_baked_frame. Once shown is set, the frame has been on
+	 * screen before, and we're only flipping back to it: there's no
+	 * rendering left to wait for or measure.
+	 */
+	struct {
+		bool frame;
+		bool shown;
+	} baked;
+};
+
+/*
+ * Describes a dmabuf to import: one fd per plane (which may all be the same
+ * dmabuf), along with the layout, as passed to drmModeAddFB2WithModifiers.
+ *
+ * acquire_fence_fd is a sync_file which signals when the producer has
+ * finished writing the buffer, or -1 to rely on implicit fencing; we take
+ * ownership of it. The plane fds stay owned by the caller.
+ */
+struct dmabuf_attributes {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+	int num_planes;
+	int fds[4];
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+	int acquire_fence_fd;
+};
+
+/*
+ * How many imported buffers each output keeps framebuffers around for:
+ * decoders usually cycle through a small fixed pool of surfaces, which
+ * this should cover.
+ */
+#define DMABUF_CACHE_SIZE 16
+
+/*
+ * The oldest back buffer we expect a GBM surface to hand us, going by
+ * EGL_EXT_buffer_age; anything older gets repainted in full.
+ */
+#define EGL_SURFACE_MAX_AGE 4
+
+/*
+ * How many buffers which no output needs any more we keep around, in case
+ * one needs a buffer of the same size and layout again; see buffer_release.
+ */
+#define BUFFER_CACHE_SIZE 8
+
+/* The gamma our renderers' output is encoded with; see output_color_init. */
+#define COLOR_CONTENT_GAMMA 2.2
+
+/*
+ * Frame capture ($KMS_CAPTURE): each output copies the frames it shows
+ * into a small ring of host-memory slots, which a writer thread then sends
+ * on to the capture file or socket; see capture.c.
+ *
+ * A slot is pending whilst the GPU is still copying into it, ready once
+ * its contents are in data, and writing whilst the writer thread has it.
+ * If every slot is busy when a frame comes along, we drop that frame
+ * rather than waiting for one.
+ *
+ * The GL renderer reads back into a pixel buffer object, which we map to
+ * copy out of once sync has signalled; the Vulkan renderer copies into a
+ * host-visible buffer of its own, which data points straight into.
+ */
+#define CAPTURE_RING_SIZE 4
+
+struct capture_slot {
+	enum capture_state {
+		CAPTURE_FREE = 0,
+		CAPTURE_PENDING,
+		CAPTURE_READY,
+		CAPTURE_WRITING,
+	} state;
+	struct output *output;
+
+	unsigned int frame_num;
+	int64_t flip_nsec;
+	uint32_t format;
+	uint32_t width, height, stride;
+	uint8_t *data;
+
+	GLuint pbo;
+	GLsync sync;
+
+	/* The writer thread's queue of ready slots, oldest first. */
+	struct capture_slot *next;
 };
 
 /*
@@ -310,7 +576,9 @@ struct buffer {
  * show a single flat fullscreen image, overlay planes are used to display
  * content on top of this which is blended by the display controller (often
  * video content), and cursor planes are almost exclusively used for mouse
- * cursors. For our uses, we only care about primary planes.
+ * cursors. We normally only use primary planes; with $KMS_OVERLAY set, we
+ * also try to place our animation on an overlay or cursor plane (see
+ * output_overlay_assign).
  *
  * Note that _only_ overlay planes will be enumerated by default; enabling
  * the 'universal planes' client capability causes the kernel to advertise
@@ -328,6 +596,21 @@ struct output {
 	 */
 	bool needs_repaint;
 
+	/*
+	 * Hotplug state. Outputs created after startup set modeset_alone,
+	 * so their first frame is committed in a request of its own, and the
+	 * modeset doesn't hold up everyone else's flips. Once the connector
+	 * is unplugged, we stop repainting the output; when nothing is left
+	 * in flight we switch its CRTC off (disabling), and destroy it once
+	 * that has completed (removed).
+	 */
+	struct {
+		bool modeset_alone;
+		bool unplugged;
+		bool disabling;
+		bool removed;
+	} hotplug;
+
 	/*
 	 * The plane -> CRTC -> connector chain we use.
 	 *
@@ -337,10 +620,52 @@ struct output {
 	uint32_t crtc_id;
 	uint32_t connector_id;
 
-	/* Supported format modifiers for XRGB8888. */
+	/*
+	 * The format we render and scan out: XRGB8888, or XRGB2101010 with
+	 * $KMS_DEEP_COLOR if the primary plane takes it. Supported format
+	 * modifiers for it, cheapest to scan out first once
+	 * output_modifiers_rank has sorted them.
+	 */
+	uint32_t format;
 	uint64_t *modifiers;
 	unsigned int num_modifiers;
 
+	/*
+	 * Set once KMS has turned down a buffer from the render GPU
+	 * ($KMS_RENDER_NODE), so we've fallen back to copying each frame
+	 * into a buffer KMS allocated; see buffer_create. Every buffer we
+	 * create for the output after that goes straight to the copy.
+	 */
+	bool render_copy;
+
+	/*
+	 * The CRTC's colour pipeline ($KMS_COLOR): blobs for the degamma
+	 * LUT, colour transform matrix and gamma LUT we set, built once
+	 * when the output is created; 0 for whichever we don't set. See
+	 * output_color_init.
+	 */
+	struct {
+		uint32_t degamma_blob_id;
+		uint32_t ctm_blob_id;
+		uint32_t gamma_blob_id;
+	} color;
+
+	/*
+	 * The modifier we picked to allocate buffers with, and how many
+	 * better-ranked candidates KMS or the renderer turned down first,
+	 * including any a failed modeset later pushed us past (see
+	 * output_modifier_fallback). Until chosen is set, the renderers
+	 * pass the whole list above to the allocator; selecting is set
+	 * whilst we try each candidate.
+	 */
+	struct {
+		bool selecting;
+		bool chosen;
+		unsigned int index;
+		uint64_t modifier;
+		int num_rejected;
+	} mod_pick;
+
 	struct {
 		struct drm_property_info plane[WDRM_PLANE__COUNT];
 		struct drm_property_info crtc[WDRM_CRTC__COUNT];
@@ -361,8 +686,24 @@ struct output {
 	/* Fence FD for completion of the last atomic commit. */
 	int commit_fence_fd;
 
-	/* Buffers allocated by us. */
+	/*
+	 * Buffers allocated by us. Rather than allocating all of
+	 * BUFFER_QUEUE_DEPTH up front, we start with two and only allocate
+	 * more when we need a buffer and all of them are busy, up to
+	 * device->queue_depth; buffers we haven't needed for a while are
+	 * freed again. The first num_buffers entries are always valid.
+	 *
+	 * All of the pool's buffers have the same size: the mode size, or
+	 * the size of the overlay region when using an overlay plane.
+	 */
 	struct buffer *buffers[BUFFER_QUEUE_DEPTH];
+	int num_buffers;
+	struct {
+		uint32_t width, height;
+		int peak;
+		uint64_t num_grown;
+		uint64_t num_shrunk;
+	} pool;
 
 	/*
 	 * The buffer we've just committed to KMS, waiting for it to send the
@@ -391,16 +732,278 @@ struct output {
 	 */
 	unsigned int frame_num;
 
+	/*
+	 * With variable refresh or async flips, frames aren't shown at a
+	 * fixed rate, so our animation follows the time each frame is shown,
+	 * counted from when the first one was, rather than counting vblanks.
+	 */
+	struct timespec anim_start;
+
+	/*
+	 * How many frames we render ahead of the one currently queued to
+	 * KMS, set from $KMS_RENDER_AHEAD. 0 means we only start rendering
+	 * once the previous commit has completed.
+	 *
+	 * Buffers which have been rendered ahead are kept in buffers_ready
+	 * in order of their animation frame, oldest first.
+	 */
+	int render_ahead;
+	struct buffer *buffers_ready[BUFFER_QUEUE_DEPTH];
+	int num_ready;
+
+	/*
+	 * In threaded mode, each output renders from its own thread, which
+	 * keeps buffers_ready topped up; the main thread only deals with
+	 * KMS, committing those buffers from the event loop.
+	 *
+	 * The lock protects all of the output's buffer state (the buffers'
+	 * in_use and ready flags, buffers_ready, buffer_pending and
+	 * buffer_last) as well as our frame timing. render_cond is signalled
+	 * whenever that state changes in a way that could let the render
+	 * thread make progress.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t render_cond;
+	pthread_t render_thread;
+	bool render_thread_running;
+	bool render_thread_exit;
+
+	/*
+	 * Deadline scheduling ($KMS_DEADLINE): rather than repainting as
+	 * soon as the previous frame has completed, we sleep on timer_fd
+	 * until just before the latest point we can start repainting and
+	 * still make the next vblank. This keeps the time between rendering
+	 * a frame and it hitting the screen as short as possible.
+	 *
+	 * The latest point is predicted from how long our previous frames
+	 * took to render and commit, which we track in render_nsec and
+	 * commit_nsec; render_start is when we started rendering the frame
+	 * currently pending, and in_commit is set whilst this output is part
+	 * of the atomic request being built.
+	 */
+	struct {
+		bool enabled;
+		int timer_fd;
+		struct timespec render_start;
+		int64_t render_nsec;
+		int64_t commit_nsec;
+		bool in_commit;
+	} sched;
+
+	/*
+	 * Which atomic request this output's repaints go in: group is the
+	 * index of the first output sharing the request (our own index if
+	 * we get one to ourselves); see assign_commit_groups. busy is set
+	 * when the kernel turned our last commit down with EBUSY, so we
+	 * try again shortly.
+	 */
+	struct {
+		int group;
+		bool busy;
+	} commit;
+
+	/*
+	 * Whilst our content is static (the animation is paused with SIGUSR2,
+	 * or an external stream hasn't given us a new buffer since the last
+	 * one we showed), there's nothing new to commit, so we stop
+	 * repainting: KMS keeps scanning out the last frame, and panels
+	 * which support self-refresh can stop fetching it at all. active is
+	 * set whilst we're idle, since when, and dpms_off once we've
+	 * switched the display off after $KMS_IDLE_DPMS seconds.
+	 */
+	struct {
+		bool active;
+		int64_t since_nsec;
+		bool dpms_off;
+	} idle;
+
+	/*
+	 * Variable refresh rate ($KMS_VRR): rather than scanning out at a
+	 * fixed rate, the display waits for each new frame, and shows it as
+	 * soon as it arrives, within the panel's range of refresh rates. The
+	 * mode's refresh rate is the fastest we can go; if we don't deliver a
+	 * frame within max_interval_nsec of the last one, the panel shows
+	 * the last one again.
+	 *
+	 * capable is set if the connector and CRTC support it, and the
+	 * range comes from the EDID's range limits, if there are any.
+	 */
+	struct {
+		bool capable;
+		bool enabled;
+		int min_hz, max_hz;
+		int64_t min_interval_nsec;
+		int64_t max_interval_nsec;
+	} vrr;
+
+	/*
+	 * Async flips ($KMS_ASYNC): rather than waiting for vblank, we flip
+	 * each frame to the screen as soon as it has finished rendering,
+	 * accepting tearing for lower latency. Without vblanks to pace us,
+	 * we repaint from sched.timer_fd, aiming for one frame every
+	 * interval_nsec. waiting is the buffer we've rendered but the GPU
+	 * hasn't finished yet: the main loop polls its render fence, and
+	 * flips to it once that signals.
+	 */
+	struct {
+		bool enabled;
+		int64_t interval_nsec;
+		struct buffer *waiting;
+	} async;
+
+	/*
+	 * Frame timing statistics, dumped on SIGUSR1 by stats_dump. These
+	 * are always recorded, and only ever touched from the main thread.
+	 *
+	 * pending collects the information for the frame in flight as we
+	 * go; once it completes, it is copied into the ring at position
+	 * (num_frames % STATS_RING_SIZE).
+	 *
+	 * We also keep running totals over every frame since startup, for
+	 * benchmarking.
+	 */
+	struct {
+		struct frame_record pending;
+		struct frame_record ring[STATS_RING_SIZE];
+		uint64_t num_frames;
+
+		int64_t first_flip_nsec;
+		int64_t last_flip_nsec;
+		int64_t total_render_nsec;
+		uint64_t num_render_samples;
+	} stats;
+
+	/*
+	 * What we've last told KMS, so that repaints only need to send what's
+	 * changed; see output_add_atomic_req. valid is set once the CRTC and
+	 * connector have been set up, and cleared whenever we can no longer
+	 * be sure what state KMS has. plane_id is the plane we last put our
+	 * content on, with the source size and position within the CRTC it
+	 * had there.
+	 */
+	struct {
+		bool valid;
+		uint32_t plane_id;
+		uint32_t src_w, src_h;
+		int x, y, w, h;
+	} state;
+
+	/*
+	 * Multi-plane composition ($KMS_OVERLAY): the static background is
+	 * rendered once into its own full-screen buffer shown on the primary
+	 * plane, and only the small animated region at x/y is repainted each
+	 * frame, into our regular buffers displayed on a second plane.
+	 *
+	 * plane_id is 0 if we only use the primary plane. The background only
+	 * needs to be added to the first atomic request; after that, KMS keeps
+	 * displaying it without us touching the primary plane again.
+	 */
+	struct {
+		uint32_t plane_id;
+		struct drm_property_info props[WDRM_PLANE__COUNT];
+		struct buffer *background;
+		bool background_committed;
+		int x, y;
+	} overlay;
+
+	/*
+	 * External content (output_external_present): once active, we
+	 * stop rendering and instead display the imported buffers we're
+	 * given, scaled to fit the mode at x/y/w/h. next is the newest
+	 * buffer we haven't committed yet, if any.
+	 *
+	 * plane_id is the primary plane if it can scan the buffers out
+	 * directly; YUV content, or whatever the primary plane won't take,
+	 * goes on an overlay plane instead, with the primary plane switched
+	 * off. props then points to overlay_props rather than the primary
+	 * plane's.
+	 *
+	 * dmabufs is the cache of framebuffers for the dmabufs we've been
+	 * given; see buffer_dmabuf_import.
+	 */
+	struct {
+		bool active;
+		struct buffer *next;
+		uint32_t plane_id;
+		uint32_t format, width, height;
+		struct drm_property_info *props;
+		struct drm_property_info overlay_props[WDRM_PLANE__COUNT];
+		bool plane_committed;
+		int x, y, w, h;
+
+		struct buffer *dmabufs;
+		int num_dmabufs;
+	} external;
+
+	/*
+	 * The baked animation ($KMS_BAKED): frames[n] is a buffer holding
+	 * animation frame n, once we've rendered it. full is set when we
+	 * stop baking new frames, because the device's budget has run out
+	 * or an allocation failed; frames still missing are then rendered
+	 * live into the pool as usual.
+	 */
+	struct {
+		struct buffer *frames[NUM_ANIM_FRAMES];
+		int num_frames;
+		bool full;
+	} baked;
+
+	/*
+	 * Frame capture ($KMS_CAPTURE): width and height are the size we
+	 * capture at, after scaling down. The GL renderer scales through
+	 * fbo_id, and the Vulkan renderer keeps its own state in vk. The
+	 * slots are protected by the device's capture lock.
+	 */
+	struct {
+		struct capture_slot slots[CAPTURE_RING_SIZE];
+		uint32_t width, height;
+		uint64_t num_captured;
+		uint64_t num_dropped;
+		GLuint fbo_id;
+		GLuint rbo_id;
+		struct vk_capture *vk;
+	} capture;
+
+	/*
+	 * Damage tracking: rendered_frame is the frame we last rendered into
+	 * any of our buffers, so we can work out what the next frame changes
+	 * and add that to the damage of all our other buffers.
+	 *
+	 * committed_frame is the frame we last committed to KMS, letting us
+	 * tell KMS which parts of the screen changed through FB_DAMAGE_CLIPS,
+	 * for drivers which have to upload the image (e.g. USB displays);
+	 * blob_id is the last request's damage blob, freed on the next one.
+	 */
+	struct {
+		unsigned int rendered_frame;
+		unsigned int committed_frame;
+		bool committed;
+		uint32_t blob_id;
+	} damage;
+
 	struct {
 		EGLConfig cfg;
 		EGLContext ctx;
 		GLuint gl_prog;
 		GLuint pos_attr;
-		GLuint col_uniform;
+		GLuint col_attr;
 		GLuint vbo;
 		GLuint vao;
 		/* Whether to use big OpenGL Core Profile context or to use GLES */
 		bool gl_core;
+
+		/*
+		 * With $KMS_EGL_SURFACE, we render into a window surface on
+		 * gbm_surface rather than our own buffers; see
+		 * output_egl_surface_render. frames holds the animation
+		 * frames we last rendered, most recent first, so that
+		 * buffer_age can tell us what's in the back buffer.
+		 */
+		struct gbm_surface *gbm_surface;
+		EGLSurface surface;
+		bool buffer_age;
+		unsigned int frames[EGL_SURFACE_MAX_AGE];
+		unsigned int num_frames;
 	} egl;
 };
 
@@ -439,11 +1042,28 @@ struct device {
 	/* Whether or not the device supports format modifiers. */
 	bool fb_modifiers;
 
+	/*
+	 * Whether the driver can flip without waiting for vblank, through
+	 * atomic commits or the legacy page-flip ioctl.
+	 */
+	struct {
+		bool atomic;
+		bool legacy;
+	} async_caps;
+
 	/* The GBM device is our buffer allocator, and we create an EGL
 	 * display from that to import buffers into. */
 	struct gbm_device *gbm_device;
 	EGLDisplay egl_dpy;
 
+	/*
+	 * With $KMS_RENDER_NODE, we render on a different GPU from the one
+	 * driving our outputs: this is that GPU's render node, which the GBM
+	 * device and EGL display above are created on. -1 when we render on
+	 * the KMS device itself.
+	 */
+	int render_fd;
+
 	/* Populated by us, to combine plane -> CRTC -> connector. */
 	struct output **outputs;
 	int num_outputs;
@@ -454,6 +1074,153 @@ struct device {
 
 	/* vulkan device */
 	struct vk_device *vk_device;
+
+	/*
+	 * Worker pool for filling dumb buffers ($KMS_SW_THREADS); NULL if
+	 * we render them from the calling thread only.
+	 */
+	struct sw_renderer *sw_renderer;
+
+	/* Whether to give dumb buffers a shadow buffer ($KMS_SHADOW). */
+	bool dumb_shadow;
+
+	/*
+	 * Colour management in the display hardware ($KMS_COLOR), rather
+	 * than in our shaders: our content is encoded with a gamma of
+	 * COLOR_CONTENT_GAMMA, which the CRTC decodes, transforms by ctm
+	 * (if has_ctm, from $KMS_CTM) and re-encodes for a display with the
+	 * given gamma. deep is set if we should render in 10 bits per
+	 * channel where we can ($KMS_DEEP_COLOR).
+	 */
+	struct {
+		bool enabled;
+		double gamma;
+		bool has_ctm;
+		double ctm[9];
+		bool deep;
+	} color;
+
+	/*
+	 * Whether the GL renderer draws its quads as triangles
+	 * ($KMS_GL_DRAW), rather than filling them with scissored clears.
+	 */
+	bool gl_draw;
+
+	/*
+	 * Whether the GL renderer draws into an EGL window surface on a
+	 * gbm_surface ($KMS_EGL_SURFACE), rather than into BOs we allocate
+	 * and wrap in FBOs ourselves.
+	 */
+	bool egl_surface;
+
+	/*
+	 * With $KMS_BAKED, outputs keep every frame of the animation they
+	 * render, and flip back to it rather than rendering it again; see
+	 * output_baked_frame. budget is how many bytes of buffers all the
+	 * outputs may keep between them, and used how many they do.
+	 */
+	struct {
+		bool enabled;
+		uint64_t budget;
+		uint64_t used;
+	} baked;
+
+	/*
+	 * Frame capture ($KMS_CAPTURE): we capture every every'th frame each
+	 * output shows, scaled down by scale in each direction, and write
+	 * them to fd (a file, or a socket with socket set) from the writer
+	 * thread. queue holds the slots it has yet to write, and cond wakes
+	 * it up, or whoever waits for it to finish with a slot.
+	 */
+	struct {
+		bool enabled;
+		int every;
+		int scale;
+		int fd;
+		bool socket;
+		pthread_t thread;
+		bool thread_exit;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		struct capture_slot *queue;
+	} capture;
+
+	/*
+	 * Whether the animation is paused (toggled with SIGUSR2), and how
+	 * long outputs stay idle before we switch their displays off, or 0
+	 * to leave them on; see output_idle_enter.
+	 */
+	struct {
+		bool paused;
+		int64_t dpms_nsec;
+	} idle;
+
+	/*
+	 * How we split repaints between atomic requests ($KMS_COMMIT): by
+	 * default, outputs whose vblanks line up share one, and everyone
+	 * else gets their own. num_groups is how many requests that makes
+	 * for our current outputs, and num_busy how many commits have been
+	 * retried after EBUSY.
+	 */
+	struct {
+		enum commit_mode {
+			COMMIT_ADAPTIVE = 0,
+			COMMIT_MERGED,
+			COMMIT_SPLIT,
+		} mode;
+		int num_groups;
+		uint64_t num_busy;
+	} commit;
+
+	/*
+	 * The most buffers each output's pool may grow to, from
+	 * $KMS_QUEUE_DEPTH; at least 2, and at most BUFFER_QUEUE_DEPTH.
+	 */
+	int queue_depth;
+
+	/*
+	 * Buffers outputs have given up, still complete with their KMS
+	 * framebuffer, BO and EGLImage or Vulkan image, for the next output
+	 * which wants a buffer of the same size and layout; see
+	 * buffer_release. Pools grow and shrink from render threads, so this
+	 * has its own lock.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		struct buffer *head;
+		int num_buffers;
+		uint64_t num_hits;
+		uint64_t num_misses;
+		uint64_t num_evicted;
+	} buffer_cache;
+
+	/*
+	 * Benchmark mode ($KMS_BENCHMARK): run for num_frames frames on each
+	 * output, then print our results and exit. If offscreen is set, we
+	 * never commit anything to KMS, and render as fast as we can.
+	 */
+	struct {
+		int num_frames;
+		bool offscreen;
+		int64_t cpu_start_nsec;
+		int64_t cpu_end_nsec;
+	} benchmark;
+
+	/*
+	 * Whether we render from one thread per output ($KMS_THREADED); if
+	 * so, render threads poke thread_event_fd (an eventfd) to wake the
+	 * main thread up whenever they have queued a new frame.
+	 */
+	bool threaded;
+	int thread_event_fd;
+
+	/*
+	 * What we know about this device's KMS objects, saved between runs
+	 * (see probe.c), and the netlink socket the kernel tells us about
+	 * hotplug on; -1 if we couldn't open it.
+	 */
+	struct probe_cache *probe;
+	int uevent_fd;
 };
 
 /*
@@ -470,26 +1237,92 @@ void device_destroy(struct device *device);
  */
 struct output *output_create(struct device *device,
 			     drmModeConnectorPtr connector);
+
+/*
+ * Re-reads a connector's state and EDID into the probe cache, returning
+ * true if anything changed since we last looked. This must be called
+ * before output_create for the connector.
+ */
+bool connector_probe(struct device *device, drmModeConnectorPtr connector);
+
+/*
+ * Creates an output for a connector which has just been plugged in, picking
+ * a free CRTC and primary plane for it, and switches an output off again
+ * once its connector has gone; see kms.c.
+ */
+struct output *output_create_hotplug(struct device *device,
+				     drmModeConnectorPtr connector);
+int output_disable(struct output *output);
+int output_set_dpms(struct output *output, bool on);
+
 bool output_egl_setup(struct output *output);
+bool output_egl_make_current(struct output *output);
 void output_egl_destroy(struct device *device, struct output *output);
+bool output_egl_surface_setup(struct output *output, uint32_t width,
+			      uint32_t height);
+struct buffer *output_egl_surface_render(struct output *output,
+					 unsigned int frame_num);
+void buffer_egl_surface_release(struct buffer *buffer);
+bool buffer_egl_capture(struct buffer *buffer, struct capture_slot *slot);
+bool capture_slot_egl_done(struct capture_slot *slot);
+void output_egl_capture_destroy(struct output *output);
 void output_destroy(struct output *output);
 
 /* Create and destroy framebuffers for a given output. */
-struct buffer *buffer_create(struct device *device, struct output *output);
-struct buffer *buffer_egl_create(struct device *device, struct output *output);
+struct buffer *buffer_create(struct device *device, struct output *output,
+			     uint32_t width, uint32_t height);
+struct buffer *buffer_egl_create(struct device *device, struct output *output,
+				 uint32_t width, uint32_t height);
 void buffer_destroy(struct buffer *buffer);
+int buffer_add_fb(struct device *device, struct buffer *buffer);
+void buffer_prime_import(struct device *device, struct buffer *buffer,
+			 const int *dma_buf_fds, int num_planes);
+void buffer_prime_release(struct device *device, struct buffer *buffer);
+void buffer_release(struct buffer *buffer);
+void buffer_cache_evict(struct device *device, int max_buffers);
+struct buffer *buffer_dmabuf_import(struct output *output,
+				    const struct dmabuf_attributes *attrs);
+void output_dmabufs_destroy(struct output *output);
+uint64_t mem_available(void);
+struct buffer *output_baked_frame(struct output *output,
+				  unsigned int frame_num);
+void output_baked_destroy(struct output *output);
 void buffer_egl_destroy(struct device *device, struct buffer *buffer);
+bool buffer_egl_bind(struct device *device, struct buffer *buffer);
+void buffer_egl_unbind(struct device *device, struct buffer *buffer);
+bool buffer_egl_add_copy(struct device *device, struct buffer *buffer);
 
 /* Fill a buffer for a given animation step. */
 void buffer_fill(struct buffer *buffer, int frame_num);
+void render_list_build(struct render_list *list, const struct damage *damage,
+		       uint32_t width, uint32_t height, unsigned int frame_num);
+struct sw_renderer *sw_renderer_create(int num_threads);
+void sw_renderer_destroy(struct sw_renderer *sw);
+int sw_renderer_num_threads(struct sw_renderer *sw);
+void buffer_sw_fill(struct buffer *buffer, int frame_num);
+void anim_damage(struct device *device, uint32_t width, uint32_t height,
+		 unsigned int from, unsigned int to, struct damage *damage);
+void buffer_anim_damage(struct buffer *buffer, unsigned int from,
+			unsigned int to, struct damage *damage);
+void damage_add_rect(struct damage *damage, int32_t x1, int32_t y1,
+		     int32_t x2, int32_t y2);
+void damage_add(struct damage *damage, const struct damage *other);
 void buffer_egl_fill(struct buffer *buffer, int frame_num);
 
 void vk_device_destroy(struct vk_device *device);
 struct vk_device *vk_device_create(struct device *device);
+bool vk_device_wait_pipeline(struct vk_device *dev);
 bool output_vulkan_setup(struct output *output);
-struct buffer *buffer_vk_create(struct device *device, struct output *output);
+struct buffer *buffer_vk_create(struct device *device, struct output *output,
+				uint32_t width, uint32_t height);
 bool buffer_vk_fill(struct buffer *buffer, int frame_num);
+void vk_batch_begin(struct vk_device *vk_dev);
+bool vk_batch_flush(struct vk_device *vk_dev);
 void buffer_vk_destroy(struct device *device, struct buffer *buffer);
+bool buffer_vk_retire(struct buffer *buffer);
+bool buffer_vk_capture(struct buffer *buffer, struct capture_slot *slot);
+bool capture_slot_vk_done(struct capture_slot *slot);
+void output_vk_capture_destroy(struct output *output);
 
 /*
  * Adds an output's state to an atomic request, setting it up to display a
@@ -497,6 +1330,40 @@ void buffer_vk_destroy(struct device *device, struct buffer *buffer);
  */
 void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 			   struct buffer *buffer);
+void output_add_in_fence(struct output *output, drmModeAtomicReqPtr req,
+			 struct buffer *buffer);
+
+/*
+ * Displays an imported buffer on the output, in place of our own rendering,
+ * from the next repaint on; picks a plane for it the first time around.
+ * Call it from the main loop's thread: an output which has gone idle is
+ * only woken up again when the main loop next runs.
+ */
+bool output_external_present(struct output *output, struct buffer *buffer);
+
+/*
+ * Sorts the output's modifiers by expected scanout bandwidth, and returns
+ * the ones buffers should be allocated with: see modifier_classify.
+ */
+void output_modifiers_rank(struct output *output);
+unsigned int output_modifiers_get(struct output *output,
+				  const uint64_t **modifiers);
+enum modifier_class modifier_classify(uint64_t modifier);
+const char *modifier_class_name(enum modifier_class class);
+
+/*
+ * Tests whether KMS accepts a full-screen buffer on the output's primary
+ * plane, with a TEST_ONLY commit.
+ */
+bool output_modifier_test(struct output *output, struct buffer *buffer);
+
+/*
+ * Finds a plane to display the output's animated region on top of its
+ * background, using TEST_ONLY commits to check that KMS accepts the layout.
+ * The background and animation buffers must already have been allocated.
+ * Returns false if no plane could be used.
+ */
+bool output_overlay_assign(struct output *output);
 
 /*
  * Commits an atomic request to KMS. Upon completion, the KMS FD will become
@@ -510,6 +1377,42 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 int atomic_commit(struct device *device, drmModeAtomicReqPtr req,
 		  bool allow_modeset);
 
+/*
+ * Flips the output's primary plane to a new buffer straight away, without
+ * waiting for vblank; see kms.c. As with atomic_commit, the KMS FD becomes
+ * readable with an event once the flip has happened.
+ */
+int output_async_flip(struct output *output, struct buffer *buffer);
+
+/*
+ * Record an output's pending frame into its statistics once it has hit the
+ * screen, and print a summary of every output's recent frame timing.
+ */
+void output_stats_push(struct output *output);
+void stats_dump(struct device *device, FILE *f);
+
+/*
+ * Frame capture: see capture.c. output_capture_frame takes a copy of a
+ * buffer which has just hit the screen, and capture_poll hands the copies
+ * the GPU has finished on to the writer thread; it returns true whilst
+ * some are still pending.
+ */
+bool capture_init(struct device *device, const char *path);
+void capture_fini(struct device *device);
+void output_capture_frame(struct output *output, struct buffer *buffer,
+			  int64_t flip_nsec);
+bool capture_poll(struct device *device);
+void output_capture_destroy(struct output *output);
+void capture_downscale(uint8_t *dst, uint32_t dst_stride,
+		       const uint8_t *src, uint32_t src_stride,
+		       uint32_t width, uint32_t height, int scale);
+
+/*
+ * Print the results of a benchmark run as JSON, from the totals collected
+ * by output_stats_push.
+ */
+void benchmark_report(struct device *device, FILE *f);
+
 /*
  * Parse the very basic information from the EDID block, as described in
  * edid.c. The EDID parser could be fairly trivially extended to pull
@@ -520,15 +1423,83 @@ struct edid_info {
 	char monitor_name[13];
 	char pnp_id[5];
 	char serial_number[13];
+
+	/* Vertical refresh range in Hz, from the range limits; 0 if none. */
+	int min_vrefresh;
+	int max_vrefresh;
 };
 
 struct edid_info *
 edid_parse(const uint8_t *data, size_t length);
 
+/*
+ * What we cache about KMS objects between runs, and between hotplug events;
+ * see probe.c. These are written to the cache file as they are, so have
+ * fixed sizes.
+ */
+#define PROBE_MAX_ENUMS 8
+#define PROBE_MAX_MODIFIERS 128
+
+/* A property's name and enum values, as from drmModeGetProperty. */
+struct probe_property {
+	uint32_t prop_id;
+	uint32_t flags;
+	char name[DRM_PROP_NAME_LEN];
+	int count_enums;
+	struct drm_mode_property_enum enums[PROBE_MAX_ENUMS];
+};
+
+/* The modifiers for one format from a plane's IN_FORMATS blob. */
+struct probe_formats {
+	uint32_t plane_id;
+	uint32_t blob_id;
+	uint32_t format;
+	unsigned int num_modifiers;
+	uint64_t modifiers[PROBE_MAX_MODIFIERS];
+};
+
+/* Whether a connector has anything plugged in, and what. */
+struct probe_connector {
+	uint32_t connector_id;
+	uint32_t connection;
+	uint64_t edid_hash;
+	bool has_edid;
+	struct edid_info edid;
+};
+
+void probe_cache_create(struct device *device);
+void probe_cache_save(struct device *device);
+void probe_cache_destroy(struct device *device);
+const struct probe_property *probe_get_property(struct device *device,
+						uint32_t prop_id);
+const struct probe_formats *probe_get_formats(struct device *device,
+					      uint32_t plane_id,
+					      uint32_t blob_id,
+					      uint32_t format);
+void probe_add_formats(struct device *device, uint32_t plane_id,
+		       uint32_t blob_id, uint32_t format,
+		       const uint64_t *modifiers, unsigned int num_modifiers);
+const struct probe_connector *probe_get_connector(struct device *device,
+						  uint32_t connector_id);
+bool probe_set_connector(struct device *device, uint32_t connector_id,
+			 uint32_t connection, uint64_t edid_hash,
+			 const struct edid_info *edid);
+bool probe_get_edid(struct device *device, uint32_t connector_id,
+		    uint64_t edid_hash, struct edid_info *edid);
+uint64_t probe_hash(const void *data, size_t length);
+
+/*
+ * Listens for the kernel's hotplug uevents: probe_uevent_read returns true
+ * for each one about our KMS device, with the connector it concerns (0 for
+ * all of them).
+ */
+int probe_uevent_open(void);
+bool probe_uevent_read(struct device *device, uint32_t *connector_id);
+
 bool
 gl_extension_supported(const char *haystack, const char *needle);
 
-int handle_to_fd(struct device *device, uint32_t gem_handle);
+int handle_to_fd(int drm_fd, uint32_t gem_handle);
 
 static void
 fd_replace(int *target, int source)
@@ -44,6 +44,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -95,6 +96,7 @@ static const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_CRTC_ID] = { .name = "CRTC_ID", },
 	[WDRM_PLANE_IN_FORMATS] = { .name = "IN_FORMATS" },
 	[WDRM_PLANE_IN_FENCE_FD] = { .name = "IN_FENCE_FD" },
+	[WDRM_PLANE_FB_DAMAGE_CLIPS] = { .name = "FB_DAMAGE_CLIPS" },
 };
 
 static struct drm_property_enum_info dpms_state_enums[] = {
@@ -121,12 +123,19 @@ static const struct drm_property_info connector_props[] = {
 	},
 	[WDRM_CONNECTOR_CRTC_ID] = { .name = "CRTC_ID", },
 	[WDRM_CONNECTOR_NON_DESKTOP] = { .name = "non-desktop", },
+	[WDRM_CONNECTOR_VRR_CAPABLE] = { .name = "vrr_capable", },
 };
 
 static const struct drm_property_info crtc_props[] = {
 	[WDRM_CRTC_MODE_ID] = { .name = "MODE_ID", },
 	[WDRM_CRTC_ACTIVE] = { .name = "ACTIVE", },
 	[WDRM_CRTC_OUT_FENCE_PTR] = { .name = "OUT_FENCE_PTR", },
+	[WDRM_CRTC_VRR_ENABLED] = { .name = "VRR_ENABLED", },
+	[WDRM_CRTC_DEGAMMA_LUT] = { .name = "DEGAMMA_LUT", },
+	[WDRM_CRTC_DEGAMMA_LUT_SIZE] = { .name = "DEGAMMA_LUT_SIZE", },
+	[WDRM_CRTC_CTM] = { .name = "CTM", },
+	[WDRM_CRTC_GAMMA_LUT] = { .name = "GAMMA_LUT", },
+	[WDRM_CRTC_GAMMA_LUT_SIZE] = { .name = "GAMMA_LUT_SIZE", },
 };
 
 /**
@@ -205,6 +214,10 @@ drm_property_get_value(struct drm_property_info *info,
  * The values given in enum_names are searched for, and stored in the
  * same-indexed field of the map array.
  *
+ * Looking up each property is an ioctl of its own, and most of them are
+ * shared between objects of the same type, so we go through the probe cache
+ * (see probe.c) rather than asking the kernel every time.
+ *
  * @param device Device
  * @param src DRM property info array to source from
  * @param info DRM property info array to copy into
@@ -218,7 +231,7 @@ drm_property_info_populate(struct device *device,
 			   unsigned int num_infos,
 			   drmModeObjectProperties *props)
 {
-	drmModePropertyRes *prop;
+	const struct probe_property *prop;
 	unsigned i, j;
 
 	for (i = 0; i < num_infos; i++) {
@@ -244,7 +257,7 @@ drm_property_info_populate(struct device *device,
 	for (i = 0; i < props->count_props; i++) {
 		unsigned int k;
 
-		prop = drmModeGetProperty(device->kms_fd, props->props[i]);
+		prop = probe_get_property(device, props->props[i]);
 		if (!prop)
 			continue;
 
@@ -254,10 +267,8 @@ drm_property_info_populate(struct device *device,
 		}
 
 		/* We don't know/care about this property. */
-		if (j == num_infos) {
-			drmModeFreeProperty(prop);
+		if (j == num_infos)
 			continue;
-		}
 
 		info[j].prop_id = props->props[i];
 
@@ -281,8 +292,6 @@ drm_property_info_populate(struct device *device,
 			info[j].enum_values[k].valid = true;
 			info[j].enum_values[k].value = prop->enums[l].value;
 		}
-
-		drmModeFreeProperty(prop);
 	}
 }
 
@@ -354,18 +363,29 @@ modifiers_ptr(struct drm_format_modifier_blob *blob)
 		(((char *)blob) + blob->modifiers_offset);
 }
 
+static bool plane_has_format(drmModePlanePtr plane, uint32_t format)
+{
+	for (unsigned int f = 0; f < plane->count_formats; f++) {
+		if (plane->formats[f] == format)
+			return true;
+	}
+	return false;
+}
+
 /*
- * This populates the list of supported formats and modifiers for the output's
- * primary plane. The IN_FORMATS property, available on every plane, declares
- * the supported format + modifier combinations for the plane.
+ * This populates the list of supported modifiers for the output's format
+ * on its primary plane. The IN_FORMATS property, available on every plane,
+ * declares the supported format + modifier combinations for the plane.
  *
  * The parsing is somewhat difficult, so rather than accessing it on demand,
  * here we simply turn it into an array of modifiers, which can be directly
- * passed to, e.g., gbm_surface_create_with_modifiers().
+ * passed to, e.g., gbm_surface_create_with_modifiers(). The result goes in
+ * the probe cache, so we only parse each plane's blob once per boot.
  */
 static void plane_formats_populate(struct output *output,
 				   drmModeObjectPropertiesPtr props)
 {
+	const struct probe_formats *cached;
 	uint32_t blob_id;
 	drmModePropertyBlobRes *blob;
 	struct drm_format_modifier_blob *fmt_mod_blob; /* IN_FORMATS content */
@@ -379,6 +399,18 @@ static void plane_formats_populate(struct output *output,
 		return;
 	}
 
+	cached = probe_get_formats(output->device, output->primary_plane_id,
+				   blob_id, output->format);
+	if (cached) {
+		output->num_modifiers = cached->num_modifiers;
+		output->modifiers = calloc(cached->num_modifiers + 1,
+					   sizeof(*output->modifiers));
+		assert(output->modifiers);
+		memcpy(output->modifiers, cached->modifiers,
+		       cached->num_modifiers * sizeof(*output->modifiers));
+		return;
+	}
+
 	blob = drmModeGetPropertyBlob(output->device->kms_fd, blob_id);
 	assert(blob);
 
@@ -387,7 +419,7 @@ static void plane_formats_populate(struct output *output,
 	blob_modifiers = modifiers_ptr(fmt_mod_blob);
 
 	for (unsigned int f = 0; f < fmt_mod_blob->count_formats; f++) {
-		if (blob_formats[f] != DRM_FORMAT_XRGB8888)
+		if (blob_formats[f] != output->format)
 			continue;
 
 		for (unsigned int m = 0; m < fmt_mod_blob->count_modifiers; m++) {
@@ -406,39 +438,220 @@ static void plane_formats_populate(struct output *output,
 	}
 
 	drmModeFreePropertyBlob(blob);
+	probe_add_formats(output->device, output->primary_plane_id, blob_id,
+			  output->format, output->modifiers,
+			  output->num_modifiers);
+}
+
+/*
+ * Intel's compressed layouts are each listed separately, rather than being
+ * a flag on top of a tiling mode; newer ones only exist in newer headers.
+ */
+static const uint64_t intel_ccs_modifiers[] = {
+	I915_FORMAT_MOD_Y_TILED_CCS,
+	I915_FORMAT_MOD_Yf_TILED_CCS,
+#ifdef I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS
+	I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS,
+	I915_FORMAT_MOD_Y_TILED_GEN12_MC_CCS,
+#endif
+#ifdef I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS_CC
+	I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS_CC,
+#endif
+#ifdef I915_FORMAT_MOD_4_TILED_DG2_RC_CCS
+	I915_FORMAT_MOD_4_TILED_DG2_RC_CCS,
+	I915_FORMAT_MOD_4_TILED_DG2_MC_CCS,
+	I915_FORMAT_MOD_4_TILED_DG2_RC_CCS_CC,
+#endif
+#ifdef I915_FORMAT_MOD_4_TILED_MTL_RC_CCS
+	I915_FORMAT_MOD_4_TILED_MTL_RC_CCS,
+	I915_FORMAT_MOD_4_TILED_MTL_MC_CCS,
+	I915_FORMAT_MOD_4_TILED_MTL_RC_CCS_CC,
+#endif
+#ifdef I915_FORMAT_MOD_4_TILED_LNL_CCS
+	I915_FORMAT_MOD_4_TILED_LNL_CCS,
+#endif
+#ifdef I915_FORMAT_MOD_4_TILED_BMG_CCS
+	I915_FORMAT_MOD_4_TILED_BMG_CCS,
+#endif
+};
+
+/*
+ * Modifiers are mostly opaque, but we know enough about the common ones to
+ * guess what scanning them out costs in memory bandwidth. Compressed
+ * layouts (Intel CCS, AMD DCC, Arm AFBC/AFRC, NVIDIA's compressed block
+ * linear) let the display engine fetch far less than width * height * 4
+ * bytes for each frame; tiled layouts at least fetch whole cache lines and
+ * DRAM pages at a time; linear is the most expensive of all, for both
+ * scanout and rendering.
+ *
+ * Anything else vendor-specific we don't recognise is assumed to be some
+ * kind of tiling.
+ */
+enum modifier_class modifier_classify(uint64_t modifier)
+{
+	if (modifier == DRM_FORMAT_MOD_LINEAR ||
+	    modifier == DRM_FORMAT_MOD_INVALID)
+		return MODIFIER_CLASS_LINEAR;
+
+	switch (modifier >> 56) {
+	case DRM_FORMAT_MOD_VENDOR_INTEL:
+		for (unsigned int i = 0; i < ARRAY_LENGTH(intel_ccs_modifiers); i++) {
+			if (modifier == intel_ccs_modifiers[i])
+				return MODIFIER_CLASS_COMPRESSED;
+		}
+		break;
+	case DRM_FORMAT_MOD_VENDOR_AMD:
+#ifdef AMD_FMT_MOD_DCC_SHIFT
+		if ((modifier >> AMD_FMT_MOD_DCC_SHIFT) & AMD_FMT_MOD_DCC_MASK)
+			return MODIFIER_CLASS_COMPRESSED;
+#endif
+		break;
+	case DRM_FORMAT_MOD_VENDOR_NVIDIA:
+		/* Block linear, with a non-zero compression type. */
+		if ((modifier & 0x10) && ((modifier >> 23) & 0x7))
+			return MODIFIER_CLASS_COMPRESSED;
+		break;
+	case DRM_FORMAT_MOD_VENDOR_ARM:
+		/* The top nibble of the value is the type: AFBC is 0, AFRC 2. */
+		if (((modifier >> 52) & 0xf) == 0x0 ||
+		    ((modifier >> 52) & 0xf) == 0x2)
+			return MODIFIER_CLASS_COMPRESSED;
+		break;
+	}
+
+	return MODIFIER_CLASS_TILED;
+}
+
+const char *modifier_class_name(enum modifier_class class)
+{
+	switch (class) {
+	case MODIFIER_CLASS_COMPRESSED:
+		return "compressed";
+	case MODIFIER_CLASS_TILED:
+		return "tiled";
+	case MODIFIER_CLASS_LINEAR:
+	default:
+		return "linear";
+	}
+}
+
+/*
+ * Sorts the output's modifiers so the ones we expect to be cheapest come
+ * first, keeping the driver's own order within each class: the list the
+ * plane gives us is usually already in its order of preference.
+ */
+void output_modifiers_rank(struct output *output)
+{
+	for (unsigned int i = 1; i < output->num_modifiers; i++) {
+		uint64_t mod = output->modifiers[i];
+		enum modifier_class class = modifier_classify(mod);
+		unsigned int j = i;
+
+		while (j > 0 &&
+		       modifier_classify(output->modifiers[j - 1]) < class) {
+			output->modifiers[j] = output->modifiers[j - 1];
+			j--;
+		}
+		output->modifiers[j] = mod;
+	}
+
+	for (unsigned int i = 0; i < output->num_modifiers; i++)
+		debug("[%s] modifier candidate %u: 0x%016" PRIx64 " (%s)\n",
+		      output->name, i, output->modifiers[i],
+		      modifier_class_name(modifier_classify(output->modifiers[i])));
+}
+
+/*
+ * Returns the modifiers the renderers should allocate buffers with: only
+ * the one we picked in output_modifier_select, once we have, or otherwise
+ * the whole list, for the allocator to choose from itself.
+ */
+unsigned int output_modifiers_get(struct output *output,
+				  const uint64_t **modifiers)
+{
+	if (output->mod_pick.chosen) {
+		*modifiers = &output->modifiers[output->mod_pick.index];
+		return 1;
+	}
+
+	*modifiers = output->modifiers;
+	return output->num_modifiers;
 }
 
 /*
- * This gets and prints a little bit of information from the EDID block,
- * as described in edid.c.
+ * Reads a connector's current state into the probe cache: whether anything
+ * is plugged in, and if so a little bit of information from its EDID
+ * block, as described in edid.c. We still have to fetch the EDID blob to
+ * tell whether it's the same monitor as last time, but only parse it if
+ * its hash has changed.
+ *
+ * Returns true if the connector's state differs from what we knew before,
+ * whether from earlier in this run, or a previous run since boot.
  */
-static void output_get_edid(struct output *output,
-			    drmModeObjectPropertiesPtr props)
+bool connector_probe(struct device *device, drmModeConnectorPtr connector)
 {
+	struct drm_property_info info[WDRM_CONNECTOR__COUNT];
+	drmModeObjectPropertiesPtr props;
 	drmModePropertyBlobPtr blob;
-	struct edid_info *edid;
-	uint32_t blob_id;
-	int ret;
+	struct edid_info edid;
+	bool has_edid = false;
+	uint64_t hash = 0;
+	uint32_t blob_id = 0;
 
-	blob_id = drm_property_get_value(&output->props.connector[WDRM_CONNECTOR_EDID],
-					 props, 0);
-	if (blob_id == 0) {
-		debug("[%s] output does not have EDID\n", output->name);
-		return;
+	props = drmModeObjectGetProperties(device->kms_fd,
+					   connector->connector_id,
+					   DRM_MODE_OBJECT_CONNECTOR);
+	if (props) {
+		drm_property_info_populate(device, connector_props, info,
+					   WDRM_CONNECTOR__COUNT, props);
+		blob_id = drm_property_get_value(&info[WDRM_CONNECTOR_EDID],
+						 props, 0);
+		drm_property_info_free(info, WDRM_CONNECTOR__COUNT);
+		drmModeFreeObjectProperties(props);
 	}
 
-	blob = drmModeGetPropertyBlob(output->device->kms_fd, blob_id);
-	assert(blob);
+	blob = blob_id ? drmModeGetPropertyBlob(device->kms_fd, blob_id) : NULL;
+	if (blob) {
+		hash = probe_hash(blob->data, blob->length);
+		has_edid = probe_get_edid(device, connector->connector_id,
+					  hash, &edid);
+		if (!has_edid) {
+			struct edid_info *parsed =
+				edid_parse(blob->data, blob->length);
+
+			if (parsed) {
+				edid = *parsed;
+				has_edid = true;
+				free(parsed);
+			}
+		}
+		drmModeFreePropertyBlob(blob);
+	}
 
-	edid = edid_parse(blob->data, blob->length);
-	drmModeFreePropertyBlob(blob);
-	if (!edid)
+	return probe_set_connector(device, connector->connector_id,
+				   connector->connection, hash,
+				   has_edid ? &edid : NULL);
+}
+
+/*
+ * This prints a little bit of information from the EDID block, which
+ * connector_probe has already put in the probe cache.
+ */
+static void output_get_edid(struct output *output)
+{
+	const struct probe_connector *entry =
+		probe_get_connector(output->device, output->connector_id);
+
+	if (!entry || !entry->has_edid) {
+		debug("[%s] output does not have EDID\n", output->name);
 		return;
+	}
 
 	debug("[%s] EDID PNP ID %s, EISA ID %s, name %s, serial %s\n",
-	       output->name, edid->pnp_id, edid->eisa_id,
-	       edid->monitor_name, edid->serial_number);
-	free(edid);
+	       output->name, entry->edid.pnp_id, entry->edid.eisa_id,
+	       entry->edid.monitor_name, entry->edid.serial_number);
+	output->vrr.min_hz = entry->edid.min_vrefresh;
+	output->vrr.max_hz = entry->edid.max_vrefresh;
 }
 
 /*
@@ -467,6 +680,275 @@ static uint32_t mode_blob_create(struct device *device, drmModeModeInfo *mode)
 	return ret;
 }
 
+/*
+ * Pick the mode to drive an output with: by default, whatever the CRTC is
+ * already running, but $KMS_MODE=WIDTHxHEIGHT picks the connector's mode
+ * with that resolution instead (e.g. for benchmarking at a particular
+ * size). If the connector has several modes at that resolution, we take
+ * the one with the highest refresh rate.
+ *
+ * Connectors can also accept modes which aren't in their list, so for
+ * arbitrary sizes we could construct our own mode timings, but monitors
+ * are less forgiving than drivers.
+ */
+static drmModeModeInfo *output_pick_mode(drmModeConnectorPtr connector,
+					 drmModeModeInfo *current)
+{
+	const char *env = getenv("KMS_MODE");
+	drmModeModeInfo *ret = NULL;
+	unsigned int width, height;
+
+	if (!env)
+		return current;
+
+	if (sscanf(env, "%ux%u", &width, &height) != 2) {
+		fprintf(stderr, "couldn't parse KMS_MODE '%s', expected WIDTHxHEIGHT\n",
+			env);
+		return current;
+	}
+
+	for (int m = 0; m < connector->count_modes; m++) {
+		drmModeModeInfo *mode = &connector->modes[m];
+
+		if (mode->hdisplay != width || mode->vdisplay != height)
+			continue;
+		if (!ret || mode->vrefresh > ret->vrefresh)
+			ret = mode;
+	}
+
+	if (!ret) {
+		fprintf(stderr, "[CONN:%" PRIu32 "]: no %u x %u mode, keeping the current one\n",
+			connector->connector_id, width, height);
+		return current;
+	}
+
+	return ret;
+}
+
+/*
+ * Creates a blob holding a LUT of the given size, mapping each linear step
+ * from 0 to 1 to that step raised to the power of exponent.
+ */
+static uint32_t lut_blob_create(struct device *device, uint64_t size,
+				double exponent)
+{
+	struct drm_color_lut *lut;
+	uint32_t blob_id = 0;
+
+	lut = calloc(size, sizeof(*lut));
+	assert(lut);
+	for (uint64_t i = 0; i < size; i++) {
+		double val = pow((double) i / (double) (size - 1), exponent);
+		uint16_t v = (uint16_t) (val * 0xffff + 0.5);
+
+		lut[i].red = lut[i].green = lut[i].blue = v;
+	}
+
+	if (drmModeCreatePropertyBlob(device->kms_fd, lut, size * sizeof(*lut),
+				      &blob_id) != 0)
+		blob_id = 0;
+	free(lut);
+	return blob_id;
+}
+
+/*
+ * The CTM holds S31.32 fixed-point values; unlike most fixed-point formats,
+ * these are sign-magnitude rather than two's complement.
+ */
+static uint32_t ctm_blob_create(struct device *device, const double *matrix)
+{
+	struct drm_color_ctm ctm;
+	uint32_t blob_id = 0;
+
+	for (int i = 0; i < 9; i++) {
+		double val = matrix[i];
+
+		ctm.matrix[i] = (uint64_t) (fabs(val) * (double) (1ULL << 32));
+		if (val < 0)
+			ctm.matrix[i] |= 1ULL << 63;
+	}
+
+	if (drmModeCreatePropertyBlob(device->kms_fd, &ctm, sizeof(ctm),
+				      &blob_id) != 0)
+		blob_id = 0;
+	return blob_id;
+}
+
+/*
+ * With $KMS_COLOR, the CRTC does our colour management for us. Each CRTC
+ * can have up to three stages, each of which the driver tells us about with
+ * properties: a degamma LUT taking the content to linear light, a colour
+ * transform matrix applied there, then a gamma LUT encoding the result for
+ * the display. Any of these can be missing; most hardware has at least the
+ * gamma LUT, since that's what legacy drmModeCrtcSetGamma uses.
+ *
+ * Our content is always encoded with COLOR_CONTENT_GAMMA, so without a
+ * transform we don't need to go through linear light at all: a single
+ * gamma LUT re-encodes it for the display, which keeps the precision the
+ * degamma LUT would lose. We only build the blobs once here, then set them
+ * along with our routing, so they're kept across every commit after.
+ */
+static void output_color_init(struct output *output,
+			      drmModeObjectPropertiesPtr props)
+{
+	struct device *device = output->device;
+	struct drm_property_info *crtc = output->props.crtc;
+	double exponent = COLOR_CONTENT_GAMMA / device->color.gamma;
+	uint64_t degamma_size, gamma_size;
+
+	gamma_size = drm_property_get_value(&crtc[WDRM_CRTC_GAMMA_LUT_SIZE],
+					    props, 0);
+	degamma_size = drm_property_get_value(&crtc[WDRM_CRTC_DEGAMMA_LUT_SIZE],
+					      props, 0);
+	if (crtc[WDRM_CRTC_GAMMA_LUT].prop_id == 0 || gamma_size < 2) {
+		printf("[%s] CRTC has no gamma LUT, so no colour management\n",
+		       output->name);
+		return;
+	}
+
+	if (device->color.has_ctm) {
+		if (crtc[WDRM_CRTC_CTM].prop_id == 0) {
+			printf("[%s] CRTC has no colour transform matrix\n",
+			       output->name);
+		} else if (crtc[WDRM_CRTC_DEGAMMA_LUT].prop_id != 0 &&
+			   degamma_size >= 2) {
+			output->color.degamma_blob_id =
+				lut_blob_create(device, degamma_size,
+						COLOR_CONTENT_GAMMA);
+			exponent = 1.0 / device->color.gamma;
+		} else {
+			/* Not strictly correct, but close enough for
+			 * small adjustments such as white balance. */
+			printf("[%s] CRTC has no degamma LUT, applying colour transform to encoded values\n",
+			       output->name);
+		}
+
+		if (crtc[WDRM_CRTC_CTM].prop_id != 0)
+			output->color.ctm_blob_id =
+				ctm_blob_create(device, device->color.ctm);
+	}
+
+	output->color.gamma_blob_id = lut_blob_create(device, gamma_size,
+						      exponent);
+	printf("[%s] using CRTC colour pipeline: %s%s%" PRIu64 "-entry gamma LUT\n",
+	       output->name,
+	       output->color.degamma_blob_id ? "degamma LUT, " : "",
+	       output->color.ctm_blob_id ? "CTM, " : "",
+	       gamma_size);
+}
+
+/*
+ * Fill in the output structure for a plane -> CRTC -> connector chain,
+ * once we have decided which objects to use and the mode to drive them
+ * with; see output_create and output_create_hotplug.
+ */
+static struct output *output_init(struct device *device,
+				  drmModeConnectorPtr connector,
+				  uint32_t crtc_id, uint32_t plane_id,
+				  drmModeModeInfo *mode)
+{
+	struct output *output;
+	drmModeObjectPropertiesPtr props;
+	uint64_t refresh;
+
+	/* DRM is supposed to provide a refresh interval, but often doesn't;
+	 * calculate our own in milliHz for higher precision anyway. */
+	refresh = ((mode->clock * 1000000LL / mode->htotal) +
+		   (mode->vtotal / 2)) / mode->vtotal;
+
+	printf("[CRTC:%" PRIu32 ", CONN %" PRIu32 ", PLANE %" PRIu32 "]: active at %u x %u, %" PRIu64 " mHz\n",
+	       crtc_id, connector->connector_id, plane_id,
+	       mode->hdisplay, mode->vdisplay, refresh);
+
+	output = calloc(1, sizeof(*output));
+	assert(output);
+	output->device = device;
+	output->primary_plane_id = plane_id;
+	output->crtc_id = crtc_id;
+	output->connector_id = connector->connector_id;
+	output->commit_fence_fd = -1;
+	output->sched.timer_fd = -1;
+	pthread_mutex_init(&output->lock, NULL);
+	pthread_cond_init(&output->render_cond, NULL);
+	snprintf(output->name, sizeof(output->name), "%s-%d",
+		 (connector->connector_type < ARRAY_LENGTH(connector_type_names) ?
+		 	connector_type_names[connector->connector_type] :
+			"UNKNOWN"),
+		 connector->connector_type_id);
+	output->needs_repaint = true;
+
+	/*
+	 * Usually we just reuse the CRTC's existing mode, see
+	 * output_pick_mode. Since our first commit is always a modeset, we
+	 * don't need to do anything special to change it.
+	 */
+	output->mode = *mode;
+	output->refresh_interval_nsec = millihz_to_nsec(refresh);
+	debug("[%s] refresh interval %" PRIu64 "ns / %" PRIu64 "ms\n", output->name, output->refresh_interval_nsec, output->refresh_interval_nsec / 1000000UL);
+	output->mode_blob_id = mode_blob_create(device, &output->mode);
+
+	/*
+	 * We render in XRGB8888 unless asked for deep colour, which only our
+	 * GPU renderers can produce, and which the primary plane has to take.
+	 */
+	output->format = DRM_FORMAT_XRGB8888;
+	if (device->color.deep && device->gbm_device) {
+		for (int p = 0; p < device->num_planes; p++) {
+			if (device->planes[p]->plane_id == plane_id &&
+			    plane_has_format(device->planes[p],
+					     DRM_FORMAT_XRGB2101010))
+				output->format = DRM_FORMAT_XRGB2101010;
+		}
+		printf("[%s] rendering in %s\n", output->name,
+		       output->format == DRM_FORMAT_XRGB2101010 ?
+		       "XRGB2101010" : "XRGB8888, as the plane has no XRGB2101010");
+	}
+
+	/*
+	 * Now we have all our objects lined up, get their property lists from
+	 * KMS and use that to fill in the props structures we have above, so
+	 * we can more easily query and set them.
+	 */
+	props = drmModeObjectGetProperties(device->kms_fd, output->primary_plane_id,
+					   DRM_MODE_OBJECT_PLANE);
+	assert(props);
+	drm_property_info_populate(device, plane_props, output->props.plane,
+				   WDRM_PLANE__COUNT, props);
+	plane_formats_populate(output, props);
+	drmModeFreeObjectProperties(props);
+
+	props = drmModeObjectGetProperties(device->kms_fd, output->crtc_id,
+					   DRM_MODE_OBJECT_CRTC);
+	assert(props);
+	drm_property_info_populate(device, crtc_props, output->props.crtc,
+				   WDRM_CRTC__COUNT, props);
+	if (device->color.enabled)
+		output_color_init(output, props);
+	drmModeFreeObjectProperties(props);
+
+	props = drmModeObjectGetProperties(device->kms_fd, output->connector_id,
+					   DRM_MODE_OBJECT_CONNECTOR);
+	assert(props);
+	drm_property_info_populate(device, connector_props, output->props.connector,
+				   WDRM_CONNECTOR__COUNT, props);
+	output_get_edid(output);
+	output->vrr.capable =
+		drm_property_get_value(&output->props.connector[WDRM_CONNECTOR_VRR_CAPABLE],
+				       props, 0) == 1 &&
+		output->props.crtc[WDRM_CRTC_VRR_ENABLED].prop_id != 0;
+	drmModeFreeObjectProperties(props);
+
+	/*
+	 * Set if we support explicit fencing inside KMS; the EGL renderer will
+	 * clear this if it doesn't support it.
+	 */
+	output->explicit_fencing =
+		(output->props.plane[WDRM_PLANE_IN_FENCE_FD].prop_id &&
+		 output->props.crtc[WDRM_CRTC_OUT_FENCE_PTR].prop_id);
+
+	return output;
+}
+
 /*
  * Create an output structure by working backwards from a connector to
  * find an active plane -> CRTC -> connector display chain. Also fills in the
@@ -484,11 +966,10 @@ struct output *output_create(struct device *device,
 			     drmModeConnectorPtr connector)
 {
 	struct output *output = NULL;
-	drmModeObjectPropertiesPtr props;
 	drmModeEncoderPtr encoder = NULL;
 	drmModePlanePtr plane = NULL;
 	drmModeCrtcPtr crtc = NULL;
-	uint64_t refresh;
+	drmModeModeInfo *mode;
 
 	/* Find the encoder (a deprecated KMS object) for this connector. */
 	if (connector->encoder_id == 0) {
@@ -558,77 +1039,10 @@ struct output *output_create(struct device *device,
 	}
 	assert(plane);
 
-	/* DRM is supposed to provide a refresh interval, but often doesn't;
-	 * calculate our own in milliHz for higher precision anyway. */
-	refresh = ((crtc->mode.clock * 1000000LL / crtc->mode.htotal) +
-		   (crtc->mode.vtotal / 2)) / crtc->mode.vtotal;
-
-	printf("[CRTC:%" PRIu32 ", CONN %" PRIu32 ", PLANE %" PRIu32 "]: active at %u x %u, %" PRIu64 " mHz\n",
-	       crtc->crtc_id, connector->connector_id, plane->plane_id,
-	       crtc->width, crtc->height, refresh);
-
-	output = calloc(1, sizeof(*output));
-	assert(output);
-	output->device = device;
-	output->primary_plane_id = plane->plane_id;
-	output->crtc_id = crtc->crtc_id;
-	output->connector_id = connector->connector_id;
-	output->commit_fence_fd = -1;
-	snprintf(output->name, sizeof(output->name), "%s-%d",
-		 (connector->connector_type < ARRAY_LENGTH(connector_type_names) ?
-		 	connector_type_names[connector->connector_type] :
-			"UNKNOWN"),
-		 connector->connector_type_id);
-	output->needs_repaint = true;
-
-	/*
-	 * Just reuse the CRTC's existing mode: requires it to already be
-	 * active. In order to use a different mode, we could look at the
-	 * mode list exposed in the connector, or construct a new DRM mode
-	 * from EDID.
-	 */
-	output->mode = crtc->mode;
-	output->refresh_interval_nsec = millihz_to_nsec(refresh);
-	debug("[%s] refresh interval %" PRIu64 "ns / %" PRIu64 "ms\n", output->name, output->refresh_interval_nsec, output->refresh_interval_nsec / 1000000UL);
-	output->mode_blob_id = mode_blob_create(device, &output->mode);
-
-	/*
-	 * Now we have all our objects lined up, get their property lists from
-	 * KMS and use that to fill in the props structures we have above, so
-	 * we can more easily query and set them.
-	 */
-	props = drmModeObjectGetProperties(device->kms_fd, output->primary_plane_id,
-					   DRM_MODE_OBJECT_PLANE);
-	assert(props);
-	drm_property_info_populate(device, plane_props, output->props.plane,
-				   WDRM_PLANE__COUNT, props);
-	plane_formats_populate(output, props);
-	drmModeFreeObjectProperties(props);
-
-	props = drmModeObjectGetProperties(device->kms_fd, output->crtc_id,
-					   DRM_MODE_OBJECT_CRTC);
-	assert(props);
-	drm_property_info_populate(device, crtc_props, output->props.crtc,
-				   WDRM_CRTC__COUNT, props);
-	drmModeFreeObjectProperties(props);
-
-	props = drmModeObjectGetProperties(device->kms_fd, output->connector_id,
-					   DRM_MODE_OBJECT_CONNECTOR);
-	assert(props);
-	drm_property_info_populate(device, connector_props, output->props.connector,
-				   WDRM_CONNECTOR__COUNT, props);
-	output_get_edid(output, props);
-	drmModeFreeObjectProperties(props);
-
-	/*
-	 * Set if we support explicit fencing inside KMS; the EGL renderer will
-	 * clear this if it doesn't support it.
-	 */
-	output->explicit_fencing =
-		(output->props.plane[WDRM_PLANE_IN_FENCE_FD].prop_id &&
-		 output->props.crtc[WDRM_CRTC_OUT_FENCE_PTR].prop_id);
+	mode = output_pick_mode(connector, &crtc->mode);
+	output = output_init(device, connector, crtc->crtc_id, plane->plane_id,
+			     mode);
 
-	drmModeFreePlane(plane);
 out_crtc:
 	drmModeFreeCrtc(crtc);
 out_encoder:
@@ -642,17 +1056,47 @@ void output_destroy(struct output *output)
 	struct device *device = output->device;
 	int i;
 
-	for (i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
-		if (output->buffers[i])
-			buffer_destroy(output->buffers[i]);
-	}
+	output_capture_destroy(output);
+	for (i = 0; i < output->num_buffers; i++)
+		buffer_release(output->buffers[i]);
+
+	if (output->overlay.background)
+		buffer_release(output->overlay.background);
+	if (output->overlay.plane_id)
+		drm_property_info_free(output->overlay.props,
+				       WDRM_PLANE__COUNT);
+
+	output_dmabufs_destroy(output);
+	output_baked_destroy(output);
+	if (output->external.plane_id &&
+	    output->external.plane_id != output->primary_plane_id)
+		drm_property_info_free(output->external.overlay_props,
+				       WDRM_PLANE__COUNT);
 
 	if (output->device->egl_dpy)
 		output_egl_destroy(device, output);
 
 	if (output->mode_blob_id != 0)
 		drmModeDestroyPropertyBlob(device->kms_fd, output->mode_blob_id);
-
+	if (output->damage.blob_id != 0)
+		drmModeDestroyPropertyBlob(device->kms_fd, output->damage.blob_id);
+	if (output->color.degamma_blob_id != 0)
+		drmModeDestroyPropertyBlob(device->kms_fd,
+					   output->color.degamma_blob_id);
+	if (output->color.ctm_blob_id != 0)
+		drmModeDestroyPropertyBlob(device->kms_fd,
+					   output->color.ctm_blob_id);
+	if (output->color.gamma_blob_id != 0)
+		drmModeDestroyPropertyBlob(device->kms_fd,
+					   output->color.gamma_blob_id);
+
+	drm_property_info_free(output->props.plane, WDRM_PLANE__COUNT);
+	drm_property_info_free(output->props.crtc, WDRM_CRTC__COUNT);
+	drm_property_info_free(output->props.connector, WDRM_CONNECTOR__COUNT);
+	free(output->modifiers);
+
+	pthread_cond_destroy(&output->render_cond);
+	pthread_mutex_destroy(&output->lock);
 	free(output);
 }
 
@@ -696,43 +1140,43 @@ connector_add_prop(drmModeAtomicReq *req, struct output *output,
 	return (ret <= 0) ? -1 : 0;
 }
 
-/* Sets a plane property inside an atomic request. */
+/*
+ * Sets a plane property inside an atomic request. As we may drive more than
+ * one plane per output, this takes the plane and its property table rather
+ * than the output.
+ */
 static int
-plane_add_prop(drmModeAtomicReq *req, struct output *output,
+plane_add_prop(drmModeAtomicReq *req, uint32_t plane_id,
+	       struct drm_property_info *props,
 	       enum wdrm_plane_property prop, uint64_t val)
 {
-	struct drm_property_info *info = &output->props.plane[prop];
+	struct drm_property_info *info = &props[prop];
 	int ret;
 
 	if (info->prop_id == 0)
 		return -1;
 
-	ret = drmModeAtomicAddProperty(req, output->primary_plane_id,
-				       info->prop_id, val);
+	ret = drmModeAtomicAddProperty(req, plane_id, info->prop_id, val);
 	debug("\t[PLANE:%lu] %lu (%s) -> %llu (0x%llx)\n",
-	      (unsigned long) output->primary_plane_id,
+	      (unsigned long) plane_id,
 	      (unsigned long) info->prop_id, info->name,
 	      (unsigned long long) val, (unsigned long long) val);
 	return (ret <= 0) ? -1 : 0;
 }
 
-
 /*
- * Populates an atomic request structure with this output's current
- * configuration.
- *
- * Atomic requests are applied incrementally on top of the current state, so
- * there is no need here to apply the entire output state, except on the first
- * modeset if we are changing the display routing (per output_create comments).
+ * Sets up a plane to display a buffer, unscaled, with its top-left corner
+ * at x/y within the CRTC; or, with plane_add_buffer_scaled, scaled to w/h.
  */
-void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
-			   struct buffer *buffer)
+static int
+plane_add_buffer_scaled(drmModeAtomicReq *req, struct output *output,
+			uint32_t plane_id, struct drm_property_info *props,
+			struct buffer *buffer, int x, int y, int w, int h)
 {
 	int ret;
 
-	debug("[%s] atomic state for commit:\n", output->name);
-
-	ret = plane_add_prop(req, output, WDRM_PLANE_CRTC_ID, output->crtc_id);
+	ret = plane_add_prop(req, plane_id, props, WDRM_PLANE_CRTC_ID,
+			     output->crtc_id);
 
 	/*
 	 * SRC_X/Y/W/H are the co-ordinates to use as the dimensions of the
@@ -740,17 +1184,19 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 	 * co-ordinates are in 16.16 fixed-point to allow for better scaling;
 	 * as we just use a full-size uncropped image, we don't need this.
 	 */
-	ret |= plane_add_prop(req, output, WDRM_PLANE_FB_ID, buffer->fb_id);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_FB_ID,
+			      buffer->fb_id);
 	if (output->explicit_fencing && buffer->render_fence_fd >= 0) {
 		assert(linux_sync_file_is_valid(buffer->render_fence_fd));
-		ret |= plane_add_prop(req, output, WDRM_PLANE_IN_FENCE_FD,
+		ret |= plane_add_prop(req, plane_id, props,
+				      WDRM_PLANE_IN_FENCE_FD,
 				      buffer->render_fence_fd);
 	}
-	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_X, 0);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_Y, 0);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_W,
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_SRC_X, 0);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_SRC_Y, 0);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_SRC_W,
 			      buffer->width << 16);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_SRC_H,
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_SRC_H,
 			      buffer->height << 16);
 
 	/*
@@ -758,24 +1204,277 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 	 * space; these positions are plain integer, as it makes no sense for
 	 * output positions to be expressed in subpixels.
 	 *
-	 * Anyway, we just use a full-screen buffer with no scaling.
+	 * We only scale imported buffers; our own are rendered at the size
+	 * we show them at.
 	 */
-	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_X, 0);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_Y, 0);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_W, buffer->width);
-	ret |= plane_add_prop(req, output, WDRM_PLANE_CRTC_H, buffer->height);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_CRTC_X, x);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_CRTC_Y, y);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_CRTC_W, w);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_CRTC_H, h);
+
+	return ret;
+}
+
+static int
+plane_add_buffer(drmModeAtomicReq *req, struct output *output,
+		 uint32_t plane_id, struct drm_property_info *props,
+		 struct buffer *buffer, int x, int y)
+{
+	return plane_add_buffer_scaled(req, output, plane_id, props, buffer,
+				       x, y, buffer->width, buffer->height);
+}
+
+/* Switches a plane off, detaching it from its CRTC. */
+static int
+plane_add_disable(drmModeAtomicReq *req, uint32_t plane_id,
+		  struct drm_property_info *props)
+{
+	int ret;
+
+	ret = plane_add_prop(req, plane_id, props, WDRM_PLANE_FB_ID, 0);
+	ret |= plane_add_prop(req, plane_id, props, WDRM_PLANE_CRTC_ID, 0);
+	return ret;
+}
+
+/*
+ * Tells KMS which parts of the buffer have changed since the last frame we
+ * committed, through the FB_DAMAGE_CLIPS property: drivers which have to
+ * copy the image to the display themselves (e.g. USB, SPI or virtual GPUs)
+ * can then only send those parts, rather than the whole image every frame.
+ *
+ * The damage is relative to whatever the plane showed before, not to what
+ * was previously in this buffer, so this is different from the buffer
+ * damage we repainted. Damage isn't kept across commits, so leaving the
+ * property out (e.g. for our first commit, when we don't know what was on
+ * screen before) means the whole buffer is considered damaged.
+ *
+ * The kernel holds on to the blob for as long as the commit needs it, so we
+ * can destroy it along with our next request.
+ */
+static void
+plane_add_damage(drmModeAtomicReq *req, struct output *output,
+		 uint32_t plane_id, struct drm_property_info *props,
+		 struct buffer *buffer)
+{
+	struct device *device = output->device;
+	struct damage damage;
+	bool committed = output->damage.committed;
+	unsigned int from = output->damage.committed_frame;
+	int ret;
 
-	/* Ensure we do actually have a full-screen buffer. */
-	assert(buffer->width == output->mode.hdisplay);
-	assert(buffer->height == output->mode.vdisplay);
+	output->damage.committed = true;
+	output->damage.committed_frame = buffer->frame_num;
+
+	if (output->damage.blob_id != 0) {
+		drmModeDestroyPropertyBlob(device->kms_fd,
+					   output->damage.blob_id);
+		output->damage.blob_id = 0;
+	}
 
 	/*
-	 * Changing any of these three properties requires the ALLOW_MODESET
-	 * flag to be set on the atomic commit.
+	 * We've no idea what changed between two imported frames, nor
+	 * between one and our own next frame, so leave those fully damaged.
 	 */
-	ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
-			     output->mode_blob_id);
+	if (buffer->dmabuf.imported) {
+		output->damage.committed = false;
+		return;
+	}
+
+	if (!committed || props[WDRM_PLANE_FB_DAMAGE_CLIPS].prop_id == 0)
+		return;
+
+	buffer_anim_damage(buffer, from, buffer->frame_num, &damage);
+	if (damage.num_rects == 0)
+		return;
+
+	ret = drmModeCreatePropertyBlob(device->kms_fd, damage.rects,
+					damage.num_rects * sizeof(damage.rects[0]),
+					&output->damage.blob_id);
+	if (ret != 0) {
+		output->damage.blob_id = 0;
+		return;
+	}
+
+	if (plane_add_prop(req, plane_id, props, WDRM_PLANE_FB_DAMAGE_CLIPS,
+			   output->damage.blob_id) != 0)
+		error("[%s] couldn't add damage to request\n", output->name);
+}
+
+/*
+ * Adds the CRTC and connector state for the output's routing.
+ *
+ * Changing any of the first three properties requires the ALLOW_MODESET
+ * flag to be set on the atomic commit; VRR_ENABLED and the colour pipeline
+ * can be changed at any time.
+ */
+static int
+output_add_routing(struct output *output, drmModeAtomicReqPtr req)
+{
+	int ret;
+
+	ret = crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
+			    output->mode_blob_id);
 	ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 1);
+	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID,
+				  output->crtc_id);
+
+	/*
+	 * VRR_ENABLED can be left on by whoever used the CRTC before us, so
+	 * we always set it to what we want.
+	 */
+	if (output->props.crtc[WDRM_CRTC_VRR_ENABLED].prop_id != 0)
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_VRR_ENABLED,
+				     output->vrr.enabled);
+
+	/*
+	 * The same goes for the colour pipeline: a blob ID of 0 resets each
+	 * stage to pass through, so we don't inherit someone else's
+	 * night-light LUT when we aren't managing colour ourselves.
+	 */
+	if (output->props.crtc[WDRM_CRTC_DEGAMMA_LUT].prop_id != 0)
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_DEGAMMA_LUT,
+				     output->color.degamma_blob_id);
+	if (output->props.crtc[WDRM_CRTC_CTM].prop_id != 0)
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_CTM,
+				     output->color.ctm_blob_id);
+	if (output->props.crtc[WDRM_CRTC_GAMMA_LUT].prop_id != 0)
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_GAMMA_LUT,
+				     output->color.gamma_blob_id);
+
+	return ret;
+}
+
+/*
+ * Puts a buffer on the plane showing the output's content.
+ *
+ * Once the plane is showing our buffers, each new buffer is usually the same
+ * size and in the same place as the last one, so all that changes is the
+ * framebuffer (and its fence). Sending only those saves us most of the
+ * properties each frame, and the kernel the work of checking them; anything
+ * else changing means we send the plane's full state again.
+ */
+static int
+output_add_content(drmModeAtomicReq *req, struct output *output,
+		   uint32_t plane_id, struct drm_property_info *props,
+		   struct buffer *buffer, int x, int y, int w, int h)
+{
+	int ret;
+
+	if (output->state.valid && output->state.plane_id == plane_id &&
+	    output->state.src_w == buffer->width &&
+	    output->state.src_h == buffer->height &&
+	    output->state.x == x && output->state.y == y &&
+	    output->state.w == w && output->state.h == h) {
+		ret = plane_add_prop(req, plane_id, props, WDRM_PLANE_FB_ID,
+				     buffer->fb_id);
+		if (output->explicit_fencing && buffer->render_fence_fd >= 0) {
+			assert(linux_sync_file_is_valid(buffer->render_fence_fd));
+			ret |= plane_add_prop(req, plane_id, props,
+					      WDRM_PLANE_IN_FENCE_FD,
+					      buffer->render_fence_fd);
+		}
+		return ret;
+	}
+
+	ret = plane_add_buffer_scaled(req, output, plane_id, props, buffer,
+				      x, y, w, h);
+	output->state.plane_id = plane_id;
+	output->state.src_w = buffer->width;
+	output->state.src_h = buffer->height;
+	output->state.x = x;
+	output->state.y = y;
+	output->state.w = w;
+	output->state.h = h;
+	return ret;
+}
+
+/*
+ * Populates an atomic request structure with this output's current
+ * configuration.
+ *
+ * Atomic requests are applied incrementally on top of the current state, so
+ * there is no need here to apply the entire output state, except on the first
+ * modeset if we are changing the display routing (per output_create comments).
+ * After that, we only send what has changed since our last request: for a
+ * normal repaint, just the new framebuffer, its fence and damage, and the
+ * request for an out-fence.
+ *
+ * When composing with an overlay plane, the buffer passed here only holds
+ * the animated region; the background goes onto the primary plane once, with
+ * our first commit, and is left alone from then on.
+ */
+void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
+			   struct buffer *buffer)
+{
+	int ret = 0;
+
+	debug("[%s] atomic state for commit:\n", output->name);
+
+	uint32_t plane_id = output->primary_plane_id;
+	struct drm_property_info *plane_props = output->props.plane;
+
+	if (buffer->dmabuf.imported) {
+		plane_id = output->external.plane_id;
+		plane_props = output->external.props;
+
+		/*
+		 * Overlay planes only need the primary plane out of the way
+		 * the first time around.
+		 */
+		if (plane_id != output->primary_plane_id &&
+		    !output->external.plane_committed) {
+			ret |= plane_add_disable(req, output->primary_plane_id,
+						 output->props.plane);
+		}
+		output->external.plane_committed = true;
+
+		ret |= output_add_content(req, output, plane_id, plane_props,
+					  buffer, output->external.x,
+					  output->external.y,
+					  output->external.w,
+					  output->external.h);
+	} else if (output->overlay.plane_id) {
+		plane_id = output->overlay.plane_id;
+		plane_props = output->overlay.props;
+
+		if (!output->overlay.background_committed) {
+			ret |= plane_add_buffer(req, output,
+						output->primary_plane_id,
+						output->props.plane,
+						output->overlay.background,
+						0, 0);
+			output->overlay.background_committed = true;
+		}
+		ret |= output_add_content(req, output, plane_id, plane_props,
+					  buffer, output->overlay.x,
+					  output->overlay.y, buffer->width,
+					  buffer->height);
+	} else {
+		/*
+		 * Going back to our own rendering after showing imported
+		 * buffers on an overlay plane: switch that off again.
+		 */
+		if (output->external.plane_committed &&
+		    output->external.plane_id != output->primary_plane_id) {
+			ret |= plane_add_disable(req, output->external.plane_id,
+						 output->external.props);
+		}
+		output->external.plane_committed = false;
+
+		ret |= output_add_content(req, output, plane_id, plane_props,
+					  buffer, 0, 0, buffer->width,
+					  buffer->height);
+
+		/* Ensure we do actually have a full-screen buffer. */
+		assert(buffer->width == output->mode.hdisplay);
+		assert(buffer->height == output->mode.vdisplay);
+	}
+
+	plane_add_damage(req, output, plane_id, plane_props, buffer);
+
+	if (!output->state.valid)
+		ret |= output_add_routing(output, req);
+	output->state.valid = true;
 
 	if (output->explicit_fencing) {
 		if (output->commit_fence_fd >= 0)
@@ -791,12 +1490,597 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
 				     (uint64_t) (uintptr_t) &output->commit_fence_fd);
 	}
 
-	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID,
-				  output->crtc_id);
+	assert(ret == 0);
+}
+
+/*
+ * Adds the render fence of a buffer we've already added to the request, for
+ * renderers which only hand us the fence after the output's state has been
+ * added, as Vulkan does when batching its submissions.
+ */
+void output_add_in_fence(struct output *output, drmModeAtomicReqPtr req,
+			 struct buffer *buffer)
+{
+	uint32_t plane_id = output->primary_plane_id;
+	struct drm_property_info *plane_props = output->props.plane;
+	int ret;
 
+	if (!output->explicit_fencing || buffer->render_fence_fd < 0)
+		return;
+
+	if (output->overlay.plane_id) {
+		plane_id = output->overlay.plane_id;
+		plane_props = output->overlay.props;
+	}
+
+	assert(linux_sync_file_is_valid(buffer->render_fence_fd));
+	ret = plane_add_prop(req, plane_id, plane_props,
+			     WDRM_PLANE_IN_FENCE_FD, buffer->render_fence_fd);
 	assert(ret == 0);
 }
 
+/* Returns true if the plane is already used by any of our outputs. */
+static bool plane_is_claimed(struct device *device, uint32_t plane_id)
+{
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+
+		if (!output)
+			continue;
+		if (output->primary_plane_id == plane_id ||
+		    output->overlay.plane_id == plane_id ||
+		    output->external.plane_id == plane_id)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Try to display the output's animated region on the given plane, above the
+ * background on the primary plane, without actually committing anything.
+ */
+static bool output_overlay_test(struct output *output, drmModePlanePtr plane,
+				struct drm_property_info *props)
+{
+	struct device *device = output->device;
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+
+	debug("[%s] testing plane %" PRIu32 " for animation:\n",
+	      output->name, plane->plane_id);
+	ret = plane_add_buffer(req, output, output->primary_plane_id,
+			       output->props.plane, output->overlay.background,
+			       0, 0);
+	ret |= plane_add_buffer(req, output, plane->plane_id, props,
+				output->buffers[0],
+				output->overlay.x, output->overlay.y);
+	ret |= output_add_routing(output, req);
+
+	if (ret == 0)
+		ret = drmModeAtomicCommit(device->kms_fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY |
+					  DRM_MODE_ATOMIC_ALLOW_MODESET,
+					  NULL);
+
+	drmModeAtomicFree(req);
+	return ret == 0;
+}
+
+/*
+ * Check whether KMS will display the given full-screen buffer on the
+ * output's primary plane, without actually committing anything. Whether a
+ * compressed or tiled layout can be scanned out can depend on the mode,
+ * the plane and the display engine's bandwidth; IN_FORMATS only tells us
+ * that the plane understands it at all.
+ */
+bool output_modifier_test(struct output *output, struct buffer *buffer)
+{
+	struct device *device = output->device;
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+
+	ret = plane_add_buffer(req, output, output->primary_plane_id,
+			       output->props.plane, buffer, 0, 0);
+	ret |= output_add_routing(output, req);
+
+	if (ret == 0)
+		ret = drmModeAtomicCommit(device->kms_fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY |
+					  DRM_MODE_ATOMIC_ALLOW_MODESET,
+					  NULL);
+
+	drmModeAtomicFree(req);
+	return ret == 0;
+}
+
+/*
+ * KMS doesn't tell us which plane layouts a driver can actually support:
+ * this can depend on the plane's position, size, format and modifier,
+ * memory bandwidth, and what the other planes are doing. So, like Weston,
+ * we just try every plane which could display on our CRTC in turn with a
+ * TEST_ONLY commit, and use the first one which works.
+ *
+ * Overlay planes are tried before cursor planes, since cursor planes are
+ * often restricted to small sizes and linear buffers; the TEST_ONLY commit
+ * tells us whether or not our region fits.
+ */
+bool output_overlay_assign(struct output *output)
+{
+	static const enum wdrm_plane_type types[] = {
+		WDRM_PLANE_TYPE_OVERLAY,
+		WDRM_PLANE_TYPE_CURSOR,
+	};
+	struct device *device = output->device;
+	uint32_t crtc_mask = 0;
+
+	assert(output->overlay.background);
+	assert(output->buffers[0]);
+
+	/* Planes refer to the CRTCs they can use by index. */
+	for (int c = 0; c < device->res->count_crtcs; c++) {
+		if (device->res->crtcs[c] == output->crtc_id) {
+			crtc_mask = 1 << c;
+			break;
+		}
+	}
+	assert(crtc_mask);
+
+	for (unsigned int t = 0; t < ARRAY_LENGTH(types); t++) {
+		for (int p = 0; p < device->num_planes; p++) {
+			drmModePlanePtr plane = device->planes[p];
+			drmModeObjectPropertiesPtr props;
+			struct drm_property_info info[WDRM_PLANE__COUNT];
+			uint64_t type;
+
+			if (!(plane->possible_crtcs & crtc_mask) ||
+			    plane_is_claimed(device, plane->plane_id) ||
+			    !plane_has_format(plane,
+					      output->overlay.background->format))
+				continue;
+
+			props = drmModeObjectGetProperties(device->kms_fd,
+							   plane->plane_id,
+							   DRM_MODE_OBJECT_PLANE);
+			if (!props)
+				continue;
+			drm_property_info_populate(device, plane_props, info,
+						   WDRM_PLANE__COUNT, props);
+			type = drm_property_get_value(&info[WDRM_PLANE_TYPE],
+						      props,
+						      WDRM_PLANE_TYPE__COUNT);
+			drmModeFreeObjectProperties(props);
+
+			/*
+			 * We can't wait for our render fences on a plane
+			 * without IN_FENCE_FD, so don't mix it with ones
+			 * that have it.
+			 */
+			if (type != types[t] ||
+			    (output->explicit_fencing &&
+			     !info[WDRM_PLANE_IN_FENCE_FD].prop_id) ||
+			    !output_overlay_test(output, plane, info)) {
+				drm_property_info_free(info, WDRM_PLANE__COUNT);
+				continue;
+			}
+
+			memcpy(output->overlay.props, info, sizeof(info));
+			output->overlay.plane_id = plane->plane_id;
+			printf("[%s] animating on %s plane %" PRIu32 " at %d,%d\n",
+			       output->name,
+			       plane_type_enums[types[t]].name,
+			       plane->plane_id,
+			       output->overlay.x, output->overlay.y);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Formats with separate luma and chroma, which primary planes generally
+ * can't scan out, but video overlay planes can; as they're usually at a
+ * different resolution from the mode as well, the overlay also scales them
+ * for us for free.
+ */
+static bool format_is_yuv(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+	case DRM_FORMAT_NV16:
+	case DRM_FORMAT_NV61:
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_UYVY:
+#ifdef DRM_FORMAT_P010
+	case DRM_FORMAT_P010:
+#endif
+#ifdef DRM_FORMAT_P016
+	case DRM_FORMAT_P016:
+#endif
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Try to display an imported buffer on the given plane, scaled to fit the
+ * mode, without actually committing anything. Anything other than the
+ * primary plane goes on its own, with the primary plane switched off.
+ */
+static bool output_external_test(struct output *output, uint32_t plane_id,
+				 struct drm_property_info *props,
+				 struct buffer *buffer)
+{
+	struct device *device = output->device;
+	drmModeAtomicReqPtr req;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+
+	debug("[%s] testing plane %" PRIu32 " for imported buffers:\n",
+	      output->name, plane_id);
+	if (plane_id != output->primary_plane_id)
+		ret |= plane_add_disable(req, output->primary_plane_id,
+					 output->props.plane);
+	ret |= plane_add_buffer_scaled(req, output, plane_id, props, buffer,
+				       output->external.x, output->external.y,
+				       output->external.w, output->external.h);
+	ret |= output_add_routing(output, req);
+
+	if (ret == 0)
+		ret = drmModeAtomicCommit(device->kms_fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY |
+					  DRM_MODE_ATOMIC_ALLOW_MODESET,
+					  NULL);
+
+	drmModeAtomicFree(req);
+	return ret == 0;
+}
+
+/*
+ * Find a plane for imported buffers like this one, in the same way as
+ * output_overlay_assign: RGB buffers are tried on the primary plane first,
+ * which is all we need if it takes them; YUV buffers, or RGB ones it
+ * won't take, go through the overlay planes in turn.
+ */
+static bool output_external_assign(struct output *output,
+				   struct buffer *buffer)
+{
+	struct device *device = output->device;
+	uint32_t crtc_mask = 0;
+	drmModePlanePtr primary = NULL;
+
+	/* Aspect-preserving fit, centred: letterboxed or pillarboxed. */
+	uint64_t mw = output->mode.hdisplay, mh = output->mode.vdisplay;
+	if ((uint64_t) buffer->width * mh > (uint64_t) buffer->height * mw) {
+		output->external.w = mw;
+		output->external.h = (buffer->height * mw) / buffer->width;
+	} else {
+		output->external.h = mh;
+		output->external.w = (buffer->width * mh) / buffer->height;
+	}
+	output->external.x = (mw - output->external.w) / 2;
+	output->external.y = (mh - output->external.h) / 2;
+
+	if (output->external.plane_id &&
+	    output->external.plane_id != output->primary_plane_id)
+		drm_property_info_free(output->external.overlay_props,
+				       WDRM_PLANE__COUNT);
+	output->external.plane_id = 0;
+
+	for (int c = 0; c < device->res->count_crtcs; c++) {
+		if (device->res->crtcs[c] == output->crtc_id) {
+			crtc_mask = 1 << c;
+			break;
+		}
+	}
+	assert(crtc_mask);
+
+	for (int p = 0; p < device->num_planes; p++) {
+		if (device->planes[p]->plane_id == output->primary_plane_id)
+			primary = device->planes[p];
+	}
+
+	if (!format_is_yuv(buffer->format) && primary &&
+	    plane_has_format(primary, buffer->format) &&
+	    output_external_test(output, output->primary_plane_id,
+				 output->props.plane, buffer)) {
+		output->external.plane_id = output->primary_plane_id;
+		output->external.props = output->props.plane;
+		goto out;
+	}
+
+	for (int p = 0; p < device->num_planes; p++) {
+		drmModePlanePtr plane = device->planes[p];
+		drmModeObjectPropertiesPtr props;
+		struct drm_property_info *info = output->external.overlay_props;
+		uint64_t type;
+
+		if (!(plane->possible_crtcs & crtc_mask) ||
+		    plane_is_claimed(device, plane->plane_id) ||
+		    !plane_has_format(plane, buffer->format))
+			continue;
+
+		props = drmModeObjectGetProperties(device->kms_fd,
+						   plane->plane_id,
+						   DRM_MODE_OBJECT_PLANE);
+		if (!props)
+			continue;
+		drm_property_info_populate(device, plane_props, info,
+					   WDRM_PLANE__COUNT, props);
+		type = drm_property_get_value(&info[WDRM_PLANE_TYPE], props,
+					      WDRM_PLANE_TYPE__COUNT);
+		drmModeFreeObjectProperties(props);
+
+		if (type != WDRM_PLANE_TYPE_OVERLAY ||
+		    (output->explicit_fencing &&
+		     !info[WDRM_PLANE_IN_FENCE_FD].prop_id) ||
+		    !output_external_test(output, plane->plane_id, info,
+					  buffer)) {
+			drm_property_info_free(info, WDRM_PLANE__COUNT);
+			continue;
+		}
+
+		output->external.plane_id = plane->plane_id;
+		output->external.props = info;
+		goto out;
+	}
+
+	return false;
+
+out:
+	output->external.format = buffer->format;
+	output->external.width = buffer->width;
+	output->external.height = buffer->height;
+	printf("[%s] showing imported %u x %u buffers on %s plane %" PRIu32 " at %d,%d (%d x %d)\n",
+	       output->name, buffer->width, buffer->height,
+	       (output->external.plane_id == output->primary_plane_id) ?
+			"primary" : "overlay",
+	       output->external.plane_id,
+	       output->external.x, output->external.y,
+	       output->external.w, output->external.h);
+	return true;
+}
+
+/*
+ * Zero-copy display of someone else's content, e.g. decoded video: rather
+ * than rendering our animation, the output shows the imported buffers it is
+ * given (see buffer_dmabuf_import), straight from the producer's memory.
+ *
+ * The plane is picked for the first buffer, and again whenever the format
+ * or size changes. Buffers only reach the screen through the repaint loop,
+ * so each one is committed at the output's next vblank, and replaced if a
+ * newer one arrives before then. Our own overlay composition
+ * ($KMS_OVERLAY) already takes the planes we'd want, and render threads
+ * ($KMS_THREADED) only hand us frames they've rendered, so neither can be
+ * mixed with this.
+ */
+bool output_external_present(struct output *output, struct buffer *buffer)
+{
+	assert(buffer->dmabuf.imported);
+	assert(buffer->output == output);
+
+	if (output->overlay.plane_id || output->device->threaded) {
+		error("[%s] can't show imported buffers with KMS_OVERLAY or KMS_THREADED\n",
+		      output->name);
+		return false;
+	}
+
+	if (!output->external.plane_id ||
+	    output->external.format != buffer->format ||
+	    output->external.width != buffer->width ||
+	    output->external.height != buffer->height) {
+		if (output->external.plane_committed) {
+			error("[%s] can't change imported buffer layout whilst showing it\n",
+			      output->name);
+			return false;
+		}
+		if (!output_external_assign(output, buffer)) {
+			error("[%s] no plane can display imported %u x %u buffer (format 0x%08" PRIx32 ", modifier 0x%016" PRIx64 ")\n",
+			      output->name, buffer->width, buffer->height,
+			      buffer->format, buffer->modifier);
+			return false;
+		}
+	}
+
+	pthread_mutex_lock(&output->lock);
+	output->external.active = true;
+	output->external.next = buffer;
+	pthread_mutex_unlock(&output->lock);
+	return true;
+}
+
+/*
+ * Create an output for a connector which has just been plugged in, and so
+ * isn't already routed anywhere: unlike output_create, we have to pick the
+ * CRTC, primary plane and mode ourselves.
+ *
+ * We only take CRTCs which are switched off, so we can't steal one from
+ * another connector we don't know about, and which one of the connector's
+ * encoders can drive. The mode is the one the monitor says it prefers,
+ * unless $KMS_MODE picks another. None of this is committed until the
+ * output's first frame.
+ */
+struct output *output_create_hotplug(struct device *device,
+				     drmModeConnectorPtr connector)
+{
+	drmModeModeInfo *mode = NULL;
+	drmModePlanePtr plane = NULL;
+	uint32_t crtc_id = 0;
+	int crtc_index = -1;
+
+	if (connector->connection != DRM_MODE_CONNECTED ||
+	    connector->count_modes == 0)
+		return NULL;
+
+	for (int m = 0; m < connector->count_modes && !mode; m++) {
+		if (connector->modes[m].type & DRM_MODE_TYPE_PREFERRED)
+			mode = &connector->modes[m];
+	}
+	mode = output_pick_mode(connector, mode ? mode : &connector->modes[0]);
+
+	for (int e = 0; e < connector->count_encoders && !crtc_id; e++) {
+		drmModeEncoderPtr encoder =
+			drmModeGetEncoder(device->kms_fd,
+					  connector->encoders[e]);
+
+		if (!encoder)
+			continue;
+
+		for (int c = 0; c < device->res->count_crtcs; c++) {
+			drmModeCrtcPtr crtc;
+			bool busy = false;
+
+			if (!(encoder->possible_crtcs & (1 << c)))
+				continue;
+			for (int o = 0; o < device->num_outputs; o++) {
+				if (device->outputs[o]->crtc_id == device->res->crtcs[c])
+					busy = true;
+			}
+			crtc = drmModeGetCrtc(device->kms_fd, device->res->crtcs[c]);
+			if (!crtc)
+				continue;
+			busy |= crtc->buffer_id != 0;
+			drmModeFreeCrtc(crtc);
+			if (busy)
+				continue;
+
+			crtc_id = device->res->crtcs[c];
+			crtc_index = c;
+			break;
+		}
+		drmModeFreeEncoder(encoder);
+	}
+	if (!crtc_id) {
+		fprintf(stderr, "[CONN:%" PRIu32 "]: no free CRTC\n",
+			connector->connector_id);
+		return NULL;
+	}
+
+	for (int p = 0; p < device->num_planes && !plane; p++) {
+		drmModeObjectPropertiesPtr props;
+		struct drm_property_info info[WDRM_PLANE__COUNT];
+		uint64_t type;
+
+		if (!(device->planes[p]->possible_crtcs & (1 << crtc_index)) ||
+		    plane_is_claimed(device, device->planes[p]->plane_id))
+			continue;
+
+		props = drmModeObjectGetProperties(device->kms_fd,
+						   device->planes[p]->plane_id,
+						   DRM_MODE_OBJECT_PLANE);
+		if (!props)
+			continue;
+		drm_property_info_populate(device, plane_props, info,
+					   WDRM_PLANE__COUNT, props);
+		type = drm_property_get_value(&info[WDRM_PLANE_TYPE], props,
+					      WDRM_PLANE_TYPE__COUNT);
+		drm_property_info_free(info, WDRM_PLANE__COUNT);
+		drmModeFreeObjectProperties(props);
+
+		if (type == WDRM_PLANE_TYPE_PRIMARY)
+			plane = device->planes[p];
+	}
+	if (!plane) {
+		fprintf(stderr, "[CRTC:%" PRIu32 "]: no free primary plane\n",
+			crtc_id);
+		return NULL;
+	}
+
+	return output_init(device, connector, crtc_id, plane->plane_id, mode);
+}
+
+/*
+ * Switch an output off once its connector has been unplugged, detaching
+ * our framebuffers from its planes. This is a modeset, but only of this
+ * output's CRTC; like any other commit, we get a completion event for the
+ * CRTC once it's done, after which its buffers can be freed.
+ *
+ * The output must not have a commit in flight.
+ */
+int output_disable(struct output *output)
+{
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+
+	ret = plane_add_prop(req, output->primary_plane_id, output->props.plane,
+			     WDRM_PLANE_FB_ID, 0);
+	ret |= plane_add_prop(req, output->primary_plane_id,
+			      output->props.plane, WDRM_PLANE_CRTC_ID, 0);
+	if (output->overlay.plane_id) {
+		ret |= plane_add_prop(req, output->overlay.plane_id,
+				      output->overlay.props, WDRM_PLANE_FB_ID, 0);
+		ret |= plane_add_prop(req, output->overlay.plane_id,
+				      output->overlay.props, WDRM_PLANE_CRTC_ID, 0);
+	}
+	if (output->external.plane_id &&
+	    output->external.plane_id != output->primary_plane_id)
+		ret |= plane_add_disable(req, output->external.plane_id,
+					 output->external.props);
+	ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 0);
+	ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID, 0);
+	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID, 0);
+
+	if (ret == 0)
+		ret = atomic_commit(output->device, req, true);
+	output->state.valid = false;
+
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/*
+ * Switch the display itself off or back on through the connector's DPMS
+ * property, leaving the rest of our configuration alone, so we can pick up
+ * where we left off.
+ *
+ * DPMS can't be set in an atomic commit, only through the legacy property
+ * ioctl; for atomic drivers, the kernel turns it into changing the CRTC's
+ * ACTIVE property, and it only returns once that's done. The output must
+ * not have a commit in flight.
+ */
+int output_set_dpms(struct output *output, bool on)
+{
+	struct drm_property_info *info =
+		&output->props.connector[WDRM_CONNECTOR_DPMS];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeConnectorSetProperty(output->device->kms_fd,
+					  output->connector_id, info->prop_id,
+					  on ? DRM_MODE_DPMS_ON :
+					       DRM_MODE_DPMS_OFF);
+	if (ret != 0) {
+		error("[%s] couldn't switch display %s: %s\n", output->name,
+		      on ? "on" : "off", strerror(errno));
+		return ret;
+	}
+
+	/*
+	 * Panels which refresh themselves may have lost what they were
+	 * keeping, so our next frame has to be sent in full.
+	 */
+	output->damage.committed = false;
+	return 0;
+}
+
 /*
  * Commits the atomic state to KMS.
  *
@@ -818,11 +2102,11 @@ void output_add_atomic_req(struct output *output, drmModeAtomicReqPtr req,
  * or modes; here we set it on our first commit (since the prior state
  * could be very different), but make sure to not use it in steady state.
  *
- * Another flag which can be used - but isn't here - is TEST_ONLY. This
- * flag simply checks whether or not the atomic commit _would_ succeed,
- * and returns without committing the state to the kernel. Weston uses
- * this to determine whether or not we can use overlays by brute force:
- * we try to place each view on a particular plane one by one, testing
+ * Another flag which isn't used here - but is by output_overlay_assign - is
+ * TEST_ONLY. This flag simply checks whether or not the atomic commit
+ * _would_ succeed, and returns without committing the state to the kernel.
+ * Weston uses this to determine whether or not we can use overlays by brute
+ * force: we try to place each view on a particular plane one by one, testing
  * whether or not it succeeds for each plane. TEST_ONLY commits are very
  * cheap, so can be used to iteratively determine a successful configuration,
  * as KMS itself does not describe the constraints a driver has, e.g.
@@ -841,8 +2125,59 @@ int atomic_commit(struct device *device, drmModeAtomicReqPtr req,
 	return drmModeAtomicCommit(device->kms_fd, req, flags, device);
 }
 
-/* Create a dmabuf FD from a GEM handle. */
-int handle_to_fd(struct device *device, uint32_t gem_handle)
+/*
+ * Flips the output to a new buffer as soon as possible, rather than at the
+ * next vblank, which will usually tear.
+ *
+ * Drivers are very restrictive about what an async flip may change: in
+ * general, only the primary plane's FB_ID, so we don't try to pass fences
+ * or damage, and the caller has to wait for rendering to finish itself. The
+ * rest of the output's state stays as set by our earlier, synchronous,
+ * commits.
+ *
+ * If the driver doesn't support async flips through atomic, or rejects
+ * them anyway (e.g. because the new buffer has a different modifier), we
+ * fall back to the legacy page-flip ioctl, which has supported async flips
+ * for much longer. Either way, we get the same completion event.
+ */
+int output_async_flip(struct output *output, struct buffer *buffer)
+{
+	struct device *device = output->device;
+	drmModeAtomicReqPtr req;
+	int ret;
+
+	if (device->async_caps.atomic) {
+		req = drmModeAtomicAlloc();
+		assert(req);
+		ret = plane_add_prop(req, output->primary_plane_id,
+				     output->props.plane, WDRM_PLANE_FB_ID,
+				     buffer->fb_id);
+		if (ret == 0)
+			ret = drmModeAtomicCommit(device->kms_fd, req,
+						  DRM_MODE_ATOMIC_NONBLOCK |
+						  DRM_MODE_PAGE_FLIP_EVENT |
+						  DRM_MODE_PAGE_FLIP_ASYNC,
+						  device);
+		drmModeAtomicFree(req);
+		if (ret == 0 || !device->async_caps.legacy)
+			return ret;
+
+		fprintf(stderr, "atomic async flip failed, falling back to "
+			"legacy page flips: %s\n", strerror(errno));
+		device->async_caps.atomic = false;
+	}
+
+	return drmModePageFlip(device->kms_fd, output->crtc_id, buffer->fb_id,
+			       DRM_MODE_PAGE_FLIP_EVENT |
+			       DRM_MODE_PAGE_FLIP_ASYNC, device);
+}
+
+/*
+ * Create a dmabuf FD from a GEM handle on the given DRM device: usually our
+ * KMS device, but GEM handles are per-device, so buffers on the render GPU
+ * need the render node's FD.
+ */
+int handle_to_fd(int drm_fd, uint32_t gem_handle)
 {
 	struct drm_prime_handle prime = {
 		.handle = gem_handle,
@@ -850,7 +2185,7 @@ int handle_to_fd(struct device *device, uint32_t gem_handle)
 	};
 	int ret;
 
-	ret = ioctl(device->kms_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime);
+	ret = ioctl(drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime);
 	if (ret != 0) {
 		error("failed to export GEM handle %" PRIu32 " to FD\n", gem_handle);
 		return -1;
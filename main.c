@@ -52,20 +52,479 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include "kms-quads.h"
 
 /* Allow the driver to drift half a millisecond every frame. */
 #define FRAME_TIMING_TOLERANCE (NSEC_PER_SEC / 2000)
 
+/*
+ * The margin we leave ourselves to paint and commit a new frame, where we
+ * don't have any better prediction from the deadline scheduler.
+ */
+#define DEFAULT_REPAINT_MARGIN (NSEC_PER_SEC / 250)
+
+/*
+ * How much extra time the deadline scheduler allows on top of its predicted
+ * repaint cost, to absorb timer wakeup latency and variance in our frames.
+ */
+#define DEADLINE_SLACK (NSEC_PER_SEC / 1000)
+
+/*
+ * Every output's buffer pool starts out with enough buffers for double
+ * buffering: one on screen, and one to render the next frame into. We only
+ * allocate more once we find them all busy, and free them again once they
+ * have not been rendered into for POOL_IDLE_NSEC.
+ */
+#define POOL_MIN_BUFFERS 2
+#define POOL_IDLE_NSEC (2 * NSEC_PER_SEC)
+
+/*
+ * Add another buffer to the output's pool, unless it has already grown to
+ * the maximum queue depth.
+ *
+ * This may be called from the output's render thread in threaded mode, which
+ * is fine, since the renderers only ever need the output's own context.
+ */
+static struct buffer *output_buffers_grow(struct output *output)
+{
+	struct buffer *buffer;
+	struct timespec now;
+
+	if (output->num_buffers >= output->device->queue_depth)
+		return NULL;
+
+	buffer = buffer_create(output->device, output, output->pool.width,
+			       output->pool.height);
+	if (!buffer) {
+		error("[%s] couldn't allocate another buffer\n", output->name);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buffer->last_used_nsec = timespec_to_nsec(&now);
+
+	output->buffers[output->num_buffers++] = buffer;
+	if (output->num_buffers > output->pool.peak)
+		output->pool.peak = output->num_buffers;
+	if (output->num_buffers > POOL_MIN_BUFFERS) {
+		output->pool.num_grown++;
+		debug("[%s] grew buffer pool to %d buffers\n",
+		      output->name, output->num_buffers);
+	}
+
+	return buffer;
+}
+
+/* Allocate the initial buffers for the output's pool, of the given size. */
+static bool output_buffers_init(struct output *output, uint32_t width,
+				uint32_t height)
+{
+	output->pool.width = width;
+	output->pool.height = height;
+
+	while (output->num_buffers < POOL_MIN_BUFFERS) {
+		if (!output_buffers_grow(output))
+			return false;
+	}
+
+	return true;
+}
+
+static void output_buffers_fini(struct output *output)
+{
+	for (int i = 0; i < output->num_buffers; i++) {
+		buffer_release(output->buffers[i]);
+		output->buffers[i] = NULL;
+	}
+	output->num_buffers = 0;
+}
+
+/*
+ * Free any buffers which have been sitting idle for a while, whilst keeping
+ * enough for double buffering. Buffers which KMS is holding on to, or which
+ * have been rendered ahead, are never idle.
+ *
+ * We look at the most recently allocated buffers first: since we always pick
+ * the first free buffer to render into, these are the ones we only needed
+ * for a burst of rendering ahead or a late frame, and which fall idle again
+ * as soon as we have caught up.
+ *
+ * Destroying a buffer needs the renderer's context just like creating one
+ * does, so we only do this from the thread which renders the output. Must be
+ * called with the output lock held.
+ */
+static void output_buffers_trim(struct output *output)
+{
+	struct timespec now;
+	int64_t now_nsec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_nsec = timespec_to_nsec(&now);
+
+	for (int i = output->num_buffers - 1;
+	     i >= 0 && output->num_buffers > POOL_MIN_BUFFERS; i--) {
+		struct buffer *buffer = output->buffers[i];
+
+		if (buffer->in_use || buffer->ready ||
+		    now_nsec - buffer->last_used_nsec < POOL_IDLE_NSEC)
+			continue;
+
+		buffer_release(buffer);
+		output->num_buffers--;
+		memmove(&output->buffers[i], &output->buffers[i + 1],
+			(output->num_buffers - i) * sizeof(output->buffers[0]));
+		output->buffers[output->num_buffers] = NULL;
+		output->pool.num_shrunk++;
+		debug("[%s] shrank buffer pool to %d buffers\n",
+		      output->name, output->num_buffers);
+	}
+}
+
+/*
+ * Find a buffer to render the next frame into. Normally, the buffer last
+ * displayed has been released by the time we come to repaint, so double
+ * buffering is enough; if KMS is still holding on to everything we have -
+ * say, because a frame missed its vblank and we are repainting for the one
+ * after - we grow the pool instead.
+ */
 static struct buffer *find_free_buffer(struct output *output)
 {
-	for (int i = 0; i < BUFFER_QUEUE_DEPTH; i++) {
+	struct buffer *buffer;
+
+	for (int i = 0; i < output->num_buffers; i++) {
+		if (!output->buffers[i]->in_use)
+			return output->buffers[i];
+	}
+
+	buffer = output_buffers_grow(output);
+	assert(buffer && "could not find free buffer for output!");
+	return buffer;
+}
+
+/*
+ * Find a buffer we can render a future frame into, whilst another frame is
+ * still queued to KMS. Unlike find_free_buffer, it is not an error for there
+ * to be no buffer available here: it just means we can't get any further
+ * ahead right now.
+ *
+ * Any buffer which KMS has released is fair game. When using explicit
+ * fencing, we can also reuse the buffer which is currently being displayed,
+ * as long as we have the out-fence for the commit which will replace it:
+ * the GPU renderers wait on buffer->kms_fence_fd before writing to the
+ * buffer, so the rendering will not start until KMS has stopped scanning
+ * out from it. This is not possible for dumb buffers, as the CPU would
+ * start scribbling over the buffer immediately.
+ *
+ * Only if neither is possible do we allocate another buffer, which might
+ * also fail if the pool is already as large as we allow it to get.
+ */
+static struct buffer *find_render_ahead_buffer(struct output *output)
+{
+	struct buffer *last = output->buffer_last;
+
+	for (int i = 0; i < output->num_buffers; i++) {
 		if (!output->buffers[i]->in_use)
 			return output->buffers[i];
 	}
 
-	assert(0 && "could not find free buffer for output!");
+	if (output->explicit_fencing && last && !last->ready &&
+	    last->gbm.bo && last->kms_fence_fd >= 0)
+		return last;
+
+	return output_buffers_grow(output);
+}
+
+/*
+ * Picks the animation frame we're about to render into a buffer, and updates
+ * our damage tracking to match.
+ *
+ * Whatever changes between the frame we last rendered into any buffer and
+ * this one is now out of date in all of our buffers, including this one;
+ * each buffer keeps accumulating this damage until we next render into it,
+ * at which point its damage tells the renderer exactly what to repaint.
+ * Buffers we've rendered less recently thus accumulate several frames'
+ * worth of damage, and buffers which have only just been added to the pool
+ * start out entirely damaged.
+ *
+ * Must be called with the output lock held; the buffer then belongs to the
+ * caller until it has been rendered.
+ */
+static void buffer_set_frame(struct output *output, struct buffer *buffer,
+			     unsigned int frame_num)
+{
+	struct damage damage;
+	struct timespec now;
+
+	buffer_anim_damage(buffer, output->damage.rendered_frame, frame_num,
+			   &damage);
+	for (int i = 0; i < output->num_buffers; i++)
+		damage_add(&output->buffers[i]->damage, &damage);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	buffer->last_used_nsec = timespec_to_nsec(&now);
+	buffer->frame_num = frame_num;
+	output->damage.rendered_frame = frame_num;
+}
+
+/*
+ * Update one of the deadline scheduler's cost predictions with a new sample.
+ *
+ * We react immediately to frames getting more expensive, since missing a
+ * vblank is far worse than waking up slightly too early, but only decay
+ * slowly when they get cheaper, so a single quick frame doesn't make us cut
+ * it too fine for the next one.
+ */
+static int64_t sched_cost_update(int64_t estimate, int64_t sample)
+{
+	if (sample < 0)
+		return estimate;
+	if (sample >= estimate)
+		return sample;
+	return estimate - (estimate - sample) / 8;
+}
+
+/*
+ * How long before the target vblank we need to start repainting this output,
+ * going by how long the last frames took us.
+ */
+static int64_t output_repaint_margin(struct output *output)
+{
+	if (!output->sched.enabled)
+		return DEFAULT_REPAINT_MARGIN;
+
+	return output->sched.render_nsec + output->sched.commit_nsec;
+}
+
+/*
+ * Called when the previous frame has completed, to work out when we should
+ * next repaint the output.
+ *
+ * Without the deadline scheduler, this is immediately. With it, we aim to
+ * start repainting for the frame after the one which has just started, as
+ * late as we can whilst still hitting that vblank, and arm the output's
+ * timer to wake us up then. If that time has already passed, we repaint
+ * immediately, and advance_frame will skip ahead to a frame we can hit.
+ *
+ * Async flips have no vblank to wait for, so would otherwise repaint as fast
+ * as we can render; instead, we pace them the same way, aiming to flip one
+ * async interval after the last flip.
+ */
+static void output_schedule_repaint(struct output *output)
+{
+	struct itimerspec timer = { 0 };
+	struct timespec now, target;
+	int64_t interval = output->refresh_interval_nsec;
+	int ret;
+
+	if (!output->sched.enabled && !output->async.enabled) {
+		output->needs_repaint = true;
+		return;
+	}
+
+	if (output->async.enabled)
+		interval = output->async.interval_nsec;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &now);
+	assert(ret == 0);
+
+	timespec_add_nsec(&target, &output->last_frame,
+			  interval - output_repaint_margin(output) -
+			  DEADLINE_SLACK);
+	if (timespec_sub_to_nsec(&target, &now) <= 0) {
+		output->needs_repaint = true;
+		return;
+	}
+
+	debug("[%s] sleeping %" PRIi64 "ns until repaint (render %" PRIi64 "ns, commit %" PRIi64 "ns)\n",
+	      output->name, timespec_sub_to_nsec(&target, &now),
+	      output->sched.render_nsec, output->sched.commit_nsec);
+
+	timer.it_value = target;
+	ret = timerfd_settime(output->sched.timer_fd, TFD_TIMER_ABSTIME,
+			      &timer, NULL);
+	if (ret != 0) {
+		error("[%s] couldn't arm repaint timer: %s\n",
+		      output->name, strerror(errno));
+		output->needs_repaint = true;
+	}
+}
+
+/*
+ * Set up deadline scheduling for an output, if $KMS_DEADLINE is set.
+ *
+ * This only makes sense when we render each frame right before committing
+ * it: with render-ahead or render threads, the frame has already been
+ * rendered by the time we would wake up.
+ */
+static void output_sched_init(struct output *output)
+{
+	if (!getenv("KMS_DEADLINE"))
+		return;
+
+	if (output->device->threaded || output->render_ahead) {
+		fprintf(stderr, "[%s] deadline scheduling can't be combined "
+			"with threaded mode or rendering ahead\n",
+			output->name);
+		return;
+	}
+
+	output->sched.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_CLOEXEC | TFD_NONBLOCK);
+	if (output->sched.timer_fd < 0) {
+		fprintf(stderr, "[%s] couldn't create timerfd: %s\n",
+			output->name, strerror(errno));
+		return;
+	}
+
+	/*
+	 * Start out with the same margin as we'd use otherwise, then let
+	 * our measurements bring it down.
+	 */
+	output->sched.enabled = true;
+	output->sched.render_nsec = DEFAULT_REPAINT_MARGIN;
+	output->sched.commit_nsec = 0;
+	printf("[%s] using deadline scheduling\n", output->name);
+}
+
+/*
+ * Set up variable refresh for an output, if $KMS_VRR is set and both the
+ * connector and the CRTC support it.
+ *
+ * With VRR, a frame is shown as soon as we commit it, so we render and
+ * commit as soon as the previous frame is on screen: together with the
+ * render fence, which KMS waits for before flipping, each frame hits the
+ * screen as soon as it is finished. Rendering ahead would only ever show
+ * frames later than necessary, and there is no vblank for the deadline
+ * scheduler to aim for, so neither can be combined with it; this also
+ * rules out threaded mode.
+ */
+static void output_vrr_init(struct output *output)
+{
+	int64_t min_interval, max_interval;
+
+	if (!getenv("KMS_VRR"))
+		return;
+
+	if (!output->vrr.capable) {
+		printf("[%s] output doesn't support variable refresh\n",
+		       output->name);
+		return;
+	}
+
+	if (output->device->threaded || output->render_ahead ||
+	    output->sched.enabled) {
+		fprintf(stderr, "[%s] variable refresh can't be combined with "
+			"threaded mode, rendering ahead or deadline "
+			"scheduling\n", output->name);
+		return;
+	}
+
+	/*
+	 * The mode's refresh rate is the fastest the panel will go. If the
+	 * EDID doesn't tell us the slowest, assume it can at least halve
+	 * the rate; the kernel knows the real range, so this only affects
+	 * how well we predict flips for very slow frames.
+	 */
+	min_interval = output->refresh_interval_nsec;
+	if (output->vrr.min_hz > 0 && output->vrr.min_hz < output->vrr.max_hz)
+		max_interval = NSEC_PER_SEC / output->vrr.min_hz;
+	else
+		max_interval = 2 * min_interval;
+	if (max_interval < min_interval)
+		max_interval = min_interval;
+
+	output->vrr.enabled = true;
+	output->vrr.min_interval_nsec = min_interval;
+	output->vrr.max_interval_nsec = max_interval;
+	printf("[%s] using variable refresh, %" PRIi64 "-%" PRIi64 " us per frame\n",
+	       output->name, min_interval / 1000, max_interval / 1000);
+}
+
+/*
+ * Set up async flips for an output, if $KMS_ASYNC is set: after our first
+ * frame, which needs a normal commit for the modeset, every frame is flipped
+ * to the screen as soon as it has been rendered, tearing rather than waiting
+ * for vblank. $KMS_ASYNC can give the most frames per second to show, which
+ * otherwise is the mode's refresh rate: we still get lower latency, since
+ * each frame is shown as soon as it is ready, rather than at the next vblank.
+ *
+ * Since we already wait for each frame to finish rendering before flipping,
+ * and pace ourselves from a timer, this doesn't make sense together with any
+ * of our other ways of scheduling frames. Legacy async flips can only flip
+ * the primary plane, so we can't use an overlay plane either.
+ */
+static void output_async_init(struct output *output)
+{
+	struct device *device = output->device;
+	const char *env = getenv("KMS_ASYNC");
+	int fps;
+
+	if (!env)
+		return;
+
+	if (!device->async_caps.atomic && !device->async_caps.legacy) {
+		printf("[%s] driver doesn't support async flips\n",
+		       output->name);
+		return;
+	}
+
+	if (device->threaded || output->render_ahead ||
+	    output->sched.enabled || output->vrr.enabled ||
+	    output->overlay.plane_id) {
+		fprintf(stderr, "[%s] async flips can't be combined with "
+			"threaded mode, rendering ahead, deadline scheduling, "
+			"variable refresh or overlay planes\n", output->name);
+		return;
+	}
+
+	output->sched.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_CLOEXEC | TFD_NONBLOCK);
+	if (output->sched.timer_fd < 0) {
+		fprintf(stderr, "[%s] couldn't create timerfd: %s\n",
+			output->name, strerror(errno));
+		return;
+	}
+
+	fps = atoi(env);
+	output->async.enabled = true;
+	output->async.interval_nsec = (fps > 0) ? NSEC_PER_SEC / fps :
+					 output->refresh_interval_nsec;
+	printf("[%s] using %s async flips, at most one every %" PRIi64 " us\n",
+	       output->name, device->async_caps.atomic ? "atomic" : "legacy",
+	       output->async.interval_nsec / 1000);
+}
+
+/*
+ * Predict when a frame we finish rendering at ready_nsec would be shown with
+ * variable refresh: as soon as it is ready, but no sooner than the minimum
+ * interval after the previous frame.
+ *
+ * If we take longer than the maximum interval, the panel starts showing the
+ * previous frame again at that point, and every maximum interval after; we
+ * then have to wait for that repeat to finish scanning out, which takes the
+ * minimum interval.
+ */
+static int64_t output_vrr_predict(struct output *output, int64_t ready_nsec)
+{
+	int64_t last = timespec_to_nsec(&output->last_frame);
+	int64_t min_interval = output->vrr.min_interval_nsec;
+	int64_t max_interval = output->vrr.max_interval_nsec;
+	int64_t target = ready_nsec;
+	int64_t repeat;
+
+	if (target < last + min_interval)
+		target = last + min_interval;
+
+	if (target - last > max_interval) {
+		repeat = last + ((target - last) / max_interval) * max_interval;
+		if (target < repeat + min_interval)
+			target = repeat + min_interval;
+	}
+
+	return target;
 }
 
 /*
@@ -110,6 +569,17 @@ static void atomic_event_handler(int fd,
 		return;
 	}
 
+	/*
+	 * If the output's connector has gone, this is our commit switching
+	 * it off; see output_hotplug_unplug.
+	 */
+	if (output->hotplug.disabling) {
+		output->hotplug.removed = true;
+		return;
+	}
+
+	pthread_mutex_lock(&output->lock);
+
 	/*
 	 * Compare the actual completion timestamp to what we had predicted it
 	 * would be when we submitted it.
@@ -137,7 +607,11 @@ static void atomic_event_handler(int fd,
 		      delta_nsec);
 	}
 
-	output->needs_repaint = true;
+	output->stats.pending.predicted_nsec =
+		timespec_to_nsec(&output->last_frame) ?
+			timespec_to_nsec(&output->next_frame) : 0;
+	output->stats.pending.flip_nsec = timespec_to_nsec(&completion);
+
 	output->last_frame = completion;
 
 	/*
@@ -148,13 +622,20 @@ static void atomic_event_handler(int fd,
 	assert(output->buffer_pending);
 	assert(output->buffer_pending->in_use);
 
-	if (output->explicit_fencing) {
+	/*
+	 * We didn't render imported buffers, so they tell us nothing about
+	 * our render times; they may well not have a fence either. Nor did
+	 * we render baked frames we've shown before.
+	 */
+	if (output->explicit_fencing &&
+	    !output->buffer_pending->dmabuf.imported &&
+	    !output->buffer_pending->baked.shown) {
 		/*
 		 * Print the time that the KMS fence FD signaled, i.e. when the
 		 * last commit completed. It should be the same time as passed
 		 * to this event handler in the function arguments.
 		 */
-		if (output->buffer_last &&
+		if (output->buffer_last && !output->buffer_last->ready &&
 		    output->buffer_last->kms_fence_fd >= 0) {
 			assert(linux_sync_file_is_valid(output->buffer_last->kms_fence_fd));
 			debug("\tKMS fence time: %" PRIu64 "ns\n",
@@ -167,19 +648,59 @@ static void atomic_event_handler(int fd,
 		 * displaying. It should be strictly before the KMS fence FD
 		 * time.
 		 */
+		int64_t render_done;
+
 		assert(linux_sync_file_is_valid(output->buffer_pending->render_fence_fd));
-		debug("\trender fence time: %" PRIu64 "ns\n",
-		      linux_sync_file_get_fence_time(output->buffer_pending->render_fence_fd));
+		render_done = linux_sync_file_get_fence_time(
+			output->buffer_pending->render_fence_fd);
+		debug("\trender fence time: %" PRIu64 "ns\n", render_done);
+		output->stats.pending.render_done_nsec = render_done;
+		output->stats.pending.render_nsec =
+			render_done - output->buffer_pending->render_start_nsec;
+
+		/*
+		 * The render fence also tells us how long the GPU took to
+		 * render the frame, from when we started submitting it.
+		 */
+		if (output->sched.enabled) {
+			output->sched.render_nsec =
+				sched_cost_update(output->sched.render_nsec,
+						  render_done - timespec_to_nsec(&output->sched.render_start));
+		}
 	}
 
+	output_stats_push(output);
+
+	/*
+	 * Now that it's on screen, this is the frame to capture, if we're
+	 * capturing; see capture.c.
+	 */
+	if (device->capture.enabled)
+		output_capture_frame(output, output->buffer_pending,
+				     timespec_to_nsec(&completion));
+
+	/*
+	 * If we've already rendered a future frame into buffer_last (see
+	 * find_render_ahead_buffer), it stays in use until we commit it.
+	 */
 	if (output->buffer_last) {
 		assert(output->buffer_last->in_use);
-		debug("\treleasing buffer with FB ID %" PRIu32 "\n", output->buffer_last->fb_id);
-		output->buffer_last->in_use = false;
+		if (!output->buffer_last->ready) {
+			debug("\treleasing buffer with FB ID %" PRIu32 "\n",
+			      output->buffer_last->fb_id);
+			output->buffer_last->in_use = false;
+			if (output->buffer_last->gbm.surface)
+				buffer_egl_surface_release(output->buffer_last);
+		}
 		output->buffer_last = NULL;
 	}
 	output->buffer_last = output->buffer_pending;
 	output->buffer_pending = NULL;
+
+	output_schedule_repaint(output);
+
+	pthread_cond_signal(&output->render_cond);
+	pthread_mutex_unlock(&output->lock);
 }
 
 /*
@@ -189,95 +710,1522 @@ static void atomic_event_handler(int fd,
 static void advance_frame(struct output *output, struct timespec *now)
 {
 	struct timespec too_soon;
+	unsigned int advanced = 0;
 
 	/* For our first tick, we won't have predicted a time. */
 	if (timespec_to_nsec(&output->last_frame) == 0L)
 		return;
 
+	/*
+	 * With variable refresh or async flips, we can't count vblanks;
+	 * instead we predict when this frame will be shown, and pick the
+	 * animation frame for that time, counting from when our first frame
+	 * was shown at the mode's refresh rate. Frames which take longer
+	 * than usual then skip ahead by however long they took, rather than
+	 * a whole number of refresh intervals.
+	 *
+	 * An async flip happens as soon as we've rendered and committed it.
+	 */
+	if (output->vrr.enabled || output->async.enabled) {
+		unsigned int frame_num;
+		int64_t predicted, elapsed;
+
+		if (timespec_to_nsec(&output->anim_start) == 0L)
+			output->anim_start = output->last_frame;
+
+		predicted = timespec_to_nsec(now) +
+			    output_repaint_margin(output);
+		if (output->vrr.enabled)
+			predicted = output_vrr_predict(output, predicted);
+		timespec_from_nsec(&output->next_frame, predicted);
+
+		elapsed = predicted - timespec_to_nsec(&output->anim_start);
+		frame_num = (elapsed / output->refresh_interval_nsec) %
+			    NUM_ANIM_FRAMES;
+		advanced = (frame_num + NUM_ANIM_FRAMES - output->frame_num) %
+			   NUM_ANIM_FRAMES;
+		output->frame_num = frame_num;
+
+		if (advanced > 1)
+			output->stats.pending.num_dropped += advanced - 1;
+		return;
+	}
+
 	/*
 	 * Starting from our last frame completion time, advance the predicted
 	 * completion for our next frame by one frame's refresh time, until we
-	 * have at least a 4ms margin in which to paint a new buffer and submit
-	 * our frame to KMS.
+	 * have enough of a margin in which to paint a new buffer and submit
+	 * our frame to KMS: 4ms by default, or however long the deadline
+	 * scheduler predicts it will take us.
 	 *
 	 * This will skip frames in the animation if necessary, so it is
 	 * temporally correct.
 	 */
-	timespec_add_msec(&too_soon, now, 4);
+	timespec_add_nsec(&too_soon, now, output_repaint_margin(output));
 	output->next_frame = output->last_frame;
 
 	while (timespec_sub_to_nsec(&too_soon, &output->next_frame) >= 0) {
 		timespec_add_nsec(&output->next_frame, &output->next_frame,
 				  output->refresh_interval_nsec);
 		output->frame_num = (output->frame_num + 1) % NUM_ANIM_FRAMES;
+		advanced++;
 	}
+
+	/* Anything past the first frame we've advanced by was dropped. */
+	if (advanced > 1)
+		output->stats.pending.num_dropped += advanced - 1;
 }
 
-static void repaint_one_output(struct output *output, drmModeAtomicReqPtr req,
-			       bool *needs_modeset)
+/*
+ * Take the oldest frame we have rendered ahead, if it is still the right
+ * frame to show at our predicted presentation time.
+ *
+ * If we have missed a frame since rendering ahead, advance_frame will have
+ * skipped the animation forward, so the frames we rendered are now stale.
+ * Rather than showing them and have the animation lag behind, we throw them
+ * away and render the current frame from scratch.
+ */
+static struct buffer *take_ready_buffer(struct output *output)
 {
-	struct timespec now;
-	struct buffer *buffer;
-	int ret;
+	while (output->num_ready > 0) {
+		struct buffer *buffer = output->buffers_ready[0];
 
-	ret = clock_gettime(CLOCK_MONOTONIC, &now);
-	assert(ret == 0);
+		output->num_ready--;
+		memmove(&output->buffers_ready[0], &output->buffers_ready[1],
+			output->num_ready * sizeof(output->buffers_ready[0]));
+		buffer->ready = false;
 
-	/*
-	 * Find a free buffer, predict the time our next frame will be
-	 * displayed, use this to derive a target position for our animation
-	 * (such that it remains as linear as possible over time, even at
-	 * the cost of dropping frames), render the content for that position.
-	 */
-	buffer = find_free_buffer(output);
-	assert(buffer);
-	advance_frame(output, &now);
-	buffer_fill(buffer, output->frame_num);
+		if (buffer->frame_num == output->frame_num)
+			return buffer;
 
-	/* Add the output's new state to the atomic modesetting request. */
-	output_add_atomic_req(output, req, buffer);
-	buffer->in_use = true;
-	output->buffer_pending = buffer;
-	output->needs_repaint = false;
+		/*
+		 * In threaded mode, we can't render a replacement here
+		 * without stalling every other output, so we show the most
+		 * recent frame we have and let the render thread catch up.
+		 */
+		if (output->num_ready == 0 && output->device->threaded) {
+			debug("[%s] showing stale frame %u (now at %u)\n",
+			      output->name, buffer->frame_num,
+			      output->frame_num);
+			return buffer;
+		}
+
+		debug("[%s] dropping stale frame %u rendered ahead (now at %u)\n",
+		      output->name, buffer->frame_num, output->frame_num);
+		buffer->in_use = false;
+	}
+
+	return NULL;
+}
+
+/*
+ * Render more frames for this output whilst the frame we've just committed is
+ * still in flight, up to the output's render-ahead depth.
+ *
+ * By the time the commit completes and we come to repaint, the next frame is
+ * then usually already waiting for us, so repaint_one_output only needs to
+ * add it to the atomic request. This gives the renderer a whole refresh
+ * interval (or more) to produce each frame, rather than the small margin
+ * left between the completion event and the next vblank.
+ *
+ * Each frame rendered ahead is for one refresh interval after the previous
+ * one, continuing on from the frame we've just committed.
+ */
+static void render_ahead_one_output(struct output *output)
+{
+	/* We can't predict anything until our first frame has completed. */
+	if (timespec_to_nsec(&output->next_frame) == 0UL)
+		return;
 
 	/*
-	 * If this output hasn't been painted before, then we need to set
-	 * ALLOW_MODESET so we can get our first buffer on screen; if we
-	 * have already presented to this output, then we don't need to since
-	 * our configuration is similar enough.
+	 * Baked frames are always ready; the ones we haven't baked yet are
+	 * rendered as we go.
 	 */
-	if (timespec_to_nsec(&output->last_frame) == 0UL)
-		*needs_modeset = true;
+	if (output->device->baked.enabled)
+		return;
 
-	if (timespec_to_nsec(&output->next_frame) != 0UL) {
-		debug("[%s] predicting presentation at %" PRIu64 " (%" PRIu64 "ns / %" PRIu64 "ms away)\n",
-		      output->name,
-		      timespec_to_nsec(&output->next_frame),
-		      timespec_sub_to_nsec(&output->next_frame, &now),
-		      timespec_sub_to_msec(&output->next_frame, &now));
-	} else {
-		debug("[%s] scheduling first frame\n", output->name);
+	while (output->num_ready < output->render_ahead) {
+		struct buffer *buffer = find_render_ahead_buffer(output);
+		unsigned int ahead = output->num_ready + 1;
+
+		if (!buffer)
+			break;
+
+		buffer_set_frame(output, buffer,
+				 (output->frame_num + ahead) % NUM_ANIM_FRAMES);
+		buffer_fill(buffer, buffer->frame_num);
+		buffer->in_use = true;
+		buffer->ready = true;
+		output->buffers_ready[output->num_ready++] = buffer;
+
+		debug("[%s] rendered frame %u ahead into FB ID %" PRIu32 "\n",
+		      output->name, buffer->frame_num, buffer->fb_id);
 	}
 }
 
-static bool shall_exit = false;
-
+/*
+ * The loop run by each output's render thread in threaded mode.
+ *
+ * This does the same job as render_ahead_one_output, except that it never
+ * stops: whenever there is a buffer free and the output's queue of frames
+ * is not full, it renders the next frame and pokes the main thread to say
+ * that it can be committed. Otherwise it sleeps until the main thread tells
+ * us that KMS has released a buffer.
+ *
+ * The rendering itself happens without holding the output lock, so that
+ * the main thread can continue dealing with KMS events for this output in
+ * the meantime. The buffer is marked as ready before we drop the lock, so
+ * nobody else will touch it until it appears in buffers_ready.
+ */
+static void *output_render_thread(void *data)
+{
+	struct output *output = data;
+	struct device *device = output->device;
+
+	pthread_mutex_lock(&output->lock);
+
+	while (!output->render_thread_exit) {
+		struct buffer *buffer = NULL;
+		unsigned int ahead;
+		uint64_t one = 1;
+
+		if (output->num_ready < output->render_ahead)
+			buffer = find_render_ahead_buffer(output);
+		if (!buffer) {
+			output_buffers_trim(output);
+			pthread_cond_wait(&output->render_cond, &output->lock);
+			continue;
+		}
+
+		/*
+		 * output->frame_num is the frame we have last committed, so
+		 * we render the one after that, plus however many we've
+		 * already got queued. Before our first commit, we render the
+		 * first frame itself.
+		 */
+		ahead = output->num_ready;
+		if (output->buffer_pending || output->buffer_last)
+			ahead++;
+		buffer_set_frame(output, buffer,
+				 (output->frame_num + ahead) % NUM_ANIM_FRAMES);
+		buffer->in_use = true;
+		buffer->ready = true;
+		pthread_mutex_unlock(&output->lock);
+
+		buffer_fill(buffer, buffer->frame_num);
+
+		pthread_mutex_lock(&output->lock);
+		output->buffers_ready[output->num_ready++] = buffer;
+		debug("[%s] render thread queued frame %u in FB ID %" PRIu32 "\n",
+		      output->name, buffer->frame_num, buffer->fb_id);
+
+		if (write(device->thread_event_fd, &one, sizeof(one)) < 0)
+			error("[%s] couldn't wake main thread: %s\n",
+			      output->name, strerror(errno));
+	}
+
+	pthread_mutex_unlock(&output->lock);
+
+	/* Let the main thread use our context again for teardown. */
+	if (device->egl_dpy)
+		eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			       EGL_NO_CONTEXT);
+
+	return NULL;
+}
+
+static bool output_render_thread_start(struct output *output)
+{
+	sigset_t all, old;
+	int ret;
+
+	/*
+	 * Block all signals in the render thread, so SIGINT is always
+	 * delivered to the main thread and interrupts its poll.
+	 */
+	sigfillset(&all);
+	output->render_thread_exit = false;
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&output->render_thread, NULL,
+			     output_render_thread, output);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		error("[%s] couldn't create render thread: %s\n",
+		      output->name, strerror(ret));
+		return false;
+	}
+
+	output->render_thread_running = true;
+	return true;
+}
+
+static void output_render_thread_stop(struct output *output)
+{
+	if (!output->render_thread_running)
+		return;
+
+	pthread_mutex_lock(&output->lock);
+	output->render_thread_exit = true;
+	pthread_cond_signal(&output->render_cond);
+	pthread_mutex_unlock(&output->lock);
+
+	pthread_join(output->render_thread, NULL);
+	output->render_thread_running = false;
+}
+
+/*
+ * In threaded mode, we don't commit anything until every output has its
+ * first frame ready, so the initial modeset can still be done in a single
+ * request covering all outputs, like the single-threaded loop does. Outputs
+ * which were plugged in later get their first commit on their own, so we
+ * don't wait for them.
+ */
+static bool first_frames_ready(struct device *device)
+{
+	bool ret = true;
+
+	for (int i = 0; i < device->num_outputs && ret; i++) {
+		struct output *output = device->outputs[i];
+
+		if (output->hotplug.modeset_alone)
+			continue;
+
+		pthread_mutex_lock(&output->lock);
+		if (timespec_to_nsec(&output->last_frame) == 0UL &&
+		    !output->buffer_pending && output->num_ready == 0)
+			ret = false;
+		pthread_mutex_unlock(&output->lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Work out how many frames we can render ahead for an output, as requested
+ * by $KMS_RENDER_AHEAD.
+ *
+ * One buffer is always on screen and another is queued for KMS, which leaves
+ * the rest of the queue depth to render into ahead of time. With explicit
+ * fencing and a GPU renderer, we can additionally render into the buffer on
+ * screen, as described in find_render_ahead_buffer.
+ */
+static int output_render_ahead_depth(struct output *output)
+{
+	const char *env = getenv("KMS_RENDER_AHEAD");
+	int max = output->device->queue_depth - 2;
+	int depth;
+
+	/* Only the GBM surface knows which buffer we'll render into next. */
+	if (output->device->egl_surface)
+		return 0;
+
+	/* The render thread always needs at least one frame to work on. */
+	if (!env)
+		return output->device->threaded ? 1 : 0;
+
+	if (output->explicit_fencing && output->device->gbm_device)
+		max++;
+
+	depth = atoi(env);
+	if (depth < 0)
+		depth = 0;
+	if (depth == 0 && output->device->threaded)
+		depth = 1;
+	if (depth > max) {
+		fprintf(stderr, "[%s] can only render %d frames ahead\n",
+			output->name, max);
+		depth = max;
+	}
+
+	return depth;
+}
+
+/*
+ * Pick the modifier to allocate the output's buffers with.
+ *
+ * Left to itself, the allocator picks whichever of the plane's modifiers
+ * the driver prefers for rendering, which may well be one the display
+ * engine can't actually scan out at this mode - compression often has
+ * bandwidth or size limits IN_FORMATS doesn't tell us about - or a plain
+ * linear layout when something far cheaper would work. So instead we rank
+ * the candidates by how much bandwidth we expect them to need, allocate a
+ * full-screen buffer with each in turn, and keep the first one KMS accepts
+ * in a TEST_ONLY commit.
+ *
+ * If nothing passes, we go back to letting the allocator choose, as before:
+ * the first real commit will then tell us whether that works either. If
+ * something did pass but the real modeset still fails, we carry on down
+ * the list from there; see output_modifier_fallback.
+ *
+ * An output which has been plugged in whilst we're running is set up on
+ * the main thread, where every test commit holds up the other outputs'
+ * repaints. So it skips the tests, and takes the best-ranked modifier we
+ * can allocate with; its own modeset then does the testing, and
+ * output_modifier_fallback works down the list if that fails.
+ */
+static void output_modifier_select(struct output *output)
+{
+	struct device *device = output->device;
+	bool probe = !output->hotplug.modeset_alone;
+
+	if (!device->gbm_device || !device->fb_modifiers ||
+	    output->num_modifiers == 0)
+		return;
+
+	output_modifiers_rank(output);
+
+	output->mod_pick.selecting = true;
+	for (unsigned int i = 0; i < output->num_modifiers; i++) {
+		struct buffer *buffer;
+		bool ok;
+
+		output->mod_pick.chosen = true;
+		output->mod_pick.index = i;
+
+		buffer = buffer_create(device, output, output->mode.hdisplay,
+				       output->mode.vdisplay);
+		if (!buffer) {
+			debug("[%s] couldn't allocate with modifier 0x%016" PRIx64 "\n",
+			      output->name, output->modifiers[i]);
+			output->mod_pick.num_rejected++;
+			output->mod_pick.chosen = false;
+			continue;
+		}
+
+		/*
+		 * The buffer which passed is one the output's pool can
+		 * take straight back out of the buffer cache.
+		 */
+		ok = !probe || output_modifier_test(output, buffer);
+		output->mod_pick.modifier = buffer->modifier;
+		if (ok) {
+			buffer_release(buffer);
+			break;
+		}
+		buffer_destroy(buffer);
+
+		debug("[%s] KMS rejected modifier 0x%016" PRIx64 "\n",
+		      output->name, output->modifiers[i]);
+		output->mod_pick.num_rejected++;
+		output->mod_pick.chosen = false;
+	}
+	output->mod_pick.selecting = false;
+
+	if (!output->mod_pick.chosen) {
+		fprintf(stderr, "[%s] no modifier passed a test commit, letting the driver choose\n",
+			output->name);
+		output->mod_pick.num_rejected = 0;
+		return;
+	}
+
+	printf("[%s] using %s modifier 0x%016" PRIx64 " (%d better candidate(s) rejected)\n",
+	       output->name,
+	       modifier_class_name(modifier_classify(output->mod_pick.modifier)),
+	       output->mod_pick.modifier, output->mod_pick.num_rejected);
+}
+
+/*
+ * Sets up multi-plane composition for an output ($KMS_OVERLAY): our content
+ * is split into a background, rendered once in a full-screen buffer on the
+ * primary plane, and a smaller animated region in the middle of the screen,
+ * which gets its own buffers on an overlay plane. Every frame after the
+ * first, we then only render and scan out a fraction of the pixels we
+ * otherwise would.
+ *
+ * We have to allocate the buffers before we know if this works: KMS can
+ * only tell us whether or not a plane layout is possible by testing it with
+ * real framebuffers. If no plane works, we free everything again and the
+ * caller falls back to the full-screen buffers on the primary plane.
+ */
+static bool output_overlay_setup(struct output *output)
+{
+	struct device *device = output->device;
+	uint32_t width = output->mode.hdisplay / 4;
+	uint32_t height = output->mode.vdisplay / 4;
+
+	output->overlay.x = (output->mode.hdisplay - width) / 2;
+	output->overlay.y = (output->mode.vdisplay - height) / 2;
+
+	output->overlay.background = buffer_create(device, output,
+						   output->mode.hdisplay,
+						   output->mode.vdisplay);
+	if (!output->overlay.background)
+		return false;
+	buffer_fill(output->overlay.background, 0);
+
+	if (output_buffers_init(output, width, height) &&
+	    output_overlay_assign(output))
+		return true;
+
+	output_buffers_fini(output);
+	output->pool.peak = 0;
+	buffer_destroy(output->overlay.background);
+	output->overlay.background = NULL;
+	return false;
+}
+
+/*
+ * Get an output ready to render: set up its renderer, pick the layout of
+ * its buffers and allocate them, and work out how it should be scheduled.
+ * This is done for every output at startup, and for any we create when a
+ * monitor is plugged in later on.
+ *
+ * Returns 0 on success, or the code to exit with otherwise.
+ */
+static int output_setup(struct output *output)
+{
+	struct device *device = output->device;
+	bool ret;
+
+	if (device->gbm_device) {
+		if (device->vk_device) {
+			ret = output_vulkan_setup(output);
+		} else {
+			ret = output_egl_setup(output);
+		}
+
+		if (!ret) {
+			fprintf(stderr,
+				"Couldn't set up renderer for output %s\n",
+				output->name);
+			return 2;
+		}
+	}
+
+	output_modifier_select(output);
+
+	/*
+	 * Rendering through a GBM surface, the surface gives us the buffers
+	 * to show, so our pool stays empty; we just use its size.
+	 */
+	if (device->egl_surface) {
+		output->pool.width = output->mode.hdisplay;
+		output->pool.height = output->mode.vdisplay;
+		if (!output_egl_surface_setup(output, output->pool.width,
+					      output->pool.height))
+			return 3;
+	} else if (getenv("KMS_OVERLAY") && !output_overlay_setup(output)) {
+		printf("[%s] no usable overlay plane, using the primary plane only\n",
+		       output->name);
+	}
+
+	if (!output->overlay.plane_id && !device->egl_surface &&
+	    !output_buffers_init(output, output->mode.hdisplay,
+				 output->mode.vdisplay))
+		return 3;
+
+	output->render_ahead = output_render_ahead_depth(output);
+	if (output->render_ahead)
+		printf("[%s] rendering %d frame(s) ahead\n",
+		       output->name, output->render_ahead);
+
+	output_sched_init(output);
+	output_vrr_init(output);
+	output_async_init(output);
+	return 0;
+}
+
+/*
+ * Wait for the GPU to finish rendering into a buffer, if it has a render
+ * fence to tell us when it has. Dumb buffers are always done by the time
+ * buffer_fill returns.
+ */
+static void buffer_wait_render(struct buffer *buffer)
+{
+	struct pollfd pfd = {
+		.fd = buffer->render_fence_fd,
+		.events = POLLIN,
+	};
+
+	if (buffer->render_fence_fd < 0)
+		return;
+
+	while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Returns true if the GPU has finished rendering into a buffer, or if we
+ * have no render fence to tell us it hasn't.
+ */
+static bool buffer_render_done(struct buffer *buffer)
+{
+	struct pollfd pfd = {
+		.fd = buffer->render_fence_fd,
+		.events = POLLIN,
+	};
+
+	if (buffer->render_fence_fd < 0)
+		return true;
+
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/*
+ * Flip to a buffer which has finished rendering with an async flip.
+ *
+ * If the flip fails, we stop using async flips for this output, and repaint
+ * it through the atomic request instead.
+ */
+static bool output_async_flip_buffer(struct output *output,
+				     struct buffer *buffer)
+{
+	struct timespec commit_start, commit_end;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &commit_start);
+	ret = output_async_flip(output, buffer);
+	clock_gettime(CLOCK_MONOTONIC, &commit_end);
+	if (ret != 0) {
+		fprintf(stderr, "[%s] async flip failed: %s\n",
+			output->name, strerror(errno));
+		output->async.enabled = false;
+		return false;
+	}
+
+	debug("[%s] async flip to FB ID %" PRIu32 "\n",
+	      output->name, buffer->fb_id);
+	output->stats.pending.commit_nsec =
+		timespec_sub_to_nsec(&commit_end, &commit_start);
+	buffer->in_use = true;
+	output->buffer_pending = buffer;
+	output->needs_repaint = false;
+	return true;
+}
+
+/*
+ * Flip to a buffer we've just rendered with an async flip, rather than adding
+ * it to the atomic request, as soon as it has finished rendering.
+ *
+ * We don't wait for the GPU here: that would hold up our events and every
+ * other output's repaint for as long as this output's frame takes to render.
+ * If it isn't done yet, the main loop polls the render fence for us, and
+ * output_async_ready flips once it signals.
+ */
+static bool repaint_output_async(struct output *output, struct buffer *buffer)
+{
+	if (buffer_render_done(buffer))
+		return output_async_flip_buffer(output, buffer);
+
+	buffer->in_use = true;
+	output->async.waiting = buffer;
+	output->needs_repaint = false;
+	return true;
+}
+
+/*
+ * The frame an output was waiting on for an async flip has finished
+ * rendering, so flip to it. If we can't, we've fallen back to the atomic
+ * request, and render a new frame for that; a GBM surface's buffer has to
+ * go back to the surface first, as in output_commit_rollback.
+ */
+static void output_async_ready(struct output *output)
+{
+	struct buffer *buffer;
+
+	pthread_mutex_lock(&output->lock);
+	buffer = output->async.waiting;
+	output->async.waiting = NULL;
+	if (buffer && !output_async_flip_buffer(output, buffer)) {
+		buffer->in_use = false;
+		if (buffer->gbm.surface)
+			buffer_egl_surface_release(buffer);
+		output->needs_repaint = true;
+	}
+	pthread_mutex_unlock(&output->lock);
+}
+
+/*
+ * Returns true if the output has nothing new to show, once we've shown our
+ * current frame. Our own animation only stops when it's paused; external
+ * content is static whenever we haven't been given a new buffer since the
+ * last one we showed, paused or not.
+ */
+static bool output_content_static(struct output *output)
+{
+	if (!output->buffer_last || output->buffer_pending)
+		return false;
+
+	if (output->external.active)
+		return !output->external.next ||
+		       output->external.next == output->buffer_last;
+
+	return output->device->idle.paused;
+}
+
+/*
+ * Stop repainting an output whose content has stopped changing. Not
+ * committing anything lets KMS keep scanning out our last frame by itself
+ * (or the panel refresh itself from its own copy), and stops us waking up
+ * every vblank; if we've been asked to, we switch the display off too once
+ * we've been idle long enough, from the main loop.
+ */
+static void output_idle_enter(struct output *output, struct timespec *now)
+{
+	output->needs_repaint = false;
+	if (output->idle.active)
+		return;
+
+	output->idle.active = true;
+	output->idle.since_nsec = timespec_to_nsec(now);
+	printf("[%s] content static, no longer repainting\n", output->name);
+}
+
+/*
+ * Start repainting again after being idle, switching the display back on
+ * if we turned it off.
+ *
+ * Our frame timing carries on from the last frame we showed, so we move
+ * that forward by however many whole refresh intervals we sat idle for:
+ * that keeps our predictions in phase with the vblanks, and the animation
+ * carries on from where it stopped rather than skipping ahead by the time
+ * we were paused.
+ */
+static void output_idle_exit(struct output *output, struct timespec *now)
+{
+	int64_t last = timespec_to_nsec(&output->last_frame);
+	int64_t skip;
+
+	if (!output->idle.active)
+		return;
+
+	pthread_mutex_lock(&output->lock);
+	if (output->idle.dpms_off && output_set_dpms(output, true) == 0)
+		printf("[%s] display switched back on\n", output->name);
+	output->idle.dpms_off = false;
+	output->idle.active = false;
+
+	if (last != 0 && timespec_to_nsec(now) > last) {
+		skip = ((timespec_to_nsec(now) - last) /
+			output->refresh_interval_nsec) *
+		       output->refresh_interval_nsec;
+		timespec_add_nsec(&output->last_frame, &output->last_frame,
+				  skip);
+		if (timespec_to_nsec(&output->anim_start) != 0)
+			timespec_add_nsec(&output->anim_start,
+					  &output->anim_start, skip);
+	}
+
+	output->needs_repaint = true;
+	pthread_mutex_unlock(&output->lock);
+}
+
+/*
+ * Switch off the displays of outputs which have been idle for long enough,
+ * and return how many milliseconds until the next one is due, or -1 if
+ * none is.
+ */
+static int outputs_idle_dpms(struct device *device, struct timespec *now)
+{
+	int timeout = -1;
+
+	if (device->idle.dpms_nsec == 0)
+		return -1;
+
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+		int64_t left;
+
+		if (!output->idle.active || output->idle.dpms_off)
+			continue;
+
+		left = output->idle.since_nsec + device->idle.dpms_nsec -
+		       timespec_to_nsec(now);
+		if (left <= 0) {
+			/* Only try once; if it fails, we'll stay on. */
+			output->idle.dpms_off = true;
+			if (output_set_dpms(output, false) == 0)
+				printf("[%s] idle, display switched off\n",
+				       output->name);
+			continue;
+		}
+
+		left = (left + 999999) / 1000000;
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+/*
+ * Returns true if the output's new state was added to the request. In
+ * threaded mode, this might not be possible yet if the render thread hasn't
+ * finished a frame for us; in that case we try again once it has.
+ *
+ * With async flips, we flip the output straight away instead, and so also
+ * return false.
+ */
+static bool repaint_one_output(struct output *output, drmModeAtomicReqPtr req,
+			       bool *needs_modeset)
+{
+	struct timespec now;
+	struct buffer *buffer;
+	int ret;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &now);
+	assert(ret == 0);
+
+	pthread_mutex_lock(&output->lock);
+
+	if (output_content_static(output)) {
+		output_idle_enter(output, &now);
+		pthread_mutex_unlock(&output->lock);
+		return false;
+	}
+
+	if (output->device->threaded && output->num_ready == 0) {
+		pthread_mutex_unlock(&output->lock);
+		return false;
+	}
+
+	/*
+	 * Predict the time our next frame will be displayed, use this to
+	 * derive a target position for our animation (such that it remains
+	 * as linear as possible over time, even at the cost of dropping
+	 * frames), then find a free buffer and render the content for that
+	 * position - unless we have already rendered it ahead of time.
+	 */
+	advance_frame(output, &now);
+
+	/*
+	 * Showing imported buffers rather than our own: commit the newest
+	 * one, unless we've got nothing new to show.
+	 */
+	if (output->external.active) {
+		buffer = output->external.next;
+		output->external.next = NULL;
+		if (!buffer || buffer == output->buffer_last) {
+			pthread_mutex_unlock(&output->lock);
+			return false;
+		}
+	} else if (output->device->baked.enabled) {
+		buffer = output_baked_frame(output, output->frame_num);
+	} else {
+		buffer = take_ready_buffer(output);
+	}
+	if (!buffer) {
+		output->sched.render_start = now;
+		if (output->egl.gbm_surface) {
+			buffer = output_egl_surface_render(output,
+							   output->frame_num);
+			if (!buffer) {
+				pthread_mutex_unlock(&output->lock);
+				return false;
+			}
+		} else {
+			buffer = find_free_buffer(output);
+			assert(buffer);
+			buffer_set_frame(output, buffer, output->frame_num);
+			buffer_fill(buffer, output->frame_num);
+		}
+
+		/*
+		 * Without a render fence to tell us when the GPU finished,
+		 * the best we can do is time how long it took us to fill
+		 * the buffer. For dumb buffers, this is exact; when using
+		 * implicit fencing with a GPU, it underestimates.
+		 */
+		if (output->sched.enabled && !output->explicit_fencing) {
+			struct timespec done;
+			clock_gettime(CLOCK_MONOTONIC, &done);
+			output->sched.render_nsec =
+				sched_cost_update(output->sched.render_nsec,
+						  timespec_sub_to_nsec(&done, &now));
+		}
+	}
+
+	/*
+	 * Our first frame always goes in the atomic request, since it
+	 * needs a full modeset.
+	 */
+	if (output->async.enabled && !buffer->dmabuf.imported &&
+	    timespec_to_nsec(&output->last_frame) != 0UL &&
+	    repaint_output_async(output, buffer)) {
+		output_buffers_trim(output);
+		pthread_mutex_unlock(&output->lock);
+		return false;
+	}
+
+	/* Add the output's new state to the atomic modesetting request. */
+	output_add_atomic_req(output, req, buffer);
+	buffer->in_use = true;
+	output->buffer_pending = buffer;
+	output->needs_repaint = false;
+	output->sched.in_commit = true;
+
+	if (!output->device->threaded)
+		output_buffers_trim(output);
+
+	/*
+	 * If this output hasn't been painted before, then we need to set
+	 * ALLOW_MODESET so we can get our first buffer on screen; if we
+	 * have already presented to this output, then we don't need to since
+	 * our configuration is similar enough.
+	 */
+	if (timespec_to_nsec(&output->last_frame) == 0UL)
+		*needs_modeset = true;
+
+	if (timespec_to_nsec(&output->next_frame) != 0UL) {
+		debug("[%s] predicting presentation at %" PRIu64 " (%" PRIu64 "ns / %" PRIu64 "ms away)\n",
+		      output->name,
+		      timespec_to_nsec(&output->next_frame),
+		      timespec_sub_to_nsec(&output->next_frame, &now),
+		      timespec_sub_to_msec(&output->next_frame, &now));
+	} else {
+		debug("[%s] scheduling first frame\n", output->name);
+	}
+
+	pthread_mutex_unlock(&output->lock);
+	return true;
+}
+
+/*
+ * One atomic request we build in the main loop, and the outputs in it.
+ */
+struct commit_group {
+	drmModeAtomicReq *req;
+	bool needs_modeset;
+	int num_outputs;
+	int ret;
+	int64_t commit_nsec;
+};
+
+/*
+ * Outputs whose vblanks are this close together are repainted in the same
+ * atomic request; see assign_commit_groups.
+ */
+#define COMMIT_PHASE_TOLERANCE_NSEC (500 * 1000)
+
+/* How soon we try again after the kernel tells us a CRTC is busy. */
+#define COMMIT_RETRY_MSEC 1
+
+/*
+ * How often we check on captured frames the GPU is still copying, if
+ * nothing else wakes us up in the meantime.
+ */
+#define CAPTURE_POLL_MSEC 2
+
+/*
+ * Returns true if the two outputs' vblanks line up, going by when their
+ * last frames were shown and their refresh rates.
+ *
+ * Both outputs' first frames can go together, since there's nothing to
+ * wait for yet: that gives the driver the whole configuration to work out
+ * at once. With variable refresh or async flips, the next frame could be
+ * shown at any time, so there's no phase to line up with.
+ */
+static bool outputs_in_phase(struct output *a, struct output *b)
+{
+	int64_t interval = a->refresh_interval_nsec;
+	int64_t last_a = timespec_to_nsec(&a->last_frame);
+	int64_t last_b = timespec_to_nsec(&b->last_frame);
+	int64_t delta;
+
+	if (a->vrr.enabled || b->vrr.enabled ||
+	    a->async.enabled || b->async.enabled)
+		return false;
+	if (last_a == 0 || last_b == 0)
+		return last_a == last_b;
+	if (llabs((long long) (interval - b->refresh_interval_nsec)) >
+	    COMMIT_PHASE_TOLERANCE_NSEC)
+		return false;
+
+	delta = (last_a - last_b) % interval;
+	if (delta < 0)
+		delta += interval;
+	if (delta > interval / 2)
+		delta = interval - delta;
+
+	return delta <= COMMIT_PHASE_TOLERANCE_NSEC;
+}
+
+/*
+ * Pick which outputs share an atomic request when we repaint them.
+ *
+ * Putting every output in one request means each of them waits for the
+ * slowest to be ready, and a commit one CRTC can't take fails for all of
+ * them; outputs at different refresh rates, or just out of phase, then
+ * keep holding each other up. Committing each CRTC on its own avoids all
+ * that, but the kernel then does the work of a commit for each output,
+ * even when their vblanks coincide and they could all flip together.
+ *
+ * So, by default, each output joins the request of the first output whose
+ * vblanks line up with its own, and otherwise gets one of its own. With
+ * $KMS_COMMIT=merged, everyone shares one request; with $KMS_COMMIT=split,
+ * nobody does. We tell the user whenever that changes how many requests
+ * we make.
+ */
+static void assign_commit_groups(struct device *device)
+{
+	int num_groups = 0, num_active = 0;
+
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+
+		output->commit.group = i;
+		if (output->hotplug.unplugged)
+			continue;
+		num_active++;
+
+		for (int j = 0; j < i && device->commit.mode != COMMIT_SPLIT; j++) {
+			struct output *leader = device->outputs[j];
+
+			if (leader->commit.group != j ||
+			    leader->hotplug.unplugged)
+				continue;
+			if (device->commit.mode == COMMIT_MERGED ||
+			    outputs_in_phase(output, leader)) {
+				output->commit.group = j;
+				break;
+			}
+		}
+
+		if (output->commit.group == i)
+			num_groups++;
+	}
+
+	if (num_groups == device->commit.num_groups)
+		return;
+	device->commit.num_groups = num_groups;
+
+	if (num_active < 2)
+		return;
+	if (num_groups == 1)
+		printf("commit strategy: merged, all %d outputs in one request\n",
+		       num_active);
+	else if (num_groups == num_active)
+		printf("commit strategy: per-CRTC, one request per output\n");
+	else
+		printf("commit strategy: %d requests for %d outputs\n",
+		       num_groups, num_active);
+}
+
+/*
+ * The request this output was in was turned down, so nothing in it has
+ * taken effect: forget we tried, and repaint the output from scratch next
+ * time round. The other requests we made are unaffected.
+ */
+static void output_commit_rollback(struct output *output)
+{
+	struct buffer *buffer;
+
+	pthread_mutex_lock(&output->lock);
+
+	buffer = output->buffer_pending;
+	output->buffer_pending = NULL;
+	if (buffer && buffer != output->buffer_last) {
+		buffer->in_use = false;
+		if (buffer->dmabuf.imported && !output->external.next)
+			output->external.next = buffer;
+		if (buffer->gbm.surface)
+			buffer_egl_surface_release(buffer);
+	}
+
+	/* We no longer know what's on the planes, so send it all again. */
+	output->state.valid = false;
+	output->damage.committed = false;
+	output->overlay.background_committed = false;
+	if (output->commit_fence_fd >= 0)
+		close(output->commit_fence_fd);
+	output->commit_fence_fd = -1;
+
+	output->sched.in_commit = false;
+	output->needs_repaint = true;
+
+	pthread_mutex_unlock(&output->lock);
+}
+
+/*
+ * The request this output was in was turned down because one of its CRTCs
+ * was still busy with a previous commit: roll it back, and try again
+ * shortly.
+ */
+static void output_commit_requeue(struct output *output)
+{
+	output_commit_rollback(output);
+
+	pthread_mutex_lock(&output->lock);
+	output->commit.busy = true;
+	output->device->commit.num_busy++;
+	pthread_mutex_unlock(&output->lock);
+
+	debug("[%s] CRTC busy, retrying commit\n", output->name);
+}
+
+/*
+ * A modeset including this output was turned down for something other than
+ * a busy CRTC. Its buffers passed a TEST_ONLY commit of their own in
+ * output_modifier_select, but the real commit can still ask more of the
+ * display engine than the test did: every head lighting up at once, say,
+ * each with its own compressed scanout. So rather than giving up, we count
+ * the modifier as rejected after all, reallocate the pool with the next
+ * candidate, and have the caller try again.
+ *
+ * This only applies while nothing of ours is on screen yet, and where the
+ * pool is all we'd have to replace. A render thread has to stop whilst we
+ * swap its buffers out from under it, as creating buffers needs the context
+ * it holds. Returns false if there is no candidate left to try, in which
+ * case the failure is the caller's to deal with as before.
+ */
+static bool output_modifier_fallback(struct output *output)
+{
+	struct device *device = output->device;
+	bool threaded = output->render_thread_running;
+	bool ok = false;
+
+	if (!output->mod_pick.chosen || output->buffer_last ||
+	    output->egl.gbm_surface || output->overlay.plane_id ||
+	    output->external.active)
+		return false;
+
+	if (output->mod_pick.index + 1 >= output->num_modifiers)
+		return false;
+
+	output_render_thread_stop(output);
+	output_commit_rollback(output);
+
+	pthread_mutex_lock(&output->lock);
+	for (int i = 0; i < output->num_ready; i++)
+		output->buffers_ready[i]->ready = false;
+	output->num_ready = 0;
+	output_buffers_fini(output);
+	if (device->baked.enabled)
+		output_baked_destroy(output);
+
+	while (!ok && output->mod_pick.index + 1 < output->num_modifiers) {
+		output->mod_pick.index++;
+		output->mod_pick.num_rejected++;
+		ok = output_buffers_init(output, output->pool.width,
+					 output->pool.height);
+		if (!ok)
+			output_buffers_fini(output);
+	}
+	if (ok)
+		output->mod_pick.modifier = output->buffers[0]->modifier;
+	pthread_mutex_unlock(&output->lock);
+
+	if (!ok) {
+		fprintf(stderr, "[%s] couldn't allocate with any remaining modifier\n",
+			output->name);
+		return false;
+	}
+
+	/* See the comment before we start the first render threads. */
+	if (threaded) {
+		if (device->egl_dpy)
+			eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE,
+				       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (!output_render_thread_start(output))
+			return false;
+	}
+
+	printf("[%s] modeset rejected, falling back to %s modifier 0x%016" PRIx64 " (%d better candidate(s) rejected)\n",
+	       output->name,
+	       modifier_class_name(modifier_classify(output->mod_pick.modifier)),
+	       output->mod_pick.modifier, output->mod_pick.num_rejected);
+
+	return true;
+}
+
+/*
+ * Tries output_modifier_fallback on each output in a modeset request which
+ * failed, until one of them has a new modifier to try; the rest of the
+ * request is then tried again as it was.
+ */
+static bool commit_group_fallback(struct device *device,
+				  struct commit_group *group, int index)
+{
+	bool found = false;
+
+	if (!group->needs_modeset)
+		return false;
+
+	for (int i = 0; i < device->num_outputs && !found; i++) {
+		struct output *output = device->outputs[i];
+
+		if (output->sched.in_commit && output->commit.group == index)
+			found = output_modifier_fallback(output);
+	}
+	if (!found)
+		return false;
+
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+
+		if (output->sched.in_commit && output->commit.group == index)
+			output_commit_rollback(output);
+	}
+
+	return true;
+}
+
+static bool shall_exit = false;
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t pause_requested = 0;
+
+/* Reads the calling process's total CPU time, across all threads. */
+static int64_t process_cpu_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return timespec_to_nsec(&ts);
+}
+
+/*
+ * Once the last frame rendered into a buffer has completed, record it for
+ * the benchmark as if it had been displayed at that point.
+ *
+ * With a render fence, we wait for it and take the time it signalled, which
+ * also gives us the render time, from starting to build the frame to the
+ * GPU finishing it. Without one, the renderer has either finished
+ * by the time buffer_fill returns (dumb buffers, or Vulkan, which waits
+ * itself), or we have no way of knowing when it finishes (implicitly-fenced
+ * GL), so we just take the current time.
+ */
+static void benchmark_retire_buffer(struct output *output,
+				    struct buffer *buffer)
+{
+	struct frame_record *rec = &output->stats.pending;
+	struct timespec now;
+
+	if (buffer->render_start_nsec == 0)
+		return;
+
+	if (buffer->render_fence_fd >= 0) {
+		buffer_wait_render(buffer);
+		rec->render_done_nsec =
+			linux_sync_file_get_fence_time(buffer->render_fence_fd);
+		rec->render_nsec = rec->render_done_nsec -
+				   buffer->render_start_nsec;
+		rec->flip_nsec = rec->render_done_nsec;
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rec->flip_nsec = timespec_to_nsec(&now);
+	}
+
+	output_stats_push(output);
+	buffer->render_start_nsec = 0;
+}
+
+/*
+ * Offscreen benchmarking: render frames into our buffers as quickly as we
+ * can, without ever committing them to KMS, so we aren't limited by the
+ * refresh rate. We grow each output's pool to the full queue depth right
+ * away, then cycle through all of its buffers, only waiting
+ * for a buffer's previous frame to complete before rendering into it again,
+ * so the GPU can work on several frames at once like it would on screen.
+ *
+ * Each frame is rendered for all outputs before moving on to the next.
+ */
+static void benchmark_offscreen(struct device *device)
+{
+	int num_frames = device->benchmark.num_frames;
+
+	for (int o = 0; o < device->num_outputs; o++) {
+		while (output_buffers_grow(device->outputs[o]))
+			;
+	}
+
+	for (int i = 0; i < num_frames && !shall_exit; i++) {
+		for (int o = 0; o < device->num_outputs; o++) {
+			struct output *output = device->outputs[o];
+			struct buffer *buffer =
+				output->buffers[i % output->num_buffers];
+
+			benchmark_retire_buffer(output, buffer);
+			buffer_set_frame(output, buffer, i % NUM_ANIM_FRAMES);
+			buffer_fill(buffer, buffer->frame_num);
+			if (buffer->render_fence_fd < 0)
+				benchmark_retire_buffer(output, buffer);
+		}
+	}
+
+	/* Collect the frames still in flight, oldest first. */
+	for (int i = num_frames - device->queue_depth; i < num_frames; i++) {
+		if (i < 0)
+			continue;
+		for (int o = 0; o < device->num_outputs; o++) {
+			struct output *output = device->outputs[o];
+			benchmark_retire_buffer(output,
+						output->buffers[i % output->num_buffers]);
+		}
+	}
+}
+
+/*
+ * For on-screen benchmarks, we stop once every output has displayed the
+ * requested number of frames after its first one.
+ */
+static bool benchmark_finished(struct device *device)
+{
+	for (int i = 0; i < device->num_outputs; i++) {
+		if (device->outputs[i]->stats.num_frames <=
+		    (uint64_t) device->benchmark.num_frames)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * A monitor has been plugged in: create an output for it, and get it ready
+ * to render much as we do for every output at startup, though without
+ * testing each modifier first; see output_modifier_select. It gets its
+ * first frame, and modeset, in the main loop as usual, but in a request of
+ * its own; until then, nothing changes for the outputs we already have.
+ */
+static void output_hotplug_add(struct device *device,
+			       drmModeConnectorPtr connector)
+{
+	struct output *output;
+
+	if (device->num_outputs == device->res->count_connectors)
+		return;
+
+	output = output_create_hotplug(device, connector);
+	if (!output)
+		return;
+
+	output->hotplug.modeset_alone = true;
+	if (output_setup(output) != 0) {
+		fprintf(stderr, "[%s] couldn't set up hotplugged output\n",
+			output->name);
+		if (output->sched.timer_fd >= 0)
+			close(output->sched.timer_fd);
+		output_destroy(output);
+		return;
+	}
+
+	/* See the comment before we start the first render threads. */
+	if (device->threaded) {
+		if (device->egl_dpy)
+			eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE,
+				       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (!output_render_thread_start(output)) {
+			if (output->sched.timer_fd >= 0)
+				close(output->sched.timer_fd);
+			output_destroy(output);
+			return;
+		}
+	}
+
+	device->outputs[device->num_outputs++] = output;
+	printf("[%s] plugged in, now driving %d outputs\n", output->name,
+	       device->num_outputs);
+}
+
+/*
+ * A monitor has been unplugged: stop repainting its output. We can't free
+ * anything yet, as KMS may still be displaying our buffers; the main loop
+ * switches the CRTC off once nothing is in flight, and destroys the output
+ * once that has completed, in output_hotplug_remove.
+ */
+static void output_hotplug_unplug(struct output *output)
+{
+	output_render_thread_stop(output);
+	output->hotplug.unplugged = true;
+	output->needs_repaint = false;
+	printf("[%s] unplugged\n", output->name);
+}
+
+static void output_hotplug_remove(struct device *device, int index)
+{
+	struct output *output = device->outputs[index];
+
+	device->num_outputs--;
+	memmove(&device->outputs[index], &device->outputs[index + 1],
+		(device->num_outputs - index) * sizeof(*device->outputs));
+
+	if (output->sched.timer_fd >= 0)
+		close(output->sched.timer_fd);
+	printf("[%s] removed, now driving %d outputs\n", output->name,
+	       device->num_outputs);
+	output_destroy(output);
+}
+
+/*
+ * Make the commits hotplug needs for one output, outside of the request
+ * we share between all the others: the first frame and modeset of an
+ * output which has just been plugged in, or switching off one which has
+ * been unplugged, once KMS is done with whatever we last committed.
+ *
+ * Returns true if the modeset failed but is worth trying again straight
+ * away, with the next modifier; see output_modifier_fallback.
+ */
+static bool output_hotplug_commit(struct output *output)
+{
+	struct device *device = output->device;
+	drmModeAtomicReqPtr req;
+	bool needs_modeset = false;
+	bool retry = false;
+	int ret;
+
+	if (output->hotplug.unplugged && !output->hotplug.disabling &&
+	    !output->buffer_pending) {
+		if (output_disable(output) == 0)
+			output->hotplug.disabling = true;
+		else
+			fprintf(stderr, "[%s] couldn't switch off output: %s\n",
+				output->name, strerror(errno));
+		return false;
+	}
+
+	if (!output->hotplug.modeset_alone || !output->needs_repaint)
+		return false;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+	if (repaint_one_output(output, req, &needs_modeset)) {
+		output->sched.in_commit = false;
+		ret = atomic_commit(device, req, true);
+		if (ret == -EBUSY) {
+			/*
+			 * Another CRTC's commit is still in flight; try
+			 * again shortly, as the main loop does.
+			 */
+			output_commit_requeue(output);
+		} else if (ret != 0 && output_modifier_fallback(output)) {
+			retry = true;
+		} else if (ret != 0) {
+			/*
+			 * With no other modifier left to try, we give up.
+			 * Nothing of ours ever made it to the screen, so
+			 * there is nothing to switch off either.
+			 */
+			output->hotplug.modeset_alone = false;
+			fprintf(stderr, "[%s] couldn't light up output: %s\n",
+				output->name, strerror(-ret));
+			output_render_thread_stop(output);
+			output->hotplug.unplugged = true;
+			output->hotplug.removed = true;
+		} else if (ret == 0) {
+			output->hotplug.modeset_alone = false;
+			output->commit.busy = false;
+		}
+	}
+	drmModeAtomicFree(req);
+
+	return retry;
+}
+
+/*
+ * Act on whatever a hotplug event changed on a connector. If a monitor has
+ * just been swapped for another, we carry on driving the new one with the
+ * old one's mode, which the kernel will tell us if it can't do.
+ */
+static void connector_changed(struct device *device,
+			      drmModeConnectorPtr connector)
+{
+	struct output *output = NULL;
+
+	for (int i = 0; i < device->num_outputs; i++) {
+		if (device->outputs[i]->connector_id == connector->connector_id &&
+		    !device->outputs[i]->hotplug.unplugged)
+			output = device->outputs[i];
+	}
+
+	if (connector->connection != DRM_MODE_CONNECTED) {
+		if (output)
+			output_hotplug_unplug(output);
+		return;
+	}
+
+	if (!output)
+		output_hotplug_add(device, connector);
+}
+
+/*
+ * An output has just been removed, freeing up its CRTC. A monitor plugged
+ * in whilst that was still switching off - the same one plugged straight
+ * back in, most often - couldn't get a CRTC at the time, and the kernel
+ * won't tell us about it again, so look for any connected connector we're
+ * not driving and try it now.
+ */
+static void connectors_recheck(struct device *device)
+{
+	for (int c = 0; c < device->res->count_connectors; c++) {
+		uint32_t id = device->res->connectors[c];
+		drmModeConnectorPtr connector;
+		bool driven = false;
+
+		for (int i = 0; i < device->num_outputs; i++) {
+			if (device->outputs[i]->connector_id == id &&
+			    !device->outputs[i]->hotplug.unplugged)
+				driven = true;
+		}
+		if (driven)
+			continue;
+
+		connector = drmModeGetConnectorCurrent(device->kms_fd, id);
+		if (!connector)
+			continue;
+		if (connector->connection == DRM_MODE_CONNECTED)
+			connector_changed(device, connector);
+		drmModeFreeConnector(connector);
+	}
+}
+
+/*
+ * The kernel has told us something was plugged in or out: re-probe just
+ * the connector it told us about, or all of them if it didn't say, and
+ * act on anything which actually changed. The kernel has already probed
+ * the connector before sending the event, so we only need its current
+ * state, which is cheap to get.
+ */
+static void handle_hotplug(struct device *device)
+{
+	uint32_t connector_id;
+
+	while (probe_uevent_read(device, &connector_id)) {
+		for (int c = 0; c < device->res->count_connectors; c++) {
+			uint32_t id = device->res->connectors[c];
+			drmModeConnectorPtr connector;
+
+			if (connector_id != 0 && id != connector_id)
+				continue;
+
+			connector = drmModeGetConnectorCurrent(device->kms_fd,
+							       id);
+			if (!connector)
+				continue;
+			if (connector_probe(device, connector))
+				connector_changed(device, connector);
+			drmModeFreeConnector(connector);
+		}
+	}
+
+	probe_cache_save(device);
+}
+
 static void sighandler(int signo)
 {
 	if (signo == SIGINT)
 		shall_exit = true;
+	else if (signo == SIGUSR1)
+		stats_requested = 1;
+	else if (signo == SIGUSR2)
+		pause_requested = 1;
 	return;
 }
 
 int main(int argc, char *argv[])
 {
 	struct device *device;
+	struct pollfd *poll_fds = NULL;
+	struct commit_group *groups = NULL;
+	int num_groups_alloc = 0;
+	const char *env;
 	int ret = 0;
 
 	struct sigaction sa;
 	sa.sa_handler = sighandler;
 	sigemptyset(&sa.sa_mask);
 	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
 
 	/*
 	 * Find a suitable KMS device, and set up our VT.
@@ -289,36 +2237,221 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (getenv("KMS_THREADED")) {
+		device->thread_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (device->thread_event_fd < 0) {
+			fprintf(stderr, "couldn't create eventfd: %s\n",
+				strerror(errno));
+			ret = 1;
+			goto out;
+		}
+		device->threaded = true;
+		printf("rendering from one thread per output\n");
+	}
+
+	/*
+	 * Benchmark mode runs for a fixed number of frames, then reports how
+	 * we did. Offscreen benchmarks never touch KMS after setup, which
+	 * lets us measure how fast we can render without being limited by
+	 * the display.
+	 */
+	if (getenv("KMS_BENCHMARK")) {
+		device->benchmark.num_frames = atoi(getenv("KMS_BENCHMARK"));
+		if (device->benchmark.num_frames <= 0) {
+			fprintf(stderr, "KMS_BENCHMARK must be a number of frames\n");
+			ret = 1;
+			goto out;
+		}
+		device->benchmark.offscreen = !!getenv("KMS_BENCHMARK_OFFSCREEN");
+	}
+
+	/*
+	 * Without a GPU, we can share out filling our dumb buffers between a
+	 * pool of threads. A single core copes fine with smaller outputs,
+	 * where waking the other threads up would cost more than it saves,
+	 * so this isn't on by default.
+	 */
+	if (!device->gbm_device && getenv("KMS_SW_THREADS"))
+		device->sw_renderer =
+			sw_renderer_create(atoi(getenv("KMS_SW_THREADS")));
+
+	/*
+	 * Dumb buffers are often write-combined or uncached, so reading them
+	 * back whilst blending is very slow; rendering into a copy in normal
+	 * memory, then copying out only what changed, can win even though
+	 * it touches every pixel twice. Which is faster depends on the
+	 * driver, so compare the two with KMS_BENCHMARK.
+	 */
+	if (!device->gbm_device && getenv("KMS_SHADOW")) {
+		device->dumb_shadow = true;
+		printf("rendering dumb buffers through a shadow buffer\n");
+	}
+	if (device->gbm_device && !device->vk_device && getenv("KMS_GL_DRAW"))
+		device->gl_draw = true;
+
+	/*
+	 * A GBM surface decides which buffer we render into next, so we
+	 * can't render ahead into it from another thread, or without
+	 * showing the result; and KMS has to be able to scan out of the
+	 * buffers it allocates, so it has to be on the KMS device.
+	 */
+	if (getenv("KMS_EGL_SURFACE")) {
+		if (!device->gbm_device || device->vk_device ||
+		    device->render_fd >= 0 || device->threaded ||
+		    device->benchmark.offscreen) {
+			fprintf(stderr, "KMS_EGL_SURFACE needs the GL renderer on the KMS device, without KMS_THREADED or KMS_BENCHMARK_OFFSCREEN\n");
+		} else {
+			device->egl_surface = true;
+		}
+	}
+
+	if (getenv("KMS_IDLE_DPMS")) {
+		device->idle.dpms_nsec =
+			(int64_t) atoi(getenv("KMS_IDLE_DPMS")) * NSEC_PER_SEC;
+		if (device->idle.dpms_nsec <= 0) {
+			fprintf(stderr, "KMS_IDLE_DPMS must be a number of seconds\n");
+			ret = 1;
+			goto out;
+		}
+	}
+
+	if (getenv("KMS_COMMIT")) {
+		if (strcmp(getenv("KMS_COMMIT"), "merged") == 0) {
+			device->commit.mode = COMMIT_MERGED;
+		} else if (strcmp(getenv("KMS_COMMIT"), "split") == 0) {
+			device->commit.mode = COMMIT_SPLIT;
+		} else {
+			fprintf(stderr, "KMS_COMMIT must be 'merged' or 'split'\n");
+			ret = 1;
+			goto out;
+		}
+	}
+
+	/*
+	 * Capturing copies every $KMS_CAPTURE_EVERY'th frame we show, scaled
+	 * down by $KMS_CAPTURE_SCALE, into a file or onto a socket. Copies
+	 * are read back on the main thread, which has to own the GL contexts
+	 * and Vulkan images to do so, and offscreen benchmarks never show
+	 * anything to capture.
+	 */
+	if (getenv("KMS_CAPTURE")) {
+		if (device->threaded || device->benchmark.offscreen ||
+		    device->egl_surface) {
+			fprintf(stderr, "KMS_CAPTURE can't be used with KMS_THREADED, KMS_BENCHMARK_OFFSCREEN or KMS_EGL_SURFACE\n");
+			ret = 1;
+			goto out;
+		}
+
+		device->capture.every = 1;
+		if (getenv("KMS_CAPTURE_EVERY"))
+			device->capture.every = atoi(getenv("KMS_CAPTURE_EVERY"));
+		device->capture.scale = 1;
+		if (getenv("KMS_CAPTURE_SCALE"))
+			device->capture.scale = atoi(getenv("KMS_CAPTURE_SCALE"));
+		if (device->capture.every <= 0 || device->capture.scale <= 0) {
+			fprintf(stderr, "KMS_CAPTURE_EVERY and KMS_CAPTURE_SCALE must be positive numbers\n");
+			ret = 1;
+			goto out;
+		}
+
+		if (!capture_init(device, getenv("KMS_CAPTURE"))) {
+			ret = 1;
+			goto out;
+		}
+		printf("capturing every %d frame(s) at 1/%d size to %s\n",
+		       device->capture.every, device->capture.scale,
+		       getenv("KMS_CAPTURE"));
+	}
+
+	/*
+	 * Baking keeps a buffer for every frame of the animation, so by
+	 * default we let it use up to half of the memory which is available
+	 * right now. Render threads render into their pools regardless of
+	 * which frames we already have, so there's no point baking there.
+	 */
+	env = getenv("KMS_BAKED");
+	if (env) {
+		if (device->threaded || device->benchmark.offscreen) {
+			fprintf(stderr, "KMS_BAKED can't be used with KMS_THREADED or KMS_BENCHMARK_OFFSCREEN\n");
+		} else {
+			device->baked.enabled = true;
+			if (*env) {
+				char *endptr = NULL;
+				long mib = strtol(env, &endptr, 10);
+
+				if (mib < 1 || *endptr != '\0')
+					fprintf(stderr, "invalid $KMS_BAKED size '%s', using the default\n",
+						env);
+				else
+					device->baked.budget = (uint64_t) mib << 20;
+			}
+			if (device->baked.budget == 0)
+				device->baked.budget = mem_available() / 2;
+			printf("baking animation frames into up to %" PRIu64 " MiB of buffers\n",
+			       device->baked.budget >> 20);
+		}
+	}
+
+	/*
+	 * The most buffers we let any output's pool grow to. Allowing fewer
+	 * than BUFFER_QUEUE_DEPTH saves memory on large outputs, at the cost
+	 * of how far we can render ahead.
+	 */
+	device->queue_depth = BUFFER_QUEUE_DEPTH;
+	if (getenv("KMS_QUEUE_DEPTH")) {
+		device->queue_depth = atoi(getenv("KMS_QUEUE_DEPTH"));
+		if (device->queue_depth < POOL_MIN_BUFFERS)
+			device->queue_depth = POOL_MIN_BUFFERS;
+		if (device->queue_depth > BUFFER_QUEUE_DEPTH) {
+			fprintf(stderr, "can only allocate up to %d buffers per output\n",
+				BUFFER_QUEUE_DEPTH);
+			device->queue_depth = BUFFER_QUEUE_DEPTH;
+		}
+	}
+
 	/*
 	 * Allocate framebuffers to display on all our outputs.
 	 *
 	 * It is possible to use an EGLSurface here, but we explicitly allocate
-	 * buffers ourselves so we can manage the queue depth.
+	 * buffers ourselves so we can manage the queue depth: each output
+	 * starts with just enough for double buffering, and grows its pool
+	 * when it needs more.
 	 */
 	for (int i = 0; i < device->num_outputs; i++) {
-		struct output *output = device->outputs[i];
-		int j;
+		ret = output_setup(device->outputs[i]);
+		if (ret != 0)
+			goto out;
+	}
 
-		if (device->gbm_device) {
-			if (device->vk_device) {
-				ret = output_vulkan_setup(output);
-			} else {
-				ret = output_egl_setup(output);
-			}
+	if (device->benchmark.num_frames)
+		device->benchmark.cpu_start_nsec = process_cpu_nsec();
 
-			if (!ret) {
-				fprintf(stderr,
-					"Couldn't set up renderer for output %s\n",
-					output->name);
-				ret = 2;
-				goto out;
-			}
-		}
+	if (device->benchmark.offscreen) {
+		benchmark_offscreen(device);
+		device->benchmark.cpu_end_nsec = process_cpu_nsec();
+		if (!shall_exit)
+			benchmark_report(device, stdout);
+		ret = 0;
+		goto out;
+	}
+
+	poll_fds = calloc(3 + 2 * device->num_outputs, sizeof(*poll_fds));
+	assert(poll_fds);
 
-		for (j = 0; j < BUFFER_QUEUE_DEPTH; j++) {
-			output->buffers[j] = buffer_create(device, output);
-			if (!output->buffers[j]) {
-				ret = 3;
+	/*
+	 * In threaded mode, hand each output over to its own render thread.
+	 * Our setup code above has left the last output's EGL context
+	 * current on this thread, but a context can only be current on one
+	 * thread at a time, so we need to let go of it first.
+	 */
+	if (device->threaded) {
+		if (device->egl_dpy)
+			eglMakeCurrent(device->egl_dpy, EGL_NO_SURFACE,
+				       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+		for (int i = 0; i < device->num_outputs; i++) {
+			if (!output_render_thread_start(device->outputs[i])) {
+				ret = 4;
 				goto out;
 			}
 		}
@@ -328,51 +2461,136 @@ int main(int argc, char *argv[])
 
 	/* Our main rendering loop, which we spin forever. */
 	while (!shall_exit) {
-		drmModeAtomicReq *req;
-		bool needs_modeset = false;
-		int output_count = 0;
+		bool commit_failed = false;
+		bool retry_now = false;
+		bool removed;
+		int poll_timeout = -1;
 		int ret = 0;
 		drmEventContext evctx = {
 			.version = 3,
 			.page_flip_handler2 = atomic_event_handler,
 		};
-		struct pollfd poll_fd = {
-			.fd = device->kms_fd,
-			.events = POLLIN,
-		};
+		struct timespec commit_start, commit_end;
 
 		/*
-		 * Allocate an atomic-modesetting request structure for any
-		 * work we will do in this loop iteration.
-		 *
 		 * Atomic modesetting allows us to group together KMS requests
-		 * for multiple outputs, so this request may contain more than
-		 * one output's repaint data.
+		 * for multiple outputs, so one request may contain more than
+		 * one output's repaint data. Work out which outputs should
+		 * share a request this time round; each group's request is
+		 * only allocated once we have something to put in it.
+		 *
+		 * Requests are kept from one time round to the next, and
+		 * emptied by rewinding them to the start, so that steady
+		 * state repaints don't allocate anything.
 		 */
-		req = drmModeAtomicAlloc();
-		assert(req);
+		if (device->num_outputs > num_groups_alloc) {
+			groups = realloc(groups,
+					 device->num_outputs * sizeof(*groups));
+			assert(groups);
+			memset(&groups[num_groups_alloc], 0,
+			       (device->num_outputs - num_groups_alloc) *
+			       sizeof(*groups));
+			num_groups_alloc = device->num_outputs;
+		}
+		for (int i = 0; i < num_groups_alloc; i++) {
+			if (groups[i].req)
+				drmModeAtomicSetCursor(groups[i].req, 0);
+			groups[i] = (struct commit_group) {
+				.req = groups[i].req,
+			};
+		}
+		assign_commit_groups(device);
 
 		/*
 		 * See which of our outputs needs repainting, and repaint them
 		 * if any.
 		 *
 		 * On our first run through the loop, all our outputs will
-		 * need repainting, so the request will contain the state for
-		 * all the outputs, submitted together.
-		 *
-		 * This is good since it gives the driver a complete overview
-		 * of any hardware changes it would need to perform to reach
-		 * the target state.
+		 * need repainting, and they all go in one request, submitted
+		 * together. This is good since it gives the driver a complete
+		 * overview of any hardware changes it would need to perform
+		 * to reach the target state.
+		 */
+		bool can_repaint = !device->threaded || first_frames_ready(device);
+
+		/*
+		 * Idle outputs aren't repainted, so nothing else notices when
+		 * an external stream hands one a new buffer; wake them up here.
 		 */
 		for (int i = 0; i < device->num_outputs; i++) {
 			struct output *output = device->outputs[i];
-			if (output->needs_repaint) {
+			struct timespec now;
+			bool wake;
+
+			if (!output->idle.active || !output->external.active)
+				continue;
+			pthread_mutex_lock(&output->lock);
+			wake = !output_content_static(output);
+			pthread_mutex_unlock(&output->lock);
+			if (wake) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				output_idle_exit(output, &now);
+			}
+		}
+
+		/*
+		 * With Vulkan, we collect the submissions for all the outputs
+		 * we repaint here and hand them to the GPU with a single
+		 * vkQueueSubmit once we're done, rather than one each. Their
+		 * render fences only exist after that, so are added to the
+		 * request afterwards. Render threads submit on their own.
+		 */
+		bool batch = device->vk_device && !device->threaded;
+		if (batch)
+			vk_batch_begin(device->vk_device);
+
+		for (int i = 0; i < device->num_outputs && can_repaint; i++) {
+			struct output *output = device->outputs[i];
+			struct commit_group *group =
+				&groups[output->commit.group];
+
+			if (output->needs_repaint &&
+			    !output->hotplug.modeset_alone &&
+			    !output->hotplug.unplugged) {
+				output->commit.busy = false;
+				if (!group->req) {
+					group->req = drmModeAtomicAlloc();
+					assert(group->req);
+				}
+
 				/*
-				 * Add this output's new state to the atomic
-				 * request.
+				 * Add this output's new state to its group's
+				 * atomic request.
 				 */
-				repaint_one_output(output, req, &needs_modeset);
-				output_count++;
+				if (repaint_one_output(output, group->req,
+						       &group->needs_modeset))
+					group->num_outputs++;
+			}
+		}
+
+		/*
+		 * If the batch can't be submitted, none of its outputs' new
+		 * buffers will ever be rendered, and they have no render
+		 * fence for KMS to wait on either; committing them would put
+		 * garbage on screen, so this is as fatal as a failed commit.
+		 */
+		if (batch) {
+			if (!vk_batch_flush(device->vk_device)) {
+				fprintf(stderr, "failed to submit batched rendering\n");
+				break;
+			}
+
+			for (int i = 0; i < device->num_outputs; i++) {
+				struct output *output = device->outputs[i];
+				struct buffer *buffer = output->buffer_pending;
+
+				if (!output->sched.in_commit || !buffer ||
+				    !buffer->fence_deferred)
+					continue;
+				output_add_in_fence(output,
+						    groups[output->commit.group].req,
+						    buffer);
+				buffer->fence_deferred = false;
 			}
 		}
 
@@ -393,13 +2611,93 @@ int main(int argc, char *argv[])
 		 * It does mean that we need to allocate paint the buffers for
 		 * each output individually, rather than having a single buffer
 		 * with the content for every output.
+		 *
+		 * If a CRTC is still busy with its last commit, the kernel
+		 * turns the request down with EBUSY: we just try the outputs
+		 * in that request again shortly. If a modeset is turned down
+		 * for any other reason, we move one of its outputs on to its
+		 * next modifier and try again the same way; only once none
+		 * of them has anywhere left to go is it fatal.
 		 */
-		if (output_count)
-			ret = atomic_commit(device, req, needs_modeset);
-		drmModeAtomicFree(req);
-		if (ret != 0) {
-			fprintf(stderr, "atomic commit failed: %d\n", ret);
+		for (int i = 0; i < device->num_outputs; i++) {
+			struct commit_group *group = &groups[i];
+
+			if (group->num_outputs) {
+				clock_gettime(CLOCK_MONOTONIC, &commit_start);
+				group->ret = atomic_commit(device, group->req,
+							   group->needs_modeset);
+				clock_gettime(CLOCK_MONOTONIC, &commit_end);
+				group->commit_nsec =
+					timespec_sub_to_nsec(&commit_end,
+							     &commit_start);
+				if (group->ret == 0 || group->ret == -EBUSY)
+					continue;
+				if (commit_group_fallback(device, group, i)) {
+					retry_now = true;
+				} else {
+					fprintf(stderr, "atomic commit failed: %d\n",
+						group->ret);
+					commit_failed = true;
+				}
+			}
+		}
+		if (commit_failed)
 			break;
+
+		for (int i = 0; i < device->num_outputs; i++) {
+			struct output *output = device->outputs[i];
+
+			if (output->sched.in_commit &&
+			    groups[output->commit.group].ret == -EBUSY)
+				output_commit_requeue(output);
+			if (output->commit.busy)
+				poll_timeout = COMMIT_RETRY_MSEC;
+		}
+
+		/*
+		 * Outputs which have been plugged in or out since startup
+		 * get their modesets in requests of their own, so only their
+		 * own CRTC is touched; see output_hotplug_commit. Any which
+		 * have finished switching off can go now, and their CRTCs
+		 * to any monitor which was waiting for one. (Those which
+		 * never lit up didn't have a CRTC to give.)
+		 */
+		for (int i = 0; i < device->num_outputs; i++) {
+			if (output_hotplug_commit(device->outputs[i]))
+				retry_now = true;
+			if (device->outputs[i]->commit.busy)
+				poll_timeout = COMMIT_RETRY_MSEC;
+		}
+		removed = false;
+		for (int i = device->num_outputs - 1; i >= 0; i--) {
+			struct output *output = device->outputs[i];
+
+			if (output->hotplug.removed) {
+				removed |= output->hotplug.disabling;
+				output_hotplug_remove(device, i);
+			}
+		}
+		if (removed)
+			connectors_recheck(device);
+
+		/*
+		 * Feed the time the commit took into the deadline scheduler
+		 * for every output which was part of it. The initial modeset
+		 * is much slower than usual, so we don't count it.
+		 */
+		for (int i = 0; i < device->num_outputs; i++) {
+			struct output *output = device->outputs[i];
+			struct commit_group *group =
+				&groups[output->commit.group];
+
+			if (!output->sched.in_commit)
+				continue;
+			output->sched.in_commit = false;
+			output->stats.pending.commit_nsec = group->commit_nsec;
+			if (output->sched.enabled && !group->needs_modeset)
+				output->sched.commit_nsec =
+					sched_cost_update(output->sched.commit_nsec,
+							  group->commit_nsec);
 		}
 
 		/*
@@ -410,12 +2708,27 @@ int main(int argc, char *argv[])
 		 */
 		for (int i = 0; i < device->num_outputs; i++) {
 			struct output *output = device->outputs[i];
-			if (output->explicit_fencing && output->buffer_last) {
+
+			pthread_mutex_lock(&output->lock);
+			if (output->explicit_fencing && output->buffer_last &&
+			    output->commit_fence_fd >= 0) {
 				assert(linux_sync_file_is_valid(output->commit_fence_fd));
 				fd_replace(&output->buffer_last->kms_fence_fd,
 					   output->commit_fence_fd);
 				output->commit_fence_fd = -1;
+				pthread_cond_signal(&output->render_cond);
 			}
+			pthread_mutex_unlock(&output->lock);
+		}
+
+		/*
+		 * Whilst KMS works on the commit we've just made, get ahead
+		 * on rendering the next frames, if we've been asked to. In
+		 * threaded mode, the render threads are already doing this.
+		 */
+		for (int i = 0; i < device->num_outputs && !device->threaded; i++) {
+			if (!device->outputs[i]->hotplug.unplugged)
+				render_ahead_one_output(device->outputs[i]);
 		}
 
 		/*
@@ -425,20 +2738,169 @@ int main(int argc, char *argv[])
 		 * the DRM FD be readable and waking us from poll), which we
 		 * then dispatch through drmHandleEvent into our callback.
 		 */
-		ret = poll(&poll_fd, 1, -1);
+		/*
+		 * Alongside the KMS FD, we also wait on the eventfd our render
+		 * threads use to wake us up, the kernel's hotplug events, the
+		 * timers the deadline scheduler uses, and the render fences of
+		 * frames waiting for an async flip. Unused entries are set to
+		 * -1, which poll ignores.
+		 */
+		poll_fds = realloc(poll_fds, (3 + 2 * device->num_outputs) *
+					     sizeof(*poll_fds));
+		assert(poll_fds);
+		poll_fds[0] = (struct pollfd) {
+			.fd = device->kms_fd,
+			.events = POLLIN,
+		};
+		poll_fds[1] = (struct pollfd) {
+			.fd = device->threaded ? device->thread_event_fd : -1,
+			.events = POLLIN,
+		};
+		poll_fds[2] = (struct pollfd) {
+			.fd = device->uevent_fd,
+			.events = POLLIN,
+		};
+		for (int i = 0; i < device->num_outputs; i++) {
+			struct buffer *waiting = device->outputs[i]->async.waiting;
+
+			poll_fds[3 + i] = (struct pollfd) {
+				.fd = device->outputs[i]->sched.timer_fd,
+				.events = POLLIN,
+			};
+			poll_fds[3 + device->num_outputs + i] = (struct pollfd) {
+				.fd = waiting ? waiting->render_fence_fd : -1,
+				.events = POLLIN,
+			};
+		}
+
+		/*
+		 * Outputs with static content don't wake us up with events,
+		 * so we need a timeout to switch their displays off.
+		 */
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int dpms_timeout = outputs_idle_dpms(device, &now);
+		if (dpms_timeout >= 0 &&
+		    (poll_timeout < 0 || dpms_timeout < poll_timeout))
+			poll_timeout = dpms_timeout;
+
+		/*
+		 * Hand any captured frames the GPU has finished copying over
+		 * to the writer thread; we need to look again shortly for
+		 * the ones it hasn't.
+		 */
+		if (capture_poll(device) &&
+		    (poll_timeout < 0 || CAPTURE_POLL_MSEC < poll_timeout))
+			poll_timeout = CAPTURE_POLL_MSEC;
+
+		/*
+		 * An output which has just moved on to its next modifier
+		 * after a failed modeset doesn't have to wait for anything
+		 * before trying again.
+		 */
+		if (retry_now)
+			poll_timeout = 0;
+
+		ret = poll(poll_fds, 3 + 2 * device->num_outputs, poll_timeout);
+
+		/*
+		 * Signals interrupt our poll; SIGUSR1 asks us to print our
+		 * frame timing statistics, then carry on as normal. SIGUSR2
+		 * pauses or resumes the animation.
+		 */
+		if (stats_requested) {
+			stats_requested = 0;
+			stats_dump(device, stdout);
+		}
+		if (pause_requested) {
+			pause_requested = 0;
+			device->idle.paused = !device->idle.paused;
+			printf("animation %s\n",
+			       device->idle.paused ? "paused" : "resumed");
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			for (int i = 0; i < device->num_outputs &&
+					!device->idle.paused; i++)
+				output_idle_exit(device->outputs[i], &now);
+		}
+		if (ret == -1 && errno == EINTR)
+			continue;
 		if (ret == -1) {
-			fprintf(stderr, "error polling KMS FD: %d\n", ret);
+			fprintf(stderr, "error polling KMS FD: %s\n",
+				strerror(errno));
 			break;
 		}
 
+		/* Frames waiting for an async flip can go once rendered. */
+		for (int i = 0; i < device->num_outputs; i++) {
+			if (poll_fds[3 + device->num_outputs + i].revents &
+			    (POLLIN | POLLERR))
+				output_async_ready(device->outputs[i]);
+		}
+
+		/* Any expired repaint timers mean it's time to repaint. */
+		for (int i = 0; i < device->num_outputs; i++) {
+			struct output *output = device->outputs[i];
+			uint64_t expirations;
+
+			if (!(poll_fds[3 + i].revents & POLLIN))
+				continue;
+			if (read(output->sched.timer_fd, &expirations,
+				 sizeof(expirations)) > 0)
+				output->needs_repaint = true;
+		}
+
+		/*
+		 * In threaded mode, we also wake up whenever a render thread
+		 * has queued a new frame. We just need to clear the eventfd
+		 * here: the next time around the loop, we will pick up any
+		 * outputs which can now be repainted.
+		 */
+		if (poll_fds[1].revents & POLLIN) {
+			uint64_t count;
+			if (read(device->thread_event_fd, &count,
+				 sizeof(count)) < 0 && errno != EAGAIN) {
+				fprintf(stderr, "error reading eventfd: %s\n",
+					strerror(errno));
+				break;
+			}
+		}
+
+		if (poll_fds[2].revents & POLLIN)
+			handle_hotplug(device);
+
+		if (!(poll_fds[0].revents & POLLIN))
+			continue;
+
 		ret = drmHandleEvent(device->kms_fd, &evctx);
 		if (ret == -1) {
 			fprintf(stderr, "error reading KMS events: %d\n", ret);
 			break;
 		}
+
+		if (device->benchmark.num_frames && benchmark_finished(device))
+			break;
+	}
+
+	if (device->benchmark.num_frames && benchmark_finished(device)) {
+		device->benchmark.cpu_end_nsec = process_cpu_nsec();
+		benchmark_report(device, stdout);
+		ret = 0;
 	}
 
 out:
+	for (int i = 0; i < device->num_outputs; i++) {
+		output_render_thread_stop(device->outputs[i]);
+		if (device->outputs[i]->sched.timer_fd >= 0)
+			close(device->outputs[i]->sched.timer_fd);
+	}
+	free(poll_fds);
+	for (int i = 0; i < num_groups_alloc; i++) {
+		if (groups[i].req)
+			drmModeAtomicFree(groups[i].req);
+	}
+	free(groups);
+	if (device->threaded)
+		close(device->thread_event_fd);
 	device_destroy(device);
 	fprintf(stdout, "good-bye\n");
 	return ret;
@@ -0,0 +1,521 @@
+/*
+ * Probe cache and hotplug events.
+ *
+ * Working out what we can do with each output takes a surprising number of
+ * round trips to the kernel: every property on every plane, CRTC and
+ * connector we look at has to be fetched one at a time to find out its name,
+ * the IN_FORMATS and EDID blobs have to be fetched and parsed, and worst of
+ * all, asking for a connector's state normally makes the kernel re-probe it,
+ * which can mean reading the EDID over DDC again. On a machine with a few
+ * monitors, that adds up to hundreds of milliseconds before we can show
+ * anything.
+ *
+ * None of this changes whilst the system is up, unless a monitor is plugged
+ * in or out; property IDs, and the blobs the driver creates for IN_FORMATS,
+ * stay the same for as long as the driver is loaded. So we keep what we
+ * learn in a cache, keyed by property, plane and connector ID (and for
+ * EDID, a hash of its contents), and save it to a file between runs; the
+ * file is only trusted for the same boot of the same KMS device.
+ *
+ * To notice monitors coming and going, we also listen for the kernel's
+ * uevents, and re-probe just the connector each one is about.
+ */
+
+/*
+ * Copyright © 2018-2019 Collabora, Ltd.
+ * Copyright © 2018-2019 DAQRI, LLC and its affiliates
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+
+#include "kms-quads.h"
+
+#define PROBE_CACHE_MAGIC 0x6b716370 /* 'pcqk' */
+#define PROBE_CACHE_VERSION 2
+
+/* The kernel's boot ID is a UUID: 36 characters. */
+#define BOOT_ID_LEN 40
+
+struct probe_header {
+	uint32_t magic;
+	uint32_t version;
+	char boot_id[BOOT_ID_LEN];
+	uint64_t rdev;
+	uint32_t num_props;
+	uint32_t num_formats;
+	uint32_t num_connectors;
+};
+
+struct probe_cache {
+	struct probe_header key;
+	char path[PATH_MAX];
+	bool dirty;
+
+	struct probe_property *props;
+	struct probe_formats *formats;
+	struct probe_connector *connectors;
+
+	/* How many kernel round trips we saved, and didn't. */
+	int hits;
+	int misses;
+};
+
+static void boot_id_read(char *buf)
+{
+	FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+	memset(buf, 0, BOOT_ID_LEN);
+	if (!f)
+		return;
+	if (fgets(buf, BOOT_ID_LEN, f))
+		buf[strcspn(buf, "\n")] = '\0';
+	fclose(f);
+}
+
+/*
+ * The cache lives in $KMS_PROBE_CACHE if set (an empty value turns the
+ * file off), and otherwise in $XDG_RUNTIME_DIR, which is cleared at boot
+ * anyway, with one file per device so the processes $KMS_ALL_DEVICES
+ * starts don't keep throwing each other's away. Without either, we only
+ * keep the cache in memory, which still saves repeated lookups of the
+ * properties planes share, and lets us tell what has changed when a
+ * hotplug event arrives.
+ */
+static void probe_cache_path(struct probe_cache *cache)
+{
+	const char *env = getenv("KMS_PROBE_CACHE");
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (env)
+		snprintf(cache->path, sizeof(cache->path), "%s", env);
+	else if (dir)
+		snprintf(cache->path, sizeof(cache->path),
+			 "%s/kms-quads-probe-%u.cache", dir,
+			 minor(cache->key.rdev));
+}
+
+static bool probe_cache_load(struct probe_cache *cache)
+{
+	struct probe_header header;
+	bool ok = false;
+	FILE *f;
+
+	f = fopen(cache->path, "rb");
+	if (!f)
+		return false;
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    header.magic != cache->key.magic ||
+	    header.version != cache->key.version ||
+	    header.rdev != cache->key.rdev ||
+	    strncmp(header.boot_id, cache->key.boot_id, BOOT_ID_LEN) != 0) {
+		debug("probe cache %s is stale, ignoring it\n", cache->path);
+		goto out;
+	}
+
+	cache->props = calloc(header.num_props + 1, sizeof(*cache->props));
+	cache->formats = calloc(header.num_formats + 1, sizeof(*cache->formats));
+	cache->connectors = calloc(header.num_connectors + 1,
+				   sizeof(*cache->connectors));
+	assert(cache->props && cache->formats && cache->connectors);
+
+	if (fread(cache->props, sizeof(*cache->props), header.num_props, f) !=
+		header.num_props ||
+	    fread(cache->formats, sizeof(*cache->formats), header.num_formats, f) !=
+		header.num_formats ||
+	    fread(cache->connectors, sizeof(*cache->connectors),
+		  header.num_connectors, f) != header.num_connectors) {
+		fprintf(stderr, "probe cache %s is truncated, ignoring it\n",
+			cache->path);
+		free(cache->props);
+		free(cache->formats);
+		free(cache->connectors);
+		cache->props = NULL;
+		cache->formats = NULL;
+		cache->connectors = NULL;
+		goto out;
+	}
+
+	cache->key.num_props = header.num_props;
+	cache->key.num_formats = header.num_formats;
+	cache->key.num_connectors = header.num_connectors;
+	ok = true;
+
+out:
+	fclose(f);
+	return ok;
+}
+
+void probe_cache_create(struct device *device)
+{
+	struct probe_cache *cache = calloc(1, sizeof(*cache));
+	struct stat st;
+
+	assert(cache);
+	cache->key.magic = PROBE_CACHE_MAGIC;
+	cache->key.version = PROBE_CACHE_VERSION;
+	boot_id_read(cache->key.boot_id);
+	if (fstat(device->kms_fd, &st) == 0)
+		cache->key.rdev = st.st_rdev;
+	device->probe = cache;
+
+	probe_cache_path(cache);
+	if (cache->path[0] && cache->key.boot_id[0] &&
+	    probe_cache_load(cache))
+		debug("loaded %" PRIu32 " properties, %" PRIu32 " planes and %" PRIu32 " connectors from probe cache %s\n",
+		      cache->key.num_props, cache->key.num_formats,
+		      cache->key.num_connectors, cache->path);
+}
+
+/*
+ * Write the cache out if we have learnt anything new. We write to a
+ * temporary file and rename it over the old one, so a run which is killed
+ * halfway through can't leave a broken cache for the next.
+ */
+void probe_cache_save(struct device *device)
+{
+	struct probe_cache *cache = device->probe;
+	char tmp[PATH_MAX + 8];
+	bool ok;
+	FILE *f;
+
+	if (!cache->dirty || !cache->path[0] || !cache->key.boot_id[0])
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", cache->path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		debug("couldn't write probe cache %s: %s\n", tmp,
+		      strerror(errno));
+		return;
+	}
+
+	ok = fwrite(&cache->key, sizeof(cache->key), 1, f) == 1 &&
+	     fwrite(cache->props, sizeof(*cache->props),
+		    cache->key.num_props, f) == cache->key.num_props &&
+	     fwrite(cache->formats, sizeof(*cache->formats),
+		    cache->key.num_formats, f) == cache->key.num_formats &&
+	     fwrite(cache->connectors, sizeof(*cache->connectors),
+		    cache->key.num_connectors, f) == cache->key.num_connectors;
+	ok &= fclose(f) == 0;
+
+	if (!ok || rename(tmp, cache->path) != 0) {
+		fprintf(stderr, "couldn't write probe cache %s\n", cache->path);
+		unlink(tmp);
+		return;
+	}
+
+	cache->dirty = false;
+}
+
+void probe_cache_destroy(struct device *device)
+{
+	struct probe_cache *cache = device->probe;
+
+	debug("probe cache: %d lookups saved, %d made\n",
+	      cache->hits, cache->misses);
+	free(cache->props);
+	free(cache->formats);
+	free(cache->connectors);
+	free(cache);
+	device->probe = NULL;
+}
+
+/*
+ * Look up a property by ID, as drmModeGetProperty would. We only keep the
+ * first few enum values; the only enums we care about (plane types and
+ * DPMS) are shorter than that.
+ *
+ * The returned pointer is only valid until the next lookup.
+ */
+const struct probe_property *probe_get_property(struct device *device,
+						uint32_t prop_id)
+{
+	struct probe_cache *cache = device->probe;
+	struct probe_property *entry;
+	drmModePropertyRes *prop;
+
+	for (uint32_t i = 0; i < cache->key.num_props; i++) {
+		if (cache->props[i].prop_id == prop_id) {
+			cache->hits++;
+			return &cache->props[i];
+		}
+	}
+
+	cache->misses++;
+	prop = drmModeGetProperty(device->kms_fd, prop_id);
+	if (!prop)
+		return NULL;
+
+	cache->props = realloc(cache->props, (cache->key.num_props + 1) *
+					     sizeof(*cache->props));
+	assert(cache->props);
+	entry = &cache->props[cache->key.num_props++];
+	memset(entry, 0, sizeof(*entry));
+	entry->prop_id = prop_id;
+	entry->flags = prop->flags;
+	snprintf(entry->name, sizeof(entry->name), "%s", prop->name);
+	for (int i = 0; i < prop->count_enums && i < PROBE_MAX_ENUMS; i++)
+		entry->enums[entry->count_enums++] = prop->enums[i];
+	drmModeFreeProperty(prop);
+
+	cache->dirty = true;
+	return entry;
+}
+
+/*
+ * Look up a plane's modifiers for a format, as parsed from its IN_FORMATS
+ * blob. The blob ID changes if the driver ever replaces the blob, so we
+ * check that the plane still has the same one.
+ */
+const struct probe_formats *probe_get_formats(struct device *device,
+					      uint32_t plane_id,
+					      uint32_t blob_id,
+					      uint32_t format)
+{
+	struct probe_cache *cache = device->probe;
+
+	for (uint32_t i = 0; i < cache->key.num_formats; i++) {
+		if (cache->formats[i].plane_id == plane_id &&
+		    cache->formats[i].blob_id == blob_id &&
+		    cache->formats[i].format == format) {
+			cache->hits++;
+			return &cache->formats[i];
+		}
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+void probe_add_formats(struct device *device, uint32_t plane_id,
+		       uint32_t blob_id, uint32_t format,
+		       const uint64_t *modifiers, unsigned int num_modifiers)
+{
+	struct probe_cache *cache = device->probe;
+	struct probe_formats *entry = NULL;
+
+	if (num_modifiers > PROBE_MAX_MODIFIERS)
+		return;
+
+	for (uint32_t i = 0; i < cache->key.num_formats; i++) {
+		if (cache->formats[i].plane_id == plane_id &&
+		    cache->formats[i].format == format)
+			entry = &cache->formats[i];
+	}
+	if (!entry) {
+		cache->formats = realloc(cache->formats,
+					 (cache->key.num_formats + 1) *
+					 sizeof(*cache->formats));
+		assert(cache->formats);
+		entry = &cache->formats[cache->key.num_formats++];
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	entry->plane_id = plane_id;
+	entry->blob_id = blob_id;
+	entry->format = format;
+	entry->num_modifiers = num_modifiers;
+	memcpy(entry->modifiers, modifiers, num_modifiers * sizeof(*modifiers));
+	cache->dirty = true;
+}
+
+const struct probe_connector *probe_get_connector(struct device *device,
+						  uint32_t connector_id)
+{
+	struct probe_cache *cache = device->probe;
+
+	for (uint32_t i = 0; i < cache->key.num_connectors; i++) {
+		if (cache->connectors[i].connector_id == connector_id)
+			return &cache->connectors[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Record what we now know about a connector: whether anything is plugged
+ * in, and the hash and parsed contents of its EDID (NULL if it has none).
+ * Returns true if that differs from what we knew before, i.e. if a monitor
+ * was plugged in, unplugged, or swapped for another.
+ */
+bool probe_set_connector(struct device *device, uint32_t connector_id,
+			 uint32_t connection, uint64_t edid_hash,
+			 const struct edid_info *edid)
+{
+	struct probe_cache *cache = device->probe;
+	struct probe_connector *entry =
+		(struct probe_connector *) probe_get_connector(device,
+							       connector_id);
+	bool changed = true;
+
+	if (!entry) {
+		cache->connectors = realloc(cache->connectors,
+					    (cache->key.num_connectors + 1) *
+					    sizeof(*cache->connectors));
+		assert(cache->connectors);
+		entry = &cache->connectors[cache->key.num_connectors++];
+		memset(entry, 0, sizeof(*entry));
+		entry->connector_id = connector_id;
+	} else {
+		changed = entry->connection != connection ||
+			  entry->has_edid != !!edid ||
+			  entry->edid_hash != edid_hash;
+	}
+
+	if (!changed)
+		return false;
+
+	entry->connection = connection;
+	entry->edid_hash = edid_hash;
+	entry->has_edid = !!edid;
+	if (edid)
+		entry->edid = *edid;
+	else
+		memset(&entry->edid, 0, sizeof(entry->edid));
+	cache->dirty = true;
+	return true;
+}
+
+/*
+ * Find the parsed EDID for a connector, if we've already seen one with the
+ * same contents; counts as a hit or miss in our statistics.
+ */
+bool probe_get_edid(struct device *device, uint32_t connector_id,
+		    uint64_t edid_hash, struct edid_info *edid)
+{
+	const struct probe_connector *entry =
+		probe_get_connector(device, connector_id);
+
+	if (!entry || !entry->has_edid || entry->edid_hash != edid_hash) {
+		device->probe->misses++;
+		return false;
+	}
+
+	device->probe->hits++;
+	*edid = entry->edid;
+	return true;
+}
+
+/* 64-bit FNV-1a: plenty to tell one monitor's EDID from another's. */
+uint64_t probe_hash(const void *data, size_t length)
+{
+	const uint8_t *bytes = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * The kernel broadcasts a uevent on this netlink socket whenever a device
+ * changes; for DRM devices, that includes connectors being plugged in or
+ * unplugged. udev listens on the same socket and re-broadcasts its own
+ * processed version, which we could use through libudev instead, but the
+ * raw kernel events tell us everything we need.
+ */
+int probe_uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* kernel events, rather than udev's */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		fprintf(stderr, "couldn't open uevent socket, not listening for hotplug: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "couldn't bind uevent socket, not listening for hotplug: %s\n",
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Read the next hotplug event for our KMS device from the uevent socket,
+ * skipping everything else. Each event is a header ("change@/devices/...")
+ * followed by NUL-separated KEY=value pairs; DRM hotplug events carry
+ * HOTPLUG=1, the device's MAJOR and MINOR, and on newer kernels, the ID of
+ * the CONNECTOR which changed.
+ *
+ * Returns false once there are no more events to read. Otherwise,
+ * *connector_id is set to the connector to re-probe, or 0 if the event
+ * didn't say and all of them should be.
+ */
+bool probe_uevent_read(struct device *device, uint32_t *connector_id)
+{
+	char buf[4096];
+	ssize_t len;
+
+	while ((len = recv(device->uevent_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		bool drm = false, hotplug = false;
+		unsigned int maj = 0, min = 0;
+
+		buf[len] = '\0';
+		*connector_id = 0;
+
+		for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strcmp(p, "SUBSYSTEM=drm"))
+				drm = true;
+			else if (!strcmp(p, "HOTPLUG=1"))
+				hotplug = true;
+			else if (!strncmp(p, "MAJOR=", 6))
+				maj = strtoul(p + 6, NULL, 10);
+			else if (!strncmp(p, "MINOR=", 6))
+				min = strtoul(p + 6, NULL, 10);
+			else if (!strncmp(p, "CONNECTOR=", 10))
+				*connector_id = strtoul(p + 10, NULL, 10);
+		}
+
+		if (drm && hotplug &&
+		    makedev(maj, min) == device->probe->key.rdev)
+			return true;
+	}
+
+	if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		fprintf(stderr, "error reading uevents: %s\n", strerror(errno));
+	return false;
+}
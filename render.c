@@ -0,0 +1,107 @@
+/*
+ * Turning our animation into a list of drawing operations.
+ *
+ * The quads we animate are solid, axis-aligned rectangles, so rather than
+ * have the GPU run a fragment shader over them (and the CPU upload their
+ * vertices and issue a draw for each one, for each damaged rectangle), we
+ * work out on the CPU which rectangles of which colour each frame consists
+ * of, already clipped to the damage. A GPU can then fill each of these with
+ * a scissored clear, which is about the cheapest thing it can do: tilers in
+ * particular often don't need to touch memory at all beyond writing the
+ * result out.
+ *
+ * The same list can also be drawn as plain triangles, with all the vertices
+ * uploaded in one go and a single draw call, for comparison; see
+ * buffer_egl_fill.
+ */
+
+/*
+ * Copyright © 2018-2019 Collabora, Ltd.
+ * Copyright © 2018-2019 DAQRI, LLC and its affiliates
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+
+#include "kms-quads.h"
+
+/*
+ * The colours of the four quads, from the top-left in memory order: black,
+ * red, blue and magenta.
+ */
+static const float quad_colours[4][4] = {
+	{ 0.0f, 0.0f, 0.0f, 1.0f },
+	{ 1.0f, 0.0f, 0.0f, 1.0f },
+	{ 0.0f, 0.0f, 1.0f, 1.0f },
+	{ 1.0f, 0.0f, 1.0f, 1.0f },
+};
+
+static void render_list_add(struct render_list *list,
+			    const struct drm_mode_rect *rect,
+			    int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+			    const float *col)
+{
+	struct render_op *op;
+
+	/* Clip the quad to the damaged rectangle. */
+	x1 = (x1 > rect->x1) ? x1 : rect->x1;
+	y1 = (y1 > rect->y1) ? y1 : rect->y1;
+	x2 = (x2 < rect->x2) ? x2 : rect->x2;
+	y2 = (y2 < rect->y2) ? y2 : rect->y2;
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	assert(list->num_ops < MAX_RENDER_OPS);
+	op = &list->ops[list->num_ops++];
+	op->rect = (struct drm_mode_rect) {
+		.x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2,
+	};
+	for (int c = 0; c < 4; c++)
+		op->col[c] = col[c];
+}
+
+/*
+ * Build the list of rectangles to fill to bring the damaged parts of a
+ * width x height image up to the given frame.
+ *
+ * The four quads meet at a point which moves from the top-left to the
+ * bottom-right corner over the course of the animation, at the same place
+ * buffer_anim_damage expects; rows are in memory order, top first.
+ */
+void render_list_build(struct render_list *list, const struct damage *damage,
+		       uint32_t width, uint32_t height, unsigned int frame_num)
+{
+	int32_t w = width;
+	int32_t h = height;
+	int32_t sx = (w * frame_num) / NUM_ANIM_FRAMES;
+	int32_t sy = (h * frame_num) / NUM_ANIM_FRAMES;
+
+	list->num_ops = 0;
+
+	for (int d = 0; d < damage->num_rects; d++) {
+		const struct drm_mode_rect *rect = &damage->rects[d];
+
+		render_list_add(list, rect, 0, 0, sx, sy, quad_colours[0]);
+		render_list_add(list, rect, sx, 0, w, sy, quad_colours[1]);
+		render_list_add(list, rect, 0, sy, sx, h, quad_colours[2]);
+		render_list_add(list, rect, sx, sy, w, h, quad_colours[3]);
+	}
+}
@@ -0,0 +1,400 @@
+/*
+ * The software renderer, used for dumb buffers when we have no GPU to render
+ * with (or are told not to use it with $KMS_NO_GBM).
+ *
+ * Dumb buffers are usually mapped write-combined: writes are not cached, but
+ * collected into a small buffer and sent to memory when a cache line's
+ * worth has been written. This makes reads horrendously slow, but
+ * sequential writes of whole cache lines fast; the very worst thing we can
+ * do is write a pixel at a time whilst doing a lot of work in between.
+ *
+ * Our content is made out of axis-aligned rectangles, so rather than work
+ * out the colour of every pixel, we work out where each row changes colour
+ * and fill the spans in between with plain wide stores. Even so, a single
+ * core can't always keep up with filling a 4K buffer at display rate, so we
+ * can also split the rows between a pool of worker threads, set with
+ * $KMS_SW_THREADS.
+ *
+ * Anything which needs to read back from the buffer (e.g. blending) would be
+ * unbearably slow on a write-combined mapping, so with $KMS_SHADOW we render
+ * into a shadow copy of the buffer in normal cached memory instead, and then
+ * copy the damaged parts across to the dumb buffer.
+ */
+
+/*
+ * Copyright © 2018-2019 Collabora, Ltd.
+ * Copyright © 2018-2019 DAQRI, LLC and its affiliates
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "kms-quads.h"
+
+/*
+ * Waking up the workers and waiting for them to finish costs us a few
+ * microseconds, so don't bother splitting small updates up.
+ */
+#define SW_MIN_ROWS_PER_THREAD 32
+
+struct sw_thread {
+	struct sw_renderer *sw;
+	pthread_t thread;
+	int index;
+};
+
+/*
+ * Our worker pool. Whoever calls buffer_sw_fill takes part in the rendering
+ * as well, so with n threads in total, we only start n - 1 workers.
+ *
+ * job_lock serialises callers, since every output's render thread can
+ * call us at once in threaded mode. The rest of the state is protected by
+ * lock: each new job bumps generation and wakes up every worker, each of
+ * which fills its share of the rows and decrements pending, and the last
+ * one to finish wakes up the caller.
+ */
+struct sw_renderer {
+	pthread_mutex_t job_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	struct sw_thread *threads;
+	int num_threads;
+
+	unsigned int generation;
+	int pending;
+	bool exit;
+
+	struct buffer *buffer;
+	int frame_num;
+};
+
+/*
+ * Fill a run of pixels with one value.
+ *
+ * Where the CPU has SIMD stores as part of its baseline instruction set
+ * (SSE2 on x86-64, NEON on AArch64), we use 16-byte stores, four at a time;
+ * the destination is only aligned to 16 bytes, so a run of four doesn't
+ * necessarily line up with a cache line. Otherwise, the compiler can usually
+ * do a reasonable job of vectorising the plain loop at the end by itself.
+ */
+static void fill_span(uint32_t *dst, uint32_t val, int32_t n)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_set1_epi32((int) val);
+
+	/* Aligned stores need the destination aligned to 16 bytes. */
+	while (n > 0 && ((uintptr_t) dst & 15)) {
+		*dst++ = val;
+		n--;
+	}
+
+	for (; n >= 16; n -= 16, dst += 16) {
+		_mm_store_si128((__m128i *) (dst + 0), v);
+		_mm_store_si128((__m128i *) (dst + 4), v);
+		_mm_store_si128((__m128i *) (dst + 8), v);
+		_mm_store_si128((__m128i *) (dst + 12), v);
+	}
+	for (; n >= 4; n -= 4, dst += 4)
+		_mm_store_si128((__m128i *) dst, v);
+#elif defined(__ARM_NEON)
+	uint32x4_t v = vdupq_n_u32(val);
+
+	for (; n >= 16; n -= 16, dst += 16) {
+		vst1q_u32(dst + 0, v);
+		vst1q_u32(dst + 4, v);
+		vst1q_u32(dst + 8, v);
+		vst1q_u32(dst + 12, v);
+	}
+	for (; n >= 4; n -= 4, dst += 4)
+		vst1q_u32(dst, v);
+#endif
+
+	while (n-- > 0)
+		*dst++ = val;
+}
+
+/*
+ * Copy a run of pixels from our shadow buffer to the dumb buffer mapping.
+ *
+ * We use non-temporal (streaming) stores where we can: these bypass the
+ * cache entirely, so copying doesn't evict the shadow buffer we're reading
+ * from, and go straight into the CPU's write-combining buffers in the same
+ * way as writes to the write-combined mapping do anyway. NEON doesn't have
+ * an equivalent we can portably use, so there we just use plain stores.
+ */
+static void copy_span(uint32_t *dst, const uint32_t *src, int32_t n)
+{
+#if defined(__SSE2__)
+	while (n > 0 && ((uintptr_t) dst & 15)) {
+		*dst++ = *src++;
+		n--;
+	}
+
+	for (; n >= 16; n -= 16, dst += 16, src += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (src + 0));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + 4));
+		__m128i c = _mm_loadu_si128((const __m128i *) (src + 8));
+		__m128i d = _mm_loadu_si128((const __m128i *) (src + 12));
+
+		_mm_stream_si128((__m128i *) (dst + 0), a);
+		_mm_stream_si128((__m128i *) (dst + 4), b);
+		_mm_stream_si128((__m128i *) (dst + 8), c);
+		_mm_stream_si128((__m128i *) (dst + 12), d);
+	}
+	for (; n >= 4; n -= 4, dst += 4, src += 4)
+		_mm_stream_si128((__m128i *) dst,
+				 _mm_loadu_si128((const __m128i *) src));
+#elif defined(__ARM_NEON)
+	for (; n >= 4; n -= 4, dst += 4, src += 4)
+		vst1q_u32(dst, vld1q_u32(src));
+#endif
+
+	while (n-- > 0)
+		*dst++ = *src++;
+}
+
+/* Find a row in either the dumb buffer mapping or our shadow copy. */
+static uint32_t *buffer_row(struct buffer *buffer, void *base, int32_t y)
+{
+	return (uint32_t *) ((uint8_t *) base + (y * buffer->pitches[0]));
+}
+
+/*
+ * Fill our share of the buffer's damage with the checkerboard described in
+ * buffer_fill: the buffer is split into four at (split_x, split_y), with the
+ * red channel set to the right of split_x and the blue channel set below
+ * split_y. So each row has at most two spans of a single colour.
+ *
+ * With a shadow buffer, we render there instead, then copy each damaged
+ * row to the dumb buffer.
+ *
+ * Each damaged rect is split into num_slices bands of rows, of which we
+ * fill the one given by slice.
+ */
+static void fill_rows(struct buffer *buffer, int frame_num, int slice,
+		      int num_slices)
+{
+	int32_t split_x = (buffer->width * frame_num) / NUM_ANIM_FRAMES;
+	int32_t split_y = (buffer->height * frame_num) / NUM_ANIM_FRAMES;
+	void *base = buffer->dumb.shadow ? buffer->dumb.shadow : buffer->dumb.mem;
+
+	for (int i = 0; i < buffer->damage.num_rects; i++) {
+		const struct drm_mode_rect *rect = &buffer->damage.rects[i];
+		int32_t rows = rect->y2 - rect->y1;
+		int32_t y1 = rect->y1 + (rows * slice) / num_slices;
+		int32_t y2 = rect->y1 + (rows * (slice + 1)) / num_slices;
+		int32_t left_end = (split_x < rect->x2) ? split_x : rect->x2;
+		int32_t right_start = (split_x > rect->x1) ? split_x : rect->x1;
+
+		for (int32_t y = y1; y < y2; y++) {
+			uint32_t *row = buffer_row(buffer, base, y);
+			uint32_t b = (y >= split_y) ? 0xff : 0x00;
+
+			if (left_end > rect->x1)
+				fill_span(row + rect->x1,
+					  (0xffu << 24) | (0x00 << 16) | b,
+					  left_end - rect->x1);
+			if (rect->x2 > right_start)
+				fill_span(row + right_start,
+					  (0xffu << 24) | (0xff << 16) | b,
+					  rect->x2 - right_start);
+		}
+
+		if (!buffer->dumb.shadow)
+			continue;
+
+		/*
+		 * Now push the rows we've just rendered out to the real
+		 * buffer, whilst they're still in our cache.
+		 */
+		for (int32_t y = y1; y < y2; y++)
+			copy_span(buffer_row(buffer, buffer->dumb.mem, y) + rect->x1,
+				  buffer_row(buffer, base, y) + rect->x1,
+				  rect->x2 - rect->x1);
+	}
+
+#if defined(__SSE2__)
+	/*
+	 * Streaming stores are weakly ordered, so make sure they've all
+	 * landed before anyone (e.g. KMS) can look at the buffer.
+	 */
+	if (buffer->dumb.shadow)
+		_mm_sfence();
+#endif
+}
+
+static void *sw_thread_run(void *data)
+{
+	struct sw_thread *thread = data;
+	struct sw_renderer *sw = thread->sw;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&sw->lock);
+
+	for (;;) {
+		struct buffer *buffer;
+		int frame_num;
+
+		while (!sw->exit && sw->generation == seen)
+			pthread_cond_wait(&sw->work_cond, &sw->lock);
+		if (sw->exit)
+			break;
+
+		seen = sw->generation;
+		buffer = sw->buffer;
+		frame_num = sw->frame_num;
+		pthread_mutex_unlock(&sw->lock);
+
+		/* Slice 0 is left for the caller. */
+		fill_rows(buffer, frame_num, thread->index + 1,
+			  sw->num_threads + 1);
+
+		pthread_mutex_lock(&sw->lock);
+		if (--sw->pending == 0)
+			pthread_cond_signal(&sw->done_cond);
+	}
+
+	pthread_mutex_unlock(&sw->lock);
+	return NULL;
+}
+
+/*
+ * Start a pool to render with num_threads threads in total, including the
+ * caller's. Returns NULL if there's no point, or we couldn't start any.
+ */
+struct sw_renderer *sw_renderer_create(int num_threads)
+{
+	struct sw_renderer *sw;
+	sigset_t all, old;
+
+	if (num_threads <= 1)
+		return NULL;
+
+	sw = calloc(1, sizeof(*sw));
+	assert(sw);
+	pthread_mutex_init(&sw->job_lock, NULL);
+	pthread_mutex_init(&sw->lock, NULL);
+	pthread_cond_init(&sw->work_cond, NULL);
+	pthread_cond_init(&sw->done_cond, NULL);
+
+	sw->threads = calloc(num_threads - 1, sizeof(*sw->threads));
+	assert(sw->threads);
+
+	/* As with the render threads, leave signals to the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < num_threads - 1; i++) {
+		struct sw_thread *thread = &sw->threads[sw->num_threads];
+
+		thread->sw = sw;
+		thread->index = sw->num_threads;
+		if (pthread_create(&thread->thread, NULL, sw_thread_run,
+				   thread) != 0) {
+			error("couldn't start software render thread %d\n", i);
+			break;
+		}
+		sw->num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (sw->num_threads == 0) {
+		sw_renderer_destroy(sw);
+		return NULL;
+	}
+
+	printf("rendering dumb buffers with %d threads\n", sw->num_threads + 1);
+	return sw;
+}
+
+/* How many threads fill each buffer, counting the one which asked. */
+int sw_renderer_num_threads(struct sw_renderer *sw)
+{
+	return sw ? sw->num_threads + 1 : 1;
+}
+
+void sw_renderer_destroy(struct sw_renderer *sw)
+{
+	pthread_mutex_lock(&sw->lock);
+	sw->exit = true;
+	pthread_cond_broadcast(&sw->work_cond);
+	pthread_mutex_unlock(&sw->lock);
+
+	for (int i = 0; i < sw->num_threads; i++)
+		pthread_join(sw->threads[i].thread, NULL);
+
+	pthread_cond_destroy(&sw->done_cond);
+	pthread_cond_destroy(&sw->work_cond);
+	pthread_mutex_destroy(&sw->lock);
+	pthread_mutex_destroy(&sw->job_lock);
+	free(sw->threads);
+	free(sw);
+}
+
+/*
+ * Fill the damaged parts of a dumb buffer with the given frame, splitting
+ * the work between our worker threads if we have any and there's enough
+ * of it.
+ */
+void buffer_sw_fill(struct buffer *buffer, int frame_num)
+{
+	struct sw_renderer *sw = buffer->output->device->sw_renderer;
+	int32_t rows = 0;
+
+	for (int i = 0; i < buffer->damage.num_rects; i++)
+		rows += buffer->damage.rects[i].y2 - buffer->damage.rects[i].y1;
+
+	if (!sw || rows < SW_MIN_ROWS_PER_THREAD * (sw->num_threads + 1)) {
+		fill_rows(buffer, frame_num, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&sw->job_lock);
+
+	pthread_mutex_lock(&sw->lock);
+	sw->buffer = buffer;
+	sw->frame_num = frame_num;
+	sw->pending = sw->num_threads;
+	sw->generation++;
+	pthread_cond_broadcast(&sw->work_cond);
+	pthread_mutex_unlock(&sw->lock);
+
+	fill_rows(buffer, frame_num, 0, sw->num_threads + 1);
+
+	pthread_mutex_lock(&sw->lock);
+	while (sw->pending > 0)
+		pthread_cond_wait(&sw->done_cond, &sw->lock);
+	pthread_mutex_unlock(&sw->lock);
+
+	pthread_mutex_unlock(&sw->job_lock);
+}
@@ -0,0 +1,310 @@
+/*
+ * Frame timing statistics.
+ *
+ * The event handler in main.c already knows when we expected each frame to
+ * be displayed, and when it actually was; in debug builds, it complains
+ * about every frame which was early or late. That isn't much use for
+ * finding out how well we're doing over time though, so we also keep the
+ * last STATS_RING_SIZE frames' timing for each output, and on SIGUSR1
+ * summarise them as histograms and percentiles.
+ *
+ * Recording a frame is just copying a few integers into the ring, so it's
+ * cheap enough to always do; all the real work happens when we're asked to
+ * dump the statistics.
+ */
+
+/*
+ * Copyright © 2018-2019 Collabora, Ltd.
+ * Copyright © 2018-2019 DAQRI, LLC and its affiliates
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kms-quads.h"
+
+/*
+ * Buckets for the histogram of intervals between flips, in refresh
+ * intervals: the last bucket collects everything longer.
+ */
+#define STATS_INTERVAL_BUCKETS 5
+
+void output_stats_push(struct output *output)
+{
+	uint64_t idx = output->stats.num_frames % STATS_RING_SIZE;
+
+	output->stats.ring[idx] = output->stats.pending;
+	if (output->stats.num_frames == 0)
+		output->stats.first_flip_nsec = output->stats.pending.flip_nsec;
+	output->stats.last_flip_nsec = output->stats.pending.flip_nsec;
+	if (output->stats.pending.render_nsec > 0) {
+		output->stats.total_render_nsec += output->stats.pending.render_nsec;
+		output->stats.num_render_samples++;
+	}
+	output->stats.num_frames++;
+	memset(&output->stats.pending, 0, sizeof(output->stats.pending));
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Print the median, 90th and 99th percentile, and worst sample, in
+ * microseconds. This sorts the samples in place.
+ */
+static void print_percentiles(FILE *f, const char *name, int64_t *samples,
+			      int num_samples)
+{
+	if (num_samples == 0) {
+		fprintf(f, "\t%-22s no samples\n", name);
+		return;
+	}
+
+	qsort(samples, num_samples, sizeof(*samples), compare_int64);
+	fprintf(f, "\t%-22s p50 %7" PRIi64 "  p90 %7" PRIi64 "  p99 %7" PRIi64 "  max %7" PRIi64 " us\n",
+		name,
+		samples[(num_samples * 50) / 100] / 1000,
+		samples[(num_samples * 90) / 100] / 1000,
+		samples[(num_samples * 99) / 100] / 1000,
+		samples[num_samples - 1] / 1000);
+}
+
+static void output_stats_dump(struct output *output, FILE *f)
+{
+	int num_records = (output->stats.num_frames < STATS_RING_SIZE) ?
+		output->stats.num_frames : STATS_RING_SIZE;
+	uint64_t first = output->stats.num_frames - num_records;
+	uint64_t intervals[STATS_INTERVAL_BUCKETS] = { 0, };
+	int64_t *samples;
+	uint64_t missed = 0, dropped = 0;
+	int num_errors = 0, num_commits = 0, num_slack = 0, num_render = 0;
+	int64_t *errors, *commits, *slack, *render;
+
+	fprintf(f, "[%s] last %d of %" PRIu64 " frames:\n",
+		output->name, num_records, output->stats.num_frames);
+	if (num_records == 0)
+		return;
+
+	samples = calloc(4 * num_records, sizeof(*samples));
+	assert(samples);
+	errors = &samples[0];
+	commits = &samples[num_records];
+	slack = &samples[2 * num_records];
+	render = &samples[3 * num_records];
+
+	for (int i = 0; i < num_records; i++) {
+		const struct frame_record *rec =
+			&output->stats.ring[(first + i) % STATS_RING_SIZE];
+
+		dropped += rec->num_dropped;
+
+		if (rec->predicted_nsec != 0)
+			errors[num_errors++] = rec->flip_nsec - rec->predicted_nsec;
+		if (rec->commit_nsec != 0)
+			commits[num_commits++] = rec->commit_nsec;
+		if (rec->render_done_nsec != 0)
+			slack[num_slack++] = rec->flip_nsec - rec->render_done_nsec;
+		if (rec->render_nsec != 0)
+			render[num_render++] = rec->render_nsec;
+
+		/*
+		 * Work out how many refresh intervals passed since the
+		 * previous flip, rounding to the nearest; anything more than
+		 * one means we missed a vblank.
+		 */
+		if (i > 0) {
+			const struct frame_record *prev =
+				&output->stats.ring[(first + i - 1) % STATS_RING_SIZE];
+			int64_t interval = rec->flip_nsec - prev->flip_nsec;
+			int64_t n = (interval + output->refresh_interval_nsec / 2) /
+				    output->refresh_interval_nsec;
+
+			if (n > 1)
+				missed += n - 1;
+			if (n < 1)
+				n = 1;
+			if (n > STATS_INTERVAL_BUCKETS)
+				n = STATS_INTERVAL_BUCKETS;
+			intervals[n - 1]++;
+		}
+	}
+
+	fprintf(f, "\tbuffer pool: %d of %d buffers (peak %d, grown %" PRIu64 " times, shrunk %" PRIu64 " times)\n",
+		output->num_buffers, output->device->queue_depth,
+		output->pool.peak, output->pool.num_grown,
+		output->pool.num_shrunk);
+	if (output->mod_pick.chosen)
+		fprintf(f, "\tmodifier: 0x%016" PRIx64 " (%s, %d better candidate(s) rejected)\n",
+			output->mod_pick.modifier,
+			modifier_class_name(modifier_classify(output->mod_pick.modifier)),
+			output->mod_pick.num_rejected);
+	fprintf(f, "\tmissed vblanks: %" PRIu64 ", dropped animation frames: %" PRIu64 "\n",
+		missed, dropped);
+
+	fprintf(f, "\tframe intervals:");
+	for (int i = 0; i < STATS_INTERVAL_BUCKETS; i++)
+		fprintf(f, "  %d%s: %" PRIu64, i + 1,
+			(i == STATS_INTERVAL_BUCKETS - 1) ? "+" : "",
+			intervals[i]);
+	fprintf(f, "\n");
+
+	print_percentiles(f, "flip vs. prediction", errors, num_errors);
+	print_percentiles(f, "commit latency", commits, num_commits);
+	print_percentiles(f, "render time", render, num_render);
+	print_percentiles(f, "render done to flip", slack, num_slack);
+
+	free(samples);
+}
+
+void stats_dump(struct device *device, FILE *f)
+{
+	for (int i = 0; i < device->num_outputs; i++)
+		output_stats_dump(device->outputs[i], f);
+
+	pthread_mutex_lock(&device->buffer_cache.lock);
+	fprintf(f, "buffer cache: %d of %d buffers, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evicted\n",
+		device->buffer_cache.num_buffers, BUFFER_CACHE_SIZE,
+		device->buffer_cache.num_hits,
+		device->buffer_cache.num_misses,
+		device->buffer_cache.num_evicted);
+	pthread_mutex_unlock(&device->buffer_cache.lock);
+	fprintf(f, "commits: %d request(s) per repaint, %" PRIu64 " retried after EBUSY\n",
+		device->commit.num_groups, device->commit.num_busy);
+	if (device->capture.enabled) {
+		for (int i = 0; i < device->num_outputs; i++)
+			fprintf(f, "capture [%s]: %" PRIu64 " frames captured, %" PRIu64 " dropped\n",
+				device->outputs[i]->name,
+				device->outputs[i]->capture.num_captured,
+				device->outputs[i]->capture.num_dropped);
+	}
+	fflush(f);
+}
+
+static const char *renderer_name(struct device *device)
+{
+	if (device->vk_device)
+		return "vulkan";
+	if (device->gbm_device)
+		return "gl";
+	return "software";
+}
+
+/*
+ * We print everything as one JSON object, so results can be fed straight
+ * into whatever keeps track of them. Times are in milliseconds; values we
+ * couldn't measure (the render time without explicit fencing) are null.
+ * The render time runs from when we start building the frame to when its
+ * render fence signals, so it includes our own command building and
+ * submission as well as the GPU's work.
+ *
+ * The frame rate is measured between the first and last frame we
+ * displayed or rendered, so doesn't include the initial modeset. The CPU
+ * time covers the whole process, including any render threads and KMS
+ * work, spread over all the frames on all the outputs.
+ *
+ * The KMS device and its driver are recorded too, so that reports from
+ * several machines, or from every device at once with $KMS_ALL_DEVICES,
+ * can be told apart.
+ */
+void benchmark_report(struct device *device, FILE *f)
+{
+	uint64_t total_frames = 0;
+	int64_t cpu_nsec = device->benchmark.cpu_end_nsec -
+			   device->benchmark.cpu_start_nsec;
+	drmVersionPtr version = drmGetVersion(device->kms_fd);
+	char *node = drmGetDeviceNameFromFd2(device->kms_fd);
+
+	for (int i = 0; i < device->num_outputs; i++)
+		total_frames += device->outputs[i]->stats.num_frames;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"device\": \"%s\",\n", node ? node : "unknown");
+	fprintf(f, "  \"driver\": \"%s\",\n",
+		version ? version->name : "unknown");
+	drmFreeVersion(version);
+	free(node);
+	fprintf(f, "  \"renderer\": \"%s\",\n", renderer_name(device));
+	fprintf(f, "  \"queue_depth\": %d,\n", device->queue_depth);
+	fprintf(f, "  \"offscreen\": %s,\n",
+		device->benchmark.offscreen ? "true" : "false");
+	fprintf(f, "  \"threaded\": %s,\n", device->threaded ? "true" : "false");
+	fprintf(f, "  \"shadow\": %s,\n", device->dumb_shadow ? "true" : "false");
+	fprintf(f, "  \"sw_threads\": %d,\n",
+		device->gbm_device ? 0 :
+		sw_renderer_num_threads(device->sw_renderer));
+	fprintf(f, "  \"cpu_ms_per_frame\": %.4f,\n",
+		total_frames ? (cpu_nsec / 1e6) / total_frames : 0.0);
+	fprintf(f, "  \"outputs\": [\n");
+
+	for (int i = 0; i < device->num_outputs; i++) {
+		struct output *output = device->outputs[i];
+		int64_t elapsed = output->stats.last_flip_nsec -
+				  output->stats.first_flip_nsec;
+		double fps = 0.0;
+
+		if (output->stats.num_frames > 1 && elapsed > 0)
+			fps = (output->stats.num_frames - 1) * 1e9 / elapsed;
+
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"name\": \"%s\",\n", output->name);
+		fprintf(f, "      \"width\": %u,\n", output->mode.hdisplay);
+		fprintf(f, "      \"height\": %u,\n", output->mode.vdisplay);
+		fprintf(f, "      \"refresh_ms\": %.4f,\n",
+			output->refresh_interval_nsec / 1e6);
+		fprintf(f, "      \"render_ahead\": %d,\n", output->render_ahead);
+		fprintf(f, "      \"buffers\": %d,\n", output->num_buffers);
+		fprintf(f, "      \"peak_buffers\": %d,\n", output->pool.peak);
+		if (output->mod_pick.chosen) {
+			fprintf(f, "      \"modifier\": \"0x%016" PRIx64 "\",\n",
+				output->mod_pick.modifier);
+			fprintf(f, "      \"modifier_class\": \"%s\",\n",
+				modifier_class_name(modifier_classify(output->mod_pick.modifier)));
+		} else {
+			fprintf(f, "      \"modifier\": null,\n");
+			fprintf(f, "      \"modifier_class\": null,\n");
+		}
+		fprintf(f, "      \"modifiers_rejected\": %d,\n",
+			output->mod_pick.num_rejected);
+		fprintf(f, "      \"frames\": %" PRIu64 ",\n",
+			output->stats.num_frames);
+		fprintf(f, "      \"fps\": %.2f,\n", fps);
+		if (output->stats.num_render_samples > 0)
+			fprintf(f, "      \"render_ms_per_frame\": %.4f\n",
+				(output->stats.total_render_nsec / 1e6) /
+				output->stats.num_render_samples);
+		else
+			fprintf(f, "      \"render_ms_per_frame\": null\n");
+		fprintf(f, "    }%s\n", (i < device->num_outputs - 1) ? "," : "");
+	}
+
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+	fflush(f);
+}
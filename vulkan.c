@@ -32,16 +32,56 @@
 #include <string.h>
 #include <inttypes.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <vulkan.frag.h>
 #include <vulkan.vert.h>
 
-// This corresponds to the XRGB drm format.
-// The egl format hardcodes this format so we can probably too.
-// It's guaranteed to be supported by the vulkan spec for everything
-// we need. SRGB is the correct choice here, as always. You'd see
-// that when rendering a texture.
-static const VkFormat format = VK_FORMAT_B8G8R8A8_SRGB;
+// every image's uniform data lives in one slot of the device's arena,
+// which grows this many slots at a time: enough for full queues on a
+// few outputs, with their KMS_OVERLAY backgrounds, plus the buffers
+// sitting in the buffer cache. Baked frames only hold theirs until
+// rendered, see buffer_vk_retire.
+#define VK_ARENA_CHUNK_SLOTS (4 * (BUFFER_QUEUE_DEPTH + 1) + BUFFER_CACHE_SIZE)
+
+// the most submissions we collect in one batch (see vk_batch_begin);
+// with more outputs than this, a batch goes to the queue in parts
+#define VK_BATCH_MAX 8
+
+// command buffers are allocated from the pool this many at a time
+#define VK_CB_CHUNK 8
+
+struct vk_image;
+
+// One chunk of the uniform arena (see vk_device.arena): a host-visible,
+// persistently mapped buffer with a slot (of the arena's stride) for each
+// of VK_ARENA_CHUNK_SLOTS images. It's bound through one dynamic uniform
+// buffer descriptor set, from a descriptor pool of its own, with each
+// image's command buffer passing its slot's offset. Free slots are kept
+// on a stack.
+struct vk_arena_chunk {
+	VkBuffer buffer;
+	VkDeviceMemory mem;
+	uint8_t *map;
+	VkDescriptorPool ds_pool;
+	VkDescriptorSet ds;
+	uint32_t free_slots[VK_ARENA_CHUNK_SLOTS];
+	uint32_t num_free;
+	struct vk_arena_chunk *next;
+};
+
+// When all outputs' submissions go to the queue together (see
+// vk_batch_begin), a single fence covers all of them. Each image keeps a
+// reference to the fence of the batch it was last submitted in; once no
+// image refers to a fence anymore, it's reused for a later batch.
+struct vk_batch_fence {
+	VkFence fence;
+	int refs;
+	struct vk_batch_fence *next;
+};
 
 struct vk_device {
 	VkInstance instance;
@@ -61,16 +101,72 @@ struct vk_device {
 	VkPhysicalDevice phdev;
 	VkDevice dev;
 
+	// The format we render into, and the drm format it corresponds to.
+	// There's only one render pass and pipeline for all outputs, so
+	// this is the same for every output too; see pick_format.
+	VkFormat format;
+	uint32_t drm_format;
+
 	uint32_t queue_family;
 	VkQueue queue;
 
+	// vulkan requires external synchronization for the queue. With
+	// KMS_THREADED, every output submits from its own render thread,
+	// so submissions have to be serialized.
+	pthread_mutex_t queue_lock;
+
+	// same for the command and descriptor pools: outputs grow and shrink
+	// their buffer pools from their render threads, so allocating and
+	// recording command buffers or descriptor sets has to be serialized
+	pthread_mutex_t pool_lock;
+
 	// pipeline
 	VkDescriptorSetLayout ds_layout;
 	VkRenderPass rp;
 	VkPipelineLayout pipe_layout;
 	VkPipeline pipe;
+
+	// The graphics pipeline is compiled on its own thread, since that
+	// is by far the slowest part of our startup and can overlap with
+	// probing our outputs; see vk_device_wait_pipeline. The compiled
+	// pipeline is also cached on disk, see pipeline_cache_path.
+	pthread_t pipe_thread;
+	bool pipe_thread_running;
+	uint8_t device_uuid[VK_UUID_SIZE];
+	VkPhysicalDeviceProperties phdev_props;
 	VkCommandPool command_pool;
-	VkDescriptorPool ds_pool;
+
+	// The uniform data for all images lives in a few host-visible
+	// buffers, one slot (of stride bytes, to satisfy
+	// minUniformBufferOffsetAlignment) per image, so creating an image
+	// usually needs neither a memory allocation nor a descriptor set.
+	// When every chunk is full, we add another, so the number of
+	// outputs and buffers isn't capped up front; see vk_arena_get.
+	// Protected by pool_lock.
+	struct {
+		VkDeviceSize stride;
+		struct vk_arena_chunk *chunks;
+	} arena;
+
+	// command buffers of destroyed images, to be re-recorded by new
+	// ones; protected by pool_lock
+	struct {
+		VkCommandBuffer *cbs;
+		uint32_t count;
+		uint32_t capacity;
+	} spare_cbs;
+
+	// submissions collected between vk_batch_begin and vk_batch_flush.
+	// Only ever used from the main thread, since render threads
+	// (KMS_THREADED) submit on their own and never batch.
+	struct {
+		bool active;
+		uint32_t count;
+		VkSubmitInfo submits[VK_BATCH_MAX];
+		VkPipelineStageFlags stages[VK_BATCH_MAX];
+		struct vk_image *images[VK_BATCH_MAX];
+		struct vk_batch_fence *fences;
+	} batch;
 };
 
 struct vk_image {
@@ -83,10 +179,11 @@ struct vk_image {
 	VkFramebuffer fb;
 	bool first;
 
-	VkBuffer ubo;
-	VkDeviceMemory ubo_mem;
+	// our slot in the device's uniform arena, and the chunk it's in;
+	// -1 if we have none
+	struct vk_arena_chunk *ubo_chunk;
+	int ubo_slot;
 	void *ubo_map;
-	VkDescriptorSet ds;
 
 	// We have to use a semaphore here since we want to "wait for it
 	// on the device" (i.e. only start rendering when the semaphore
@@ -102,6 +199,47 @@ struct vk_image {
 	// are happy if we signal them via this fence that execution
 	// has finished.
 	VkFence render_fence; // signaled by vulkan when rendering finishes
+
+	// if the last submission was batched, the fence covering it instead
+	// of render_fence
+	struct vk_batch_fence *batch_fence;
+
+	// the capture still copying out of this image, if any; see
+	// buffer_vk_capture
+	struct vk_capture_slot *capture;
+};
+
+// Frame capture (see capture.c). Each of an output's capture slots has its
+// own host-visible buffer, which a command buffer of its own copies the
+// image into, straight after the frame has been shown. It goes on the same
+// queue as our rendering, so the copy is ordered against the next frame
+// rendered into the image without any semaphores; its fence tells
+// capture_poll when the copy has landed.
+//
+// When scaling down, we blit into image first, and copy that. If the
+// image's modifier doesn't support blitting, we copy at full size instead
+// and scale down on the CPU once the copy is done; width, height and stride
+// are the size of what we copied.
+struct vk_capture_slot {
+	VkBuffer buffer;
+	VkDeviceMemory mem;
+	bool coherent;
+	VkCommandBuffer cb;
+	VkFence fence;
+	bool submitted;
+	uint32_t width, height, stride;
+
+	// the image being copied out of, until the copy is done
+	struct vk_image *img;
+};
+
+struct vk_capture {
+	struct vk_capture_slot slots[CAPTURE_RING_SIZE];
+	VkImage image;
+	VkDeviceMemory image_mem;
+	bool blit_checked;
+	bool blit;
+	VkFilter filter;
 };
 
 // #define vk_error(res, fmt, ...)
@@ -249,10 +387,13 @@ static VkBool32 debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT severity,
 	return false;
 }
 
-// Returns whether the given drm device pci info matches the given physical
-// device. Will write/realloc the given extensions count and data of
+// Returns whether the given physical device is the gpu behind the given
+// drm fd, which may be a primary or a render node. VK_EXT_physical_device_drm
+// gives us the device's nodes to compare against; without it, we fall back
+// to comparing pci bus addresses, which only works for pci devices.
+// Will write/realloc the given extensions count and data of
 // the queried physical device.
-bool match(drmPciBusInfoPtr pci_bus_info, VkPhysicalDevice phdev,
+bool match(int drm_fd, drmDevicePtr drm_dev, VkPhysicalDevice phdev,
 	uint32_t *extc, VkExtensionProperties **exts)
 {
 	VkResult res;
@@ -272,23 +413,45 @@ bool match(drmPciBusInfoPtr pci_bus_info, VkPhysicalDevice phdev,
 		return false;
 	}
 
-	if (!has_extension(*exts, *extc, VK_EXT_PCI_BUS_INFO_EXTENSION_NAME)) {
-		error("Physical device has not support for VK_EXT_pci_bus_info\n");
+	bool has_drm = has_extension(*exts, *extc,
+		VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME);
+	bool has_pci = drm_dev->bustype == DRM_BUS_PCI &&
+		has_extension(*exts, *extc, VK_EXT_PCI_BUS_INFO_EXTENSION_NAME);
+	if (!has_drm && !has_pci) {
+		error("Physical device supports neither VK_EXT_physical_device_drm "
+			"nor VK_EXT_pci_bus_info for a pci device\n");
 		return false;
 	}
 
+	VkPhysicalDeviceDrmPropertiesEXT drm_props = {0};
+	drm_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT;
+
 	VkPhysicalDevicePCIBusInfoPropertiesEXT pci_props = {0};
 	pci_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PCI_BUS_INFO_PROPERTIES_EXT;
 
 	VkPhysicalDeviceProperties2 phdev_props = {0};
 	phdev_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
-	phdev_props.pNext = &pci_props;
+	phdev_props.pNext = has_drm ? (void *) &drm_props : (void *) &pci_props;
 
 	vkGetPhysicalDeviceProperties2(phdev, &phdev_props);
-	bool match = pci_props.pciBus == pci_bus_info->bus &&
-		pci_props.pciDevice == pci_bus_info->dev &&
-		pci_props.pciDomain == pci_bus_info->domain &&
-		pci_props.pciFunction == pci_bus_info->func;
+
+	bool match;
+	if (has_drm) {
+		struct stat st;
+		match = fstat(drm_fd, &st) == 0 &&
+			((drm_props.hasPrimary &&
+			  major(st.st_rdev) == drm_props.primaryMajor &&
+			  minor(st.st_rdev) == drm_props.primaryMinor) ||
+			 (drm_props.hasRender &&
+			  major(st.st_rdev) == drm_props.renderMajor &&
+			  minor(st.st_rdev) == drm_props.renderMinor));
+	} else {
+		drmPciBusInfoPtr pci_bus_info = drm_dev->businfo.pci;
+		match = pci_props.pciBus == pci_bus_info->bus &&
+			pci_props.pciDevice == pci_bus_info->dev &&
+			pci_props.pciDomain == pci_bus_info->domain &&
+			pci_props.pciFunction == pci_bus_info->func;
+	}
 
 	VkPhysicalDeviceProperties *props = &phdev_props.properties;
 	uint32_t vv_major = (props->apiVersion >> 22);
@@ -326,8 +489,25 @@ bool match(drmPciBusInfoPtr pci_bus_info, VkPhysicalDevice phdev,
 	return match;
 }
 
+static void arena_chunk_destroy(struct vk_device *vk_dev,
+		struct vk_arena_chunk *chunk)
+{
+	if (chunk->ds_pool) {
+		// also frees the descriptor set
+		vkDestroyDescriptorPool(vk_dev->dev, chunk->ds_pool, NULL);
+	}
+	if (chunk->buffer) {
+		vkDestroyBuffer(vk_dev->dev, chunk->buffer, NULL);
+	}
+	if (chunk->mem) {
+		vkFreeMemory(vk_dev->dev, chunk->mem, NULL);
+	}
+	free(chunk);
+}
+
 void vk_device_destroy(struct vk_device *device)
 {
+	vk_device_wait_pipeline(device);
 	if (device->pipe) {
 		vkDestroyPipeline(device->dev, device->pipe, NULL);
 	}
@@ -338,13 +518,23 @@ void vk_device_destroy(struct vk_device *device)
 		vkDestroyPipelineLayout(device->dev, device->pipe_layout, NULL);
 	}
 	if (device->command_pool) {
+		// also frees the spare command buffers
 		vkDestroyCommandPool(device->dev, device->command_pool, NULL);
 	}
+	free(device->spare_cbs.cbs);
+	while (device->arena.chunks) {
+		struct vk_arena_chunk *chunk = device->arena.chunks;
+		device->arena.chunks = chunk->next;
+		arena_chunk_destroy(device, chunk);
+	}
 	if (device->ds_layout) {
 		vkDestroyDescriptorSetLayout(device->dev, device->ds_layout, NULL);
 	}
-	if (device->ds_pool) {
-		vkDestroyDescriptorPool(device->dev, device->ds_pool, NULL);
+	while (device->batch.fences) {
+		struct vk_batch_fence *fence = device->batch.fences;
+		device->batch.fences = fence->next;
+		vkDestroyFence(device->dev, fence->fence, NULL);
+		free(fence);
 	}
 	if (device->dev) {
 		vkDestroyDevice(device->dev, NULL);
@@ -356,9 +546,207 @@ void vk_device_destroy(struct vk_device *device)
 	if (device->instance) {
 		vkDestroyInstance(device->instance, NULL);
 	}
+	pthread_mutex_destroy(&device->queue_lock);
+	pthread_mutex_destroy(&device->pool_lock);
 	free(device);
 }
 
+// The pipeline cache lives in $XDG_CACHE_HOME/kms-quads (falling back to
+// ~/.cache/kms-quads), with one file per device and driver version, since
+// a cache is useless with any other driver build anyways. Creates the
+// directories on the way if needed.
+// Returns false if there is no sensible place for the cache.
+static bool pipeline_cache_path(struct vk_device *dev, char *path, size_t size)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char dir[256];
+	int len;
+
+	if (xdg && xdg[0] == '/') {
+		len = snprintf(dir, sizeof(dir), "%s", xdg);
+	} else if (home) {
+		len = snprintf(dir, sizeof(dir), "%s/.cache", home);
+	} else {
+		return false;
+	}
+
+	if (len < 0 || (size_t) len >= sizeof(dir)) {
+		return false;
+	}
+
+	mkdir(dir, 0755);
+	strncat(dir, "/kms-quads", sizeof(dir) - strlen(dir) - 1);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		debug("Can't create pipeline cache dir %s: %s\n", dir, strerror(errno));
+		return false;
+	}
+
+	char uuid[2 * VK_UUID_SIZE + 1];
+	for (unsigned i = 0u; i < VK_UUID_SIZE; ++i) {
+		snprintf(uuid + 2 * i, 3, "%02x", dev->device_uuid[i]);
+	}
+
+	len = snprintf(path, size, "%s/pipeline-%s-%08" PRIx32 ".bin",
+		dir, uuid, dev->phdev_props.driverVersion);
+	return len > 0 && (size_t) len < size;
+}
+
+// Reads the pipeline cache data from disk, if there is any we can use.
+// Drivers are supposed to check the header themselves and ignore data
+// that isn't theirs, but not all of them are that robust, so we check
+// that it was written by the same device and driver build ourselves.
+static void *pipeline_cache_load(struct vk_device *dev, const char *path,
+		size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	void *data = NULL;
+	long len;
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 32 ||
+			fseek(f, 0, SEEK_SET) != 0) {
+		goto out;
+	}
+
+	data = malloc(len);
+	assert(data);
+	if (fread(data, 1, len, f) != (size_t) len) {
+		goto err;
+	}
+
+	uint32_t header[4];
+	memcpy(header, data, sizeof(header));
+	if (header[0] < 32 || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+			header[2] != dev->phdev_props.vendorID ||
+			header[3] != dev->phdev_props.deviceID ||
+			memcmp((uint8_t *) data + 16, dev->phdev_props.pipelineCacheUUID,
+				VK_UUID_SIZE) != 0) {
+		debug("Ignoring stale pipeline cache %s\n", path);
+		goto err;
+	}
+
+	*size = len;
+	goto out;
+
+err:
+	free(data);
+	data = NULL;
+out:
+	fclose(f);
+	return data;
+}
+
+// Writes the pipeline cache data back to disk. We write to a temporary
+// file first and then rename it into place, so that a concurrently
+// starting instance (or a crash halfway through) never sees a
+// partially written cache.
+static void pipeline_cache_store(struct vk_device *dev, VkPipelineCache cache,
+		const char *path)
+{
+	size_t size = 0;
+	VkResult res = vkGetPipelineCacheData(dev->dev, cache, &size, NULL);
+	if (res != VK_SUCCESS || size == 0) {
+		return;
+	}
+
+	void *data = malloc(size);
+	assert(data);
+	res = vkGetPipelineCacheData(dev->dev, cache, &size, data);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkGetPipelineCacheData");
+		free(data);
+		return;
+	}
+
+	char tmp_path[512];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long) getpid());
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		debug("Can't write pipeline cache %s: %s\n", tmp_path, strerror(errno));
+		free(data);
+		return;
+	}
+
+	bool ok = fwrite(data, 1, size, f) == size;
+	ok &= fclose(f) == 0;
+	if (!ok || rename(tmp_path, path) != 0) {
+		error("Failed to write pipeline cache %s\n", path);
+		unlink(tmp_path);
+	} else {
+		debug("Wrote %zu bytes of pipeline cache to %s\n", size, path);
+	}
+
+	free(data);
+}
+
+static bool init_graphics_pipeline(struct vk_device *dev, VkPipelineCache cache);
+
+// Entry point for the pipeline thread: compiles our pipeline, seeding
+// the driver with whatever we cached last time and storing the result
+// for the next start.
+static void *pipeline_thread(void *data)
+{
+	struct vk_device *dev = data;
+	char path[512];
+	bool have_path = pipeline_cache_path(dev, path, sizeof(path));
+	size_t initial_size = 0;
+	void *initial = NULL;
+	if (have_path) {
+		initial = pipeline_cache_load(dev, path, &initial_size);
+	}
+
+	VkPipelineCacheCreateInfo pci = {0};
+	pci.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	pci.initialDataSize = initial_size;
+	pci.pInitialData = initial;
+
+	VkPipelineCache cache = VK_NULL_HANDLE;
+	VkResult res = vkCreatePipelineCache(dev->dev, &pci, NULL, &cache);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreatePipelineCache");
+		cache = VK_NULL_HANDLE;
+	}
+	free(initial);
+
+	debug("Compiling pipeline (%s cache data)\n",
+		initial_size ? "with" : "without");
+	bool ok = init_graphics_pipeline(dev, cache);
+
+	if (cache) {
+		if (ok && have_path) {
+			pipeline_cache_store(dev, cache, path);
+		}
+		vkDestroyPipelineCache(dev->dev, cache, NULL);
+	}
+
+	return NULL;
+}
+
+// B8G8R8A8 corresponds to the XRGB8888 drm format. It's guaranteed to
+// be supported by the vulkan spec for everything we need. SRGB is the
+// correct choice here, as always; you'd see that when rendering a
+// texture. But with KMS_COLOR the CRTC encodes our output for the
+// display instead, so we want the colors written as they are, and
+// 10-bit formats (KMS_DEEP_COLOR) have no SRGB variant anyway. The
+// fragment shader then doesn't need to linearize its colors; see the
+// specialization constant in init_graphics_pipeline.
+static void pick_format(struct vk_device *dev, struct device *device)
+{
+	if (device->color.deep) {
+		dev->format = VK_FORMAT_A2R10G10B10_UNORM_PACK32;
+		dev->drm_format = DRM_FORMAT_XRGB2101010;
+	} else if (device->color.enabled) {
+		dev->format = VK_FORMAT_B8G8R8A8_UNORM;
+		dev->drm_format = DRM_FORMAT_XRGB8888;
+	} else {
+		dev->format = VK_FORMAT_B8G8R8A8_SRGB;
+		dev->drm_format = DRM_FORMAT_XRGB8888;
+	}
+}
+
 static bool init_pipeline(struct vk_device *dev)
 {
 	// render pass
@@ -366,7 +754,7 @@ static bool init_pipeline(struct vk_device *dev)
 	// we always render the full image. For incremental presentation you
 	// have to use LOAD_OP_STORE and a valid image layout.
 	VkAttachmentDescription attachment = {0};
-	attachment.format = format;
+	attachment.format = dev->format;
 	attachment.samples = VK_SAMPLE_COUNT_1_BIT;
 	attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	// attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
@@ -408,7 +796,7 @@ static bool init_pipeline(struct vk_device *dev)
 	VkDescriptorSetLayoutBinding binding = {0};
 	binding.binding = 0;
 	binding.descriptorCount = 1;
-	binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
 	VkDescriptorSetLayoutCreateInfo dli = {0};
@@ -431,7 +819,36 @@ static bool init_pipeline(struct vk_device *dev)
 		return false;
 	}
 
-	// pipeline
+	// the pipeline itself is compiled in the background, everything
+	// else can go on in the meantime
+	int err = pthread_create(&dev->pipe_thread, NULL, pipeline_thread, dev);
+	if (err != 0) {
+		error("Failed to create pipeline thread: %s\n", strerror(err));
+		return false;
+	}
+
+	dev->pipe_thread_running = true;
+	return true;
+}
+
+// Returns whether the pipeline was created successfully, waiting
+// for the pipeline thread to finish if needed. Only called from the
+// main thread: device_open waits for it once it's done probing, before
+// any output can start rendering, and vk_device_destroy after.
+bool vk_device_wait_pipeline(struct vk_device *dev)
+{
+	if (dev->pipe_thread_running) {
+		pthread_join(dev->pipe_thread, NULL);
+		dev->pipe_thread_running = false;
+	}
+
+	return dev->pipe != VK_NULL_HANDLE;
+}
+
+static bool init_graphics_pipeline(struct vk_device *dev, VkPipelineCache cache)
+{
+	VkResult res;
+
 	VkShaderModule vert_module;
 	VkShaderModule frag_module;
 
@@ -454,12 +871,26 @@ static bool init_pipeline(struct vk_device *dev)
 		return false;
 	}
 
+	// the fragment shader only has to linearize its colors when the
+	// render target encodes them again, see pick_format
+	VkBool32 srgb_target = (dev->format == VK_FORMAT_B8G8R8A8_SRGB);
+	VkSpecializationMapEntry spec_entry = {0};
+	spec_entry.constantID = 0;
+	spec_entry.offset = 0;
+	spec_entry.size = sizeof(srgb_target);
+
+	VkSpecializationInfo spec = {0};
+	spec.mapEntryCount = 1;
+	spec.pMapEntries = &spec_entry;
+	spec.dataSize = sizeof(srgb_target);
+	spec.pData = &srgb_target;
+
 	VkPipelineShaderStageCreateInfo pipe_stages[2] = {{
 			VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
 			NULL, 0, VK_SHADER_STAGE_VERTEX_BIT, vert_module, "main", NULL
 		}, {
 			VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-			NULL, 0, VK_SHADER_STAGE_FRAGMENT_BIT, frag_module, "main", NULL
+			NULL, 0, VK_SHADER_STAGE_FRAGMENT_BIT, frag_module, "main", &spec
 		}
 	};
 
@@ -524,8 +955,6 @@ static bool init_pipeline(struct vk_device *dev)
 	pipe_info.pDynamicState = &dynamic;
 	pipe_info.pVertexInputState = &vertex;
 
-	// could use a cache here for faster loading
-	VkPipelineCache cache = VK_NULL_HANDLE;
 	res = vkCreateGraphicsPipelines(dev->dev, cache, 1, &pipe_info,
 		NULL, &dev->pipe);
 	vkDestroyShaderModule(dev->dev, vert_module, NULL);
@@ -538,6 +967,225 @@ static bool init_pipeline(struct vk_device *dev)
 	return true;
 }
 
+// Creates a chunk of the uniform arena, with its own descriptor set; see
+// vk_arena_chunk.
+static struct vk_arena_chunk *arena_chunk_create(struct vk_device *vk_dev)
+{
+	VkResult res;
+
+	struct vk_arena_chunk *chunk = calloc(1, sizeof(*chunk));
+	if (!chunk) {
+		return NULL;
+	}
+
+	VkBufferCreateInfo bi = {0};
+	bi.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bi.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	bi.size = vk_dev->arena.stride * VK_ARENA_CHUNK_SLOTS;
+	bi.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	res = vkCreateBuffer(vk_dev->dev, &bi, NULL, &chunk->buffer);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreateBuffer");
+		goto error;
+	}
+
+	VkMemoryRequirements bmr = {0};
+	vkGetBufferMemoryRequirements(vk_dev->dev, chunk->buffer, &bmr);
+
+	// the vulkan spec guarantees that non-sparse buffers can
+	// always be allocated on host visible, coherent memory, i.e.
+	// we must find a valid memory type.
+	VkMemoryAllocateInfo mai = {0};
+	mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	mai.allocationSize = bmr.size;
+	int mem_type = find_mem_type(vk_dev->phdev,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, bmr.memoryTypeBits);
+	assert(mem_type >= 0);
+	mai.memoryTypeIndex = mem_type;
+	res = vkAllocateMemory(vk_dev->dev, &mai, NULL, &chunk->mem);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkAllocateMemory");
+		goto error;
+	}
+
+	res = vkBindBufferMemory(vk_dev->dev, chunk->buffer, chunk->mem, 0);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkBindBufferMemory");
+		goto error;
+	}
+
+	// mapped for as long as the device lives
+	void *map;
+	res = vkMapMemory(vk_dev->dev, chunk->mem, 0, VK_WHOLE_SIZE, 0, &map);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkMapMemory");
+		goto error;
+	}
+	chunk->map = map;
+
+	// descriptor pools can't grow, so each chunk has one just big
+	// enough for its own set
+	VkDescriptorPoolSize pool_size = {0};
+	pool_size.descriptorCount = 1;
+	pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+
+	VkDescriptorPoolCreateInfo dpi = {0};
+	dpi.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	dpi.maxSets = 1;
+	dpi.poolSizeCount = 1u;
+	dpi.pPoolSizes = &pool_size;
+	res = vkCreateDescriptorPool(vk_dev->dev, &dpi, NULL, &chunk->ds_pool);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreateDescriptorPool");
+		goto error;
+	}
+
+	VkDescriptorSetAllocateInfo dai = {0};
+	dai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	dai.descriptorPool = chunk->ds_pool;
+	dai.descriptorSetCount = 1;
+	dai.pSetLayouts = &vk_dev->ds_layout;
+	res = vkAllocateDescriptorSets(vk_dev->dev, &dai, &chunk->ds);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkAllocateDescriptorSets");
+		goto error;
+	}
+
+	// the range is one slot; which one is given by the dynamic offset
+	// when binding
+	VkDescriptorBufferInfo buffer_info = {0};
+	buffer_info.buffer = chunk->buffer;
+	buffer_info.offset = 0;
+	buffer_info.range = sizeof(float);
+
+	VkWriteDescriptorSet write = {0};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	write.pBufferInfo = &buffer_info;
+	write.descriptorCount = 1;
+	write.dstSet = chunk->ds;
+	vkUpdateDescriptorSets(vk_dev->dev, 1, &write, 0, NULL);
+
+	// hand out the low slots first
+	for (uint32_t i = 0u; i < VK_ARENA_CHUNK_SLOTS; ++i) {
+		chunk->free_slots[i] = VK_ARENA_CHUNK_SLOTS - 1 - i;
+	}
+	chunk->num_free = VK_ARENA_CHUNK_SLOTS;
+	return chunk;
+
+error:
+	arena_chunk_destroy(vk_dev, chunk);
+	return NULL;
+}
+
+// Sets up the uniform arena (see vk_device.arena) with its first chunk.
+static bool init_arena(struct vk_device *vk_dev)
+{
+	// our uniform data is a single float
+	VkDeviceSize align = vk_dev->phdev_props.limits.minUniformBufferOffsetAlignment;
+	if (align < sizeof(float)) {
+		align = sizeof(float);
+	}
+	vk_dev->arena.stride = (sizeof(float) + align - 1) & ~(align - 1);
+
+	vk_dev->arena.chunks = arena_chunk_create(vk_dev);
+	return vk_dev->arena.chunks != NULL;
+}
+
+// Takes a slot in the uniform arena for an image, adding a chunk if all
+// the ones we have are full. Chunks are only freed with the device, so
+// the first one with a free slot is usually the first we look at. Must
+// be called with pool_lock held.
+static bool vk_arena_get(struct vk_device *vk_dev, struct vk_image *img)
+{
+	struct vk_arena_chunk *chunk = vk_dev->arena.chunks;
+	while (chunk && chunk->num_free == 0) {
+		chunk = chunk->next;
+	}
+
+	if (!chunk) {
+		chunk = arena_chunk_create(vk_dev);
+		if (!chunk) {
+			return false;
+		}
+		chunk->next = vk_dev->arena.chunks;
+		vk_dev->arena.chunks = chunk;
+	}
+
+	img->ubo_chunk = chunk;
+	img->ubo_slot = chunk->free_slots[--chunk->num_free];
+	img->ubo_map = chunk->map + img->ubo_slot * vk_dev->arena.stride;
+	return true;
+}
+
+// Gives an image's arena slot back. Must be called with pool_lock held.
+static void vk_arena_put(struct vk_device *vk_dev, struct vk_image *img)
+{
+	if (img->ubo_slot < 0) {
+		return;
+	}
+
+	struct vk_arena_chunk *chunk = img->ubo_chunk;
+	chunk->free_slots[chunk->num_free++] = img->ubo_slot;
+	img->ubo_chunk = NULL;
+	img->ubo_slot = -1;
+	img->ubo_map = NULL;
+}
+
+// Takes a command buffer, from the spare ones if possible. When we run
+// out, we allocate VK_CB_CHUNK at once, so a pool of n buffers costs
+// n / VK_CB_CHUNK allocations. Must be called with pool_lock held.
+static VkCommandBuffer vk_cb_get(struct vk_device *vk_dev)
+{
+	if (vk_dev->spare_cbs.count == 0) {
+		if (vk_dev->spare_cbs.capacity < VK_CB_CHUNK) {
+			VkCommandBuffer *cbs = realloc(vk_dev->spare_cbs.cbs,
+				VK_CB_CHUNK * sizeof(*cbs));
+			if (!cbs) {
+				return VK_NULL_HANDLE;
+			}
+			vk_dev->spare_cbs.cbs = cbs;
+			vk_dev->spare_cbs.capacity = VK_CB_CHUNK;
+		}
+
+		VkCommandBufferAllocateInfo cmd_buf_info = {0};
+		cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		cmd_buf_info.commandPool = vk_dev->command_pool;
+		cmd_buf_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		cmd_buf_info.commandBufferCount = VK_CB_CHUNK;
+		VkResult res = vkAllocateCommandBuffers(vk_dev->dev, &cmd_buf_info,
+			vk_dev->spare_cbs.cbs);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkAllocateCommandBuffers");
+			return VK_NULL_HANDLE;
+		}
+		vk_dev->spare_cbs.count = VK_CB_CHUNK;
+	}
+
+	return vk_dev->spare_cbs.cbs[--vk_dev->spare_cbs.count];
+}
+
+// Gives a command buffer back for reuse. The pool was created with
+// RESET_COMMAND_BUFFER_BIT, so beginning it again implicitly resets it.
+// Must be called with pool_lock held.
+static void vk_cb_put(struct vk_device *vk_dev, VkCommandBuffer cb)
+{
+	if (vk_dev->spare_cbs.count == vk_dev->spare_cbs.capacity) {
+		uint32_t capacity = 2 * vk_dev->spare_cbs.capacity;
+		VkCommandBuffer *cbs = realloc(vk_dev->spare_cbs.cbs,
+			capacity * sizeof(*cbs));
+		if (!cbs) {
+			vkFreeCommandBuffers(vk_dev->dev, vk_dev->command_pool, 1, &cb);
+			return;
+		}
+		vk_dev->spare_cbs.cbs = cbs;
+		vk_dev->spare_cbs.capacity = capacity;
+	}
+
+	vk_dev->spare_cbs.cbs[vk_dev->spare_cbs.count++] = cb;
+}
+
 struct vk_device *vk_device_create(struct device *device)
 {
 	// check for drm device support
@@ -570,6 +1218,8 @@ struct vk_device *vk_device_create(struct device *device)
 
 	struct vk_device *vk_dev = calloc(1, sizeof(*vk_dev));
 	assert(vk_dev);
+	pthread_mutex_init(&vk_dev->queue_lock, NULL);
+	pthread_mutex_init(&vk_dev->pool_lock, NULL);
 
 	// create instance
 	const char *req = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
@@ -643,11 +1293,12 @@ struct vk_device *vk_device_create(struct device *device)
 		}
 	}
 
-	// get pci information of device
+	// we render on the gpu our gbm device is on: the render node
+	// with $KMS_RENDER_NODE, otherwise the one driving kms
+	int drm_fd = device->render_fd >= 0 ? device->render_fd : device->kms_fd;
 	drmDevicePtr drm_dev;
-	drmGetDevice(device->kms_fd, &drm_dev);
-	if(drm_dev->bustype != DRM_BUS_PCI) {
-		error("Given device isn't a pci device\n");
+	if (drmGetDevice2(drm_fd, 0, &drm_dev) != 0) {
+		error("Couldn't get drm device information\n");
 		goto error;
 	}
 
@@ -656,6 +1307,7 @@ struct vk_device *vk_device_create(struct device *device)
 	uint32_t num_phdevs;
 	res = vkEnumeratePhysicalDevices(vk_dev->instance, &num_phdevs, NULL);
 	if (res != VK_SUCCESS || num_phdevs == 0) {
+		drmFreeDevice(&drm_dev);
 		vk_error(res, "Could not retrieve physical device");
 		goto error;
 	}
@@ -664,26 +1316,30 @@ struct vk_device *vk_device_create(struct device *device)
 	res = vkEnumeratePhysicalDevices(vk_dev->instance, &num_phdevs, phdevs);
 	if (res != VK_SUCCESS || num_phdevs == 0) {
 		free(phdevs);
+		drmFreeDevice(&drm_dev);
 		vk_error(res, "Could not retrieve physical device");
 		goto error;
 	}
 
-	drmPciBusInfoPtr pci = drm_dev->businfo.pci;
-	debug("PCI bus: %04x:%02x:%02x.%x\n", pci->domain,
-		pci->bus, pci->dev, pci->func);
+	if (drm_dev->bustype == DRM_BUS_PCI) {
+		drmPciBusInfoPtr pci = drm_dev->businfo.pci;
+		debug("PCI bus: %04x:%02x:%02x.%x\n", pci->domain,
+			pci->bus, pci->dev, pci->func);
+	}
 
 	VkExtensionProperties *phdev_exts = NULL;
 	uint32_t phdev_extc = 0;
 	VkPhysicalDevice phdev = VK_NULL_HANDLE;
 	for (unsigned i = 0u; i < num_phdevs; ++i) {
 		VkPhysicalDevice phdevi = phdevs[i];
-		if (match(drm_dev->businfo.pci, phdevi, &phdev_extc, &phdev_exts)) {
+		if (match(drm_fd, drm_dev, phdevi, &phdev_extc, &phdev_exts)) {
 			phdev = phdevi;
 			break;
 		}
 	}
 
 	free(phdevs);
+	drmFreeDevice(&drm_dev);
 	if (phdev == VK_NULL_HANDLE) {
 		error("Can't find vulkan physical device for drm dev\n");
 		goto error;
@@ -695,6 +1351,16 @@ struct vk_device *vk_device_create(struct device *device)
 
 	vk_dev->phdev = phdev;
 
+	// used to key our on-disk pipeline cache
+	VkPhysicalDeviceIDProperties id_props = {0};
+	id_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+	VkPhysicalDeviceProperties2 props2 = {0};
+	props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	props2.pNext = &id_props;
+	vkGetPhysicalDeviceProperties2(phdev, &props2);
+	vk_dev->phdev_props = props2.properties;
+	memcpy(vk_dev->device_uuid, id_props.deviceUUID, VK_UUID_SIZE);
+
 	// query extensions
 	const char* dev_exts[8];
 	uint32_t dev_extc = 0;
@@ -797,22 +1463,6 @@ struct vk_device *vk_device_create(struct device *device)
 		goto error;
 	}
 
-	// descriptor pool
-	VkDescriptorPoolSize pool_size = {0};
-	pool_size.descriptorCount = BUFFER_QUEUE_DEPTH;
-	pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-
-	VkDescriptorPoolCreateInfo dpi = {0};
-	dpi.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	dpi.maxSets = BUFFER_QUEUE_DEPTH;
-	dpi.poolSizeCount = 1u;
-	dpi.pPoolSizes = &pool_size;
-	res = vkCreateDescriptorPool(vk_dev->dev, &dpi, NULL, &vk_dev->ds_pool);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkCreateDescriptorPool");
-		goto error;
-	}
-
 	if (vk_dev->explicit_fencing) {
 		// semaphore import/export support
 		// we import kms_fence_fd as semaphore and add that as wait semaphore
@@ -863,11 +1513,16 @@ struct vk_device *vk_device_create(struct device *device)
 		goto error;
 	}
 
-	// init renderpass and pipeline
+	// init renderpass and start compiling the pipeline
+	pick_format(vk_dev, device);
 	if (!init_pipeline(vk_dev)) {
 		goto error;
 	}
 
+	if (!init_arena(vk_dev)) {
+		goto error;
+	}
+
 	device->vk_device = vk_dev;
 	return vk_dev;
 
@@ -891,6 +1546,11 @@ bool output_vulkan_setup(struct output *output)
 	}
 
 	output->explicit_fencing &= vk_dev->explicit_fencing;
+	if (output->format != vk_dev->drm_format) {
+		error("[%s] Vulkan renders every output in the same format, "
+			"but this one can't scan it out\n", output->name);
+		return false;
+	}
 	if (output->num_modifiers == 0) {
 		error("Output doesn't support any modifiers, vulkan requires modifiers");
 		return false;
@@ -915,8 +1575,12 @@ bool output_vulkan_setup(struct output *output)
 	VkPhysicalDeviceImageFormatInfo2 fmti = {0};
 	fmti.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
 	fmti.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	if (output->device->capture.enabled) {
+		// we copy captured frames out of our images
+		fmti.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
 	fmti.type = VK_IMAGE_TYPE_2D;
-	fmti.format = format;
+	fmti.format = vk_dev->format;
 	fmti.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 	fmti.pNext = &efmti;
 
@@ -972,7 +1636,8 @@ bool output_vulkan_setup(struct output *output)
 	return true;
 }
 
-struct buffer *buffer_vk_create(struct device *device, struct output *output)
+struct buffer *buffer_vk_create(struct device *device, struct output *output,
+		uint32_t width, uint32_t height)
 {
 	struct vk_image *img = calloc(1, sizeof(*img));
 	struct vk_device *vk_dev = device->vk_device;
@@ -983,22 +1648,22 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 
 	// fill buffer info
 	img->first = true;
+	img->ubo_slot = -1;
 	img->buffer.output = output;
 	img->buffer.render_fence_fd = -1;
 	img->buffer.kms_fence_fd = -1;
-	img->buffer.format = DRM_FORMAT_XRGB8888;
-	img->buffer.width = output->mode.hdisplay;
-	img->buffer.height = output->mode.vdisplay;
-	uint32_t width = img->buffer.width;
-	uint32_t height = img->buffer.height;
-
-	// create gbm bo with modifiers supported by output and vulkan
+	img->buffer.format = output->format;
+	img->buffer.width = width;
+	img->buffer.height = height;
+
+	// create gbm bo with modifiers supported by output and vulkan,
+	// or just the one main.c picked for this output
+	const uint64_t *modifiers;
+	unsigned int num_modifiers = output_modifiers_get(output, &modifiers);
 	img->buffer.gbm.bo = gbm_bo_create_with_modifiers(device->gbm_device,
-	   width, height, DRM_FORMAT_XRGB8888,
-	   output->modifiers, output->num_modifiers);
+	   width, height, output->format, modifiers, num_modifiers);
 	if (!img->buffer.gbm.bo) {
-		error("failed to create %u x %u BO\n", output->mode.hdisplay,
-			output->mode.vdisplay);
+		error("failed to create %u x %u BO\n", width, height);
 		goto err;
 	}
 
@@ -1018,7 +1683,10 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 		}
 		img->buffer.gem_handles[i] = h.u32;
 
-		dma_buf_fds[i] = handle_to_fd(device, img->buffer.gem_handles[i]);
+		dma_buf_fds[i] = handle_to_fd(device->render_fd >= 0 ?
+					      device->render_fd :
+					      device->kms_fd,
+					      img->buffer.gem_handles[i]);
 		if (dma_buf_fds[i] == -1) {
 			error("failed to get file descriptor for BO plane %d (modifier 0x%" PRIx64 ")\n",
 			      i, img->buffer.modifier);
@@ -1041,6 +1709,13 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 		plane_layouts[i].size = 0; // vulkan spec says must be 0
 	}
 
+	// the bo's gem handles are only valid on the render gpu; if that's
+	// not our kms device, we also need to import the dma_bufs there,
+	// before vulkan takes ownership of them below
+	if (device->render_fd >= 0) {
+		buffer_prime_import(device, &img->buffer, dma_buf_fds, num_planes);
+	}
+
 	// TODO: could all planes point to the same dma_buf object?
 	// we can compare that via the SYS_kcmp syscall on linux,
 	// is that valid here? In that case we can get away with 1 memory
@@ -1054,7 +1729,7 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 	VkImageCreateInfo img_info = {0};
 	img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	img_info.imageType = VK_IMAGE_TYPE_2D;
-	img_info.format = format;
+	img_info.format = vk_dev->format;
 	img_info.mipLevels = 1;
 	img_info.arrayLayers = 1;
 	img_info.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -1064,6 +1739,9 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 	img_info.extent.height = height;
 	img_info.extent.depth = 1;
 	img_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	if (device->capture.enabled) {
+		img_info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
 	if (disjoint) {
 		img_info.flags = VK_IMAGE_CREATE_DISJOINT_BIT;
 	}
@@ -1172,7 +1850,7 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 	VkImageViewCreateInfo view_info = {0};
 	view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 	view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	view_info.format = format;
+	view_info.format = vk_dev->format;
 	view_info.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
 	view_info.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
 	view_info.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
@@ -1204,85 +1882,25 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 		goto err;
 	}
 
-	// create ubo and descriptor set
-	const float ubo_size = 4;
-	VkBufferCreateInfo bi = {0};
-	bi.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bi.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	bi.size = ubo_size;
-	bi.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-	res = vkCreateBuffer(vk_dev->dev, &bi, NULL, &img->ubo);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkCreateBuffer");
-		goto err;
-	}
-
-	VkMemoryRequirements bmr = {0};
-	vkGetBufferMemoryRequirements(vk_dev->dev, img->ubo, &bmr);
-
-	VkMemoryAllocateInfo mai = {0};
-	mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	mai.allocationSize = bmr.size;
-
-	// the vulkan spec guarantees that non-sparse buffers can
-	// always be allocated on host visible, coherent memory, i.e.
-	// we must find a valid memory type.
-	int mem_type = find_mem_type(vk_dev->phdev,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, bmr.memoryTypeBits);
-	assert(mem_type >= 0);
-	mai.memoryTypeIndex = mem_type;
-	res = vkAllocateMemory(vk_dev->dev, &mai, NULL, &img->ubo_mem);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkAllocateMemory");
-		goto err;
-	}
-
-	res = vkBindBufferMemory(vk_dev->dev, img->ubo, img->ubo_mem, 0);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkBindBufferMemory");
-		goto err;
-	}
-
-	res = vkMapMemory(vk_dev->dev, img->ubo_mem, 0, ubo_size, 0, &img->ubo_map);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkMapMemory");
-		goto err;
-	}
-
-	VkDescriptorSetAllocateInfo dai = {0};
-	dai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	dai.descriptorPool = vk_dev->ds_pool;
-	dai.descriptorSetCount = 1;
-	dai.pSetLayouts = &vk_dev->ds_layout;
-	res = vkAllocateDescriptorSets(vk_dev->dev, &dai, &img->ds);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkAllocateDescriptorSets");
+	// take a slot in the uniform arena
+	pthread_mutex_lock(&vk_dev->pool_lock);
+	bool have_slot = vk_arena_get(vk_dev, img);
+	pthread_mutex_unlock(&vk_dev->pool_lock);
+	if (!have_slot) {
+		error("Couldn't grow the uniform arena\n");
 		goto err;
 	}
+	uint32_t ubo_offset = img->ubo_slot * vk_dev->arena.stride;
 
-	VkDescriptorBufferInfo buffer_info = {0};
-	buffer_info.buffer = img->ubo;
-	buffer_info.offset = 0;
-	buffer_info.range = ubo_size;
-
-	VkWriteDescriptorSet write = {0};
-	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	write.pBufferInfo = &buffer_info;
-	write.descriptorCount = 1;
-	write.dstSet = img->ds;
-	vkUpdateDescriptorSets(vk_dev->dev, 1, &write, 0, NULL);
+	// device_open already waited for the pipeline thread, and fell
+	// back to gl if it failed
+	assert(vk_dev->pipe);
 
 	// create and record render command buffer
-	VkCommandBufferAllocateInfo cmd_buf_info = {0};
-	cmd_buf_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	cmd_buf_info.commandPool = vk_dev->command_pool;
-	cmd_buf_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	cmd_buf_info.commandBufferCount = 1u;
-	res = vkAllocateCommandBuffers(vk_dev->dev, &cmd_buf_info, &img->cb);
-	if (res != VK_SUCCESS) {
-		vk_error(res, "vkAllocateCommandBuffers");
+	pthread_mutex_lock(&vk_dev->pool_lock);
+	img->cb = vk_cb_get(vk_dev);
+	if (!img->cb) {
+		pthread_mutex_unlock(&vk_dev->pool_lock);
 		goto err;
 	}
 
@@ -1350,7 +1968,7 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 
 	vkCmdBindPipeline(img->cb, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_dev->pipe);
 	vkCmdBindDescriptorSets(img->cb, VK_PIPELINE_BIND_POINT_GRAPHICS,
-		vk_dev->pipe_layout, 0, 1, &img->ds, 0, NULL);
+		vk_dev->pipe_layout, 0, 1, &img->ubo_chunk->ds, 1, &ubo_offset);
 	vkCmdDraw(img->cb, 4, 1, 0, 0);
 
 	vkCmdEndRenderPass(img->cb);
@@ -1367,6 +1985,7 @@ struct buffer *buffer_vk_create(struct device *device, struct output *output)
 		0, NULL, 1, &barrier);
 
 	vkEndCommandBuffer(img->cb);
+	pthread_mutex_unlock(&vk_dev->pool_lock);
 
 	// create semaphore that will be used for importing bufer->kms_fence_fd
 	VkSemaphoreCreateInfo sem_info = {0};
@@ -1421,6 +2040,23 @@ void buffer_vk_destroy(struct device *device, struct buffer *buffer)
 	}
 
 	VkResult res;
+	if (img->capture) {
+		res = vkWaitForFences(vk_dev->dev, 1, &img->capture->fence, false, UINT64_MAX);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkWaitForFences");
+		}
+		img->capture->img = NULL;
+		img->capture = NULL;
+	}
+	if (img->batch_fence) {
+		res = vkWaitForFences(vk_dev->dev, 1, &img->batch_fence->fence, false, UINT64_MAX);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkWaitForFences");
+		}
+		img->batch_fence->refs--;
+		img->batch_fence = NULL;
+		img->first = true; // render_fence isn't pending
+	}
 	if (img->render_fence) {
 		if (!img->first) {
 			res = vkWaitForFences(vk_dev->dev, 1, &img->render_fence, false, UINT64_MAX);
@@ -1432,8 +2068,14 @@ void buffer_vk_destroy(struct device *device, struct buffer *buffer)
 		vkDestroyFence(vk_dev->dev, img->render_fence, NULL);
 	}
 
-	// no need to free command buffer or descriptor sets, we will destroy
-	// the pools and implicitly free them
+	// buffers come and go whilst the device lives, so we can't just
+	// leave this to destroying the pools
+	pthread_mutex_lock(&vk_dev->pool_lock);
+	if (img->cb) {
+		vk_cb_put(vk_dev, img->cb);
+	}
+	vk_arena_put(vk_dev, img);
+	pthread_mutex_unlock(&vk_dev->pool_lock);
 
 	if (img->buffer_semaphore) {
 		vkDestroySemaphore(vk_dev->dev, img->buffer_semaphore, NULL);
@@ -1450,12 +2092,6 @@ void buffer_vk_destroy(struct device *device, struct buffer *buffer)
 	if (img->image) {
 		vkDestroyImage(vk_dev->dev, img->image, NULL);
 	}
-	if (img->ubo) {
-		vkDestroyBuffer(vk_dev->dev, img->ubo, NULL);
-	}
-	if (img->ubo_mem) {
-		vkFreeMemory(vk_dev->dev, img->ubo_mem, NULL);
-	}
 
 	for (unsigned i = 0u; i < 4u; ++i) {
 		if (img->memories[i]) {
@@ -1470,6 +2106,174 @@ void buffer_vk_destroy(struct device *device, struct buffer *buffer)
 	if (img->buffer.gbm.bo) {
 		gbm_bo_destroy(img->buffer.gbm.bo);
 	}
+	buffer_prime_release(device, &img->buffer);
+}
+
+// Gives back the arena slot and command buffer of an image which will
+// never be rendered into again. A baked frame (see output_baked_frame) is
+// rendered once and then only ever flipped to, so it only needs them until
+// that one submission has completed; keeping them for good would grow the
+// arena by a whole animation's worth of slots.
+// Returns false, keeping both, if the submission is still pending.
+bool buffer_vk_retire(struct buffer *buffer)
+{
+	struct vk_image *img = (struct vk_image *)buffer;
+	struct vk_device *vk_dev = buffer->output->device->vk_device;
+	assert(vk_dev);
+
+	if (!img->cb) {
+		return true;
+	}
+
+	if (img->batch_fence) {
+		if (vkGetFenceStatus(vk_dev->dev, img->batch_fence->fence) != VK_SUCCESS) {
+			return false;
+		}
+		img->batch_fence->refs--;
+		img->batch_fence = NULL;
+		img->first = true; // render_fence isn't pending
+	} else if (!img->first &&
+			vkGetFenceStatus(vk_dev->dev, img->render_fence) != VK_SUCCESS) {
+		// either still rendering, or waiting in an unsubmitted batch
+		return false;
+	}
+
+	pthread_mutex_lock(&vk_dev->pool_lock);
+	vk_cb_put(vk_dev, img->cb);
+	vk_arena_put(vk_dev, img);
+	pthread_mutex_unlock(&vk_dev->pool_lock);
+
+	img->cb = VK_NULL_HANDLE;
+	return true;
+}
+
+// Returns a batch fence nobody refers to anymore, reset and ready to be
+// submitted, or a new one.
+static struct vk_batch_fence *batch_fence_get(struct vk_device *vk_dev)
+{
+	VkResult res;
+	struct vk_batch_fence *fence;
+	for (fence = vk_dev->batch.fences; fence; fence = fence->next) {
+		if (fence->refs > 0) {
+			continue;
+		}
+
+		// every image that referred to it has waited for it
+		res = vkResetFences(vk_dev->dev, 1, &fence->fence);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkResetFences");
+			return NULL;
+		}
+		return fence;
+	}
+
+	fence = calloc(1, sizeof(*fence));
+	if (!fence) {
+		return NULL;
+	}
+
+	VkFenceCreateInfo fence_info = {0};
+	fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	res = vkCreateFence(vk_dev->dev, &fence_info, NULL, &fence->fence);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreateFence");
+		free(fence);
+		return NULL;
+	}
+
+	fence->next = vk_dev->batch.fences;
+	vk_dev->batch.fences = fence;
+	return fence;
+}
+
+// Submits everything queued up in the batch with a single vkQueueSubmit,
+// then exports each output's render fence, like buffer_vk_fill does for
+// a single submission.
+static bool vk_batch_submit(struct vk_device *vk_dev)
+{
+	VkResult res;
+	uint32_t count = vk_dev->batch.count;
+	bool ok = true;
+	bool wait = false;
+
+	if (count == 0) {
+		return true;
+	}
+	vk_dev->batch.count = 0;
+
+	struct vk_batch_fence *fence = batch_fence_get(vk_dev);
+	if (!fence) {
+		error("Failed to get a fence for the batch\n");
+		return false;
+	}
+
+	pthread_mutex_lock(&vk_dev->queue_lock);
+	res = vkQueueSubmit(vk_dev->queue, count, vk_dev->batch.submits, fence->fence);
+	pthread_mutex_unlock(&vk_dev->queue_lock);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkQueueSubmit");
+		return false;
+	}
+
+	for (uint32_t i = 0u; i < count; ++i) {
+		struct vk_image *img = vk_dev->batch.images[i];
+		img->batch_fence = fence;
+		fence->refs++;
+
+		if (!img->buffer.output->explicit_fencing) {
+			wait = true;
+			continue;
+		}
+
+		// see buffer_vk_fill: the semaphore has a signal operation
+		// pending now, so we can export it
+		VkSemaphoreGetFdInfoKHR fdi = {0};
+		fdi.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+		fdi.semaphore = img->render_semaphore;
+		fdi.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+		int fd = -1;
+		res = vk_dev->api.getSemaphoreFdKHR(vk_dev->dev, &fdi, &fd);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkGetSemaphoreFdKHR");
+			ok = false;
+			continue;
+		}
+		fd_replace(&img->buffer.render_fence_fd, fd);
+	}
+
+	// stall when not able to use explicit fencing; one wait for
+	// the whole batch is enough
+	if (wait) {
+		res = vkWaitForFences(vk_dev->dev, 1, &fence->fence, false, UINT64_MAX);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkWaitForFences");
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+// Starts collecting buffer_vk_fill's submissions rather than submitting
+// each on its own. Every vkQueueSubmit takes the queue lock and goes
+// through the driver's submission path (often an ioctl), so when we
+// repaint several outputs in one go, we'd rather pay for that once.
+// The main loop does this around the outputs it is about to put in one
+// atomic commit, since none of them flip before that commit anyway.
+void vk_batch_begin(struct vk_device *vk_dev)
+{
+	assert(vk_dev->batch.count == 0);
+	vk_dev->batch.active = true;
+}
+
+// Submits the batch and stops batching. Buffers filled since
+// vk_batch_begin have their render_fence_fd set once this returns;
+// fence_deferred tells the caller which still need it added as
+// IN_FENCE_FD.
+bool vk_batch_flush(struct vk_device *vk_dev)
+{
+	vk_dev->batch.active = false;
+	return vk_batch_submit(vk_dev);
 }
 
 bool buffer_vk_fill(struct buffer *buffer, int frame_num)
@@ -1480,13 +2284,26 @@ bool buffer_vk_fill(struct buffer *buffer, int frame_num)
 	assert(vk_dev);
 	VkResult res;
 
+	// retired images (see buffer_vk_retire) are never rendered again
+	assert(img->cb);
+
 	// update frame number in mapped memory
 	*(float*)img->ubo_map = ((float)frame_num) / NUM_ANIM_FRAMES;
 
 	// make the validation layers happy and assert that the command
 	// buffer really has finished. Otherwise it's an error in the drm
-	// subsystem/an error in our program (buffer reuse) logic
-	if (!img->first) {
+	// subsystem/an error in our program (buffer reuse) logic.
+	// If it was last submitted in a batch, only the batch's fence was
+	// signaled, and our own one is still reset from before.
+	if (img->batch_fence) {
+		res = vkGetFenceStatus(vk_dev->dev, img->batch_fence->fence);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "Invalid batch fence status");
+		}
+
+		img->batch_fence->refs--;
+		img->batch_fence = NULL;
+	} else if (!img->first) {
 		res = vkGetFenceStatus(vk_dev->dev, img->render_fence);
 		if (res != VK_SUCCESS) {
 			vk_error(res, "Invalid render_fence status");
@@ -1500,10 +2317,26 @@ bool buffer_vk_fill(struct buffer *buffer, int frame_num)
 		img->first = false;
 	}
 
+	// The copy out of the image for a capture has normally long finished
+	// by the time we render into it again, but we mustn't overwrite it
+	// before it has.
+	if (img->capture) {
+		res = vkWaitForFences(vk_dev->dev, 1, &img->capture->fence, false, UINT64_MAX);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkWaitForFences");
+		}
+		img->capture->img = NULL;
+		img->capture = NULL;
+	}
+
 	// submit the buffers command buffer
 	// for explicit fencing:
-	// - it waits for the kms_fence_fd semaphore
+	// - it waits for the kms_fence_fd semaphore, if there is one
 	// - upon completion, it signals the render semaphore
+	// All semaphores and fences used here are created once together
+	// with the buffer, so steady-state frames allocate no vulkan objects.
+	// Note that timeline semaphores wouldn't help us here: they can't
+	// be exported or imported as sync_fd, which KMS needs.
 	VkPipelineStageFlags stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 	VkSubmitInfo submission = {0};
 	submission.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1511,40 +2344,30 @@ bool buffer_vk_fill(struct buffer *buffer, int frame_num)
 	submission.pCommandBuffers = &img->cb;
 
 	if (buffer->output->explicit_fencing) {
-		// we don't have to recreate it every frame but there
-		// are currently validation layer errors for sync_fd handles
-		// (don't reset payload on export) so we recreate the
-		// semaphore in every frame. Shouldn't hurt performance.
-		if (img->buffer_semaphore) {
-			vkDestroySemaphore(vk_dev->dev, img->render_semaphore, NULL);
-		}
-
-		VkExportSemaphoreCreateInfo esi = {0};
-		esi.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
-		esi.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
-
-		VkSemaphoreCreateInfo sem_info = {0};
-		sem_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-		sem_info.pNext = &esi;
-		res = vkCreateSemaphore(vk_dev->dev, &sem_info, NULL, &img->render_semaphore);
-		if (res != VK_SUCCESS) {
-			vk_error(res, "vkCreateSemaphore");
-			return false;
-		}
+		// The render semaphore is created once with the buffer and
+		// reused for every frame: exporting a sync_fd from it below
+		// (which has copy transference) resets its payload, just
+		// like a wait operation would, so it is unsignaled again by
+		// the time we signal it in the next submission.
+		submission.signalSemaphoreCount = 1u;
+		submission.pSignalSemaphores = &img->render_semaphore;
+	}
 
-		// importing semaphore transfers ownership to vulkan
-		// importing it as temporary (which is btw the only supported way
-		// for sync_fd semaphores) means that after the next wait operation,
-		// the semaphore is reset to its prior state, i.e. we can import
-		// a new semaphore next frame.
+	if (buffer->output->explicit_fencing && buffer->kms_fence_fd >= 0) {
+		// Importing the semaphore transfers ownership of the fd to
+		// vulkan on success, so we must not close it ourselves.
+		// Importing it as temporary (which is btw the only supported
+		// way for sync_fd semaphores) means that after the next wait
+		// operation, the semaphore is reset to its prior state, i.e.
+		// we can import a new fd into the same semaphore next frame.
 		// As mentioned in the egl backend, the whole kms_fence_fd
-		// is not needed with the current architecture of the application
-		// since we only re-use buffers after kms is finished with them.
-		// In real applications it might be useful though to use it.
+		// is not needed unless we render ahead since otherwise we
+		// only re-use buffers after kms is finished with them. When
+		// the buffer has not been shown yet, there is nothing to wait
+		// for at all.
 		VkImportSemaphoreFdInfoKHR isi = {0};
 		isi.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR;
 		isi.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
-		isi.fd = dup(buffer->kms_fence_fd);
 		isi.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT;
 		isi.fd = buffer->kms_fence_fd;
 		isi.semaphore = img->buffer_semaphore;
@@ -1553,25 +2376,47 @@ bool buffer_vk_fill(struct buffer *buffer, int frame_num)
 			vk_error(res, "vkImportSemaphoreFdKHR");
 			return false;
 		}
+		buffer->kms_fence_fd = -1;
 
-		submission.signalSemaphoreCount = 1u;
-		submission.pSignalSemaphores = &img->render_semaphore;
 		submission.waitSemaphoreCount = 1;
 		submission.pWaitDstStageMask = &stage;
 		submission.pWaitSemaphores = &img->buffer_semaphore;
 	}
 
+	// Within a batch, we just queue the submission up; vk_batch_flush
+	// submits it together with the other outputs' and exports the render
+	// fence. Outputs using async flips need their render fence right
+	// away, so they always submit on their own.
+	if (vk_dev->batch.active && !buffer->output->async.enabled) {
+		uint32_t n = vk_dev->batch.count;
+
+		vk_dev->batch.stages[n] = stage;
+		vk_dev->batch.submits[n] = submission;
+		vk_dev->batch.submits[n].pWaitDstStageMask = &vk_dev->batch.stages[n];
+		vk_dev->batch.images[n] = img;
+		vk_dev->batch.count++;
+
+		// don't let anyone pick up the previous frame's fence
+		fd_replace(&img->buffer.render_fence_fd, -1);
+		buffer->fence_deferred = buffer->output->explicit_fencing;
+
+		if (vk_dev->batch.count == VK_BATCH_MAX) {
+			if (!vk_batch_submit(vk_dev)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	pthread_mutex_lock(&vk_dev->queue_lock);
 	res = vkQueueSubmit(vk_dev->queue, 1, &submission, img->render_fence);
+	pthread_mutex_unlock(&vk_dev->queue_lock);
 	if (res != VK_SUCCESS) {
 		vk_error(res, "vkQueueSubmit");
 		return false;
 	}
 
 	if (buffer->output->explicit_fencing) {
-		if (img->buffer.render_fence_fd) {
-			close(img->buffer.render_fence_fd);
-		}
-
 		// We have to export the fence/semaphore *every frame* since
 		// we pass ownership to the kernel when passing the sync_fd.
 		// additionally, to export a fence as sync_fd, it
@@ -1584,12 +2429,16 @@ bool buffer_vk_fill(struct buffer *buffer, int frame_num)
 		fdi.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
 		fdi.semaphore = img->render_semaphore;
 		fdi.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
-		res = vk_dev->api.getSemaphoreFdKHR(vk_dev->dev, &fdi,
-			&img->buffer.render_fence_fd);
+		int fd = -1;
+		res = vk_dev->api.getSemaphoreFdKHR(vk_dev->dev, &fdi, &fd);
 		if (res != VK_SUCCESS) {
 			vk_error(res, "vkGetSemaphoreFdKHR");
 			return false;
 		}
+
+		// closes the previous frame's fd, if KMS didn't already
+		// take it from us
+		fd_replace(&img->buffer.render_fence_fd, fd);
 	} else {
 		// stall when no able to use explicit fencing
 		res = vkWaitForFences(vk_dev->dev, 1, &img->render_fence, false, UINT64_MAX);
@@ -1601,3 +2450,454 @@ bool buffer_vk_fill(struct buffer *buffer, int frame_num)
 
 	return true;
 }
+
+// Whether we can blit out of images with the given modifier, to scale
+// captured frames down on the GPU, and into an optimally tiled image.
+static bool capture_blit_supported(struct vk_device *vk_dev, uint64_t modifier,
+		VkFilter *filter)
+{
+	VkDrmFormatModifierPropertiesListEXT mod_list = {0};
+	mod_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+
+	VkFormatProperties2 props = {0};
+	props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+	props.pNext = &mod_list;
+	vkGetPhysicalDeviceFormatProperties2(vk_dev->phdev, vk_dev->format, &props);
+
+	if (!(props.formatProperties.optimalTilingFeatures &
+			VK_FORMAT_FEATURE_BLIT_DST_BIT)) {
+		return false;
+	}
+
+	mod_list.pDrmFormatModifierProperties = calloc(
+		mod_list.drmFormatModifierCount,
+		sizeof(*mod_list.pDrmFormatModifierProperties));
+	if (!mod_list.pDrmFormatModifierProperties) {
+		return false;
+	}
+	vkGetPhysicalDeviceFormatProperties2(vk_dev->phdev, vk_dev->format, &props);
+
+	bool supported = false;
+	for (uint32_t i = 0u; i < mod_list.drmFormatModifierCount; ++i) {
+		const VkDrmFormatModifierPropertiesEXT *mod =
+			&mod_list.pDrmFormatModifierProperties[i];
+		if (mod->drmFormatModifier != modifier) {
+			continue;
+		}
+
+		supported = mod->drmFormatModifierTilingFeatures &
+			VK_FORMAT_FEATURE_BLIT_SRC_BIT;
+		*filter = (mod->drmFormatModifierTilingFeatures &
+			VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) ?
+			VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+		break;
+	}
+
+	free(mod_list.pDrmFormatModifierProperties);
+	return supported;
+}
+
+// The optimally tiled image we blit captured frames into to scale them
+// down, before copying them out.
+static bool capture_image_init(struct vk_device *vk_dev, struct vk_capture *cap,
+		uint32_t width, uint32_t height)
+{
+	VkResult res;
+
+	VkImageCreateInfo img_info = {0};
+	img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	img_info.imageType = VK_IMAGE_TYPE_2D;
+	img_info.format = vk_dev->format;
+	img_info.mipLevels = 1;
+	img_info.arrayLayers = 1;
+	img_info.samples = VK_SAMPLE_COUNT_1_BIT;
+	img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	img_info.extent.width = width;
+	img_info.extent.height = height;
+	img_info.extent.depth = 1;
+	img_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+	img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+		VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	res = vkCreateImage(vk_dev->dev, &img_info, NULL, &cap->image);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreateImage");
+		return false;
+	}
+
+	VkMemoryRequirements mr = {0};
+	vkGetImageMemoryRequirements(vk_dev->dev, cap->image, &mr);
+
+	VkMemoryAllocateInfo mai = {0};
+	mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	mai.allocationSize = mr.size;
+	int mem_type = find_mem_type(vk_dev->phdev,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mr.memoryTypeBits);
+	if (mem_type < 0) {
+		mem_type = find_mem_type(vk_dev->phdev, 0, mr.memoryTypeBits);
+	}
+	mai.memoryTypeIndex = mem_type;
+	res = vkAllocateMemory(vk_dev->dev, &mai, NULL, &cap->image_mem);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkAllocateMemory");
+		return false;
+	}
+
+	res = vkBindImageMemory(vk_dev->dev, cap->image, cap->image_mem, 0);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkBindImageMemory");
+		return false;
+	}
+
+	return true;
+}
+
+// The slot's buffer, mapped for as long as the output lives (slot->data
+// points into it), its command buffer and fence.
+static bool capture_slot_init(struct vk_device *vk_dev,
+		struct vk_capture_slot *vslot, struct capture_slot *slot)
+{
+	VkResult res;
+
+	// we've tried before, and failed part way through
+	if (vslot->buffer) {
+		return false;
+	}
+
+	VkBufferCreateInfo bi = {0};
+	bi.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bi.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	bi.size = (VkDeviceSize) vslot->stride * vslot->height;
+	bi.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	res = vkCreateBuffer(vk_dev->dev, &bi, NULL, &vslot->buffer);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreateBuffer");
+		return false;
+	}
+
+	VkMemoryRequirements bmr = {0};
+	vkGetBufferMemoryRequirements(vk_dev->dev, vslot->buffer, &bmr);
+
+	// we read all of it back on the cpu, so cached memory is much
+	// faster where there is some; host visible, coherent memory
+	// always exists for buffers (see arena_chunk_create)
+	VkMemoryAllocateInfo mai = {0};
+	mai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	mai.allocationSize = bmr.size;
+	int mem_type = find_mem_type(vk_dev->phdev,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_CACHED_BIT, bmr.memoryTypeBits);
+	if (mem_type < 0) {
+		mem_type = find_mem_type(vk_dev->phdev,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, bmr.memoryTypeBits);
+	}
+	assert(mem_type >= 0);
+
+	VkPhysicalDeviceMemoryProperties mem_props;
+	vkGetPhysicalDeviceMemoryProperties(vk_dev->phdev, &mem_props);
+	vslot->coherent = mem_props.memoryTypes[mem_type].propertyFlags &
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+	mai.memoryTypeIndex = mem_type;
+	res = vkAllocateMemory(vk_dev->dev, &mai, NULL, &vslot->mem);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkAllocateMemory");
+		return false;
+	}
+
+	res = vkBindBufferMemory(vk_dev->dev, vslot->buffer, vslot->mem, 0);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkBindBufferMemory");
+		return false;
+	}
+
+	void *map;
+	res = vkMapMemory(vk_dev->dev, vslot->mem, 0, VK_WHOLE_SIZE, 0, &map);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkMapMemory");
+		return false;
+	}
+	slot->data = map;
+
+	VkFenceCreateInfo fence_info = {0};
+	fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	res = vkCreateFence(vk_dev->dev, &fence_info, NULL, &vslot->fence);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkCreateFence");
+		return false;
+	}
+
+	pthread_mutex_lock(&vk_dev->pool_lock);
+	vslot->cb = vk_cb_get(vk_dev);
+	pthread_mutex_unlock(&vk_dev->pool_lock);
+	return vslot->cb != VK_NULL_HANDLE;
+}
+
+bool buffer_vk_capture(struct buffer *buffer, struct capture_slot *slot)
+{
+	struct vk_image *img = (struct vk_image *)buffer;
+	struct output *output = buffer->output;
+	struct vk_device *vk_dev = output->device->vk_device;
+	VkResult res;
+
+	if (!output->capture.vk) {
+		output->capture.vk = calloc(1, sizeof(*output->capture.vk));
+		if (!output->capture.vk) {
+			return false;
+		}
+	}
+	struct vk_capture *cap = output->capture.vk;
+	struct vk_capture_slot *vslot = &cap->slots[slot - output->capture.slots];
+	bool scale = slot->width != buffer->width || slot->height != buffer->height;
+
+	// the image can't be copied out of twice at once: we only capture
+	// each frame once it's been shown, so it's still being copied for a
+	// previous capture if it's shown a second time (a baked frame) within
+	// a few vblanks. Not worth waiting for; just drop the frame
+	if (img->capture) {
+		return false;
+	}
+
+	if (scale && !cap->blit_checked) {
+		cap->blit_checked = true;
+		cap->blit = capture_blit_supported(vk_dev, buffer->modifier,
+			&cap->filter) &&
+			capture_image_init(vk_dev, cap, slot->width, slot->height);
+		if (!cap->blit) {
+			printf("[%s] can't blit to scale captured frames down, "
+				"scaling on the cpu instead\n", output->name);
+		}
+	}
+	bool blit = scale && cap->blit;
+
+	if (!vslot->cb) {
+		vslot->width = blit || !scale ? slot->width : buffer->width;
+		vslot->height = blit || !scale ? slot->height : buffer->height;
+		vslot->stride = vslot->width * 4;
+		if (!capture_slot_init(vk_dev, vslot, slot)) {
+			return false;
+		}
+	}
+
+	if (vslot->submitted) {
+		res = vkResetFences(vk_dev->dev, 1, &vslot->fence);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkResetFences");
+			return false;
+		}
+		vslot->submitted = false;
+	}
+
+	pthread_mutex_lock(&vk_dev->pool_lock);
+	VkCommandBufferBeginInfo begin_info = {0};
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(vslot->cb, &begin_info);
+
+	// acquire the image from the external queue family again, just like
+	// when rendering (see the XXX in buffer_vk_create), and release it
+	// once we're done. The frame has already been shown, so its rendering
+	// has long finished.
+	uint32_t ext_qfam = VK_QUEUE_FAMILY_EXTERNAL;
+
+	VkImageMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.image = img->image;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barrier.srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	barrier.srcQueueFamilyIndex = ext_qfam;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barrier.dstQueueFamilyIndex = vk_dev->queue_family;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.subresourceRange.levelCount = 1;
+	vkCmdPipelineBarrier(vslot->cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+	VkBufferImageCopy region = {0};
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.layerCount = 1;
+	region.imageExtent.width = vslot->width;
+	region.imageExtent.height = vslot->height;
+	region.imageExtent.depth = 1;
+
+	if (blit) {
+		// the scaled image's previous contents don't matter
+		VkImageMemoryBarrier sbarrier = {0};
+		sbarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		sbarrier.image = cap->image;
+		sbarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		sbarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		sbarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		sbarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		sbarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		sbarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		sbarrier.subresourceRange = barrier.subresourceRange;
+		vkCmdPipelineBarrier(vslot->cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+			1, &sbarrier);
+
+		VkImageBlit blit_region = {0};
+		blit_region.srcSubresource = region.imageSubresource;
+		blit_region.srcOffsets[1].x = buffer->width;
+		blit_region.srcOffsets[1].y = buffer->height;
+		blit_region.srcOffsets[1].z = 1;
+		blit_region.dstSubresource = region.imageSubresource;
+		blit_region.dstOffsets[1].x = slot->width;
+		blit_region.dstOffsets[1].y = slot->height;
+		blit_region.dstOffsets[1].z = 1;
+		vkCmdBlitImage(vslot->cb, img->image, VK_IMAGE_LAYOUT_GENERAL,
+			cap->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			1, &blit_region, cap->filter);
+
+		sbarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		sbarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		sbarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		sbarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		vkCmdPipelineBarrier(vslot->cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+			1, &sbarrier);
+
+		vkCmdCopyImageToBuffer(vslot->cb, cap->image,
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vslot->buffer,
+			1, &region);
+	} else {
+		vkCmdCopyImageToBuffer(vslot->cb, img->image,
+			VK_IMAGE_LAYOUT_GENERAL, vslot->buffer, 1, &region);
+	}
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barrier.srcQueueFamilyIndex = vk_dev->queue_family;
+	barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	barrier.dstQueueFamilyIndex = ext_qfam;
+
+	// and make the copy visible to the host once the fence has signaled
+	VkBufferMemoryBarrier bbarrier = {0};
+	bbarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	bbarrier.buffer = vslot->buffer;
+	bbarrier.size = VK_WHOLE_SIZE;
+	bbarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	bbarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	bbarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bbarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+
+	vkCmdPipelineBarrier(vslot->cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+		0, 0, NULL, 1, &bbarrier, 1, &barrier);
+
+	vkEndCommandBuffer(vslot->cb);
+	pthread_mutex_unlock(&vk_dev->pool_lock);
+
+	VkSubmitInfo submission = {0};
+	submission.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submission.commandBufferCount = 1;
+	submission.pCommandBuffers = &vslot->cb;
+
+	pthread_mutex_lock(&vk_dev->queue_lock);
+	res = vkQueueSubmit(vk_dev->queue, 1, &submission, vslot->fence);
+	pthread_mutex_unlock(&vk_dev->queue_lock);
+	if (res != VK_SUCCESS) {
+		vk_error(res, "vkQueueSubmit");
+		return false;
+	}
+
+	vslot->submitted = true;
+	vslot->img = img;
+	img->capture = vslot;
+	slot->format = buffer->format;
+	return true;
+}
+
+// Returns whether the copy into the slot is done, scaling it down in place
+// first if the gpu couldn't.
+bool capture_slot_vk_done(struct capture_slot *slot)
+{
+	struct output *output = slot->output;
+	struct vk_device *vk_dev = output->device->vk_device;
+	struct vk_capture_slot *vslot =
+		&output->capture.vk->slots[slot - output->capture.slots];
+
+	VkResult res = vkGetFenceStatus(vk_dev->dev, vslot->fence);
+	if (res == VK_NOT_READY) {
+		return false;
+	} else if (res != VK_SUCCESS) {
+		vk_error(res, "vkGetFenceStatus");
+	}
+
+	if (vslot->img) {
+		vslot->img->capture = NULL;
+		vslot->img = NULL;
+	}
+
+	if (!vslot->coherent) {
+		VkMappedMemoryRange range = {0};
+		range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+		range.memory = vslot->mem;
+		range.size = VK_WHOLE_SIZE;
+		res = vkInvalidateMappedMemoryRanges(vk_dev->dev, 1, &range);
+		if (res != VK_SUCCESS) {
+			vk_error(res, "vkInvalidateMappedMemoryRanges");
+		}
+	}
+
+	// rows and pixels only ever move towards the start, so this works
+	// in place
+	if (vslot->width != slot->width) {
+		capture_downscale(slot->data, slot->stride, slot->data,
+			vslot->stride, slot->width, slot->height,
+			output->device->capture.scale);
+	}
+
+	return true;
+}
+
+void output_vk_capture_destroy(struct output *output)
+{
+	struct vk_device *vk_dev = output->device->vk_device;
+	struct vk_capture *cap = output->capture.vk;
+	VkResult res;
+
+	if (!cap) {
+		return;
+	}
+
+	for (unsigned i = 0u; i < CAPTURE_RING_SIZE; ++i) {
+		struct vk_capture_slot *vslot = &cap->slots[i];
+
+		if (vslot->submitted) {
+			res = vkWaitForFences(vk_dev->dev, 1, &vslot->fence, false, UINT64_MAX);
+			if (res != VK_SUCCESS) {
+				vk_error(res, "vkWaitForFences");
+			}
+		}
+		if (vslot->img) {
+			vslot->img->capture = NULL;
+		}
+		if (vslot->cb) {
+			pthread_mutex_lock(&vk_dev->pool_lock);
+			vk_cb_put(vk_dev, vslot->cb);
+			pthread_mutex_unlock(&vk_dev->pool_lock);
+		}
+		if (vslot->fence) {
+			vkDestroyFence(vk_dev->dev, vslot->fence, NULL);
+		}
+		if (vslot->buffer) {
+			vkDestroyBuffer(vk_dev->dev, vslot->buffer, NULL);
+		}
+		if (vslot->mem) {
+			// implicitly unmapped
+			vkFreeMemory(vk_dev->dev, vslot->mem, NULL);
+		}
+	}
+
+	if (cap->image) {
+		vkDestroyImage(vk_dev->dev, cap->image, NULL);
+	}
+	if (cap->image_mem) {
+		vkFreeMemory(vk_dev->dev, cap->image_mem, NULL);
+	}
+	free(cap);
+	output->capture.vk = NULL;
+}
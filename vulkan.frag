@@ -7,6 +7,9 @@ layout(set = 0, binding = 0) uniform UBO {
 	float t; // in [0, 1], wrapping around
 } ubo;
 
+// whether the render target is srgb, see pick_format in vulkan.c
+layout(constant_id = 0) const bool srgb_target = true;
+
 const float pi = 3.1415926535897932;
 
 void main() {
@@ -19,8 +22,14 @@ void main() {
 	// *incorrect* for most purposes but it looks linear in this case, we
 	// aren't trying to achieve anything physcially). So we need to bring the
 	// color into linear color space afterwards since that's what shaders
-	// should output (e.g. for blending). That's what the pow is for
-	fragColor = vec4(pow(col, vec3(2.2)), 1);
+	// should output (e.g. for blending). That's what the pow is for.
+	// When we aren't rendering into an srgb target, nothing encodes our
+	// output again (with KMS_COLOR, the CRTC does that for the display),
+	// so we write the colors as they are.
+	if (srgb_target) {
+		col = pow(col, vec3(2.2));
+	}
+	fragColor = vec4(col, 1);
 
 	// simple white-black color ramp for testing
 	// float gray = pow(uv.x, 2.2 * 2.2);